@@ -9,12 +9,40 @@
 
 #define PY_SSIZE_T_CLEAN
 #include "Python.h"
+#ifdef __APPLE__
 #include <AudioUnit/AudioUnit.h>
 #include <CoreAudio/CoreAudio.h>
 #include <CoreServices/CoreServices.h>
+#include <AudioToolbox/MusicDevice.h>
+#include <mach/mach.h>
+#include <mach/thread_policy.h>
+/* kAudioObjectPropertyElementMain is new in the macOS 12 SDK */
+#if !defined(MAC_OS_VERSION_12_0)                                             \
+    || __MAC_OS_X_VERSION_MAX_ALLOWED < MAC_OS_VERSION_12_0
+#define kAudioObjectPropertyElementMain kAudioObjectPropertyElementMaster
+#endif
+#else
+#include "nullaudio.h"
+#include <sys/syscall.h>
+#endif
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <structmember.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #if PY_VERSION_HEX < 0x02050000 && !defined(PY_SSIZE_T_MIN)
 typedef int Py_ssize_t;
@@ -28,8 +56,11 @@ typedef int Py_ssize_t;
 
 PyDoc_STRVAR(coreaudio_module_doc,
              "This modules provides support for the CoreAudio API.\n"
-             "Available types are: AudioComponent, AudioComponentDescription and "
-             "AudioStreamBasicDescType.\n");
+             "Available types are: Analyzer, AudioComponent, "
+             "AudioComponentDescription, AudioStreamBasicDescType, "
+             "AudioUnitPool, ClipPlayer, Clock, "
+             "Connection, JitterBuffer, Recorder, SampleBank, TimeStretch and "
+             "VirtualDriver.\n");
 
 static PyObject* CoreAudioError;
 
@@ -134,6 +165,109 @@ static PyObject* component_new(PyTypeObject* type, PyObject* args,
 
 static void component_dealloc(component_t* obj) { PyObject_Free(obj); }
 
+static PyObject* component_getname(component_t* self, void* closure)
+{
+    OSStatus rc;
+    CFStringRef name;
+    char buffer[256];
+
+    if (!self->component) {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+
+    rc = AudioComponentCopyName(self->component, &name);
+    if (rc != noErr) {
+        PyErr_Format(CoreAudioError, "AudioComponentCopyName failed: %4.4s",
+                     (char*)&rc);
+        return NULL;
+    }
+
+    if (!CFStringGetCString(name, buffer, sizeof(buffer),
+                            kCFStringEncodingUTF8))
+        buffer[0] = '\0';
+    CFRelease(name);
+
+    return PyUnicode_FromString(buffer);
+}
+
+static PyObject* component_getversion(component_t* self, void* closure)
+{
+    OSStatus rc;
+    UInt32 version = 0;
+
+    if (!self->component) {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+
+    rc = AudioComponentGetVersion(self->component, &version);
+    if (rc != noErr) {
+        PyErr_Format(CoreAudioError, "AudioComponentGetVersion failed: %4.4s",
+                     (char*)&rc);
+        return NULL;
+    }
+
+    return PyLong_FromUnsignedLong(version);
+}
+
+static PyObject* component_getdescription(component_t* self, void* closure)
+{
+    OSStatus rc;
+    component_desc_t* retval;
+
+    if (!self->component) {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+
+    if (!(retval = (component_desc_t*)PyObject_New(
+              component_desc_t, &AudioComponentDescriptionType)))
+        return NULL;
+
+    rc = AudioComponentGetDescription(self->component, &retval->desc);
+    if (rc != noErr) {
+        Py_DECREF(retval);
+        PyErr_Format(CoreAudioError,
+                     "AudioComponentGetDescription failed: %4.4s", (char*)&rc);
+        return NULL;
+    }
+
+    return (PyObject*)retval;
+}
+
+static PyObject* component_repr(component_t* self)
+{
+    PyObject* name;
+    PyObject* retval;
+    UInt32 version = 0;
+
+    if (!self->component)
+        return PyUnicode_FromString("<AudioComponent (none)>");
+
+    if (!(name = component_getname(self, NULL)))
+        return NULL;
+
+    AudioComponentGetVersion(self->component, &version);
+
+    // versions are 0xMMMMmmbb
+    retval = PyUnicode_FromFormat("<AudioComponent %R %u.%u.%u>", name,
+                                  version >> 16, (version >> 8) & 0xff,
+                                  version & 0xff);
+    Py_DECREF(name);
+
+    return retval;
+}
+
+static PyGetSetDef component_getset[] = {
+    { "name", (getter)component_getname, NULL, "the component name" },
+    { "version", (getter)component_getversion, NULL,
+      "the component version, as 0xMMMMmmbb" },
+    { "description", (getter)component_getdescription, NULL,
+      "the AudioComponentDescription of the component" },
+    { NULL }
+};
+
 static PyTypeObject AudioComponentType = {
     PyVarObject_HEAD_INIT(&PyType_Type, 0)
     .tp_name = "coreaudio.AudioComponent",
@@ -141,7 +275,9 @@ static PyTypeObject AudioComponentType = {
     .tp_doc = PyDoc_STR("CoreFoundation AudioComponent"),
     .tp_new = component_new,
     .tp_dealloc = (destructor)component_dealloc,
+    .tp_repr = (reprfunc)component_repr,
     .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_getset = component_getset,
 };
 
 typedef struct {
@@ -249,7 +385,7 @@ static PyObject* audio_timestamp_get_host_time(audio_timestamp_t* self)
     self->timestamp.mHostTime = AudioGetCurrentHostTime();
     self->timestamp.mFlags |= kAudioTimeStampHostTimeValid;
 
-    return PyLong_FromLong(self->timestamp.mHostTime);
+    return PyLong_FromUnsignedLongLong(self->timestamp.mHostTime);
 }
 
 static PyMemberDef audio_timestamp_members[] = {
@@ -297,286 +433,9339 @@ static PyTypeObject AudioTimeStampType = {
     .tp_members = audio_timestamp_members,
 };
 
+/*
+ * Native render sources
+ *
+ * A native source is a Python object that can render audio on the I/O
+ * thread without taking the GIL. It can be passed to SetRenderCallback
+ * instead of a Python callable. A source that renders a fixed format checks
+ * it against the bus's input stream format when it is attached.
+ */
+
+typedef OSStatus (*native_render_t)(PyObject* source,
+                                    AudioUnitRenderActionFlags* ioActionFlags,
+                                    const AudioTimeStamp* inTimeStamp,
+                                    UInt32 inBusNumber, UInt32 inNumberFrames,
+                                    AudioBufferList* ioData);
+
+/* Returns 0 if the source can render into a bus of 'format', or -1 with
+   CoreAudioError set */
+typedef int (*native_check_t)(PyObject* source,
+                              const AudioStreamBasicDescription* format);
+
 typedef struct {
     PyObject_HEAD;
-    AudioUnit instance;
-    PyObject* render_callback;
-    PyObject* user_data;
-} audio_unit_t;
+    native_render_t render;
+    native_check_t check; /* or NULL */
+} native_source_t;
 
-static PyTypeObject AudioUnitType;
+static PyTypeObject JitterBufferType;
+static PyTypeObject ConnectionType;
+static PyTypeObject ClipPlayerType;
+static PyTypeObject TimeStretchType;
 
-static PyObject* audio_unit_new(PyTypeObject* type, PyObject* args,
-                                PyObject* kwds)
+static int native_source_check(PyObject* o)
 {
-    audio_unit_t* self;
-
-    if (!PyArg_ParseTuple(args, ":AudioUnit"))
-        return NULL;
+    return PyObject_TypeCheck(o, &JitterBufferType)
+        || PyObject_TypeCheck(o, &ConnectionType)
+        || PyObject_TypeCheck(o, &ClipPlayerType)
+        || PyObject_TypeCheck(o, &TimeStretchType);
+}
 
-    if (!(self = (audio_unit_t*)PyObject_New(audio_unit_t, &AudioUnitType)))
+/* Allocate an AudioBufferList with room for 'frames' frames of 'fmt' */
+static AudioBufferList* alloc_buffer_list(const AudioStreamBasicDescription* fmt,
+                                          UInt32 frames)
+{
+    UInt32 nbuffers = fmt->mFormatFlags & kAudioFormatFlagIsNonInterleaved
+        ? fmt->mChannelsPerFrame
+        : 1;
+    UInt32 size = frames * (fmt->mBytesPerFrame ? fmt->mBytesPerFrame : 1);
+    AudioBufferList* abl;
+    Byte* data;
+    UInt32 i;
+
+    if (!nbuffers)
+        nbuffers = 1;
+
+    abl = PyMem_Calloc(1, sizeof(AudioBufferList)
+                              + (nbuffers - 1) * sizeof(AudioBuffer)
+                              + (size_t)nbuffers * size);
+    if (!abl)
         return NULL;
 
-    self->instance = NULL;
-    self->render_callback = NULL;
-    self->user_data = NULL;
+    data = (Byte*)&abl->mBuffers[nbuffers];
+    abl->mNumberBuffers = nbuffers;
+    for (i = 0; i < nbuffers; ++i) {
+        abl->mBuffers[i].mNumberChannels
+            = nbuffers == 1 ? fmt->mChannelsPerFrame : 1;
+        abl->mBuffers[i].mDataByteSize = size;
+        abl->mBuffers[i].mData = data + (size_t)i * size;
+    }
 
-    return (PyObject*)self;
+    return abl;
 }
 
-static void audio_unit_dealloc(audio_unit_t* obj)
+/*
+ * G.711 mu-law
+ */
+
+#define ULAW_BIAS 0x84
+#define ULAW_CLIP 32635
+
+static Byte ulaw_encode(SInt16 sample)
 {
-    if (obj->render_callback) {
-        Py_DECREF(obj->render_callback);
-    }
+    int sign = (sample >> 8) & 0x80;
+    int s = sample;
+    int exponent, mantissa, mask;
 
-    if (obj->user_data) {
-        Py_DECREF(obj->user_data);
-    }
+    if (sign)
+        s = -s;
+    if (s > ULAW_CLIP)
+        s = ULAW_CLIP;
+    s += ULAW_BIAS;
 
-    if (obj->instance) {
-        AudioUnitUninitialize(obj->instance);
-        AudioComponentInstanceDispose(obj->instance);
-    }
+    for (exponent = 7, mask = 0x4000; !(s & mask) && exponent > 0;
+         exponent--, mask >>= 1)
+        ;
 
-    PyObject_Free(obj);
+    mantissa = (s >> (exponent + 3)) & 0x0f;
+
+    return (Byte)~(sign | (exponent << 4) | mantissa);
 }
 
-static PyObject* audio_unit_setstreamformat(audio_unit_t* self, PyObject* args)
+static SInt16 ulaw_decode(Byte u)
 {
-    OSErr rc;
-    audio_stream_basic_desc_t* bdesc;
+    int sample;
 
-    if (!PyArg_ParseTuple(args, "O!:SetStreamFormat",
-                          &AudioStreamBasicDescType, &bdesc))
-        return NULL;
+    u = ~u;
+    sample = ((((int)u & 0x0f) << 3) + ULAW_BIAS) << ((u & 0x70) >> 4);
+    sample -= ULAW_BIAS;
 
-    rc = AudioUnitSetProperty(self->instance, kAudioUnitProperty_StreamFormat,
-                              kAudioUnitScope_Input, 0, &bdesc->bdesc,
-                              sizeof(AudioStreamBasicDescription));
+    return (SInt16)((u & 0x80) ? -sample : sample);
+}
 
-    if (rc != noErr) {
+/*
+ * JitterBuffer
+ *
+ * Reorders sequenced packets of a mono stream (mu-law or 16 bit signed
+ * linear PCM), adapts its playout delay to the observed interarrival
+ * jitter (RFC 3550, 6.4.1) and conceals lost packets by repeating the last
+ * good packet with decreasing gain. When the delay shrinks, a packet is
+ * skipped and the next one is crossfaded in from it.
+ *
+ * Put() may be called from any thread. The render thread only ever tries
+ * to take the lock; if it is contended, the period is concealed.
+ */
+
+/* Number of consecutively concealed packets before we rebuffer */
+#define JB_MAX_CONCEAL 5
+
+typedef struct {
+    UInt16 seq;
+    int valid;
+} jb_slot_t;
+
+typedef struct {
+    native_source_t source;
+    pthread_mutex_t mutex;
+
+    /* configuration */
+    UInt32 format;
+    Float64 sample_rate;
+    UInt32 packet_frames;
+    UInt32 bytes_per_frame;
+    UInt32 packet_bytes;
+    UInt32 capacity; /* in packets, a power of two */
+    UInt32 min_depth; /* in frames */
+    UInt32 max_depth; /* in frames */
+
+    /* packet storage: capacity slots of packet_bytes each */
+    jb_slot_t* slots;
+    Byte* data;
+
+    /* the last played packet, used for concealment (render thread only) */
+    Byte* last;
+    int have_last;
+    UInt32 concealed_run;
+
+    /* the packet skipped to shrink the delay, faded out over the next one
+       (render thread only) */
+    Byte* fade;
+    int fading;
+
+    /* playout state */
+    int started;
+    int playing;
+    UInt16 play_seq;
+    UInt16 high_seq;
+    UInt32 play_offset; /* in frames, within the current packet */
+    UInt32 target_depth; /* in frames */
+
+    /* jitter estimation, in frames */
+    int have_transit;
+    double last_transit;
+    double jitter;
+
+    /* statistics */
+    UInt64 received;
+    UInt64 late;
+    UInt64 duplicate;
+    UInt64 overflow;
+    UInt64 lost;
+    UInt64 dropped;
+    UInt64 underruns;
+    atomic_ullong contended; /* written by the render thread without the
+                                lock */
+} jitter_buffer_t;
+
+static OSStatus jitter_buffer_render(PyObject* source,
+                                     AudioUnitRenderActionFlags* ioActionFlags,
+                                     const AudioTimeStamp* inTimeStamp,
+                                     UInt32 inBusNumber, UInt32 inNumberFrames,
+                                     AudioBufferList* ioData);
+
+/* The bus must take the packets as they are: mono mu-law or 16 bit signed
+   integers at the buffer's rate, or non-interleaved buffers of them */
+static int jitter_buffer_check(PyObject* source,
+                               const AudioStreamBasicDescription* format)
+{
+    jitter_buffer_t* self = (jitter_buffer_t*)source;
+    UInt32 channels = format->mFormatFlags & kAudioFormatFlagIsNonInterleaved
+        ? 1
+        : format->mChannelsPerFrame;
+
+    if (format->mFormatID != self->format
+        || format->mSampleRate != self->sample_rate || channels != 1
+        || format->mBytesPerFrame != self->bytes_per_frame
+        || (self->format == kAudioFormatLinearPCM
+            && (format->mBitsPerChannel != 16
+                || (format->mFormatFlags & kAudioFormatFlagIsFloat)
+                || !(format->mFormatFlags
+                     & kAudioFormatFlagIsSignedInteger)))) {
         PyErr_Format(CoreAudioError,
-                     "AudioUnitSetProperty(StreamFormat) failed: %4.4s",
-                     (char*)&rc);
-        return NULL;
+                     "the bus format does not match the JitterBuffer: "
+                     "expected mono %s at %u Hz",
+                     self->format == kAudioFormatULaw ? "mu-law"
+                                                      : "16 bit linear PCM",
+                     (unsigned int)self->sample_rate);
+        return -1;
     }
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    return 0;
 }
 
-static OSStatus audio_unit_render_callback(
-    void* inRefCon, AudioUnitRenderActionFlags* ioActionFlags,
-    const AudioTimeStamp* inTimeStamp, UInt32 inBusNumber,
-    UInt32 inNumberFrames, AudioBufferList* ioData)
+static void jitter_buffer_reset_locked(jitter_buffer_t* self)
 {
-    int i;
-    PyObject* o;
-    audio_unit_t* self = (audio_unit_t*)inRefCon;
-    PyGILState_STATE gil = PyGILState_Ensure();
-
-    PyObject* args = Py_BuildValue(
-        "(k{sdsKsdsKsk}iiiO)", *ioActionFlags, "mSampleTime",
-        inTimeStamp->mSampleTime, "mHostTime", inTimeStamp->mHostTime,
-        "mRateScalar", inTimeStamp->mRateScalar, "mWordClockTime",
-        inTimeStamp->mWordClockTime, "mFlags", inTimeStamp->mFlags,
-        inBusNumber, inNumberFrames, ioData->mNumberBuffers, self->user_data);
+    UInt32 i;
+
+    for (i = 0; i < self->capacity; ++i)
+        self->slots[i].valid = 0;
+
+    self->have_last = 0;
+    self->concealed_run = 0;
+    self->fading = 0;
+    self->started = 0;
+    self->playing = 0;
+    self->play_seq = 0;
+    self->high_seq = 0;
+    self->play_offset = 0;
+    self->target_depth = self->min_depth;
+    self->have_transit = 0;
+    self->last_transit = 0.0;
+    self->jitter = 0.0;
+}
 
-    PyObject* result = PyObject_CallObject(self->render_callback, args);
-    if (!result)
-        goto py_error;
+static PyObject* jitter_buffer_new(PyTypeObject* type, PyObject* args,
+                                   PyObject* kwds)
+{
+    static char* kwlist[] = { "packet_frames", "sample_rate", "format",
+                              "min_delay", "max_delay", "capacity", NULL };
+    jitter_buffer_t* self;
+    UInt32 packet_frames = 160;
+    Float64 sample_rate = 8000.0;
+    UInt32 format = kAudioFormatULaw;
+    double min_delay = 20.0;
+    double max_delay = 200.0;
+    UInt32 capacity = 64;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|IdIddI:JitterBuffer",
+                                     kwlist, &packet_frames, &sample_rate,
+                                     &format, &min_delay, &max_delay,
+                                     &capacity))
+        return NULL;
 
-    if (!PyTuple_Check(result)) {
-        fprintf(stderr, "render callback must return a tuple\n");
-        goto error;
+    if (format != kAudioFormatULaw && format != kAudioFormatLinearPCM) {
+        PyErr_SetString(PyExc_ValueError,
+                        "format must be kAudioFormatULaw or "
+                        "kAudioFormatLinearPCM");
+        return NULL;
     }
 
-    o = PyTuple_GetItem(result, 0);
-    if (!o)
-        goto py_error;
-
-    if (o != Py_None) {
-        if (!PyLong_Check(o)) {
-            fprintf(stderr,
-                    "render callback must return a tuple (None|int, bytes)\n");
-            goto error;
-        }
-
-        *ioActionFlags = PyLong_AsUnsignedLongMask(o);
+    if (!packet_frames || sample_rate <= 0.0 || min_delay < 0.0
+        || max_delay < min_delay) {
+        PyErr_SetString(PyExc_ValueError, "invalid jitter buffer geometry");
+        return NULL;
     }
 
-    for (i = 1; i < PyTuple_Size(result); ++i) {
-        char* buffer;
-        Py_ssize_t len;
-
-        o = PyTuple_GetItem(result, i);
-        if (!PyBytes_Check(o)) {
-            fprintf(stderr,
-                    "render callback must return a tuple (None|int, bytes)\n");
-            goto error;
-        }
-        if (PyBytes_AsStringAndSize(o, &buffer, &len) < 0)
-            goto py_error;
+    // round the capacity up to a power of two
+    if (capacity < 4 || capacity > 32768) {
+        PyErr_SetString(PyExc_ValueError,
+                        "capacity must be between 4 and 32768 packets");
+        return NULL;
+    }
+    while (capacity & (capacity - 1))
+        capacity = (capacity | (capacity - 1)) + 1;
 
-        if (len == 0) {
-            PyGILState_Release(gil);
-            // No data: stop audio output
-            AudioOutputUnitStop(self->instance);
+    if (!(self = (jitter_buffer_t*)PyObject_New(jitter_buffer_t,
+                                                &JitterBufferType)))
+        return NULL;
 
-            return 0;
-        }
+    self->source.render = jitter_buffer_render;
+    self->source.check = jitter_buffer_check;
+    self->format = format;
+    self->sample_rate = sample_rate;
+    self->packet_frames = packet_frames;
+    self->bytes_per_frame = format == kAudioFormatULaw ? 1 : 2;
+    self->packet_bytes = packet_frames * self->bytes_per_frame;
+    self->capacity = capacity;
+    self->min_depth = (UInt32)(min_delay * sample_rate / 1000.0);
+    self->max_depth = (UInt32)(max_delay * sample_rate / 1000.0);
+    if (self->max_depth > (capacity - 1) * packet_frames)
+        self->max_depth = (capacity - 1) * packet_frames;
+    if (self->min_depth > self->max_depth)
+        self->min_depth = self->max_depth;
+
+    self->slots = PyMem_Calloc(capacity, sizeof(jb_slot_t));
+    self->data = PyMem_Malloc((size_t)capacity * self->packet_bytes);
+    self->last = PyMem_Malloc(self->packet_bytes);
+    self->fade = PyMem_Malloc(self->packet_bytes);
+    if (!self->slots || !self->data || !self->last || !self->fade) {
+        PyMem_Free(self->slots);
+        PyMem_Free(self->data);
+        PyMem_Free(self->last);
+        PyMem_Free(self->fade);
+        PyObject_Free(self);
+        return PyErr_NoMemory();
+    }
 
-        if (len != ioData->mBuffers[i - 1].mDataByteSize) {
-            fprintf(stderr,
-                    "render_callback: buffer %d size mismatch: "
-                    "expected %u bytes, got %d\n",
-                    i - 1, (unsigned int)ioData->mBuffers[i - 1].mDataByteSize,
-                    (int)len);
-            goto error;
-        }
+    pthread_mutex_init(&self->mutex, NULL);
+    jitter_buffer_reset_locked(self);
 
-        memcpy(ioData->mBuffers[i - 1].mData, buffer, len);
-    }
+    self->received = self->late = self->duplicate = self->overflow = 0;
+    self->lost = self->dropped = self->underruns = 0;
+    atomic_init(&self->contended, 0);
 
-    PyGILState_Release(gil);
+    return (PyObject*)self;
+}
 
-    return 0;
+static void jitter_buffer_dealloc(jitter_buffer_t* obj)
+{
+    pthread_mutex_destroy(&obj->mutex);
+    PyMem_Free(obj->slots);
+    PyMem_Free(obj->data);
+    PyMem_Free(obj->last);
+    PyMem_Free(obj->fade);
+    PyObject_Free(obj);
+}
 
-py_error:
-    // Todo: store the exception and traceback somewhere
-    PyErr_Print();
+/* Frames buffered ahead of the playout position. Caller holds the lock. */
+static UInt32 jitter_buffer_depth(jitter_buffer_t* self)
+{
+    SInt16 ahead = (SInt16)(self->high_seq - self->play_seq);
 
-error:
-    PyGILState_Release(gil);
-    // Stop output - nothing good could come out of continued operation
-    AudioOutputUnitStop(self->instance);
+    if (!self->started || ahead < 0)
+        return 0;
 
-    return -1;
+    return (UInt32)(ahead + 1) * self->packet_frames - self->play_offset;
 }
 
-static PyObject* audio_unit_setrendercallback(audio_unit_t* self,
-                                              PyObject* args)
+static PyObject* jitter_buffer_put(jitter_buffer_t* self, PyObject* args)
 {
-    OSErr rc;
-    PyObject* callback;
-    PyObject* user_data = Py_None;
-    AURenderCallbackStruct input;
+    unsigned int seq;
+    UInt32 timestamp;
+    Py_buffer payload;
+    jb_slot_t* slot;
+    double arrival, transit;
+    SInt16 delta;
+
+    if (!PyArg_ParseTuple(args, "IIy*:Put", &seq, &timestamp, &payload))
+        return NULL;
 
-    if (!PyArg_ParseTuple(args, "O|O:SetRenderCallback", &callback,
-                          &user_data)) {
+    if (payload.len > self->packet_bytes) {
+        PyErr_Format(PyExc_ValueError,
+                     "payload too large: expected at most %u bytes, got %zd",
+                     (unsigned int)self->packet_bytes, payload.len);
+        PyBuffer_Release(&payload);
         return NULL;
     }
 
-    // If a callback or user data was previously set, decrement the refcount
-    if (self->render_callback) {
-        Py_DECREF(self->render_callback);
-    }
+    // arrival time in sample units
+    arrival = (double)AudioConvertHostTimeToNanos(AudioGetCurrentHostTime())
+        * self->sample_rate / 1e9;
 
-    if (self->user_data) {
-        Py_DECREF(self->user_data);
-    }
+    pthread_mutex_lock(&self->mutex);
 
-    // Keep a reference
-    Py_INCREF(callback);
-    Py_INCREF(user_data);
+    self->received++;
 
-    self->render_callback = callback;
-    self->user_data = user_data;
+    // interarrival jitter, RFC 3550
+    transit = arrival - (double)timestamp;
+    if (self->have_transit) {
+        double d = fabs(transit - self->last_transit);
+        // ignore timestamp wraps and resyncs
+        if (d < self->sample_rate)
+            self->jitter += (d - self->jitter) / 16.0;
+    }
+    self->last_transit = transit;
+    self->have_transit = 1;
+
+    self->target_depth = self->packet_frames + (UInt32)(4.0 * self->jitter);
+    if (self->target_depth < self->min_depth)
+        self->target_depth = self->min_depth;
+    if (self->target_depth > self->max_depth)
+        self->target_depth = self->max_depth;
+
+    if (!self->started) {
+        self->started = 1;
+        self->play_seq = self->high_seq = (UInt16)seq;
+        self->play_offset = 0;
+    }
 
-    if (callback != Py_None) {
-        input.inputProc = audio_unit_render_callback;
-        input.inputProcRefCon = self;
-    } else {
-        input.inputProc = NULL;
-        input.inputProcRefCon = NULL;
+    delta = (SInt16)((UInt16)seq - self->play_seq);
+    if (delta < 0) {
+        if (self->playing) {
+            // too late, already played or concealed
+            self->late++;
+            goto done;
+        }
+        // reordered before playout started: move the start back
+        if ((UInt32)(SInt16)(self->high_seq - (UInt16)seq) >= self->capacity) {
+            self->overflow++;
+            goto done;
+        }
+        self->play_seq = (UInt16)seq;
+        delta = 0;
     }
 
-    rc = AudioUnitSetProperty(self->instance,
-                              kAudioUnitProperty_SetRenderCallback,
-                              kAudioUnitScope_Input, 0, &input, sizeof(input));
+    if ((UInt32)delta >= self->capacity) {
+        self->overflow++;
+        goto done;
+    }
 
-    if (rc != noErr) {
-        self->render_callback = NULL;
-        self->user_data = NULL;
+    slot = &self->slots[seq & (self->capacity - 1)];
+    if (slot->valid && slot->seq == (UInt16)seq) {
+        self->duplicate++;
+        goto done;
+    }
 
-        Py_DECREF(callback);
-        Py_DECREF(user_data);
+    slot->seq = (UInt16)seq;
+    slot->valid = 1;
+    memcpy(self->data + (size_t)(seq & (self->capacity - 1))
+               * self->packet_bytes,
+           payload.buf, payload.len);
+    // pad short packets with silence
+    memset(self->data + (size_t)(seq & (self->capacity - 1))
+                   * self->packet_bytes + payload.len,
+           self->format == kAudioFormatULaw ? 0xff : 0,
+           self->packet_bytes - payload.len);
 
-        PyErr_Format(CoreAudioError,
-                     "AudioUnitSetProperty(RenderCallback) failed: "
-                     "%c%c%c%c",
-                     FOURCC_ARGS(rc));
-        return NULL;
-    }
+    if ((SInt16)((UInt16)seq - self->high_seq) > 0)
+        self->high_seq = (UInt16)seq;
+
+done:
+    pthread_mutex_unlock(&self->mutex);
+    PyBuffer_Release(&payload);
 
     Py_INCREF(Py_None);
     return Py_None;
 }
 
-static PyObject* audio_unit_initialize(audio_unit_t* self, PyObject* args)
+/* Synthesize one packet from the last good one, attenuated by 6 dB for
+   each consecutively concealed packet. Render thread only. */
+static void jitter_buffer_conceal(jitter_buffer_t* self, Byte* out,
+                                  UInt32 offset, UInt32 frames)
 {
-    OSErr rc;
-
-    if (!PyArg_ParseTuple(args, ":Initialize"))
-        return NULL;
+    UInt32 i;
+    int shift = (int)self->concealed_run;
 
-    rc = AudioUnitInitialize(self->instance);
-    if (rc != noErr) {
-        PyErr_Format(CoreAudioError, "Initialize failed: %4.4s", (char*)&rc);
-        return NULL;
+    if (!self->have_last || shift >= JB_MAX_CONCEAL) {
+        memset(out, self->format == kAudioFormatULaw ? 0xff : 0,
+               frames * self->bytes_per_frame);
+        return;
     }
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    if (self->format == kAudioFormatULaw) {
+        for (i = 0; i < frames; ++i)
+            out[i] = ulaw_encode(ulaw_decode(self->last[offset + i]) >> shift);
+    } else {
+        const SInt16* src = (const SInt16*)self->last + offset;
+        SInt16* dst = (SInt16*)out;
+        for (i = 0; i < frames; ++i)
+            dst[i] = src[i] >> shift;
+    }
 }
 
-static PyObject* audio_unit_start(audio_unit_t* self, PyObject* args)
+/* Crossfade 'frames' of the packet being played, from 'offset', in from
+   the skipped packet. The gain reaches the played packet on its last frame.
+   Render thread only. */
+static void jitter_buffer_crossfade(jitter_buffer_t* self, Byte* out,
+                                    UInt32 offset, UInt32 frames)
 {
-    OSErr rc;
+    UInt32 i;
 
-    if (!PyArg_ParseTuple(args, ":Start"))
-        return NULL;
+    for (i = 0; i < frames; ++i) {
+        float gain = (float)(offset + i + 1) / self->packet_frames;
 
-    rc = AudioOutputUnitStart(self->instance);
-    if (rc != noErr) {
-        PyErr_Format(CoreAudioError, "Start failed: %4.4s", (char*)&rc);
-        return NULL;
-    }
+        if (self->format == kAudioFormatULaw) {
+            float from = ulaw_decode(self->fade[offset + i]);
+            float to = ulaw_decode(out[i]);
 
-    Py_INCREF(Py_None);
-    return Py_None;
+            out[i] = ulaw_encode((SInt16)lrintf(from + (to - from) * gain));
+        } else {
+            float from = ((const SInt16*)self->fade)[offset + i];
+            float to = ((SInt16*)out)[i];
+
+            ((SInt16*)out)[i] = (SInt16)lrintf(from + (to - from) * gain);
+        }
+    }
 }
 
-static PyObject* audio_unit_stop(audio_unit_t* self, PyObject* args)
+static OSStatus jitter_buffer_render(PyObject* source,
+                                     AudioUnitRenderActionFlags* ioActionFlags,
+                                     const AudioTimeStamp* inTimeStamp,
+                                     UInt32 inBusNumber, UInt32 inNumberFrames,
+                                     AudioBufferList* ioData)
 {
+    jitter_buffer_t* self = (jitter_buffer_t*)source;
+    Byte* out = ioData->mBuffers[0].mData;
+    UInt32 frames = ioData->mBuffers[0].mDataByteSize / self->bytes_per_frame;
+    UInt32 i;
+
+    if (frames > inNumberFrames)
+        frames = inNumberFrames;
+
+    if (pthread_mutex_trylock(&self->mutex) != 0) {
+        // never block the I/O thread
+        atomic_fetch_add_explicit(&self->contended, 1, memory_order_relaxed);
+        memset(out, self->format == kAudioFormatULaw ? 0xff : 0,
+               frames * self->bytes_per_frame);
+        goto copy;
+    }
+
+    while (frames) {
+        UInt32 slot_index = self->play_seq & (self->capacity - 1);
+        jb_slot_t* slot = &self->slots[slot_index];
+        UInt32 n = self->packet_frames - self->play_offset;
+
+        if (n > frames)
+            n = frames;
+
+        if (!self->playing) {
+            if (!self->started
+                || jitter_buffer_depth(self) < self->target_depth) {
+                memset(out, self->format == kAudioFormatULaw ? 0xff : 0,
+                       frames * self->bytes_per_frame);
+                break;
+            }
+            self->playing = 1;
+        }
+
+        if (slot->valid && slot->seq == self->play_seq) {
+            memcpy(out,
+                   self->data + (size_t)slot_index * self->packet_bytes
+                       + self->play_offset * self->bytes_per_frame,
+                   n * self->bytes_per_frame);
+        } else {
+            jitter_buffer_conceal(self, out, self->play_offset, n);
+        }
+
+        if (self->fading)
+            jitter_buffer_crossfade(self, out, self->play_offset, n);
+
+        out += n * self->bytes_per_frame;
+        frames -= n;
+        self->play_offset += n;
+
+        if (self->play_offset < self->packet_frames)
+            continue;
+
+        // end of packet
+        if (slot->valid && slot->seq == self->play_seq) {
+            memcpy(self->last,
+                   self->data + (size_t)slot_index * self->packet_bytes,
+                   self->packet_bytes);
+            self->have_last = 1;
+            self->concealed_run = 0;
+            slot->valid = 0;
+        } else if ((SInt16)(self->high_seq - self->play_seq) > 0) {
+            self->lost++;
+            self->concealed_run++;
+        } else {
+            self->underruns++;
+            self->concealed_run++;
+        }
+
+        self->play_seq++;
+        self->play_offset = 0;
+        self->fading = 0;
+
+        if (self->concealed_run >= JB_MAX_CONCEAL
+            && (SInt16)(self->high_seq - self->play_seq) < 0) {
+            // nothing left to play: rebuffer at the next packet
+            self->playing = 0;
+            self->started = 0;
+            self->have_last = 0;
+            continue;
+        }
+
+        // shrink the delay if we are well above target; the skipped packet
+        // continues the one just played, so the next one is faded in from
+        // it rather than spliced on
+        if (jitter_buffer_depth(self)
+            > self->target_depth + 2 * self->packet_frames) {
+            slot_index = self->play_seq & (self->capacity - 1);
+            slot = &self->slots[slot_index];
+            if (slot->valid && slot->seq == self->play_seq)
+                memcpy(self->fade,
+                       self->data + (size_t)slot_index * self->packet_bytes,
+                       self->packet_bytes);
+            else
+                jitter_buffer_conceal(self, self->fade, 0,
+                                      self->packet_frames);
+            self->fading = 1;
+            slot->valid = 0;
+            self->play_seq++;
+            self->dropped++;
+        }
+    }
+
+    pthread_mutex_unlock(&self->mutex);
+
+copy:
+    // mono source: duplicate into any further non-interleaved buffers
+    for (i = 1; i < ioData->mNumberBuffers; ++i) {
+        UInt32 len = ioData->mBuffers[i].mDataByteSize;
+        if (len > ioData->mBuffers[0].mDataByteSize)
+            len = ioData->mBuffers[0].mDataByteSize;
+        memcpy(ioData->mBuffers[i].mData, ioData->mBuffers[0].mData, len);
+    }
+
+    return noErr;
+}
+
+static PyObject* jitter_buffer_reset(jitter_buffer_t* self, PyObject* args)
+{
+    if (!PyArg_ParseTuple(args, ":Reset"))
+        return NULL;
+
+    pthread_mutex_lock(&self->mutex);
+    jitter_buffer_reset_locked(self);
+    pthread_mutex_unlock(&self->mutex);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject* jitter_buffer_getstats(jitter_buffer_t* self, PyObject* args)
+{
+    PyObject* stats;
+    double ms = 1000.0 / self->sample_rate;
+
+    if (!PyArg_ParseTuple(args, ":GetStats"))
+        return NULL;
+
+    pthread_mutex_lock(&self->mutex);
+    stats = Py_BuildValue(
+        "{sKsKsKsKsKsKsKsKsdsdsd}", "received", self->received, "late",
+        self->late, "duplicate", self->duplicate, "overflow", self->overflow,
+        "lost", self->lost, "dropped", self->dropped, "underruns",
+        self->underruns, "contended", atomic_load(&self->contended), "jitter",
+        self->jitter * ms, "target_delay", self->target_depth * ms, "delay",
+        jitter_buffer_depth(self) * ms);
+    pthread_mutex_unlock(&self->mutex);
+
+    return stats;
+}
+
+static PyMethodDef jitter_buffer_methods[] = {
+    { "Put", (PyCFunction)jitter_buffer_put, METH_VARARGS,
+      "Put(seq, timestamp, payload) -- queue a packet. 'seq' is the 16 bit "
+      "sequence number, 'timestamp' the media timestamp in samples." },
+    { "Reset", (PyCFunction)jitter_buffer_reset, METH_VARARGS,
+      "Reset() -- discard all packets and the jitter estimate." },
+    { "GetStats", (PyCFunction)jitter_buffer_getstats, METH_VARARGS,
+      "GetStats() -- return a dict of counters; delays are in ms." },
+    { NULL, NULL }
+};
+
+static PyTypeObject JitterBufferType = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    .tp_name = "coreaudio.JitterBuffer",
+    .tp_basicsize = sizeof(jitter_buffer_t),
+    .tp_doc = PyDoc_STR(
+        "JitterBuffer(packet_frames=160, sample_rate=8000.0, "
+        "format=kAudioFormatULaw, min_delay=20.0, max_delay=200.0, "
+        "capacity=64)\n\n"
+        "Adaptive jitter buffer for a packetized mono stream. Pass it to "
+        "AudioUnit.SetRenderCallback to render it natively. Delays are "
+        "in milliseconds, the capacity in packets."),
+    .tp_new = jitter_buffer_new,
+    .tp_dealloc = (destructor)jitter_buffer_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_methods = jitter_buffer_methods,
+};
+
+/*
+ * Sample banks
+ *
+ * A SampleBank holds many short clips of one format in a single read-only
+ * arena, addressed by name. The arena has the layout of a pack file, so a
+ * bank can be saved once and then memory mapped by any number of processes,
+ * which share its pages:
+ *
+ *   bank_header_t | bank_clip_t[nclips] | names | clip data (16 byte aligned)
+ *
+ * Offsets are from the start of the pack, in host byte order.
+ *
+ * A ClipPlayer is a native source that plays clips from a bank: Play(name)
+ * hands a clip index to the render thread with an atomic store, and the
+ * render callback copies straight from the arena.
+ */
+
+#define BANK_MAGIC "SBNK"
+#define BANK_VERSION 1
+#define BANK_ALIGN 16
+
+typedef struct {
+    char magic[4];
+    UInt32 version;
+    UInt32 nclips;
+    UInt32 reserved;
+    AudioStreamBasicDescription format;
+    UInt64 size; /* of the whole pack */
+} bank_header_t;
+
+typedef struct {
+    UInt64 offset;
+    UInt64 bytes;
+    UInt32 name_offset;
+    UInt32 name_length;
+} bank_clip_t;
+
+typedef struct {
+    PyObject_HEAD;
+    char* arena;
+    size_t size;
+    int mapped;
+    const bank_header_t* header;
+    const bank_clip_t* clips;
+    PyObject* ids; /* name -> clip index */
+} sample_bank_t;
+
+static PyTypeObject SampleBankType;
+
+static size_t bank_align(size_t n)
+{
+    return (n + BANK_ALIGN - 1) & ~(size_t)(BANK_ALIGN - 1);
+}
+
+/* Check the arena and build the name index */
+static int sample_bank_index(sample_bank_t* self)
+{
+    const bank_header_t* header = (const bank_header_t*)self->arena;
+    const bank_clip_t* clips;
+    size_t table;
+    UInt32 i;
+
+    if (self->size < sizeof(bank_header_t)
+        || memcmp(header->magic, BANK_MAGIC, 4)
+        || header->version != BANK_VERSION || header->size != self->size
+        || !header->format.mBytesPerFrame) {
+        PyErr_SetString(CoreAudioError, "not a sample bank");
+        return -1;
+    }
+
+    table = sizeof(bank_header_t)
+        + (size_t)header->nclips * sizeof(bank_clip_t);
+    if (header->nclips > (self->size - sizeof(bank_header_t))
+                / sizeof(bank_clip_t)) {
+        PyErr_SetString(CoreAudioError, "sample bank is truncated");
+        return -1;
+    }
+
+    clips = (const bank_clip_t*)(self->arena + sizeof(bank_header_t));
+
+    if (!(self->ids = PyDict_New()))
+        return -1;
+
+    for (i = 0; i < header->nclips; ++i) {
+        const bank_clip_t* clip = &clips[i];
+        PyObject* name;
+        PyObject* index;
+        int rc;
+
+        if (clip->name_offset < table || clip->name_offset > self->size
+            || clip->name_length > self->size - clip->name_offset
+            || clip->offset > self->size
+            || clip->bytes > self->size - clip->offset
+            || clip->bytes % header->format.mBytesPerFrame) {
+            PyErr_SetString(CoreAudioError, "sample bank is corrupt");
+            return -1;
+        }
+
+        if (!(name = PyUnicode_DecodeUTF8(self->arena + clip->name_offset,
+                                          clip->name_length, NULL)))
+            return -1;
+        if (!(index = PyLong_FromUnsignedLong(i))) {
+            Py_DECREF(name);
+            return -1;
+        }
+        rc = PyDict_SetItem(self->ids, name, index);
+        Py_DECREF(name);
+        Py_DECREF(index);
+        if (rc < 0)
+            return -1;
+    }
+
+    self->header = header;
+    self->clips = clips;
+
+    return 0;
+}
+
+static int sample_bank_map(sample_bank_t* self, PyObject* path)
+{
+    PyObject* bytes;
+    struct stat st;
+    void* arena;
+    int fd;
+
+    if (!PyUnicode_FSConverter(path, &bytes))
+        return -1;
+
+    fd = open(PyBytes_AS_STRING(bytes), O_RDONLY);
+    if (fd < 0) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path);
+        Py_DECREF(bytes);
+        return -1;
+    }
+    Py_DECREF(bytes);
+
+    if (fstat(fd, &st) < 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        close(fd);
+        return -1;
+    }
+
+    if (st.st_size < (off_t)sizeof(bank_header_t)) {
+        close(fd);
+        PyErr_SetString(CoreAudioError, "not a sample bank");
+        return -1;
+    }
+
+    arena = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (arena == MAP_FAILED) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+
+    self->arena = arena;
+    self->size = st.st_size;
+    self->mapped = 1;
+
+    return 0;
+}
+
+static int sample_bank_build(sample_bank_t* self, PyObject* clips,
+                             const AudioStreamBasicDescription* format)
+{
+    PyObject* items;
+    Py_buffer* views = NULL;
+    Py_ssize_t n, i, nviews = 0;
+    size_t names = 0, data = 0, names_start, data_start;
+    bank_header_t* header;
+    bank_clip_t* table;
+    int rc = -1;
+
+    if (!format->mBytesPerFrame) {
+        PyErr_SetString(PyExc_ValueError,
+                        "the format must have a fixed mBytesPerFrame");
+        return -1;
+    }
+
+    if (!(items = PyMapping_Items(clips)))
+        return -1;
+
+    n = PyList_GET_SIZE(items);
+    if (n > 0xffffffff) {
+        PyErr_SetString(PyExc_ValueError, "too many clips");
+        goto done;
+    }
+
+    // the views are held until the data is copied, so it can't change size
+    if (!(views = PyMem_Calloc(n ? n : 1, sizeof(Py_buffer)))) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    // first pass: the sizes
+    for (i = 0; i < n; ++i) {
+        PyObject* item = PyList_GET_ITEM(items, i);
+        PyObject* name = PyTuple_GET_ITEM(item, 0);
+        Py_ssize_t len;
+
+        if (!PyUnicode_Check(name)) {
+            PyErr_SetString(PyExc_TypeError, "clip names must be str");
+            goto done;
+        }
+        if (!PyUnicode_AsUTF8AndSize(name, &len))
+            goto done;
+        names += len;
+
+        if (PyObject_GetBuffer(PyTuple_GET_ITEM(item, 1), &views[i],
+                               PyBUF_SIMPLE)
+            < 0)
+            goto done;
+        nviews++;
+        len = views[i].len;
+
+        if (len % format->mBytesPerFrame) {
+            PyErr_Format(PyExc_ValueError,
+                         "clip '%U' is not a whole number of frames", name);
+            goto done;
+        }
+        data += bank_align(len);
+    }
+
+    names_start = sizeof(bank_header_t) + n * sizeof(bank_clip_t);
+    data_start = bank_align(names_start + names);
+    self->size = data_start + data;
+
+    if (!(self->arena = PyMem_Calloc(1, self->size))) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    header = (bank_header_t*)self->arena;
+    memcpy(header->magic, BANK_MAGIC, 4);
+    header->version = BANK_VERSION;
+    header->nclips = (UInt32)n;
+    header->format = *format;
+    header->size = self->size;
+
+    table = (bank_clip_t*)(self->arena + sizeof(bank_header_t));
+    names = names_start;
+    data = data_start;
+
+    // second pass: copy
+    for (i = 0; i < n; ++i) {
+        PyObject* item = PyList_GET_ITEM(items, i);
+        Py_ssize_t len;
+        const char* name = PyUnicode_AsUTF8AndSize(PyTuple_GET_ITEM(item, 0),
+                                                   &len);
+
+        memcpy(self->arena + names, name, len);
+        table[i].name_offset = (UInt32)names;
+        table[i].name_length = (UInt32)len;
+        names += len;
+
+        memcpy(self->arena + data, views[i].buf, views[i].len);
+        table[i].offset = data;
+        table[i].bytes = views[i].len;
+        data += bank_align(views[i].len);
+    }
+
+    rc = 0;
+
+done:
+    for (i = 0; i < nviews; ++i)
+        PyBuffer_Release(&views[i]);
+    PyMem_Free(views);
+    Py_DECREF(items);
+    return rc;
+}
+
+static void sample_bank_dealloc(sample_bank_t* obj)
+{
+    if (obj->mapped)
+        munmap(obj->arena, obj->size);
+    else
+        PyMem_Free(obj->arena);
+    Py_XDECREF(obj->ids);
+
+    PyObject_Free(obj);
+}
+
+static PyObject* sample_bank_new(PyTypeObject* type, PyObject* args,
+                                 PyObject* kwds)
+{
+    sample_bank_t* self;
+    PyObject* source;
+    audio_stream_basic_desc_t* format = NULL;
+    int rc;
+
+    if (!PyArg_ParseTuple(args, "O|O!:SampleBank", &source,
+                          &AudioStreamBasicDescType, &format))
+        return NULL;
+
+    if (!(self = (sample_bank_t*)PyObject_New(sample_bank_t,
+                                              &SampleBankType)))
+        return NULL;
+
+    self->arena = NULL;
+    self->size = 0;
+    self->mapped = 0;
+    self->header = NULL;
+    self->clips = NULL;
+    self->ids = NULL;
+
+    if (PyUnicode_Check(source) || PyBytes_Check(source)
+        || PyObject_HasAttrString(source, "__fspath__")) {
+        rc = sample_bank_map(self, source);
+    } else if (!format) {
+        PyErr_SetString(PyExc_TypeError,
+                        "SampleBank(clips, format) needs a format");
+        rc = -1;
+    } else {
+        rc = sample_bank_build(self, source, &format->bdesc);
+    }
+
+    if (rc < 0 || sample_bank_index(self) < 0) {
+        Py_DECREF(self);
+        return NULL;
+    }
+
+    return (PyObject*)self;
+}
+
+/* Look up a clip by name, with an exception if there is none */
+static long sample_bank_lookup(sample_bank_t* self, PyObject* name)
+{
+    PyObject* index = PyDict_GetItemWithError(self->ids, name);
+
+    if (!index) {
+        if (!PyErr_Occurred())
+            PyErr_SetObject(PyExc_KeyError, name);
+        return -1;
+    }
+
+    return PyLong_AsLong(index);
+}
+
+static PyObject* sample_bank_save(sample_bank_t* self, PyObject* args)
+{
+    PyObject* path;
+    FILE* f;
+    size_t written = 0;
+
+    if (!PyArg_ParseTuple(args, "O&:Save", PyUnicode_FSConverter, &path))
+        return NULL;
+
+    Py_BEGIN_ALLOW_THREADS;
+    if ((f = fopen(PyBytes_AS_STRING(path), "wb"))) {
+        written = fwrite(self->arena, 1, self->size, f);
+        if (fclose(f) != 0)
+            written = 0;
+    }
+    Py_END_ALLOW_THREADS;
+
+    if (!f || written != self->size) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path);
+        Py_DECREF(path);
+        return NULL;
+    }
+
+    Py_DECREF(path);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject* sample_bank_getids(sample_bank_t* self, PyObject* args)
+{
+    if (!PyArg_ParseTuple(args, ":GetIds"))
+        return NULL;
+
+    return PyDict_Keys(self->ids);
+}
+
+static PyObject* sample_bank_getframes(sample_bank_t* self, PyObject* args)
+{
+    PyObject* name;
+    long index;
+
+    if (!PyArg_ParseTuple(args, "U:GetFrames", &name))
+        return NULL;
+
+    if ((index = sample_bank_lookup(self, name)) < 0)
+        return NULL;
+
+    return PyLong_FromUnsignedLongLong(
+        self->clips[index].bytes / self->header->format.mBytesPerFrame);
+}
+
+static PyObject* sample_bank_getformat(sample_bank_t* self, void* closure)
+{
+    audio_stream_basic_desc_t* retval;
+
+    if (!(retval = (audio_stream_basic_desc_t*)PyObject_New(
+              audio_stream_basic_desc_t, &AudioStreamBasicDescType)))
+        return NULL;
+
+    retval->bdesc = self->header->format;
+
+    return (PyObject*)retval;
+}
+
+static Py_ssize_t sample_bank_length(sample_bank_t* self)
+{
+    return self->header->nclips;
+}
+
+static PyMethodDef sample_bank_methods[] = {
+    { "Save", (PyCFunction)sample_bank_save, METH_VARARGS,
+      "Save(path) -- write the bank as a pack file that can be mapped with "
+      "SampleBank(path)." },
+    { "GetIds", (PyCFunction)sample_bank_getids, METH_VARARGS,
+      "GetIds() -- return the names of the clips." },
+    { "GetFrames", (PyCFunction)sample_bank_getframes, METH_VARARGS,
+      "GetFrames(name) -- return the length of a clip in frames." },
+    { NULL, NULL }
+};
+
+static PyGetSetDef sample_bank_getset[] = {
+    { "format", (getter)sample_bank_getformat, NULL,
+      "the AudioStreamBasicDescription of all clips" },
+    { NULL }
+};
+
+static PySequenceMethods sample_bank_as_sequence = {
+    .sq_length = (lenfunc)sample_bank_length,
+};
+
+static PyTypeObject SampleBankType = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    .tp_name = "coreaudio.SampleBank",
+    .tp_basicsize = sizeof(sample_bank_t),
+    .tp_doc = PyDoc_STR(
+        "SampleBank(clips, format) or SampleBank(path)\n\n"
+        "Clips of one format in a single arena, addressed by name. 'clips' "
+        "maps names to bytes; a path is a pack file written by Save, which "
+        "is memory mapped and shared between processes."),
+    .tp_new = sample_bank_new,
+    .tp_dealloc = (destructor)sample_bank_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_methods = sample_bank_methods,
+    .tp_getset = sample_bank_getset,
+    .tp_as_sequence = &sample_bank_as_sequence,
+};
+
+/* The trigger word: a generation count in the upper half, the clip index
+   + 1 (or 0 to stop) in the lower 31 bits, and a loop flag */
+#define CLIP_LOOP 0x80000000u
+
+typedef struct {
+    native_source_t source;
+    sample_bank_t* bank;
+    _Atomic UInt64 trigger;
+    _Atomic UInt64 finished; /* the trigger word of the last clip played out */
+    /* only used on the render thread */
+    UInt64 seen;
+    const bank_clip_t* clip;
+    int loop;
+    UInt64 position; /* in bytes */
+} clip_player_t;
+
+static OSStatus clip_player_render(PyObject* source,
+                                   AudioUnitRenderActionFlags* ioActionFlags,
+                                   const AudioTimeStamp* inTimeStamp,
+                                   UInt32 inBusNumber, UInt32 inNumberFrames,
+                                   AudioBufferList* ioData)
+{
+    clip_player_t* self = (clip_player_t*)source;
+    UInt64 trigger = atomic_load_explicit(&self->trigger,
+                                          memory_order_acquire);
+    UInt32 bpf = self->bank->header->format.mBytesPerFrame;
+    char* out = ioData->mBuffers[0].mData;
+    UInt64 want = (UInt64)inNumberFrames * bpf;
+    UInt64 n;
+    UInt32 i;
+
+    if (trigger != self->seen) {
+        UInt32 index = trigger & ~CLIP_LOOP & 0xffffffffu;
+
+        self->seen = trigger;
+        self->clip = index ? &self->bank->clips[index - 1] : NULL;
+        self->loop = (trigger & CLIP_LOOP) != 0;
+        self->position = 0;
+    }
+
+    if (!self->clip || ioData->mNumberBuffers != 1
+        || ioData->mBuffers[0].mDataByteSize != want) {
+        for (i = 0; i < ioData->mNumberBuffers; ++i)
+            memset(ioData->mBuffers[i].mData, 0,
+                   ioData->mBuffers[i].mDataByteSize);
+        *ioActionFlags |= kAudioUnitRenderAction_OutputIsSilence;
+        return noErr;
+    }
+
+    while (want) {
+        n = self->clip->bytes - self->position;
+        if (n > want)
+            n = want;
+
+        memcpy(out, self->bank->arena + self->clip->offset + self->position,
+               n);
+        out += n;
+        want -= n;
+        self->position += n;
+
+        if (self->position == self->clip->bytes) {
+            if (!self->loop || !self->clip->bytes) {
+                memset(out, 0, want);
+                self->clip = NULL;
+                atomic_store_explicit(&self->finished, self->seen,
+                                      memory_order_release);
+                break;
+            }
+            self->position = 0;
+        }
+    }
+
+    return noErr;
+}
+
+/* The clips are copied as they are, into a single buffer */
+static int clip_player_check(PyObject* source,
+                             const AudioStreamBasicDescription* format)
+{
+    clip_player_t* self = (clip_player_t*)source;
+    const AudioStreamBasicDescription* clips = &self->bank->header->format;
+    UInt32 flags = kAudioFormatFlagIsFloat | kAudioFormatFlagIsSignedInteger
+        | kAudioFormatFlagIsBigEndian;
+
+    if (format->mFormatID != clips->mFormatID
+        || format->mSampleRate != clips->mSampleRate
+        || format->mChannelsPerFrame != clips->mChannelsPerFrame
+        || format->mBitsPerChannel != clips->mBitsPerChannel
+        || format->mBytesPerFrame != clips->mBytesPerFrame
+        || (format->mFormatFlags & flags) != (clips->mFormatFlags & flags)
+        || (format->mChannelsPerFrame > 1
+            && (format->mFormatFlags & kAudioFormatFlagIsNonInterleaved))) {
+        PyErr_SetString(CoreAudioError,
+                        "the bus format does not match the SampleBank: "
+                        "expected its format, interleaved");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void clip_player_dealloc(clip_player_t* obj)
+{
+    Py_XDECREF(obj->bank);
+
+    PyObject_Free(obj);
+}
+
+static PyObject* clip_player_new(PyTypeObject* type, PyObject* args,
+                                 PyObject* kwds)
+{
+    clip_player_t* self;
+    sample_bank_t* bank;
+
+    if (!PyArg_ParseTuple(args, "O!:ClipPlayer", &SampleBankType, &bank))
+        return NULL;
+
+    if (!(self = (clip_player_t*)PyObject_New(clip_player_t,
+                                              &ClipPlayerType)))
+        return NULL;
+
+    self->source.render = clip_player_render;
+    self->source.check = clip_player_check;
+    Py_INCREF(bank);
+    self->bank = bank;
+    self->trigger = 0;
+    self->finished = 0;
+    self->seen = 0;
+    self->clip = NULL;
+    self->loop = 0;
+    self->position = 0;
+
+    return (PyObject*)self;
+}
+
+static void clip_player_trigger(clip_player_t* self, UInt32 word)
+{
+    UInt64 generation = (atomic_load(&self->trigger) >> 32) + 1;
+
+    atomic_store_explicit(&self->trigger, generation << 32 | word,
+                          memory_order_release);
+}
+
+static PyObject* clip_player_play(clip_player_t* self, PyObject* args)
+{
+    PyObject* name;
+    int loop = 0;
+    long index;
+
+    if (!PyArg_ParseTuple(args, "U|p:Play", &name, &loop))
+        return NULL;
+
+    if ((index = sample_bank_lookup(self->bank, name)) < 0)
+        return NULL;
+
+    clip_player_trigger(self, (UInt32)(index + 1) | (loop ? CLIP_LOOP : 0));
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject* clip_player_stop(clip_player_t* self, PyObject* args)
+{
+    if (!PyArg_ParseTuple(args, ":Stop"))
+        return NULL;
+
+    clip_player_trigger(self, 0);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject* clip_player_isplaying(clip_player_t* self, PyObject* args)
+{
+    UInt64 trigger;
+
+    if (!PyArg_ParseTuple(args, ":IsPlaying"))
+        return NULL;
+
+    // playing until the render thread has played out this very trigger
+    trigger = atomic_load(&self->trigger);
+
+    return PyBool_FromLong((trigger & ~CLIP_LOOP & 0xffffffffu)
+                           && atomic_load(&self->finished) != trigger);
+}
+
+static PyMethodDef clip_player_methods[] = {
+    { "Play", (PyCFunction)clip_player_play, METH_VARARGS,
+      "Play(name[, loop]) -- start playing a clip of the bank from the next "
+      "render cycle, replacing whatever is playing." },
+    { "Stop", (PyCFunction)clip_player_stop, METH_VARARGS,
+      "Stop() -- stop playing; the player renders silence." },
+    { "IsPlaying", (PyCFunction)clip_player_isplaying, METH_VARARGS,
+      "IsPlaying() -- true until a clip that does not loop has ended." },
+    { NULL, NULL }
+};
+
+static PyMemberDef clip_player_members[] = {
+    { "bank", T_OBJECT, offsetof(clip_player_t, bank), READONLY },
+    { NULL }
+};
+
+static PyTypeObject ClipPlayerType = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    .tp_name = "coreaudio.ClipPlayer",
+    .tp_basicsize = sizeof(clip_player_t),
+    .tp_doc = PyDoc_STR(
+        "ClipPlayer(bank)\n\n"
+        "Plays clips from a SampleBank. Pass it to AudioUnit.SetRenderCallback "
+        "on a bus with the format of the bank."),
+    .tp_new = clip_player_new,
+    .tp_dealloc = (destructor)clip_player_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_methods = clip_player_methods,
+    .tp_members = clip_player_members,
+};
+
+/*
+ * Time stretching
+ *
+ * WSOLA (waveform similarity overlap-add): the output is built from Hann
+ * windowed frames of WSOLA_FRAME_MS with 50% overlap. Each frame is taken
+ * from near its ideal position in the input, within a search tolerance,
+ * where it best continues the previously used frame, measured by the
+ * normalized cross-correlation of the mono mix. This changes the tempo
+ * without changing the pitch.
+ *
+ * The quality (0-2) trades search effort for accuracy: it sets the search
+ * tolerance and whether the search first steps over every fourth or
+ * second position before refining around the best one.
+ *
+ * A TimeStretch is a native source that pulls another native source; the
+ * same engine stretches buffers offline in TimeStretchBuffer.
+ */
+
+#define WSOLA_FRAME_MS 30
+#define WSOLA_MIN_RATE 0.25
+#define WSOLA_MAX_RATE 4.0
+#define WSOLA_MAX_QUALITY 2
+
+/* Search tolerance in ms and coarse step, by quality */
+static const int wsola_tolerance_ms[] = { 5, 8, 12 };
+static const int wsola_coarse_step[] = { 4, 2, 1 };
+
+typedef struct {
+    UInt32 channels;
+    UInt32 frame; /* N, the window length in frames */
+    UInt32 hop; /* N / 2, the synthesis hop */
+    UInt32 tolerance; /* the maximum tolerance in frames */
+    Float32* window;
+
+    /* input, interleaved and mixed to mono; in[0] is frame 'base' */
+    Float32* in;
+    Float32* mono;
+    UInt32 capacity;
+    UInt32 length;
+    SInt64 base;
+
+    /* the second half of the last frame, windowed */
+    Float32* overlap;
+
+    Float64 analysis; /* the ideal input position of the next frame */
+    SInt64 previous; /* the input position of the last frame */
+    int started;
+} wsola_t;
+
+static void wsola_free(wsola_t* w)
+{
+    PyMem_RawFree(w->window);
+    PyMem_RawFree(w->in);
+    PyMem_RawFree(w->mono);
+    PyMem_RawFree(w->overlap);
+}
+
+/* Set up for up to 'block' frames written at a time, or a hop if 0.
+   Returns -1 if out of memory. */
+static int wsola_init(wsola_t* w, UInt32 channels, Float64 sample_rate,
+                      UInt32 block)
+{
+    UInt32 i;
+
+    memset(w, 0, sizeof(*w));
+
+    w->channels = channels;
+    w->hop = (UInt32)(sample_rate * WSOLA_FRAME_MS / 2000.0);
+    if (w->hop < 16)
+        w->hop = 16;
+    w->frame = 2 * w->hop;
+    w->tolerance = (UInt32)(sample_rate
+                            * wsola_tolerance_ms[WSOLA_MAX_QUALITY] / 1000.0);
+    if (!block)
+        block = w->hop;
+
+    // a frame, the search around it and the largest analysis hop
+    w->capacity = w->frame + 2 * w->tolerance
+        + (UInt32)(w->hop * WSOLA_MAX_RATE) + w->hop + block;
+
+    w->window = PyMem_RawMalloc(w->frame * sizeof(Float32));
+    w->in = PyMem_RawMalloc((size_t)w->capacity * channels * sizeof(Float32));
+    w->mono = PyMem_RawMalloc(w->capacity * sizeof(Float32));
+    w->overlap = PyMem_RawCalloc((size_t)w->hop * channels, sizeof(Float32));
+    if (!w->window || !w->in || !w->mono || !w->overlap) {
+        wsola_free(w);
+        return -1;
+    }
+
+    // periodic Hann: overlapping halves sum to one
+    for (i = 0; i < w->frame; ++i)
+        w->window[i] = (Float32)(0.5 - 0.5 * cos(2.0 * M_PI * i / w->frame));
+
+    return 0;
+}
+
+static UInt32 wsola_space(const wsola_t* w)
+{
+    return w->capacity - w->length;
+}
+
+/* Append 'n' interleaved frames; at most wsola_space() */
+static void wsola_write(wsola_t* w, const Float32* frames, UInt32 n)
+{
+    Float32* in = w->in + (size_t)w->length * w->channels;
+    Float32 scale = 1.0f / w->channels;
+    UInt32 i, c;
+
+    memcpy(in, frames, (size_t)n * w->channels * sizeof(Float32));
+
+    for (i = 0; i < n; ++i) {
+        Float32 sum = 0.0f;
+
+        for (c = 0; c < w->channels; ++c)
+            sum += frames[i * w->channels + c];
+        w->mono[w->length + i] = sum * scale;
+    }
+
+    w->length += n;
+}
+
+/* The dot products a.b and b.b over n samples */
+static void wsola_dot(const Float32* a, const Float32* b, UInt32 n,
+                      Float32* ab, Float32* bb)
+{
+    UInt32 i = 0;
+    Float32 sab = 0.0f, sbb = 0.0f;
+
+#if defined(__SSE__)
+    __m128 vab = _mm_setzero_ps(), vbb = _mm_setzero_ps();
+    float lanes[4];
+
+    for (; i + 4 <= n; i += 4) {
+        __m128 va = _mm_loadu_ps(a + i);
+        __m128 vb = _mm_loadu_ps(b + i);
+
+        vab = _mm_add_ps(vab, _mm_mul_ps(va, vb));
+        vbb = _mm_add_ps(vbb, _mm_mul_ps(vb, vb));
+    }
+    _mm_storeu_ps(lanes, vab);
+    sab = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    _mm_storeu_ps(lanes, vbb);
+    sbb = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#elif defined(__ARM_NEON)
+    float32x4_t vab = vdupq_n_f32(0.0f), vbb = vdupq_n_f32(0.0f);
+
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t va = vld1q_f32(a + i);
+        float32x4_t vb = vld1q_f32(b + i);
+
+        vab = vmlaq_f32(vab, va, vb);
+        vbb = vmlaq_f32(vbb, vb, vb);
+    }
+    sab = vgetq_lane_f32(vab, 0) + vgetq_lane_f32(vab, 1)
+        + vgetq_lane_f32(vab, 2) + vgetq_lane_f32(vab, 3);
+    sbb = vgetq_lane_f32(vbb, 0) + vgetq_lane_f32(vbb, 1)
+        + vgetq_lane_f32(vbb, 2) + vgetq_lane_f32(vbb, 3);
+#endif
+
+    for (; i < n; ++i) {
+        sab += a[i] * b[i];
+        sbb += b[i] * b[i];
+    }
+
+    *ab = sab;
+    *bb = sbb;
+}
+
+/* The similarity of the candidate at 'position' to the natural
+   continuation of the last frame */
+static Float32 wsola_similarity(const wsola_t* w, SInt64 position,
+                                const Float32* natural)
+{
+    Float32 ab, bb;
+
+    wsola_dot(natural, w->mono + (position - w->base), w->hop, &ab, &bb);
+
+    return bb > 1e-9f ? ab / sqrtf(bb) : 0.0f;
+}
+
+/* Produce the next 'hop' interleaved frames into 'out'. Returns 0 if more
+   input is needed first. */
+static int wsola_step(wsola_t* w, Float64 rate, int quality, Float32* out)
+{
+    SInt64 target = (SInt64)llround(w->analysis);
+    SInt64 natural = w->previous + w->hop;
+    UInt32 tolerance = (UInt32)((Float64)w->tolerance
+                                * wsola_tolerance_ms[quality]
+                                / wsola_tolerance_ms[WSOLA_MAX_QUALITY]);
+    SInt64 end = w->base + w->length;
+    SInt64 best = target;
+    SInt64 lo, hi, p, keep;
+    UInt32 i, c, step = wsola_coarse_step[quality];
+    const Float32* in;
+
+    if (target + (SInt64)tolerance + w->frame > end
+        || (w->started && natural + w->hop > end))
+        return 0;
+
+    if (w->started) {
+        const Float32* continuation = w->mono + (natural - w->base);
+        Float32 score, best_score = -1e30f;
+
+        lo = target - (SInt64)tolerance;
+        if (lo < w->base)
+            lo = w->base;
+        hi = target + (SInt64)tolerance;
+
+        for (p = lo; p <= hi; p += step) {
+            if ((score = wsola_similarity(w, p, continuation)) > best_score) {
+                best_score = score;
+                best = p;
+            }
+        }
+
+        // refine around the best coarse position
+        if (step > 1) {
+            SInt64 center = best;
+
+            for (p = center - step + 1; p < center + (SInt64)step; ++p) {
+                if (p < lo || p > hi || p == center)
+                    continue;
+                if ((score = wsola_similarity(w, p, continuation))
+                    > best_score) {
+                    best_score = score;
+                    best = p;
+                }
+            }
+        }
+    }
+
+    // overlap-add: the first half completes the output, the second half
+    // is kept for the next step
+    in = w->in + (size_t)(best - w->base) * w->channels;
+    for (i = 0; i < w->hop; ++i) {
+        for (c = 0; c < w->channels; ++c) {
+            size_t k = (size_t)i * w->channels + c;
+
+            out[k] = w->overlap[k] + w->window[i] * in[k];
+            w->overlap[k] = w->window[i + w->hop]
+                * in[(size_t)(i + w->hop) * w->channels + c];
+        }
+    }
+
+    w->previous = best;
+    w->started = 1;
+    w->analysis += w->hop * rate;
+
+    // discard input that no search will reach
+    keep = (SInt64)llround(w->analysis) - (SInt64)w->tolerance;
+    if (keep > w->previous + w->hop)
+        keep = w->previous + w->hop;
+    if (keep > w->base) {
+        UInt32 drop = (UInt32)(keep - w->base);
+
+        if (drop > w->length)
+            drop = w->length;
+        memmove(w->in, w->in + (size_t)drop * w->channels,
+                (size_t)(w->length - drop) * w->channels * sizeof(Float32));
+        memmove(w->mono, w->mono + drop,
+                (w->length - drop) * sizeof(Float32));
+        w->length -= drop;
+        w->base += drop;
+    }
+
+    return 1;
+}
+
+static int wsola_format_supported(const AudioStreamBasicDescription* fmt)
+{
+    if (fmt->mFormatID != kAudioFormatLinearPCM || !fmt->mChannelsPerFrame
+        || fmt->mSampleRate <= 0.0
+        || (fmt->mFormatFlags & kAudioFormatFlagIsNonInterleaved))
+        return 0;
+
+    if (fmt->mFormatFlags & kAudioFormatFlagIsFloat)
+        return fmt->mBitsPerChannel == 32;
+
+    return fmt->mBitsPerChannel == 16;
+}
+
+static void wsola_to_float(const AudioStreamBasicDescription* fmt,
+                           const void* data, Float32* out, UInt32 samples)
+{
+    UInt32 i;
+
+    if (fmt->mFormatFlags & kAudioFormatFlagIsFloat)
+        memcpy(out, data, samples * sizeof(Float32));
+    else
+        for (i = 0; i < samples; ++i)
+            out[i] = ((const SInt16*)data)[i] / 32768.0f;
+}
+
+static void wsola_from_float(const AudioStreamBasicDescription* fmt,
+                             const Float32* in, void* data, UInt32 samples)
+{
+    UInt32 i;
+
+    if (fmt->mFormatFlags & kAudioFormatFlagIsFloat)
+        memcpy(data, in, samples * sizeof(Float32));
+    else
+        for (i = 0; i < samples; ++i) {
+            Float32 s = in[i] * 32768.0f;
+
+            ((SInt16*)data)[i] = s >= 32767.0f ? 32767
+                : s <= -32768.0f               ? -32768
+                                               : (SInt16)lrintf(s);
+        }
+}
+
+/* The largest number of frames a TimeStretch renders per cycle */
+#define STRETCH_MAX_FRAMES 8192
+
+typedef struct {
+    native_source_t source;
+    native_source_t* upstream;
+    AudioStreamBasicDescription format;
+    _Atomic(Float64) rate;
+    atomic_int quality;
+
+    /* render thread only */
+    wsola_t wsola;
+    AudioBufferList* pull; /* 'hop' frames from upstream */
+    Float32* converted;
+    Float32* out; /* a fifo of stretched frames */
+    UInt32 out_frames;
+    Float64 sample_time; /* of the upstream */
+} time_stretch_t;
+
+static OSStatus time_stretch_render(PyObject* source,
+                                    AudioUnitRenderActionFlags* ioActionFlags,
+                                    const AudioTimeStamp* inTimeStamp,
+                                    UInt32 inBusNumber, UInt32 inNumberFrames,
+                                    AudioBufferList* ioData)
+{
+    time_stretch_t* self = (time_stretch_t*)source;
+    wsola_t* w = &self->wsola;
+    UInt32 channels = self->format.mChannelsPerFrame;
+    UInt32 bpf = self->format.mBytesPerFrame;
+    Float64 rate = atomic_load_explicit(&self->rate, memory_order_relaxed);
+    int quality = atomic_load_explicit(&self->quality, memory_order_relaxed);
+    UInt32 i;
+
+    if (ioData->mNumberBuffers != 1 || inNumberFrames > STRETCH_MAX_FRAMES
+        || ioData->mBuffers[0].mDataByteSize != inNumberFrames * bpf) {
+        for (i = 0; i < ioData->mNumberBuffers; ++i)
+            memset(ioData->mBuffers[i].mData, 0,
+                   ioData->mBuffers[i].mDataByteSize);
+        *ioActionFlags |= kAudioUnitRenderAction_OutputIsSilence;
+        return noErr;
+    }
+
+    while (self->out_frames < inNumberFrames) {
+        Float32* out = self->out + (size_t)self->out_frames * channels;
+
+        if (wsola_step(w, rate, quality, out)) {
+            self->out_frames += w->hop;
+        } else {
+            AudioUnitRenderActionFlags flags = 0;
+            AudioTimeStamp ts = *inTimeStamp;
+            OSStatus rc;
+
+            ts.mSampleTime = self->sample_time;
+            self->pull->mBuffers[0].mDataByteSize = w->hop * bpf;
+
+            rc = self->upstream->render((PyObject*)self->upstream, &flags, &ts,
+                                        inBusNumber, w->hop, self->pull);
+            if (rc != noErr)
+                return rc;
+
+            wsola_to_float(&self->format, self->pull->mBuffers[0].mData,
+                           self->converted, w->hop * channels);
+            wsola_write(w, self->converted, w->hop);
+            self->sample_time += w->hop;
+        }
+    }
+
+    wsola_from_float(&self->format, self->out, ioData->mBuffers[0].mData,
+                     inNumberFrames * channels);
+
+    self->out_frames -= inNumberFrames;
+    memmove(self->out, self->out + (size_t)inNumberFrames * channels,
+            (size_t)self->out_frames * channels * sizeof(Float32));
+
+    return noErr;
+}
+
+static void time_stretch_dealloc(time_stretch_t* obj)
+{
+    wsola_free(&obj->wsola);
+    PyMem_Free(obj->pull);
+    PyMem_Free(obj->converted);
+    PyMem_Free(obj->out);
+    Py_XDECREF(obj->upstream);
+
+    PyObject_Free(obj);
+}
+
+static int time_stretch_check(double rate, int quality)
+{
+    if (rate < WSOLA_MIN_RATE || rate > WSOLA_MAX_RATE) {
+        PyErr_SetString(PyExc_ValueError, "rate must be between 0.25 and 4");
+        return -1;
+    }
+
+    if (quality < 0 || quality > WSOLA_MAX_QUALITY) {
+        PyErr_Format(PyExc_ValueError, "quality must be between 0 and %d",
+                     WSOLA_MAX_QUALITY);
+        return -1;
+    }
+
+    return 0;
+}
+
+static PyObject* time_stretch_new(PyTypeObject* type, PyObject* args,
+                                  PyObject* kwds)
+{
+    static char* kwlist[] = { "source", "format", "rate", "quality", NULL };
+    time_stretch_t* self;
+    PyObject* upstream;
+    audio_stream_basic_desc_t* format;
+    double rate = 1.0;
+    int quality = 1;
+    UInt32 channels;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO!|di:TimeStretch", kwlist,
+                                     &upstream, &AudioStreamBasicDescType,
+                                     &format, &rate, &quality))
+        return NULL;
+
+    if (!native_source_check(upstream)) {
+        PyErr_SetString(PyExc_TypeError, "source must be a native source");
+        return NULL;
+    }
+
+    if (!wsola_format_supported(&format->bdesc)) {
+        PyErr_SetString(CoreAudioError,
+                        "can only stretch interleaved 16 bit integer or 32 bit "
+                        "float linear PCM");
+        return NULL;
+    }
+
+    if (time_stretch_check(rate, quality) < 0)
+        return NULL;
+
+    if (!(self = (time_stretch_t*)PyObject_New(time_stretch_t,
+                                               &TimeStretchType)))
+        return NULL;
+
+    self->source.render = time_stretch_render;
+    self->source.check = NULL;
+    Py_INCREF(upstream);
+    self->upstream = (native_source_t*)upstream;
+    self->format = format->bdesc;
+    self->rate = rate;
+    self->quality = quality;
+    self->pull = NULL;
+    self->converted = NULL;
+    self->out = NULL;
+    self->out_frames = 0;
+    self->sample_time = 0.0;
+
+    channels = self->format.mChannelsPerFrame;
+    if (wsola_init(&self->wsola, channels, self->format.mSampleRate, 0) < 0) {
+        memset(&self->wsola, 0, sizeof(self->wsola));
+        Py_DECREF(self);
+        return PyErr_NoMemory();
+    }
+
+    self->pull = alloc_buffer_list(&self->format, self->wsola.hop);
+    self->converted = PyMem_Malloc((size_t)self->wsola.hop * channels
+                                   * sizeof(Float32));
+    self->out = PyMem_Malloc((size_t)(STRETCH_MAX_FRAMES + self->wsola.hop)
+                             * channels * sizeof(Float32));
+    if (!self->pull || !self->converted || !self->out) {
+        Py_DECREF(self);
+        return PyErr_NoMemory();
+    }
+
+    return (PyObject*)self;
+}
+
+static PyObject* time_stretch_setrate(time_stretch_t* self, PyObject* args)
+{
+    double rate;
+
+    if (!PyArg_ParseTuple(args, "d:SetRate", &rate))
+        return NULL;
+
+    if (time_stretch_check(rate, 0) < 0)
+        return NULL;
+
+    atomic_store_explicit(&self->rate, rate, memory_order_relaxed);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject* time_stretch_getrate(time_stretch_t* self, PyObject* args)
+{
+    if (!PyArg_ParseTuple(args, ":GetRate"))
+        return NULL;
+
+    return PyFloat_FromDouble(atomic_load(&self->rate));
+}
+
+static PyObject* time_stretch_setquality(time_stretch_t* self, PyObject* args)
+{
+    int quality;
+
+    if (!PyArg_ParseTuple(args, "i:SetQuality", &quality))
+        return NULL;
+
+    if (time_stretch_check(1.0, quality) < 0)
+        return NULL;
+
+    atomic_store_explicit(&self->quality, quality, memory_order_relaxed);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyMethodDef time_stretch_methods[] = {
+    { "SetRate", (PyCFunction)time_stretch_setrate, METH_VARARGS,
+      "SetRate(rate) -- set the playback speed; 2.0 plays twice as fast. "
+      "Takes effect with the next frame." },
+    { "GetRate", (PyCFunction)time_stretch_getrate, METH_VARARGS,
+      "GetRate() -- return the playback speed." },
+    { "SetQuality", (PyCFunction)time_stretch_setquality, METH_VARARGS,
+      "SetQuality(quality) -- 0 (least CPU) to 2 (best)." },
+    { NULL, NULL }
+};
+
+static PyMemberDef time_stretch_members[] = {
+    { "source", T_OBJECT, offsetof(time_stretch_t, upstream), READONLY },
+    { NULL }
+};
+
+static PyTypeObject TimeStretchType = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    .tp_name = "coreaudio.TimeStretch",
+    .tp_basicsize = sizeof(time_stretch_t),
+    .tp_doc = PyDoc_STR(
+        "TimeStretch(source, format, rate=1.0, quality=1)\n\n"
+        "Plays a native source faster or slower without changing its pitch. "
+        "'format' is the format of the source, which must be interleaved 16 "
+        "bit integer or 32 bit float linear PCM. Pass it to "
+        "AudioUnit.SetRenderCallback on a bus with that format."),
+    .tp_new = time_stretch_new,
+    .tp_dealloc = (destructor)time_stretch_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_methods = time_stretch_methods,
+    .tp_members = time_stretch_members,
+};
+
+static PyObject* coreaudio_timestretchbuffer(PyObject* self, PyObject* args)
+{
+    audio_stream_basic_desc_t* format;
+    Py_buffer data;
+    double rate;
+    int quality = 1;
+    const AudioStreamBasicDescription* fmt;
+    wsola_t w;
+    UInt32 channels, bpf, block;
+    Py_ssize_t frames, done = 0, produced = 0, wanted, capacity;
+    Float32* in = NULL;
+    Float32* out = NULL;
+    PyObject* result = NULL;
+
+    if (!PyArg_ParseTuple(args, "y*O!d|i:TimeStretchBuffer", &data,
+                          &AudioStreamBasicDescType, &format, &rate,
+                          &quality))
+        return NULL;
+
+    fmt = &format->bdesc;
+    if (!wsola_format_supported(fmt)) {
+        PyErr_SetString(CoreAudioError,
+                        "can only stretch interleaved 16 bit integer or 32 bit "
+                        "float linear PCM");
+        goto done;
+    }
+
+    if (time_stretch_check(rate, quality) < 0)
+        goto done;
+
+    channels = fmt->mChannelsPerFrame;
+    bpf = fmt->mBytesPerFrame;
+    if (data.len % bpf) {
+        PyErr_SetString(PyExc_ValueError, "data is not a whole number of frames");
+        goto done;
+    }
+
+    frames = data.len / bpf;
+    wanted = (Py_ssize_t)llround(frames / rate);
+    block = 4096;
+
+    if (wsola_init(&w, channels, fmt->mSampleRate, block) < 0) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    capacity = wanted + w.hop;
+    in = PyMem_RawMalloc((size_t)block * channels * sizeof(Float32));
+    out = PyMem_RawMalloc((size_t)capacity * channels * sizeof(Float32));
+    if (!in || !out) {
+        wsola_free(&w);
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    Py_BEGIN_ALLOW_THREADS;
+    // pad the input with silence so the last frames are complete
+    while (produced < wanted) {
+        if (produced + w.hop <= capacity
+            && wsola_step(&w, rate, quality,
+                          out + (size_t)produced * channels)) {
+            produced += w.hop;
+            continue;
+        }
+        if (produced + w.hop > capacity)
+            break;
+
+        {
+            UInt32 n = wsola_space(&w) < block ? wsola_space(&w) : block;
+            Py_ssize_t left = frames - done;
+
+            if (!n)
+                break;
+            if (left > 0) {
+                if (n > left)
+                    n = (UInt32)left;
+                wsola_to_float(fmt, (const Byte*)data.buf + done * bpf, in,
+                               n * channels);
+            } else
+                memset(in, 0, (size_t)n * channels * sizeof(Float32));
+            wsola_write(&w, in, n);
+            done += n;
+        }
+    }
+    Py_END_ALLOW_THREADS;
+
+    wsola_free(&w);
+
+    if ((result = PyBytes_FromStringAndSize(NULL, wanted * bpf)))
+        wsola_from_float(fmt, out, PyBytes_AS_STRING(result),
+                         (UInt32)(wanted * channels));
+
+done:
+    PyMem_RawFree(in);
+    PyMem_RawFree(out);
+    PyBuffer_Release(&data);
+    return result;
+}
+
+/*
+ * Render tracing
+ *
+ * Each AudioUnit can record timestamped events from its render callbacks
+ * into a preallocated ring. Recording is an atomic increment and a clock
+ * read; it never allocates, locks or does I/O. The ring is formatted as
+ * Chrome trace JSON or Perfetto protobuf on demand.
+ */
+
+enum {
+    TRACE_ENTER,
+    TRACE_GIL_ACQUIRED,
+    TRACE_PYTHON_RETURNED,
+    TRACE_MEMCPY_DONE,
+    TRACE_EXIT,
+};
+
+typedef struct {
+    _Atomic UInt64 stamp; /* index + 1 once the event is complete */
+    UInt64 ns;
+    UInt64 serial;
+    UInt64 tid;
+    UInt32 type;
+    UInt32 bus;
+    UInt32 frames;
+} trace_event_t;
+
+typedef struct trace_ring {
+    struct trace_ring* retired; /* smaller rings replaced while rendering */
+    UInt32 size; /* events allocated, a power of two */
+    _Atomic UInt32 capacity; /* events in use, a power of two up to size */
+    _Atomic UInt64 base; /* events before this one were cleared */
+    _Atomic UInt64 head;
+    _Atomic UInt64 serial;
+    trace_event_t events[];
+} trace_ring_t;
+
+static UInt64 current_thread_id(void)
+{
+    static __thread UInt64 tid;
+
+    if (!tid) {
+#ifdef __APPLE__
+        pthread_threadid_np(NULL, &tid);
+#else
+        tid = (UInt64)syscall(SYS_gettid);
+#endif
+    }
+
+    return tid;
+}
+
+static trace_ring_t* trace_ring_new(UInt32 capacity)
+{
+    trace_ring_t* ring;
+
+    ring = PyMem_Calloc(1, sizeof(trace_ring_t)
+                               + (size_t)capacity * sizeof(trace_event_t));
+    if (!ring)
+        return NULL;
+
+    ring->size = capacity;
+    atomic_init(&ring->capacity, capacity);
+
+    return ring;
+}
+
+static void trace_ring_free(trace_ring_t* ring)
+{
+    while (ring) {
+        trace_ring_t* retired = ring->retired;
+        PyMem_Free(ring);
+        ring = retired;
+    }
+}
+
+/* Start a new callback; returns its serial number */
+static UInt64 trace_begin(trace_ring_t* ring)
+{
+    return atomic_fetch_add_explicit(&ring->serial, 1, memory_order_relaxed);
+}
+
+static void trace_record(trace_ring_t* ring, UInt64 serial, UInt32 type,
+                         UInt32 bus, UInt32 frames)
+{
+    UInt64 index;
+    trace_event_t* ev;
+
+    index = atomic_fetch_add_explicit(&ring->head, 1, memory_order_relaxed);
+    ev = &ring->events[index
+                       & (atomic_load_explicit(&ring->capacity,
+                                               memory_order_relaxed)
+                          - 1)];
+
+    atomic_store_explicit(&ev->stamp, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    ev->ns = AudioConvertHostTimeToNanos(AudioGetCurrentHostTime());
+    ev->serial = serial;
+    ev->tid = current_thread_id();
+    ev->type = type;
+    ev->bus = bus;
+    ev->frames = frames;
+    atomic_store_explicit(&ev->stamp, index + 1, memory_order_release);
+}
+
+static inline void trace_event(trace_ring_t* ring, UInt64 serial,
+                               UInt32 type, UInt32 bus, UInt32 frames)
+{
+    if (ring)
+        trace_record(ring, serial, type, bus, frames);
+}
+
+/* Copy the complete events out of the ring, oldest first. Returns the
+   number of events copied and sets *lost to the number overwritten or
+   still in progress. */
+static size_t trace_snapshot(trace_ring_t* ring, trace_event_t* out,
+                             UInt64* lost)
+{
+    UInt32 capacity = atomic_load_explicit(&ring->capacity,
+                                           memory_order_relaxed);
+    UInt64 base = atomic_load_explicit(&ring->base, memory_order_relaxed);
+    UInt64 head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    UInt64 start = head > capacity ? head - capacity : 0;
+    UInt64 i;
+    size_t n = 0;
+
+    if (start < base)
+        start = base;
+    *lost = start - base;
+
+    for (i = start; i < head; ++i) {
+        trace_event_t* ev = &ring->events[i & (capacity - 1)];
+        UInt64 stamp = atomic_load_explicit(&ev->stamp, memory_order_acquire);
+
+        if (stamp != i + 1) {
+            (*lost)++;
+            continue;
+        }
+
+        out[n].ns = ev->ns;
+        out[n].serial = ev->serial;
+        out[n].tid = ev->tid;
+        out[n].type = ev->type;
+        out[n].bus = ev->bus;
+        out[n].frames = ev->frames;
+        atomic_thread_fence(memory_order_acquire);
+
+        // overwritten while we were copying
+        if (atomic_load_explicit(&ev->stamp, memory_order_relaxed) != i + 1) {
+            (*lost)++;
+            continue;
+        }
+        n++;
+    }
+
+    return n;
+}
+
+/* A growable output buffer */
+
+typedef struct {
+    Byte* data;
+    size_t len;
+    size_t cap;
+} outbuf_t;
+
+static int outbuf_reserve(outbuf_t* b, size_t n)
+{
+    if (b->len + n > b->cap) {
+        size_t cap = b->cap ? b->cap : 4096;
+        Byte* data;
+
+        while (cap < b->len + n)
+            cap *= 2;
+        if (!(data = PyMem_Realloc(b->data, cap))) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        b->data = data;
+        b->cap = cap;
+    }
+
+    return 0;
+}
+
+static int outbuf_write(outbuf_t* b, const void* data, size_t n)
+{
+    if (outbuf_reserve(b, n) < 0)
+        return -1;
+
+    memcpy(b->data + b->len, data, n);
+    b->len += n;
+
+    return 0;
+}
+
+static int outbuf_printf(outbuf_t* b, const char* fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if (outbuf_reserve(b, 256) < 0)
+        return -1;
+
+    va_start(ap, fmt);
+    n = vsnprintf((char*)b->data + b->len, b->cap - b->len, fmt, ap);
+    va_end(ap);
+
+    if (n < 0) {
+        PyErr_SetString(PyExc_ValueError, "formatting failed");
+        return -1;
+    }
+
+    if ((size_t)n >= b->cap - b->len) {
+        if (outbuf_reserve(b, (size_t)n + 1) < 0)
+            return -1;
+        va_start(ap, fmt);
+        vsnprintf((char*)b->data + b->len, b->cap - b->len, fmt, ap);
+        va_end(ap);
+    }
+    b->len += n;
+
+    return 0;
+}
+
+/* Protocol buffer encoding, just enough for Perfetto */
+
+static int pb_varint(outbuf_t* b, UInt64 v)
+{
+    Byte tmp[10];
+    size_t n = 0;
+
+    do {
+        tmp[n++] = (Byte)((v & 0x7f) | (v > 0x7f ? 0x80 : 0));
+        v >>= 7;
+    } while (v);
+
+    return outbuf_write(b, tmp, n);
+}
+
+static int pb_uint(outbuf_t* b, UInt32 field, UInt64 v)
+{
+    if (pb_varint(b, (UInt64)field << 3) < 0)
+        return -1;
+
+    return pb_varint(b, v);
+}
+
+static int pb_bytes(outbuf_t* b, UInt32 field, const void* data, size_t n)
+{
+    if (pb_varint(b, ((UInt64)field << 3) | 2) < 0 || pb_varint(b, n) < 0)
+        return -1;
+
+    return outbuf_write(b, data, n);
+}
+
+static int pb_string(outbuf_t* b, UInt32 field, const char* s)
+{
+    return pb_bytes(b, field, s, strlen(s));
+}
+
+/*
+ * Callbacks are turned into slices: one for the whole callback and one for
+ * each phase between consecutive events of the same callback.
+ */
+
+static const char* trace_phase_name(UInt32 type)
+{
+    switch (type) {
+    case TRACE_GIL_ACQUIRED:
+        return "acquire GIL";
+    case TRACE_PYTHON_RETURNED:
+        return "python callback";
+    case TRACE_MEMCPY_DONE:
+        return "copy";
+    default:
+        return NULL;
+    }
+}
+
+typedef int (*trace_slice_func)(outbuf_t* b, const char* name,
+                                const trace_event_t* begin,
+                                const trace_event_t* end, int toplevel);
+
+static int trace_slices(outbuf_t* b, const trace_event_t* events, size_t n,
+                        trace_slice_func emit)
+{
+    size_t i, j;
+
+    for (i = 0; i < n; i = j) {
+        const trace_event_t* enter = &events[i];
+
+        // collect the events of this callback
+        for (j = i + 1; j < n && events[j].serial == enter->serial
+             && events[j].tid == enter->tid;
+             ++j)
+            ;
+
+        if (enter->type != TRACE_ENTER || events[j - 1].type != TRACE_EXIT)
+            continue;
+
+        if (emit(b, "render", enter, &events[j - 1], 1) < 0)
+            return -1;
+
+        for (size_t k = i + 1; k < j; ++k) {
+            const char* name = trace_phase_name(events[k].type);
+            if (name && emit(b, name, &events[k - 1], &events[k], 0) < 0)
+                return -1;
+        }
+
+        if (emit(b, NULL, enter, &events[j - 1], 1) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static int trace_chrome_slice(outbuf_t* b, const char* name,
+                              const trace_event_t* begin,
+                              const trace_event_t* end, int toplevel)
+{
+    // the end of a toplevel slice has already been written as "X"
+    if (!name)
+        return 0;
+
+    return outbuf_printf(
+        b,
+        "%s{\"name\":\"%s\",\"cat\":\"coreaudio\",\"ph\":\"X\","
+        "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%llu,"
+        "\"args\":{\"bus\":%u,\"frames\":%u,\"serial\":%llu}}",
+        b->len > 1 ? ",\n" : "", name, begin->ns / 1000.0,
+        (end->ns - begin->ns) / 1000.0, (int)getpid(),
+        (unsigned long long)begin->tid, (unsigned int)begin->bus,
+        (unsigned int)begin->frames, (unsigned long long)begin->serial);
+}
+
+/* Perfetto TracePacket, TrackEvent and DebugAnnotation field numbers */
+#define PB_TRACE_PACKET 1
+#define PB_PACKET_TIMESTAMP 8
+#define PB_PACKET_SEQUENCE_ID 10
+#define PB_PACKET_TRACK_EVENT 11
+#define PB_PACKET_SEQUENCE_FLAGS 13
+#define PB_PACKET_TRACK_DESCRIPTOR 60
+#define PB_EVENT_DEBUG_ANNOTATIONS 4
+#define PB_EVENT_TYPE 9
+#define PB_EVENT_TRACK_UUID 11
+#define PB_EVENT_NAME 23
+#define PB_ANNOTATION_UINT_VALUE 3
+#define PB_ANNOTATION_NAME 10
+#define PB_DESCRIPTOR_UUID 1
+#define PB_DESCRIPTOR_NAME 2
+#define PB_DESCRIPTOR_THREAD 4
+#define PB_THREAD_PID 1
+#define PB_THREAD_TID 2
+#define PB_SLICE_BEGIN 1
+#define PB_SLICE_END 2
+#define PB_SEQUENCE_ID 0x636175 /* 'cau' */
+
+static int pb_packet(outbuf_t* b, outbuf_t* packet)
+{
+    int rc = pb_bytes(b, PB_TRACE_PACKET, packet->data, packet->len);
+
+    packet->len = 0;
+
+    return rc;
+}
+
+static int pb_annotation(outbuf_t* b, const char* name, UInt64 v)
+{
+    outbuf_t a = { NULL, 0, 0 };
+    int rc = -1;
+
+    if (pb_string(&a, PB_ANNOTATION_NAME, name) == 0
+        && pb_uint(&a, PB_ANNOTATION_UINT_VALUE, v) == 0)
+        rc = pb_bytes(b, PB_EVENT_DEBUG_ANNOTATIONS, a.data, a.len);
+
+    PyMem_Free(a.data);
+
+    return rc;
+}
+
+static int pb_track_event(outbuf_t* b, UInt64 ts, UInt64 track, UInt32 type,
+                          const char* name, const trace_event_t* ev)
+{
+    outbuf_t packet = { NULL, 0, 0 };
+    outbuf_t event = { NULL, 0, 0 };
+    int rc = -1;
+
+    if (pb_uint(&event, PB_EVENT_TYPE, type) < 0
+        || pb_uint(&event, PB_EVENT_TRACK_UUID, track) < 0)
+        goto done;
+
+    if (name) {
+        if (pb_string(&event, PB_EVENT_NAME, name) < 0
+            || pb_annotation(&event, "bus", ev->bus) < 0
+            || pb_annotation(&event, "frames", ev->frames) < 0
+            || pb_annotation(&event, "serial", ev->serial) < 0)
+            goto done;
+    }
+
+    if (pb_uint(&packet, PB_PACKET_TIMESTAMP, ts) < 0
+        || pb_uint(&packet, PB_PACKET_SEQUENCE_ID, PB_SEQUENCE_ID) < 0
+        || pb_bytes(&packet, PB_PACKET_TRACK_EVENT, event.data, event.len) < 0)
+        goto done;
+
+    rc = pb_packet(b, &packet);
+
+done:
+    PyMem_Free(packet.data);
+    PyMem_Free(event.data);
+
+    return rc;
+}
+
+static int trace_perfetto_slice(outbuf_t* b, const char* name,
+                                const trace_event_t* begin,
+                                const trace_event_t* end, int toplevel)
+{
+    if (!name)
+        // close the toplevel slice
+        return pb_track_event(b, end->ns, end->tid, PB_SLICE_END, NULL, end);
+
+    if (pb_track_event(b, begin->ns, begin->tid, PB_SLICE_BEGIN, name, begin)
+        < 0)
+        return -1;
+
+    if (toplevel)
+        return 0;
+
+    return pb_track_event(b, end->ns, end->tid, PB_SLICE_END, NULL, end);
+}
+
+static int trace_perfetto_tracks(outbuf_t* b, const trace_event_t* events,
+                                 size_t n)
+{
+    outbuf_t packet = { NULL, 0, 0 };
+    outbuf_t desc = { NULL, 0, 0 };
+    outbuf_t thread = { NULL, 0, 0 };
+    size_t i, j;
+    int rc = 0;
+
+    for (i = 0; i < n && rc == 0; ++i) {
+        for (j = 0; j < i; ++j)
+            if (events[j].tid == events[i].tid)
+                break;
+        if (j < i)
+            continue;
+
+        rc = -1;
+        if (pb_uint(&thread, PB_THREAD_PID, (UInt64)getpid()) < 0
+            || pb_uint(&thread, PB_THREAD_TID, events[i].tid) < 0
+            || pb_uint(&desc, PB_DESCRIPTOR_UUID, events[i].tid) < 0
+            || pb_string(&desc, PB_DESCRIPTOR_NAME, "render") < 0
+            || pb_bytes(&desc, PB_DESCRIPTOR_THREAD, thread.data, thread.len)
+                < 0
+            || pb_uint(&packet, PB_PACKET_SEQUENCE_ID, PB_SEQUENCE_ID) < 0
+            || (b->len == 0
+                && pb_uint(&packet, PB_PACKET_SEQUENCE_FLAGS, 1) < 0)
+            || pb_bytes(&packet, PB_PACKET_TRACK_DESCRIPTOR, desc.data,
+                        desc.len)
+                < 0
+            || pb_packet(b, &packet) < 0)
+            break;
+        rc = 0;
+
+        desc.len = thread.len = 0;
+    }
+
+    PyMem_Free(packet.data);
+    PyMem_Free(desc.data);
+    PyMem_Free(thread.data);
+
+    return rc;
+}
+
+/* Format a ring as "chrome" (a JSON str) or "perfetto" (protobuf bytes) */
+static PyObject* trace_format(trace_ring_t* ring, const char* format)
+{
+    trace_event_t* events;
+    outbuf_t b = { NULL, 0, 0 };
+    UInt64 lost;
+    size_t n;
+    PyObject* result = NULL;
+    int perfetto;
+
+    if (strcmp(format, "chrome") == 0)
+        perfetto = 0;
+    else if (strcmp(format, "perfetto") == 0)
+        perfetto = 1;
+    else {
+        PyErr_Format(PyExc_ValueError,
+                     "unknown trace format '%s', "
+                     "expected 'chrome' or 'perfetto'",
+                     format);
+        return NULL;
+    }
+
+    if (!(events = PyMem_Malloc((size_t)ring->size * sizeof(*events))))
+        return PyErr_NoMemory();
+
+    Py_BEGIN_ALLOW_THREADS;
+    n = trace_snapshot(ring, events, &lost);
+    Py_END_ALLOW_THREADS;
+
+    if (perfetto) {
+        if (trace_perfetto_tracks(&b, events, n) < 0
+            || trace_slices(&b, events, n, trace_perfetto_slice) < 0)
+            goto done;
+        result = PyBytes_FromStringAndSize((char*)b.data, b.len);
+    } else {
+        PyObject* trace_events;
+
+        if (outbuf_write(&b, "[", 1) < 0
+            || trace_slices(&b, events, n, trace_chrome_slice) < 0
+            || outbuf_printf(&b, "]") < 0)
+            goto done;
+        if (!(trace_events
+              = PyUnicode_FromStringAndSize((char*)b.data, b.len)))
+            goto done;
+        result = PyUnicode_FromFormat(
+            "{\"traceEvents\":%U,\"otherData\":{\"lost_events\":%llu}}",
+            trace_events, (unsigned long long)lost);
+        Py_DECREF(trace_events);
+    }
+
+done:
+    PyMem_Free(b.data);
+    PyMem_Free(events);
+
+    return result;
+}
+
+/*
+ * Input buses
+ *
+ * Every input bus (element) of a unit has its own render callback or native
+ * source and its own stream format. The render callbacks look the bus up by
+ * inBusNumber. The table is only ever replaced as a whole when it grows, so
+ * the I/O thread never sees it half-built; buses and replaced tables live
+ * as long as the unit.
+ */
+
+/* Highest bus number we accept, to keep tables small */
+#define MAX_BUSES 4096
+
+typedef struct {
+    PyObject* callback;
+    PyObject* user_data;
+    _Atomic(native_source_t*) source;
+    AudioStreamBasicDescription format;
+    int has_format;
+    _Atomic(struct deadline_bus*) deadline;
+} audio_unit_bus_t;
+
+typedef struct bus_table {
+    struct bus_table* retired;
+    UInt32 count;
+    _Atomic(audio_unit_bus_t*) bus[];
+} bus_table_t;
+
+/*
+ * The rendered output of a unit's output bus, shared by all connections
+ * pulling from it, so that a unit feeding several others renders only once
+ * per cycle. The buffer is preallocated at MaximumFramesPerSlice. When the
+ * format or MaximumFramesPerSlice change, a replacement is linked in through
+ * 'next'; the render thread follows the chain to its end.
+ *
+ * A destination may process in place in the buffer it is handed, so once
+ * several connections pull from a bus, each gets a copy in a buffer of its
+ * own instead of the shared one.
+ */
+
+/* The most connections from one output bus */
+#define MAX_OUTPUT_CONNECTIONS 64
+
+typedef struct unit_output {
+    _Atomic(struct unit_output*) next;
+    UInt32 bus;
+    AudioStreamBasicDescription format;
+    AudioBufferList* buffers;
+    AudioBufferList** copies; /* by connection slot */
+    UInt32 ncopies;
+    UInt64 slots; /* in the first of the chain, the slots taken */
+    UInt32 max_frames;
+    int valid;
+    Float64 sample_time;
+    UInt32 frames;
+    AudioUnitRenderActionFlags flags;
+    OSStatus status;
+} unit_output_t;
+
+/*
+ * The state of a render notification that has been removed. CoreAudio
+ * removes notifications asynchronously, so a cycle in flight may still call
+ * one; like retired bus tables, the state is kept until the unit is
+ * disposed of.
+ */
+typedef struct unit_tap {
+    struct unit_tap* next;
+    void (*free)(struct unit_tap*);
+} unit_tap_t;
+
+/*
+ * A native source that was replaced on a bus. The render thread may still
+ * be inside it, so it is kept until every native callback that could have
+ * loaded it has returned (a unit renders on one thread at a time), or until
+ * the unit is disposed of.
+ */
+typedef struct retired_source {
+    struct retired_source* next;
+    PyObject* source;
+    UInt64 calls; /* native callbacks entered when it was replaced */
+} retired_source_t;
+
+typedef struct {
+    PyObject_HEAD;
+    AudioUnit instance;
+    _Atomic(bus_table_t*) buses;
+    _Atomic(trace_ring_t*) trace;
+    trace_ring_t* trace_ring;
+    unit_output_t** outputs;
+    UInt32 noutputs;
+    _Atomic(struct deadline*) deadline;
+    struct midi_queue* midi;
+    struct param_queue* params;
+    int taps; /* Recorders, Clocks and Analyzers attached */
+    unit_tap_t* retired_taps;
+    int connections; /* installed Connections that pull from this unit */
+    _Atomic UInt64 native_calls; /* native callbacks entered */
+    _Atomic UInt64 native_returns; /* and returned from */
+    retired_source_t* retired_sources;
+} audio_unit_t;
+
+static PyTypeObject AudioUnitType;
+
+static void audio_unit_init(audio_unit_t* self, AudioUnit instance)
+{
+    self->instance = instance;
+    self->buses = NULL;
+    self->trace = NULL;
+    self->trace_ring = NULL;
+    self->outputs = NULL;
+    self->noutputs = 0;
+    self->deadline = NULL;
+    self->midi = NULL;
+    self->params = NULL;
+    self->taps = 0;
+    self->retired_taps = NULL;
+    self->connections = 0;
+    atomic_init(&self->native_calls, 0);
+    atomic_init(&self->native_returns, 0);
+    self->retired_sources = NULL;
+}
+
+/* Keep the state of a removed tap until the unit is disposed of */
+static void audio_unit_retire_tap(audio_unit_t* self, unit_tap_t* tap)
+{
+    tap->next = self->retired_taps;
+    self->retired_taps = tap;
+    self->taps--;
+}
+
+/* Keep a replaced native source until the render thread is done with it.
+   'r' is preallocated, so that this can't fail. */
+static void audio_unit_retire_source(audio_unit_t* self, retired_source_t* r,
+                                     PyObject* source)
+{
+    r->source = source;
+    r->calls = atomic_load(&self->native_calls);
+    r->next = self->retired_sources;
+    self->retired_sources = r;
+}
+
+/* Release the retired sources the render thread can no longer be in; all of
+   them if 'all' is set, after the unit was disposed of */
+static void audio_unit_reclaim_sources(audio_unit_t* self, int all)
+{
+    UInt64 returns = atomic_load_explicit(&self->native_returns,
+                                          memory_order_acquire);
+    retired_source_t** link = &self->retired_sources;
+    retired_source_t* r;
+
+    while ((r = *link)) {
+        if (all || returns >= r->calls) {
+            *link = r->next;
+            Py_DECREF(r->source);
+            PyMem_Free(r);
+        } else
+            link = &r->next;
+    }
+}
+
+static void unit_output_free(unit_output_t* output)
+{
+    UInt32 i;
+
+    for (i = 0; i < output->ncopies; ++i)
+        PyMem_Free(output->copies[i]);
+    PyMem_Free(output->copies);
+    PyMem_Free(output->buffers);
+    PyMem_Free(output);
+}
+
+static void audio_unit_free_outputs(audio_unit_t* self)
+{
+    UInt32 i;
+
+    for (i = 0; i < self->noutputs; ++i) {
+        unit_output_t* output = self->outputs[i];
+
+        while (output) {
+            unit_output_t* next = atomic_load(&output->next);
+
+            unit_output_free(output);
+            output = next;
+        }
+    }
+    PyMem_Free(self->outputs);
+
+    self->outputs = NULL;
+    self->noutputs = 0;
+}
+
+/* The buffers that are current */
+static unit_output_t* unit_output_current(unit_output_t* output)
+{
+    unit_output_t* next;
+
+    while ((next = atomic_load_explicit(&output->next, memory_order_acquire)))
+        output = next;
+
+    return output;
+}
+
+/* Return the shared output of a bus of 'self', creating it if necessary, or
+   replacing its buffers if the format or MaximumFramesPerSlice changed or
+   fewer than 'ncopies' copies are allocated */
+static unit_output_t* audio_unit_get_output(audio_unit_t* self, UInt32 bus,
+                                            UInt32 ncopies)
+{
+    OSErr rc;
+    unit_output_t* output;
+    unit_output_t* head = NULL;
+    unit_output_t* current;
+    unit_output_t** outputs;
+    AudioStreamBasicDescription format;
+    UInt32 max_frames = 0;
+    UInt32 size = sizeof(format);
+    UInt32 i;
+
+    rc = AudioUnitGetProperty(self->instance, kAudioUnitProperty_StreamFormat,
+                              kAudioUnitScope_Output, bus, &format, &size);
+    if (rc != noErr) {
+        PyErr_Format(CoreAudioError,
+                     "AudioUnitGetProperty(StreamFormat) failed: %4.4s",
+                     (char*)&rc);
+        return NULL;
+    }
+
+    size = sizeof(max_frames);
+    rc = AudioUnitGetProperty(self->instance,
+                              kAudioUnitProperty_MaximumFramesPerSlice,
+                              kAudioUnitScope_Global, 0, &max_frames, &size);
+    if (rc != noErr) {
+        PyErr_Format(CoreAudioError,
+                     "AudioUnitGetProperty(MaximumFramesPerSlice) failed: "
+                     "%4.4s",
+                     (char*)&rc);
+        return NULL;
+    }
+
+    for (i = 0; i < self->noutputs; ++i) {
+        if (self->outputs[i]->bus == bus) {
+            head = self->outputs[i];
+            break;
+        }
+    }
+
+    if (head) {
+        current = unit_output_current(head);
+        if (current->max_frames == max_frames
+            && !memcmp(&current->format, &format, sizeof(format))
+            && current->ncopies >= ncopies)
+            return head;
+        // copies are never dropped
+        if (current->ncopies > ncopies)
+            ncopies = current->ncopies;
+    }
+
+    if (!(output = PyMem_Calloc(1, sizeof(unit_output_t))))
+        return (unit_output_t*)PyErr_NoMemory();
+
+    output->bus = bus;
+    output->format = format;
+    output->max_frames = max_frames;
+    if (!(output->buffers = alloc_buffer_list(&format, max_frames))
+        || (ncopies
+            && !(output->copies
+                 = PyMem_Calloc(ncopies, sizeof(AudioBufferList*))))) {
+        unit_output_free(output);
+        return (unit_output_t*)PyErr_NoMemory();
+    }
+
+    for (; output->ncopies < ncopies; ++output->ncopies)
+        if (!(output->copies[output->ncopies]
+              = alloc_buffer_list(&format, max_frames))) {
+            unit_output_free(output);
+            return (unit_output_t*)PyErr_NoMemory();
+        }
+
+    // the render thread may still use the old buffers
+    if (head) {
+        atomic_store_explicit(&current->next, output, memory_order_release);
+        return head;
+    }
+
+    outputs = PyMem_Realloc(self->outputs,
+                            (self->noutputs + 1) * sizeof(unit_output_t*));
+    if (!outputs) {
+        unit_output_free(output);
+        return (unit_output_t*)PyErr_NoMemory();
+    }
+
+    outputs[self->noutputs++] = output;
+    self->outputs = outputs;
+
+    return output;
+}
+
+/* A Connection (see Connect) */
+typedef struct {
+    native_source_t source;
+    audio_unit_t* src;
+    UInt32 src_bus;
+    UInt32 dst_bus; /* not a reference to dst, which owns us */
+    unit_output_t* output;
+    UInt32 slot; /* of the copy in output */
+    int installed; /* counted in src->connections */
+} connection_t;
+
+/* Called when 'callback' is taken off its bus */
+static void connection_uninstall(PyObject* callback)
+{
+    connection_t* connection = (connection_t*)callback;
+
+    if (callback && PyObject_TypeCheck(callback, &ConnectionType)
+        && connection->installed) {
+        connection->installed = 0;
+        connection->src->connections--;
+    }
+}
+
+/* Look up a bus from the I/O thread; NULL if it was never set up */
+static audio_unit_bus_t* audio_unit_lookup_bus(audio_unit_t* self, UInt32 bus)
+{
+    bus_table_t* table = atomic_load_explicit(&self->buses,
+                                              memory_order_acquire);
+
+    if (!table || bus >= table->count)
+        return NULL;
+
+    return atomic_load_explicit(&table->bus[bus], memory_order_acquire);
+}
+
+/* Look up or create a bus. Called with the GIL held. */
+static audio_unit_bus_t* audio_unit_get_bus(audio_unit_t* self, UInt32 bus)
+{
+    bus_table_t* table = atomic_load_explicit(&self->buses,
+                                              memory_order_relaxed);
+    audio_unit_bus_t* b;
+
+    if (bus >= MAX_BUSES) {
+        PyErr_Format(PyExc_ValueError, "bus must be less than %d", MAX_BUSES);
+        return NULL;
+    }
+
+    if (!table || bus >= table->count) {
+        UInt32 count = table ? table->count : 0;
+        UInt32 newcount = count ? count : 1;
+        bus_table_t* grown;
+        UInt32 i;
+
+        while (newcount <= bus)
+            newcount *= 2;
+
+        grown = PyMem_Calloc(1, sizeof(bus_table_t)
+                                    + newcount * sizeof(audio_unit_bus_t*));
+        if (!grown) {
+            PyErr_NoMemory();
+            return NULL;
+        }
+
+        grown->count = newcount;
+        grown->retired = table;
+        for (i = 0; i < count; ++i)
+            atomic_init(&grown->bus[i], atomic_load(&table->bus[i]));
+
+        atomic_store_explicit(&self->buses, grown, memory_order_release);
+        table = grown;
+    }
+
+    if ((b = atomic_load_explicit(&table->bus[bus], memory_order_relaxed)))
+        return b;
+
+    if (!(b = PyMem_Calloc(1, sizeof(audio_unit_bus_t)))) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    atomic_store_explicit(&table->bus[bus], b, memory_order_release);
+
+    return b;
+}
+
+/* Call the Python render callback of 'bus' into ioData, with the GIL held.
+   Returns 0 on success, 1 when the callback returned an empty buffer (end of
+   stream) and -1 on error. */
+static int audio_unit_call_python(audio_unit_bus_t* bus, trace_ring_t* trace,
+                                  UInt64 serial,
+                                  AudioUnitRenderActionFlags* ioActionFlags,
+                                  const AudioTimeStamp* inTimeStamp,
+                                  UInt32 inBusNumber, UInt32 inNumberFrames,
+                                  AudioBufferList* ioData)
+{
+    int i;
+    PyObject* o;
+    PyObject* args;
+    PyObject* result = NULL;
+
+    // The callback may have been replaced while we waited for the GIL
+    if (!bus || !bus->callback || !PyCallable_Check(bus->callback)
+        || native_source_check(bus->callback)) {
+        for (i = 0; i < (int)ioData->mNumberBuffers; ++i)
+            memset(ioData->mBuffers[i].mData, 0,
+                   ioData->mBuffers[i].mDataByteSize);
+        *ioActionFlags |= kAudioUnitRenderAction_OutputIsSilence;
+        return 0;
+    }
+
+    args = Py_BuildValue(
+        "(k{sdsKsdsKsk}iiiO)", *ioActionFlags, "mSampleTime",
+        inTimeStamp->mSampleTime, "mHostTime", inTimeStamp->mHostTime,
+        "mRateScalar", inTimeStamp->mRateScalar, "mWordClockTime",
+        inTimeStamp->mWordClockTime, "mFlags", inTimeStamp->mFlags,
+        inBusNumber, inNumberFrames, ioData->mNumberBuffers, bus->user_data);
+    if (!args)
+        goto py_error;
+
+    result = PyObject_CallObject(bus->callback, args);
+    Py_DECREF(args);
+
+    trace_event(trace, serial, TRACE_PYTHON_RETURNED, inBusNumber,
+                inNumberFrames);
+
+    if (!result)
+        goto py_error;
+
+    if (!PyTuple_Check(result)) {
+        fprintf(stderr, "render callback must return a tuple\n");
+        goto error;
+    }
+
+    o = PyTuple_GetItem(result, 0);
+    if (!o)
+        goto py_error;
+
+    if (o != Py_None) {
+        if (!PyLong_Check(o)) {
+            fprintf(stderr,
+                    "render callback must return a tuple (None|int, bytes)\n");
+            goto error;
+        }
+
+        *ioActionFlags = PyLong_AsUnsignedLongMask(o);
+    }
+
+    for (i = 1; i < PyTuple_Size(result); ++i) {
+        char* buffer;
+        Py_ssize_t len;
+
+        o = PyTuple_GetItem(result, i);
+        if (!PyBytes_Check(o)) {
+            fprintf(stderr,
+                    "render callback must return a tuple (None|int, bytes)\n");
+            goto error;
+        }
+        if (PyBytes_AsStringAndSize(o, &buffer, &len) < 0)
+            goto py_error;
+
+        if (len == 0) {
+            // No data: the caller stops audio output
+            Py_DECREF(result);
+            return 1;
+        }
+
+        if (len != ioData->mBuffers[i - 1].mDataByteSize) {
+            fprintf(stderr,
+                    "render_callback: buffer %d size mismatch: "
+                    "expected %u bytes, got %d\n",
+                    i - 1, (unsigned int)ioData->mBuffers[i - 1].mDataByteSize,
+                    (int)len);
+            goto error;
+        }
+
+        memcpy(ioData->mBuffers[i - 1].mData, buffer, len);
+    }
+
+    trace_event(trace, serial, TRACE_MEMCPY_DONE, inBusNumber, inNumberFrames);
+
+    Py_DECREF(result);
+
+    return 0;
+
+py_error:
+    // Todo: store the exception and traceback somewhere
+    PyErr_Print();
+
+error:
+    Py_XDECREF(result);
+
+    return -1;
+}
+
+/*
+ * Thread policy
+ *
+ * The threads this module starts (named "deadline", "recorder" and
+ * "analyzer") and any thread that calls RegisterThread(name) are kept in a
+ * registry. SetThreadPolicy(name, ...) sets the scheduling priority and the
+ * CPUs of all threads of a name; threads that register later under that
+ * name get the same policy. A registered thread leaves the registry when
+ * it exits.
+ *
+ * SetMemoryPolicy() locks the process's memory and has the buffers the
+ * render thread writes to prefaulted when they are allocated, so that it
+ * doesn't take page faults.
+ */
+
+#define THREAD_MAX 256
+#define THREAD_MAX_POLICIES 32
+#define THREAD_NAME_MAX 32
+#define THREAD_MAX_CPUS 1024
+
+typedef struct {
+    char name[THREAD_NAME_MAX];
+    int realtime;
+    int priority; /* the realtime priority, or the nice value */
+    Float64 period; /* time constraints in seconds, on macOS */
+    Float64 computation;
+    Float64 constraint;
+    int pinned; /* otherwise, all CPUs */
+    unsigned char cpus[THREAD_MAX_CPUS / 8];
+} thread_settings_t;
+
+typedef struct {
+    char name[THREAD_NAME_MAX];
+    int used;
+    int owned; /* started by this module */
+    pthread_t thread;
+    UInt64 tid;
+    int error; /* from applying the policy, an errno value */
+} thread_entry_t;
+
+static pthread_mutex_t thread_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_key;
+static thread_entry_t thread_entries[THREAD_MAX];
+static thread_settings_t thread_policies[THREAD_MAX_POLICIES];
+static int thread_npolicies;
+static atomic_int memory_prefault;
+
+/* Apply a policy to a thread; returns an errno value, or 0 */
+static int thread_settings_apply(const thread_settings_t* p,
+                                 thread_entry_t* e)
+{
+#ifdef __APPLE__
+    mach_port_t port = pthread_mach_thread_np(e->thread);
+    kern_return_t kr;
+
+    if (p->realtime) {
+        thread_time_constraint_policy_data_t tc;
+        Float64 computation = p->computation > 0.0 ? p->computation : 0.001;
+
+        tc.period = (uint32_t)AudioConvertNanosToHostTime(
+            (UInt64)(p->period * 1e9));
+        tc.computation = (uint32_t)AudioConvertNanosToHostTime(
+            (UInt64)(computation * 1e9));
+        tc.constraint = (uint32_t)AudioConvertNanosToHostTime((UInt64)(
+            (p->constraint > 0.0 ? p->constraint : 2.0 * computation) * 1e9));
+        tc.preemptible = 1;
+        kr = thread_policy_set(port, THREAD_TIME_CONSTRAINT_POLICY,
+                               (thread_policy_t)&tc,
+                               THREAD_TIME_CONSTRAINT_POLICY_COUNT);
+    } else {
+        thread_standard_policy_data_t sp = { 0 };
+        thread_precedence_policy_data_t pp;
+
+        kr = thread_policy_set(port, THREAD_STANDARD_POLICY,
+                               (thread_policy_t)&sp,
+                               THREAD_STANDARD_POLICY_COUNT);
+        if (kr == KERN_SUCCESS) {
+            pp.importance = p->priority;
+            kr = thread_policy_set(port, THREAD_PRECEDENCE_POLICY,
+                                   (thread_policy_t)&pp,
+                                   THREAD_PRECEDENCE_POLICY_COUNT);
+        }
+    }
+
+    // macOS can't pin threads; threads with the same affinity tag share a
+    // cache, so the tag is the first of the CPUs
+    if (kr == KERN_SUCCESS && p->pinned) {
+        thread_affinity_policy_data_t ap = { 0 };
+        int cpu;
+
+        for (cpu = 0; cpu < THREAD_MAX_CPUS; ++cpu)
+            if (p->cpus[cpu / 8] & (1 << (cpu % 8)))
+                break;
+        ap.affinity_tag = cpu + 1;
+        kr = thread_policy_set(port, THREAD_AFFINITY_POLICY,
+                               (thread_policy_t)&ap,
+                               THREAD_AFFINITY_POLICY_COUNT);
+    }
+
+    return kr == KERN_SUCCESS ? 0 : EPERM;
+#else
+    pid_t tid = (pid_t)e->tid;
+    struct sched_param sp;
+    cpu_set_t set;
+    int cpu;
+
+    memset(&sp, 0, sizeof(sp));
+    if (p->realtime) {
+        sp.sched_priority = p->priority;
+        if (sched_setscheduler(tid, SCHED_FIFO, &sp) < 0)
+            return errno;
+    } else if (sched_setscheduler(tid, SCHED_OTHER, &sp) < 0
+               || setpriority(PRIO_PROCESS, tid, p->priority) < 0)
+        return errno;
+
+    CPU_ZERO(&set);
+    for (cpu = 0; cpu < THREAD_MAX_CPUS && cpu < CPU_SETSIZE; ++cpu)
+        if (!p->pinned || (p->cpus[cpu / 8] & (1 << (cpu % 8))))
+            CPU_SET(cpu, &set);
+
+    if (sched_setaffinity(tid, sizeof(set), &set) < 0)
+        return errno;
+
+    return 0;
+#endif
+}
+
+static thread_settings_t* thread_find_policy(const char* name)
+{
+    int i;
+
+    for (i = 0; i < thread_npolicies; ++i)
+        if (!strcmp(thread_policies[i].name, name))
+            return &thread_policies[i];
+
+    return NULL;
+}
+
+/* Called when a registered thread exits */
+static void thread_forget(void* entry)
+{
+    pthread_mutex_lock(&thread_lock);
+    ((thread_entry_t*)entry)->used = 0;
+    pthread_mutex_unlock(&thread_lock);
+}
+
+static void thread_key_init(void)
+{
+    pthread_key_create(&thread_key, thread_forget);
+}
+
+/* Register the calling thread under 'name' and apply the name's policy.
+   Returns the entry, or NULL if the registry is full. */
+static thread_entry_t* thread_register(const char* name, int owned)
+{
+    thread_entry_t* e;
+    thread_settings_t* p;
+    int i;
+
+    pthread_once(&thread_key_once, thread_key_init);
+
+    pthread_mutex_lock(&thread_lock);
+
+    if (!(e = pthread_getspecific(thread_key))) {
+        for (i = 0; i < THREAD_MAX && thread_entries[i].used; ++i)
+            ;
+        if (i == THREAD_MAX) {
+            pthread_mutex_unlock(&thread_lock);
+            return NULL;
+        }
+        e = &thread_entries[i];
+        e->used = 1;
+        e->thread = pthread_self();
+        e->tid = current_thread_id();
+        pthread_setspecific(thread_key, e);
+    }
+
+    snprintf(e->name, sizeof(e->name), "%s", name);
+    e->owned = owned;
+    e->error = 0;
+    if ((p = thread_find_policy(e->name)))
+        e->error = thread_settings_apply(p, e);
+
+    pthread_mutex_unlock(&thread_lock);
+
+    return e;
+}
+
+static void thread_unregister(void)
+{
+    thread_entry_t* e;
+
+    pthread_once(&thread_key_once, thread_key_init);
+
+    if ((e = pthread_getspecific(thread_key))) {
+        pthread_setspecific(thread_key, NULL);
+        thread_forget(e);
+    }
+}
+
+/* Touch a buffer the render thread writes to, if prefaulting is on */
+static void memory_prefault_buffer(void* p, size_t bytes)
+{
+    if (atomic_load_explicit(&memory_prefault, memory_order_relaxed))
+        memset(p, 0, bytes);
+}
+
+static PyObject* coreaudio_registerthread(PyObject* self, PyObject* args)
+{
+    const char* name;
+    thread_entry_t* e;
+    int error;
+
+    if (!PyArg_ParseTuple(args, "s:RegisterThread", &name))
+        return NULL;
+
+    if (strlen(name) >= THREAD_NAME_MAX) {
+        PyErr_SetString(PyExc_ValueError, "the name is too long");
+        return NULL;
+    }
+
+    if (!(e = thread_register(name, 0))) {
+        PyErr_SetString(CoreAudioError, "too many registered threads");
+        return NULL;
+    }
+
+    if ((error = e->error)) {
+        errno = error;
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+
+    return PyLong_FromUnsignedLongLong(e->tid);
+}
+
+static PyObject* coreaudio_unregisterthread(PyObject* self, PyObject* args)
+{
+    if (!PyArg_ParseTuple(args, ":UnregisterThread"))
+        return NULL;
+
+    thread_unregister();
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject* coreaudio_setthreadpolicy(PyObject* self, PyObject* args,
+                                           PyObject* kwds)
+{
+    static char* kwlist[] = { "name",        "realtime",   "priority",
+                              "cpus",        "period",     "computation",
+                              "constraint",  NULL };
+    thread_settings_t settings;
+    thread_settings_t* p;
+    const char* name;
+    PyObject* cpus = Py_None;
+    int realtime = 0, priority = 0, applied = 0, error = 0, i;
+
+    memset(&settings, 0, sizeof(settings));
+
+    if (!PyArg_ParseTupleAndKeywords(
+            args, kwds, "s|piOddd:SetThreadPolicy", kwlist, &name, &realtime,
+            &priority, &cpus, &settings.period, &settings.computation,
+            &settings.constraint))
+        return NULL;
+
+    if (strlen(name) >= THREAD_NAME_MAX) {
+        PyErr_SetString(PyExc_ValueError, "the name is too long");
+        return NULL;
+    }
+
+    if (settings.period < 0.0 || settings.computation < 0.0
+        || settings.constraint < 0.0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "time constraints must not be negative");
+        return NULL;
+    }
+
+    snprintf(settings.name, sizeof(settings.name), "%s", name);
+    settings.realtime = realtime;
+    settings.priority = priority;
+
+    if (cpus != Py_None) {
+        PyObject* seq = PySequence_Fast(cpus, "cpus must be a sequence");
+        Py_ssize_t n, j;
+
+        if (!seq)
+            return NULL;
+
+        n = PySequence_Fast_GET_SIZE(seq);
+        for (j = 0; j < n; ++j) {
+            long cpu = PyLong_AsLong(PySequence_Fast_GET_ITEM(seq, j));
+
+            if (cpu == -1 && PyErr_Occurred()) {
+                Py_DECREF(seq);
+                return NULL;
+            }
+            if (cpu < 0 || cpu >= THREAD_MAX_CPUS) {
+                Py_DECREF(seq);
+                PyErr_SetString(PyExc_ValueError, "no such CPU");
+                return NULL;
+            }
+            settings.cpus[cpu / 8] |= 1 << (cpu % 8);
+        }
+        Py_DECREF(seq);
+
+        if (!n) {
+            PyErr_SetString(PyExc_ValueError, "cpus must not be empty");
+            return NULL;
+        }
+        settings.pinned = 1;
+    }
+
+    Py_BEGIN_ALLOW_THREADS;
+    pthread_mutex_lock(&thread_lock);
+
+    if (!(p = thread_find_policy(name))
+        && thread_npolicies < THREAD_MAX_POLICIES)
+        p = &thread_policies[thread_npolicies++];
+
+    if (p) {
+        *p = settings;
+
+        for (i = 0; i < THREAD_MAX; ++i) {
+            thread_entry_t* e = &thread_entries[i];
+
+            if (e->used && !strcmp(e->name, name)) {
+                if ((e->error = thread_settings_apply(p, e)) && !error)
+                    error = e->error;
+                applied++;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&thread_lock);
+    Py_END_ALLOW_THREADS;
+
+    if (!p) {
+        PyErr_SetString(CoreAudioError, "too many thread policies");
+        return NULL;
+    }
+
+    if (error) {
+        errno = error;
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+
+    return PyLong_FromLong(applied);
+}
+
+/* Add the counters of a thread to 'stats'; where the system doesn't have
+   them per thread, they are None */
+static int thread_add_stats(const thread_entry_t* e, PyObject* stats)
+{
+#ifdef __APPLE__
+    mach_port_t port = pthread_mach_thread_np(e->thread);
+    PyObject* counters;
+    thread_basic_info_data_t info;
+    mach_msg_type_number_t count = THREAD_BASIC_INFO_COUNT;
+    Float64 cpu_time = 0.0;
+
+    if (thread_info(port, THREAD_BASIC_INFO, (thread_info_t)&info, &count)
+        == KERN_SUCCESS)
+        cpu_time = info.user_time.seconds + info.system_time.seconds
+            + (info.user_time.microseconds + info.system_time.microseconds)
+                / 1e6;
+
+    thread_time_constraint_policy_data_t tc;
+    thread_precedence_policy_data_t pp;
+    boolean_t get_default = FALSE;
+    PyObject* priority;
+    int realtime = 0, rc;
+
+    // a thread without a time constraint policy reports the default
+    count = THREAD_TIME_CONSTRAINT_POLICY_COUNT;
+    if (thread_policy_get(port, THREAD_TIME_CONSTRAINT_POLICY,
+                          (thread_policy_t)&tc, &count, &get_default)
+        == KERN_SUCCESS)
+        realtime = !get_default;
+
+    // the precedence is what SetThreadPolicy sets as the priority; there is
+    // no affinity mask to report, so cpus is always None
+    get_default = FALSE;
+    count = THREAD_PRECEDENCE_POLICY_COUNT;
+    if (!realtime
+        && thread_policy_get(port, THREAD_PRECEDENCE_POLICY,
+                             (thread_policy_t)&pp, &count, &get_default)
+            == KERN_SUCCESS)
+        priority = PyLong_FromLong(pp.importance);
+    else {
+        Py_INCREF(Py_None);
+        priority = Py_None;
+    }
+    if (!priority)
+        return -1;
+
+    if (!(counters = Py_BuildValue(
+              "{sOsOsOsOsdsOsNsO}", "minor_faults", Py_None, "major_faults",
+              Py_None, "voluntary_switches", Py_None, "involuntary_switches",
+              Py_None, "cpu_time", cpu_time, "realtime",
+              realtime ? Py_True : Py_False, "priority", priority, "cpus",
+              Py_None)))
+        return -1;
+
+    rc = PyDict_Update(stats, counters);
+    Py_DECREF(counters);
+
+    return rc;
+#else
+    char path[64], buf[2048];
+    unsigned long long minflt = 0, majflt = 0, utime = 0, stime = 0;
+    unsigned long long voluntary = 0, involuntary = 0;
+    struct sched_param sp;
+    cpu_set_t set;
+    PyObject* cpus;
+    PyObject* counters;
+    const char* s;
+    ssize_t n;
+    int fd, policy, cpu, realtime, rc;
+
+    snprintf(path, sizeof(path), "/proc/self/task/%llu/stat",
+             (unsigned long long)e->tid);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0) {
+        n = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        buf[n > 0 ? n : 0] = '\0';
+        // the command may contain anything, up to the last parenthesis
+        if ((s = strrchr(buf, ')')))
+            sscanf(s + 1,
+                   " %*c %*d %*d %*d %*d %*d %*u %llu %*u %llu %*u %llu %llu",
+                   &minflt, &majflt, &utime, &stime);
+    }
+
+    snprintf(path, sizeof(path), "/proc/self/task/%llu/status",
+             (unsigned long long)e->tid);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0) {
+        n = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        buf[n > 0 ? n : 0] = '\0';
+        if ((s = strstr(buf, "\nvoluntary_ctxt_switches:")))
+            sscanf(s, "\nvoluntary_ctxt_switches: %llu", &voluntary);
+        if ((s = strstr(buf, "\nnonvoluntary_ctxt_switches:")))
+            sscanf(s, "\nnonvoluntary_ctxt_switches: %llu", &involuntary);
+    }
+
+    policy = sched_getscheduler((pid_t)e->tid);
+    if (sched_getparam((pid_t)e->tid, &sp) < 0)
+        sp.sched_priority = 0;
+
+    if (!(cpus = PyList_New(0)))
+        return -1;
+    if (sched_getaffinity((pid_t)e->tid, sizeof(set), &set) == 0)
+        for (cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            if (CPU_ISSET(cpu, &set)) {
+                PyObject* c = PyLong_FromLong(cpu);
+
+                if (!c || PyList_Append(cpus, c) < 0) {
+                    Py_XDECREF(c);
+                    Py_DECREF(cpus);
+                    return -1;
+                }
+                Py_DECREF(c);
+            }
+
+    realtime = policy == SCHED_FIFO || policy == SCHED_RR;
+    if (!(counters = Py_BuildValue(
+              "{sKsKsKsKsdsOsisN}", "minor_faults", minflt, "major_faults",
+              majflt, "voluntary_switches", voluntary, "involuntary_switches",
+              involuntary, "cpu_time",
+              (double)(utime + stime) / sysconf(_SC_CLK_TCK), "realtime",
+              realtime ? Py_True : Py_False, "priority",
+              realtime ? sp.sched_priority
+                       : getpriority(PRIO_PROCESS, (id_t)e->tid),
+              "cpus", cpus)))
+        return -1;
+
+    rc = PyDict_Update(stats, counters);
+    Py_DECREF(counters);
+
+    return rc;
+#endif
+}
+
+static PyObject* coreaudio_getthreadstats(PyObject* self, PyObject* args)
+{
+    thread_entry_t entries[THREAD_MAX];
+    PyObject* result;
+    int i;
+
+    if (!PyArg_ParseTuple(args, ":GetThreadStats"))
+        return NULL;
+
+    pthread_mutex_lock(&thread_lock);
+    memcpy(entries, thread_entries, sizeof(entries));
+    pthread_mutex_unlock(&thread_lock);
+
+    if (!(result = PyList_New(0)))
+        return NULL;
+
+    for (i = 0; i < THREAD_MAX; ++i) {
+        thread_entry_t* e = &entries[i];
+        PyObject* stats;
+
+        if (!e->used)
+            continue;
+
+        if (!(stats = Py_BuildValue("{sssKsOsi}", "name", e->name,
+                                    "thread_id", (unsigned long long)e->tid,
+                                    "owned", e->owned ? Py_True : Py_False,
+                                    "error", e->error))
+            || thread_add_stats(e, stats) < 0
+            || PyList_Append(result, stats) < 0) {
+            Py_XDECREF(stats);
+            Py_DECREF(result);
+            return NULL;
+        }
+        Py_DECREF(stats);
+    }
+
+    return result;
+}
+
+static PyObject* coreaudio_setmemorypolicy(PyObject* self, PyObject* args,
+                                           PyObject* kwds)
+{
+    static char* kwlist[] = { "lock", "prefault", NULL };
+    static int locked;
+    int lock = 0, prefault = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|pp:SetMemoryPolicy",
+                                     kwlist, &lock, &prefault))
+        return NULL;
+
+    if (lock && !locked) {
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+            return PyErr_SetFromErrno(PyExc_OSError);
+        locked = 1;
+    } else if (!lock && locked) {
+        if (munlockall() < 0)
+            return PyErr_SetFromErrno(PyExc_OSError);
+        locked = 0;
+    }
+
+    atomic_store(&memory_prefault, prefault);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/*
+ * Render deadlines
+ *
+ * With SetDeadline(fraction), Python render callbacks run on a worker
+ * thread owned by the unit. The render thread waits for their output only
+ * until 'fraction' of the period has passed (measured from the first bus
+ * pulled in the cycle); then it conceals the miss from the last block it
+ * played instead of blocking on the GIL. A block that arrives late is not
+ * played, as its time has passed, but it becomes the basis of further
+ * concealment. While the worker is still busy with a late block, the
+ * periods that follow are concealed as well. The render thread only tries
+ * to take the deadline's lock; if it is contended, the period is concealed
+ * too.
+ *
+ * Concealment works on 32 bit float and 16 bit integer PCM; other formats
+ * are concealed with silence.
+ */
+
+enum { CONCEAL_FADE, CONCEAL_REPEAT, CONCEAL_CROSSFADE };
+
+enum { DEADLINE_IDLE, DEADLINE_PENDING, DEADLINE_RUNNING, DEADLINE_DONE };
+
+/* Consecutive concealed periods before we give up and play silence */
+#define DEADLINE_MAX_CONCEAL 5
+/* The length of crossfades and fade ins, in frames */
+#define DEADLINE_XFADE 64
+
+static const char* conceal_names[] = { "fade", "repeat", "crossfade" };
+
+/* Per-bus buffers, sized for the bus format at MaximumFramesPerSlice */
+typedef struct deadline_bus {
+    struct deadline_bus* retired;
+    AudioStreamBasicDescription format;
+    UInt32 max_frames;
+    AudioBufferList* pending; /* written by the worker */
+    AudioBufferList* last; /* the last block played (or late) */
+    UInt32 last_frames;
+    AudioBufferList* tail; /* the end of what was really played */
+    UInt32 tail_frames;
+    UInt32 concealed; /* consecutive concealed periods */
+} deadline_bus_t;
+
+typedef struct deadline {
+    audio_unit_t* unit; /* borrowed: the unit owns us */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    int quit;
+    double fraction;
+    int mode;
+    /* the request: one at a time */
+    int state;
+    int abandoned;
+    int result;
+    audio_unit_bus_t* bus;
+    deadline_bus_t* dbus;
+    UInt32 bus_number;
+    UInt32 frames;
+    AudioUnitRenderActionFlags flags;
+    AudioTimeStamp timestamp;
+    trace_ring_t* trace;
+    UInt64 serial;
+    /* the current cycle */
+    int cycle_valid;
+    Float64 cycle_sample_time;
+    UInt64 cycle_deadline;
+    /* statistics */
+    UInt64 periods;
+    UInt64 misses;
+    UInt64 late;
+    UInt64 skipped;
+    UInt64 errors;
+    UInt64 contended; /* written by the render thread only */
+    UInt64 wait_ns;
+    UInt64 max_wait_ns;
+    Float64 last_miss_sample_time;
+    UInt64 last_miss_host_time;
+} deadline_t;
+
+static UInt64 monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (UInt64)ts.tv_sec * 1000000000ULL + (UInt64)ts.tv_nsec;
+}
+
+/* Wait on 'cond' until the CLOCK_MONOTONIC time 'until'. Returns nonzero on
+   timeout. */
+static int deadline_timedwait(pthread_cond_t* cond, pthread_mutex_t* lock,
+                              UInt64 until)
+{
+    struct timespec ts;
+    UInt64 now = monotonic_ns();
+
+    if (now >= until)
+        return 1;
+
+#ifdef __APPLE__
+    ts.tv_sec = (until - now) / 1000000000ULL;
+    ts.tv_nsec = (until - now) % 1000000000ULL;
+    return pthread_cond_timedwait_relative_np(cond, lock, &ts) != 0;
+#else
+    ts.tv_sec = until / 1000000000ULL;
+    ts.tv_nsec = until % 1000000000ULL;
+    return pthread_cond_timedwait(cond, lock, &ts) != 0;
+#endif
+}
+
+static int pcm_concealable(const AudioStreamBasicDescription* fmt)
+{
+    if (fmt->mFormatID != kAudioFormatLinearPCM)
+        return 0;
+
+    if (fmt->mFormatFlags & kAudioFormatFlagIsFloat)
+        return fmt->mBitsPerChannel == 32;
+
+    return fmt->mBitsPerChannel == 16
+        && (fmt->mFormatFlags & kAudioFormatFlagIsSignedInteger);
+}
+
+static Float32 pcm_get(const AudioStreamBasicDescription* fmt, void* data,
+                       UInt32 index)
+{
+    if (fmt->mFormatFlags & kAudioFormatFlagIsFloat)
+        return ((Float32*)data)[index];
+
+    return ((SInt16*)data)[index] / 32768.0f;
+}
+
+static void pcm_set(const AudioStreamBasicDescription* fmt, void* data,
+                    UInt32 index, Float32 value)
+{
+    if (fmt->mFormatFlags & kAudioFormatFlagIsFloat) {
+        ((Float32*)data)[index] = value;
+    } else {
+        value *= 32768.0f;
+        ((SInt16*)data)[index] = value > 32767.0f ? 32767
+            : value < -32768.0f                   ? -32768
+                                                  : (SInt16)lrintf(value);
+    }
+}
+
+static void deadline_bus_free(deadline_bus_t* dbus)
+{
+    while (dbus) {
+        deadline_bus_t* retired = dbus->retired;
+        PyMem_Free(dbus->pending);
+        PyMem_Free(dbus->last);
+        PyMem_Free(dbus->tail);
+        PyMem_Free(dbus);
+        dbus = retired;
+    }
+}
+
+/* Make sure 'b' has deadline buffers that match its current format. Called
+   with the GIL held. */
+static int deadline_prepare_bus(audio_unit_t* self, UInt32 bus,
+                                audio_unit_bus_t* b)
+{
+    OSErr rc;
+    AudioStreamBasicDescription format;
+    UInt32 max_frames = 0;
+    UInt32 size = sizeof(format);
+    deadline_bus_t* old = atomic_load(&b->deadline);
+    deadline_bus_t* dbus;
+
+    if (b->has_format) {
+        format = b->format;
+    } else {
+        rc = AudioUnitGetProperty(self->instance,
+                                  kAudioUnitProperty_StreamFormat,
+                                  kAudioUnitScope_Input, bus, &format, &size);
+        if (rc != noErr) {
+            PyErr_Format(CoreAudioError,
+                         "AudioUnitGetProperty(StreamFormat) failed: %4.4s",
+                         (char*)&rc);
+            return -1;
+        }
+    }
+
+    size = sizeof(max_frames);
+    rc = AudioUnitGetProperty(self->instance,
+                              kAudioUnitProperty_MaximumFramesPerSlice,
+                              kAudioUnitScope_Global, 0, &max_frames, &size);
+    if (rc != noErr) {
+        PyErr_Format(CoreAudioError,
+                     "AudioUnitGetProperty(MaximumFramesPerSlice) failed: "
+                     "%4.4s",
+                     (char*)&rc);
+        return -1;
+    }
+
+    if (old && old->max_frames == max_frames
+        && !memcmp(&old->format, &format, sizeof(format)))
+        return 0;
+
+    if (!(dbus = PyMem_Calloc(1, sizeof(deadline_bus_t)))) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    dbus->format = format;
+    dbus->max_frames = max_frames;
+    dbus->pending = alloc_buffer_list(&format, max_frames);
+    dbus->last = alloc_buffer_list(&format, max_frames);
+    dbus->tail = alloc_buffer_list(&format, DEADLINE_XFADE);
+    if (!dbus->pending || !dbus->last || !dbus->tail) {
+        deadline_bus_free(dbus);
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    // the render thread may still use the old buffers
+    dbus->retired = old;
+    atomic_store_explicit(&b->deadline, dbus, memory_order_release);
+
+    return 0;
+}
+
+static void* deadline_worker(void* arg)
+{
+    deadline_t* self = (deadline_t*)arg;
+    AudioUnitRenderActionFlags flags;
+    AudioBufferList* abl;
+    PyGILState_STATE gil;
+    UInt32 i;
+    int result;
+
+    thread_register("deadline", 1);
+
+    pthread_mutex_lock(&self->lock);
+
+    for (;;) {
+        while (!self->quit && self->state != DEADLINE_PENDING)
+            pthread_cond_wait(&self->work, &self->lock);
+        if (self->quit)
+            break;
+
+        self->state = DEADLINE_RUNNING;
+        flags = self->flags;
+        abl = self->dbus->pending;
+        for (i = 0; i < abl->mNumberBuffers; ++i)
+            abl->mBuffers[i].mDataByteSize
+                = self->frames * self->dbus->format.mBytesPerFrame;
+        pthread_mutex_unlock(&self->lock);
+
+        gil = PyGILState_Ensure();
+
+        trace_event(self->trace, self->serial, TRACE_GIL_ACQUIRED,
+                    self->bus_number, self->frames);
+
+        result = audio_unit_call_python(self->bus, self->trace, self->serial,
+                                        &flags, &self->timestamp,
+                                        self->bus_number, self->frames, abl);
+
+        PyGILState_Release(gil);
+
+        pthread_mutex_lock(&self->lock);
+        self->flags = flags;
+        self->result = result;
+        self->state = DEADLINE_DONE;
+        pthread_cond_signal(&self->done);
+    }
+
+    pthread_mutex_unlock(&self->lock);
+
+    thread_unregister();
+
+    return NULL;
+}
+
+/* Crossfade the start of ioData from the time reversed tail of what was
+   played before, which continues it without a step */
+static void deadline_crossfade(deadline_bus_t* dbus, UInt32 frames,
+                               AudioBufferList* ioData)
+{
+    const AudioStreamBasicDescription* fmt = &dbus->format;
+    UInt32 spf = fmt->mFormatFlags & kAudioFormatFlagIsNonInterleaved
+        ? 1
+        : fmt->mChannelsPerFrame;
+    UInt32 xfade = dbus->tail_frames < frames ? dbus->tail_frames : frames;
+    UInt32 b, f, c;
+
+    for (b = 0; b < ioData->mNumberBuffers; ++b) {
+        void* tail = dbus->tail->mBuffers[b].mData;
+        void* out = ioData->mBuffers[b].mData;
+
+        for (f = 0; f < xfade; ++f) {
+            Float32 w = (Float32)f / (Float32)xfade;
+
+            for (c = 0; c < spf; ++c) {
+                Float32 mirror = pcm_get(
+                    fmt, tail, (dbus->tail_frames - 1 - f) * spf + c);
+
+                pcm_set(fmt, out, f * spf + c,
+                        w * pcm_get(fmt, out, f * spf + c)
+                            + (1.0f - w) * mirror);
+            }
+        }
+    }
+}
+
+/* Remember the end of what we played */
+static void deadline_keep_tail(deadline_bus_t* dbus, AudioBufferList* from,
+                               UInt32 frames)
+{
+    UInt32 n = frames < DEADLINE_XFADE ? frames : DEADLINE_XFADE;
+    UInt32 bpf = dbus->format.mBytesPerFrame;
+    UInt32 b;
+
+    for (b = 0; b < dbus->tail->mNumberBuffers && b < from->mNumberBuffers;
+         ++b)
+        memcpy(dbus->tail->mBuffers[b].mData,
+               (char*)from->mBuffers[b].mData + (frames - n) * bpf, n * bpf);
+    dbus->tail_frames = n;
+}
+
+/* Fill ioData from the last block, because the real one is missing */
+static void deadline_conceal(deadline_t* self, deadline_bus_t* dbus,
+                             AudioUnitRenderActionFlags* ioActionFlags,
+                             UInt32 frames, AudioBufferList* ioData)
+{
+    const AudioStreamBasicDescription* fmt = &dbus->format;
+    UInt32 n = dbus->concealed++;
+    UInt32 spf = fmt->mFormatFlags & kAudioFormatFlagIsNonInterleaved
+        ? 1
+        : fmt->mChannelsPerFrame;
+    UInt32 b, f, c;
+    Float32 gain;
+
+    if (!dbus->last_frames || !pcm_concealable(fmt)
+        || n >= DEADLINE_MAX_CONCEAL
+        || (self->mode == CONCEAL_FADE && n > 0)) {
+        for (b = 0; b < ioData->mNumberBuffers; ++b)
+            memset(ioData->mBuffers[b].mData, 0,
+                   ioData->mBuffers[b].mDataByteSize);
+        *ioActionFlags |= kAudioUnitRenderAction_OutputIsSilence;
+        deadline_keep_tail(dbus, ioData, frames);
+        return;
+    }
+
+    // repeat the last block, 6 dB quieter each time
+    gain = 1.0f / (Float32)(1 << n);
+
+    for (b = 0; b < ioData->mNumberBuffers; ++b) {
+        void* in = dbus->last->mBuffers[b].mData;
+        void* out = ioData->mBuffers[b].mData;
+
+        for (f = 0; f < frames; ++f) {
+            UInt32 src = f % dbus->last_frames;
+            Float32 g = self->mode == CONCEAL_FADE
+                ? 1.0f - (Float32)f / (Float32)frames
+                : gain;
+
+            for (c = 0; c < spf; ++c)
+                pcm_set(fmt, out, f * spf + c,
+                        g * pcm_get(fmt, in, src * spf + c));
+        }
+    }
+
+    if (self->mode != CONCEAL_REPEAT)
+        deadline_crossfade(dbus, frames, ioData);
+
+    deadline_keep_tail(dbus, ioData, frames);
+}
+
+static void deadline_keep(deadline_bus_t* dbus, AudioBufferList* from,
+                          UInt32 frames)
+{
+    UInt32 b;
+
+    for (b = 0; b < dbus->last->mNumberBuffers && b < from->mNumberBuffers;
+         ++b)
+        memcpy(dbus->last->mBuffers[b].mData, from->mBuffers[b].mData,
+               frames * dbus->format.mBytesPerFrame);
+    dbus->last_frames = frames;
+}
+
+/* The render thread side. Returns 0 if the bus was rendered (or concealed),
+   nonzero if the caller must call Python directly. */
+static int deadline_render(audio_unit_t* unit, deadline_t* self,
+                           audio_unit_bus_t* bus, trace_ring_t* trace,
+                           UInt64 serial,
+                           AudioUnitRenderActionFlags* ioActionFlags,
+                           const AudioTimeStamp* inTimeStamp,
+                           UInt32 inBusNumber, UInt32 inNumberFrames,
+                           AudioBufferList* ioData)
+{
+    deadline_bus_t* dbus = bus ? atomic_load_explicit(&bus->deadline,
+                                                      memory_order_acquire)
+                               : NULL;
+    UInt64 now, waited;
+    int timeout = 0;
+    int result;
+    UInt32 b;
+
+    if (!dbus || inNumberFrames > dbus->max_frames
+        || ioData->mNumberBuffers != dbus->pending->mNumberBuffers
+        || ioData->mBuffers[0].mDataByteSize
+            != inNumberFrames * dbus->format.mBytesPerFrame)
+        return -1;
+
+    now = monotonic_ns();
+
+    if (pthread_mutex_trylock(&self->lock) != 0) {
+        // never block the render thread
+        self->contended++;
+        deadline_conceal(self, dbus, ioActionFlags, inNumberFrames, ioData);
+        return 0;
+    }
+
+    if (self->fraction <= 0.0) {
+        pthread_mutex_unlock(&self->lock);
+        return -1;
+    }
+
+    // the deadline is per cycle, however many buses we pull in it
+    if (!self->cycle_valid
+        || !(inTimeStamp->mFlags & kAudioTimeStampSampleTimeValid)
+        || inTimeStamp->mSampleTime != self->cycle_sample_time) {
+        self->cycle_valid = 1;
+        self->cycle_sample_time = inTimeStamp->mSampleTime;
+        self->cycle_deadline = now
+            + (UInt64)(self->fraction * 1e9 * inNumberFrames
+                       / dbus->format.mSampleRate);
+    }
+
+    self->periods++;
+
+    // A late block has arrived: keep it to conceal from
+    if (self->state == DEADLINE_DONE && self->abandoned) {
+        if (self->result == 0)
+            deadline_keep(self->dbus, self->dbus->pending, self->frames);
+        else if (self->result < 0)
+            self->errors++;
+        self->late++;
+        self->state = DEADLINE_IDLE;
+        self->abandoned = 0;
+    }
+
+    if (self->state != DEADLINE_IDLE) {
+        self->skipped++;
+        timeout = 1;
+    } else {
+        self->bus = bus;
+        self->dbus = dbus;
+        self->bus_number = inBusNumber;
+        self->frames = inNumberFrames;
+        self->flags = *ioActionFlags;
+        self->timestamp = *inTimeStamp;
+        self->trace = trace;
+        self->serial = serial;
+        self->state = DEADLINE_PENDING;
+        pthread_cond_signal(&self->work);
+
+        while (self->state != DEADLINE_DONE && !timeout)
+            timeout = deadline_timedwait(&self->done, &self->lock,
+                                         self->cycle_deadline);
+
+        if (self->state == DEADLINE_DONE) {
+            timeout = 0;
+            self->state = DEADLINE_IDLE;
+        } else {
+            self->abandoned = 1;
+        }
+    }
+
+    waited = monotonic_ns() - now;
+    self->wait_ns += waited;
+    if (waited > self->max_wait_ns)
+        self->max_wait_ns = waited;
+
+    result = self->result;
+
+    if (timeout || result < 0) {
+        if (timeout)
+            self->misses++;
+        else
+            self->errors++;
+        self->last_miss_sample_time = inTimeStamp->mSampleTime;
+        self->last_miss_host_time = inTimeStamp->mHostTime;
+        pthread_mutex_unlock(&self->lock);
+
+        deadline_conceal(self, dbus, ioActionFlags, inNumberFrames, ioData);
+        return 0;
+    }
+
+    *ioActionFlags = self->flags;
+    pthread_mutex_unlock(&self->lock);
+
+    if (result > 0) {
+        // end of stream, as without a deadline
+        for (b = 0; b < ioData->mNumberBuffers; ++b)
+            memset(ioData->mBuffers[b].mData, 0,
+                   ioData->mBuffers[b].mDataByteSize);
+        *ioActionFlags |= kAudioUnitRenderAction_OutputIsSilence;
+        AudioOutputUnitStop(unit->instance);
+        return 0;
+    }
+
+    for (b = 0; b < ioData->mNumberBuffers; ++b)
+        memcpy(ioData->mBuffers[b].mData, dbus->pending->mBuffers[b].mData,
+               ioData->mBuffers[b].mDataByteSize);
+
+    // blend into what was concealed (or faded out)
+    if (dbus->concealed && self->mode != CONCEAL_REPEAT
+        && pcm_concealable(&dbus->format))
+        deadline_crossfade(dbus, inNumberFrames, ioData);
+    dbus->concealed = 0;
+
+    deadline_keep(dbus, ioData, inNumberFrames);
+    deadline_keep_tail(dbus, ioData, inNumberFrames);
+
+    return 0;
+}
+
+static void deadline_free(deadline_t* self)
+{
+    if (!self)
+        return;
+
+    pthread_mutex_lock(&self->lock);
+    self->quit = 1;
+    pthread_cond_signal(&self->work);
+    pthread_mutex_unlock(&self->lock);
+
+    // the worker may be waiting for the GIL
+    Py_BEGIN_ALLOW_THREADS;
+    pthread_join(self->thread, NULL);
+    Py_END_ALLOW_THREADS;
+
+    pthread_cond_destroy(&self->work);
+    pthread_cond_destroy(&self->done);
+    pthread_mutex_destroy(&self->lock);
+
+    PyMem_Free(self);
+}
+
+static deadline_t* deadline_new(audio_unit_t* unit)
+{
+    deadline_t* self;
+    pthread_condattr_t attr;
+    int rc;
+
+    if (!(self = PyMem_Calloc(1, sizeof(deadline_t))))
+        return (deadline_t*)PyErr_NoMemory();
+
+    self->unit = unit;
+    self->mode = CONCEAL_CROSSFADE;
+
+    pthread_condattr_init(&attr);
+#ifndef __APPLE__
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+    pthread_mutex_init(&self->lock, NULL);
+    pthread_cond_init(&self->work, NULL);
+    pthread_cond_init(&self->done, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if ((rc = pthread_create(&self->thread, NULL, deadline_worker, self))) {
+        pthread_cond_destroy(&self->work);
+        pthread_cond_destroy(&self->done);
+        pthread_mutex_destroy(&self->lock);
+        PyMem_Free(self);
+        errno = rc;
+        return (deadline_t*)PyErr_SetFromErrno(PyExc_OSError);
+    }
+
+    return self;
+}
+
+static void audio_unit_free_buses(audio_unit_t* self)
+{
+    bus_table_t* table = atomic_load(&self->buses);
+    UInt32 i;
+
+    if (!table)
+        return;
+
+    for (i = 0; i < table->count; ++i) {
+        audio_unit_bus_t* b = atomic_load(&table->bus[i]);
+
+        if (b) {
+            connection_uninstall(b->callback);
+            Py_XDECREF(b->callback);
+            Py_XDECREF(b->user_data);
+            deadline_bus_free(atomic_load(&b->deadline));
+            PyMem_Free(b);
+        }
+    }
+
+    while (table) {
+        bus_table_t* retired = table->retired;
+        PyMem_Free(table);
+        table = retired;
+    }
+
+    self->buses = NULL;
+}
+
+static PyObject* audio_unit_new(PyTypeObject* type, PyObject* args,
+                                PyObject* kwds)
+{
+    audio_unit_t* self;
+
+    if (!PyArg_ParseTuple(args, ":AudioUnit"))
+        return NULL;
+
+    if (!(self = (audio_unit_t*)PyObject_New(audio_unit_t, &AudioUnitType)))
+        return NULL;
+
+    audio_unit_init(self, NULL);
+
+    return (PyObject*)self;
+}
+
+static void audio_unit_dealloc(audio_unit_t* obj)
+{
+    // Dispose first: the I/O thread may still be rendering from a native
+    // source owned by a bus
+    if (obj->instance) {
+        Py_BEGIN_ALLOW_THREADS;
+        AudioUnitUninitialize(obj->instance);
+        AudioComponentInstanceDispose(obj->instance);
+        Py_END_ALLOW_THREADS;
+    }
+
+    while (obj->retired_taps) {
+        unit_tap_t* tap = obj->retired_taps;
+
+        obj->retired_taps = tap->next;
+        tap->free(tap);
+    }
+
+    audio_unit_reclaim_sources(obj, 1);
+
+    deadline_free(atomic_load(&obj->deadline));
+    PyMem_Free(obj->midi);
+    PyMem_Free(obj->params);
+    audio_unit_free_buses(obj);
+    audio_unit_free_outputs(obj);
+    trace_ring_free(obj->trace_ring);
+
+    PyObject_Free(obj);
+}
+
+/*
+ * Properties, buffer sizes and latency
+ *
+ * GetProperty/SetProperty convert property values according to a type
+ * code, like the struct module: 'I' (UInt32), 'i' (SInt32), 'Q' (UInt64),
+ * 'd' (Float64), 'f' (Float32), 'asbd' (an AudioStreamBasicDescription) or
+ * 'b' (raw bytes). The well known properties have a default type; the
+ * others default to raw bytes.
+ */
+
+typedef struct {
+    AudioUnitPropertyID property;
+    const char* type;
+} property_type_t;
+
+static const property_type_t property_types[] = {
+    { kAudioUnitProperty_SampleRate, "d" },
+    { kAudioUnitProperty_StreamFormat, "asbd" },
+    { kAudioUnitProperty_ElementCount, "I" },
+    { kAudioUnitProperty_Latency, "d" },
+    { kAudioUnitProperty_MaximumFramesPerSlice, "I" },
+    { kAudioUnitProperty_TailTime, "d" },
+    { kAudioOutputUnitProperty_CurrentDevice, "I" },
+    { 0, NULL }
+};
+
+static const char* property_type(AudioUnitPropertyID property,
+                                 const char* type)
+{
+    const property_type_t* p;
+
+    if (type)
+        return type;
+
+    for (p = property_types; p->type; ++p)
+        if (p->property == property)
+            return p->type;
+
+    return "b";
+}
+
+typedef union {
+    UInt32 u32;
+    SInt32 s32;
+    UInt64 u64;
+    Float64 f64;
+    Float32 f32;
+    AudioStreamBasicDescription asbd;
+} property_value_t;
+
+/* Convert 'value' for a property of 'type'. Returns the size, or 0 with an
+   exception set. */
+static UInt32 property_from_python(const char* type, PyObject* value,
+                                   property_value_t* out)
+{
+    if (!strcmp(type, "I"))
+        out->u32 = (UInt32)PyLong_AsUnsignedLong(value);
+    else if (!strcmp(type, "i"))
+        out->s32 = (SInt32)PyLong_AsLong(value);
+    else if (!strcmp(type, "Q"))
+        out->u64 = PyLong_AsUnsignedLongLong(value);
+    else if (!strcmp(type, "d"))
+        out->f64 = PyFloat_AsDouble(value);
+    else if (!strcmp(type, "f"))
+        out->f32 = (Float32)PyFloat_AsDouble(value);
+    else if (!strcmp(type, "asbd")) {
+        if (!PyObject_TypeCheck(value, &AudioStreamBasicDescType)) {
+            PyErr_SetString(PyExc_TypeError,
+                            "value must be an AudioStreamBasicDescription");
+            return 0;
+        }
+        out->asbd = ((audio_stream_basic_desc_t*)value)->bdesc;
+        return sizeof(AudioStreamBasicDescription);
+    } else {
+        PyErr_Format(PyExc_ValueError, "unknown property type '%s'", type);
+        return 0;
+    }
+
+    if (PyErr_Occurred())
+        return 0;
+
+    switch (type[0]) {
+    case 'Q':
+    case 'd':
+        return 8;
+    default:
+        return 4;
+    }
+}
+
+static PyObject* property_to_python(const char* type,
+                                    const property_value_t* value)
+{
+    audio_stream_basic_desc_t* retval;
+
+    if (!strcmp(type, "I"))
+        return PyLong_FromUnsignedLong(value->u32);
+    if (!strcmp(type, "i"))
+        return PyLong_FromLong(value->s32);
+    if (!strcmp(type, "Q"))
+        return PyLong_FromUnsignedLongLong(value->u64);
+    if (!strcmp(type, "d"))
+        return PyFloat_FromDouble(value->f64);
+    if (!strcmp(type, "f"))
+        return PyFloat_FromDouble(value->f32);
+
+    if (!(retval = (audio_stream_basic_desc_t*)PyObject_New(
+              audio_stream_basic_desc_t, &AudioStreamBasicDescType)))
+        return NULL;
+
+    retval->bdesc = value->asbd;
+
+    return (PyObject*)retval;
+}
+
+/* Rebuild the native buffers that are sized by a format or by
+   MaximumFramesPerSlice, after either changed */
+static int audio_unit_resize_buffers(audio_unit_t* self)
+{
+    bus_table_t* table;
+    UInt32 i;
+
+    for (i = 0; i < self->noutputs; ++i)
+        if (!audio_unit_get_output(self, self->outputs[i]->bus, 0))
+            return -1;
+
+    if (!atomic_load(&self->deadline) || !(table = atomic_load(&self->buses)))
+        return 0;
+
+    for (i = 0; i < table->count; ++i) {
+        audio_unit_bus_t* b = atomic_load(&table->bus[i]);
+
+        if (b && b->callback && b->callback != Py_None
+            && !native_source_check(b->callback)
+            && deadline_prepare_bus(self, i, b) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static PyObject* audio_unit_getproperty(audio_unit_t* self, PyObject* args)
+{
+    OSErr rc;
+    AudioUnitPropertyID property;
+    UInt32 scope = kAudioUnitScope_Global;
+    UInt32 element = 0;
+    const char* type = NULL;
+    property_value_t value;
+    UInt32 size;
+    void* data;
+    PyObject* retval;
+
+    if (!PyArg_ParseTuple(args, "I|IIs:GetProperty", &property, &scope,
+                          &element, &type))
+        return NULL;
+
+    type = property_type(property, type);
+
+    if (!strcmp(type, "b")) {
+        rc = AudioUnitGetPropertyInfo(self->instance, property, scope,
+                                      element, &size, NULL);
+        if (rc != noErr) {
+            PyErr_Format(CoreAudioError,
+                         "AudioUnitGetPropertyInfo failed: %4.4s",
+                         (char*)&rc);
+            return NULL;
+        }
+
+        // the property may turn out shorter than its info said
+        if (!(data = PyMem_Malloc(size ? size : 1)))
+            return PyErr_NoMemory();
+
+        rc = AudioUnitGetProperty(self->instance, property, scope, element,
+                                  data, &size);
+        if (rc != noErr) {
+            PyMem_Free(data);
+            PyErr_Format(CoreAudioError, "AudioUnitGetProperty failed: %4.4s",
+                         (char*)&rc);
+            return NULL;
+        }
+
+        retval = PyBytes_FromStringAndSize(data, size);
+        PyMem_Free(data);
+
+        return retval;
+    }
+
+    if (strcmp(type, "I") && strcmp(type, "i") && strcmp(type, "Q")
+        && strcmp(type, "d") && strcmp(type, "f") && strcmp(type, "asbd")) {
+        PyErr_Format(PyExc_ValueError, "unknown property type '%s'", type);
+        return NULL;
+    }
+
+    memset(&value, 0, sizeof(value));
+    size = !strcmp(type, "asbd") ? sizeof(AudioStreamBasicDescription)
+        : type[0] == 'Q' || type[0] == 'd' ? 8
+                                           : 4;
+
+    rc = AudioUnitGetProperty(self->instance, property, scope, element,
+                              &value, &size);
+    if (rc != noErr) {
+        PyErr_Format(CoreAudioError, "AudioUnitGetProperty failed: %4.4s",
+                     (char*)&rc);
+        return NULL;
+    }
+
+    return property_to_python(type, &value);
+}
+
+static PyObject* audio_unit_setproperty(audio_unit_t* self, PyObject* args)
+{
+    OSErr rc;
+    AudioUnitPropertyID property;
+    PyObject* object;
+    UInt32 scope = kAudioUnitScope_Global;
+    UInt32 element = 0;
+    const char* type = NULL;
+    property_value_t value;
+    Py_buffer view;
+    const void* data = &value;
+    UInt32 size;
+    audio_unit_bus_t* b = NULL;
+
+    if (!PyArg_ParseTuple(args, "IO|IIs:SetProperty", &property, &object,
+                          &scope, &element, &type))
+        return NULL;
+
+    if (property == kAudioUnitProperty_SetRenderCallback) {
+        PyErr_SetString(PyExc_ValueError, "use SetRenderCallback");
+        return NULL;
+    }
+
+    type = property_type(property, type);
+
+    view.obj = NULL;
+    if (!strcmp(type, "b")) {
+        if (PyObject_GetBuffer(object, &view, PyBUF_SIMPLE) < 0)
+            return NULL;
+        data = view.buf;
+        size = (UInt32)view.len;
+    } else if (!(size = property_from_python(type, object, &value))) {
+        return NULL;
+    }
+
+    if ((property == kAudioUnitProperty_StreamFormat
+         || property == kAudioUnitProperty_SampleRate)
+        && scope == kAudioUnitScope_Input
+        && !(b = audio_unit_get_bus(self, element))) {
+        PyBuffer_Release(&view);
+        return NULL;
+    }
+
+    // this may wait for the render thread
+    Py_BEGIN_ALLOW_THREADS;
+    rc = AudioUnitSetProperty(self->instance, property, scope, element, data,
+                              size);
+    Py_END_ALLOW_THREADS;
+
+    if (view.obj)
+        PyBuffer_Release(&view);
+
+    if (rc != noErr) {
+        PyErr_Format(CoreAudioError, "AudioUnitSetProperty failed: %4.4s",
+                     (char*)&rc);
+        return NULL;
+    }
+
+    // keep the format of the bus in sync, as SetStreamFormat does
+    if (b) {
+        size = sizeof(AudioStreamBasicDescription);
+        if (AudioUnitGetProperty(self->instance,
+                                 kAudioUnitProperty_StreamFormat, scope,
+                                 element, &b->format, &size)
+            == noErr)
+            b->has_format = 1;
+    }
+
+    if ((property == kAudioUnitProperty_StreamFormat
+         || property == kAudioUnitProperty_SampleRate
+         || property == kAudioUnitProperty_MaximumFramesPerSlice)
+        && audio_unit_resize_buffers(self) < 0)
+        return NULL;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/* The device of an output unit, or kAudioObjectUnknown */
+static AudioDeviceID audio_unit_current_device(audio_unit_t* self)
+{
+    AudioDeviceID device = kAudioObjectUnknown;
+    UInt32 size = sizeof(device);
+
+    if (AudioUnitGetProperty(self->instance,
+                             kAudioOutputUnitProperty_CurrentDevice,
+                             kAudioUnitScope_Global, 0, &device, &size)
+        != noErr)
+        return kAudioObjectUnknown;
+
+    return device;
+}
+
+static UInt32 audio_device_get_uint32(AudioDeviceID device,
+                                      AudioObjectPropertySelector selector,
+                                      AudioObjectPropertyScope scope)
+{
+    AudioObjectPropertyAddress address
+        = { selector, scope, kAudioObjectPropertyElementMain };
+    UInt32 value = 0;
+    UInt32 size = sizeof(value);
+
+    if (AudioObjectGetPropertyData(device, &address, 0, NULL, &size, &value)
+        != noErr)
+        return 0;
+
+    return value;
+}
+
+static PyObject* audio_unit_setbufferframes(audio_unit_t* self,
+                                            PyObject* args)
+{
+    OSStatus rc;
+    UInt32 frames;
+    UInt32 max_frames = 0;
+    UInt32 size = sizeof(max_frames);
+    AudioDeviceID device = audio_unit_current_device(self);
+    AudioObjectPropertyAddress address
+        = { kAudioDevicePropertyBufferFrameSize,
+            kAudioObjectPropertyScopeGlobal, kAudioObjectPropertyElementMain };
+
+    if (!PyArg_ParseTuple(args, "I:SetBufferFrames", &frames))
+        return NULL;
+
+    if (device != kAudioObjectUnknown) {
+        rc = AudioObjectSetPropertyData(device, &address, 0, NULL,
+                                        sizeof(frames), &frames);
+        if (rc != noErr) {
+            PyErr_Format(CoreAudioError,
+                         "AudioObjectSetPropertyData(BufferFrameSize) failed: "
+                         "%4.4s",
+                         (char*)&rc);
+            return NULL;
+        }
+    }
+
+    rc = AudioUnitGetProperty(self->instance,
+                              kAudioUnitProperty_MaximumFramesPerSlice,
+                              kAudioUnitScope_Global, 0, &max_frames, &size);
+    if (rc != noErr) {
+        PyErr_Format(CoreAudioError,
+                     "AudioUnitGetProperty(MaximumFramesPerSlice) failed: "
+                     "%4.4s",
+                     (char*)&rc);
+        return NULL;
+    }
+
+    // A device may deliver up to its buffer size; other units render what
+    // they are asked for, so their buffers can shrink, too
+    if (max_frames < frames
+        || (device == kAudioObjectUnknown && max_frames != frames)) {
+        rc = AudioUnitSetProperty(self->instance,
+                                  kAudioUnitProperty_MaximumFramesPerSlice,
+                                  kAudioUnitScope_Global, 0, &frames,
+                                  sizeof(frames));
+        if (rc != noErr) {
+            PyErr_Format(CoreAudioError,
+                         "AudioUnitSetProperty(MaximumFramesPerSlice) failed: "
+                         "%4.4s",
+                         (char*)&rc);
+            return NULL;
+        }
+
+        if (audio_unit_resize_buffers(self) < 0)
+            return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject* audio_unit_getbufferframes(audio_unit_t* self,
+                                            PyObject* args)
+{
+    AudioDeviceID device = audio_unit_current_device(self);
+    UInt32 frames = 0;
+    UInt32 size = sizeof(frames);
+
+    if (!PyArg_ParseTuple(args, ":GetBufferFrames"))
+        return NULL;
+
+    if (device != kAudioObjectUnknown)
+        frames = audio_device_get_uint32(device,
+                                         kAudioDevicePropertyBufferFrameSize,
+                                         kAudioObjectPropertyScopeGlobal);
+    else
+        AudioUnitGetProperty(self->instance,
+                             kAudioUnitProperty_MaximumFramesPerSlice,
+                             kAudioUnitScope_Global, 0, &frames, &size);
+
+    return PyLong_FromUnsignedLong(frames);
+}
+
+/* The processing latency of a unit and, through Connections, of the units
+   it pulls from (the longest path) */
+static Float64 audio_unit_graph_latency(audio_unit_t* self)
+{
+    bus_table_t* table = atomic_load(&self->buses);
+    Float64 latency = 0.0;
+    Float64 upstream = 0.0;
+    UInt32 size = sizeof(latency);
+    UInt32 i;
+
+    if (AudioUnitGetProperty(self->instance, kAudioUnitProperty_Latency,
+                             kAudioUnitScope_Global, 0, &latency, &size)
+        != noErr)
+        latency = 0.0;
+
+    for (i = 0; table && i < table->count; ++i) {
+        audio_unit_bus_t* b = atomic_load(&table->bus[i]);
+        Float64 l;
+
+        if (b && b->callback && PyObject_TypeCheck(b->callback, &ConnectionType)
+            && (l = audio_unit_graph_latency(((connection_t*)b->callback)->src))
+                > upstream)
+            upstream = l;
+    }
+
+    return latency + upstream;
+}
+
+static PyObject* audio_unit_getlatency(audio_unit_t* self, PyObject* args)
+{
+    AudioDeviceID device = audio_unit_current_device(self);
+    AudioStreamBasicDescription format;
+    UInt32 size = sizeof(format);
+    UInt32 buffer_frames = 0;
+    UInt32 device_frames = 0;
+    Float64 unit_seconds;
+    Float64 frames;
+
+    if (!PyArg_ParseTuple(args, ":GetLatency"))
+        return NULL;
+
+    if (AudioUnitGetProperty(self->instance, kAudioUnitProperty_StreamFormat,
+                             kAudioUnitScope_Output, 0, &format, &size)
+            != noErr
+        || format.mSampleRate <= 0.0) {
+        PyErr_SetString(CoreAudioError, "the output has no sample rate");
+        return NULL;
+    }
+
+    if (device != kAudioObjectUnknown) {
+        buffer_frames = audio_device_get_uint32(
+            device, kAudioDevicePropertyBufferFrameSize,
+            kAudioObjectPropertyScopeGlobal);
+        device_frames = audio_device_get_uint32(
+                            device, kAudioDevicePropertyLatency,
+                            kAudioObjectPropertyScopeOutput)
+            + audio_device_get_uint32(device,
+                                      kAudioDevicePropertySafetyOffset,
+                                      kAudioObjectPropertyScopeOutput);
+    }
+
+    unit_seconds = audio_unit_graph_latency(self);
+    frames = buffer_frames + device_frames + unit_seconds * format.mSampleRate;
+
+    return Py_BuildValue("{sdsdsIsIsdsd}", "frames", frames, "seconds",
+                         frames / format.mSampleRate, "buffer_frames",
+                         buffer_frames, "device_frames", device_frames,
+                         "unit_seconds", unit_seconds, "sample_rate",
+                         format.mSampleRate);
+}
+
+/*
+ * Timed event queues
+ *
+ * The common part of MIDI and parameter scheduling. Events of a fixed size,
+ * each starting with a timed_event_t, are queued in time ordered batches
+ * with the GIL held. The queue is a single producer ring. A render
+ * notification on the unit moves queued events into a list of pending
+ * events, keeping it in the order of the queue's compare function. Before
+ * each cycle is rendered, it takes the events due in that cycle.
+ */
+
+/* Capacity of a queue and of its list of pending events; a power of two */
+#define TIMED_QUEUE_SIZE 4096
+
+/* The storage a queue needs for its ring and its pending list */
+#define TIMED_QUEUE_STORAGE(size) (2 * TIMED_QUEUE_SIZE * (size_t)(size))
+
+typedef struct {
+    Float64 time; /* in samples */
+    UInt32 seq; /* keeps simultaneous events in order */
+    int relative; /* time is relative to the cycle that drains it */
+} timed_event_t;
+
+typedef struct {
+    size_t size; /* of an event */
+    int (*compare)(const void*, const void*);
+    atomic_uint head; /* written with the GIL held */
+    atomic_uint tail; /* written by the render thread */
+    atomic_uint flushes; /* clear requests */
+    atomic_uint flush_to; /* a clear discards the ring up to here */
+    _Atomic(Float64) next_sample_time; /* the end of the last cycle */
+    atomic_int rendered; /* next_sample_time is valid */
+    atomic_uint npending;
+    atomic_ullong dispatched;
+    atomic_ullong late;
+    atomic_ullong errors;
+    UInt64 queued;
+    UInt32 seq;
+
+    /* render thread only */
+    unsigned int seen_flushes;
+    Byte* pending;
+
+    Byte* events;
+} timed_queue_t;
+
+/* Order events by time; simultaneous events keep the order they were
+   queued in */
+static int timed_event_compare(const void* a, const void* b)
+{
+    const timed_event_t* x = a;
+    const timed_event_t* y = b;
+
+    if (x->time != y->time)
+        return x->time < y->time ? -1 : 1;
+
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/* 'storage' holds TIMED_QUEUE_STORAGE(size) zeroed bytes */
+static void timed_queue_init(timed_queue_t* queue, void* storage, size_t size,
+                             int (*compare)(const void*, const void*))
+{
+    queue->size = size;
+    queue->compare = compare;
+    queue->pending = storage;
+    queue->events = queue->pending + TIMED_QUEUE_SIZE * size;
+}
+
+static void* timed_queue_at(const timed_queue_t* queue, Byte* events,
+                            UInt32 index)
+{
+    return events + (size_t)index * queue->size;
+}
+
+/* The first pending event; pending events are consumed from the front */
+static void* timed_queue_pending(const timed_queue_t* queue, UInt32 index)
+{
+    return timed_queue_at(queue, queue->pending, index);
+}
+
+/* Start a cycle: apply a clear, then move queued events into the pending
+   list. Returns nonzero if the queue was cleared. */
+static int timed_queue_begin(timed_queue_t* queue, Float64 start)
+{
+    unsigned int flushes = atomic_load_explicit(&queue->flushes,
+                                                memory_order_acquire);
+    unsigned int head, tail;
+    UInt32 npending;
+    int cleared = 0;
+
+    if (flushes != queue->seen_flushes) {
+        unsigned int flush_to = atomic_load_explicit(&queue->flush_to,
+                                                     memory_order_relaxed);
+
+        queue->seen_flushes = flushes;
+        atomic_store_explicit(&queue->npending, 0, memory_order_relaxed);
+        if ((int)(flush_to - atomic_load_explicit(&queue->tail,
+                                                  memory_order_relaxed))
+            > 0)
+            atomic_store_explicit(&queue->tail, flush_to,
+                                  memory_order_release);
+        cleared = 1;
+    }
+
+    head = atomic_load_explicit(&queue->head, memory_order_acquire);
+    tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    npending = atomic_load_explicit(&queue->npending, memory_order_relaxed);
+
+    while (tail != head && npending < TIMED_QUEUE_SIZE) {
+        timed_event_t* event = timed_queue_at(
+            queue, queue->events, tail & (TIMED_QUEUE_SIZE - 1));
+        UInt32 i = npending;
+
+        if (event->relative) {
+            event->relative = 0;
+            event->time += start;
+        }
+
+        // batches arrive in order, so this usually appends
+        while (i > 0
+               && queue->compare(timed_queue_pending(queue, i - 1), event) > 0)
+            --i;
+        memmove(timed_queue_pending(queue, i + 1),
+                timed_queue_pending(queue, i), (npending - i) * queue->size);
+        memcpy(timed_queue_pending(queue, i), event, queue->size);
+        ++npending;
+        ++tail;
+    }
+
+    atomic_store_explicit(&queue->tail, tail, memory_order_release);
+    atomic_store_explicit(&queue->npending, npending, memory_order_relaxed);
+
+    return cleared;
+}
+
+/* The number of pending events due in the cycle [start, end); those due
+   before it are counted as late */
+static UInt32 timed_queue_due(timed_queue_t* queue, Float64 start,
+                              Float64 end)
+{
+    UInt32 npending = atomic_load_explicit(&queue->npending,
+                                           memory_order_relaxed);
+    UInt32 n = 0;
+
+    for (; n < npending; ++n) {
+        const timed_event_t* event = timed_queue_pending(queue, n);
+
+        if (event->time >= end)
+            break;
+        if (event->time < start)
+            atomic_fetch_add_explicit(&queue->late, 1, memory_order_relaxed);
+    }
+
+    return n;
+}
+
+/* Remove the first 'n' pending events, which have been dispatched */
+static void timed_queue_consume(timed_queue_t* queue, UInt32 n)
+{
+    UInt32 npending = atomic_load_explicit(&queue->npending,
+                                           memory_order_relaxed);
+
+    if (!n)
+        return;
+
+    memmove(queue->pending, timed_queue_pending(queue, n),
+            (npending - n) * queue->size);
+    atomic_store_explicit(&queue->npending, npending - n,
+                          memory_order_relaxed);
+    atomic_fetch_add_explicit(&queue->dispatched, n, memory_order_relaxed);
+}
+
+/* Finish a cycle that ends at 'end' */
+static void timed_queue_end(timed_queue_t* queue, Float64 end)
+{
+    atomic_store_explicit(&queue->next_sample_time, end, memory_order_relaxed);
+    atomic_store_explicit(&queue->rendered, 1, memory_order_release);
+}
+
+/* Queue the events of the fast sequence 'seq'. 'parse' fills in an event
+   from an item, with a time relative to the batch. Returns the sample time
+   the batch is relative to, None if the unit has not rendered yet, or NULL
+   with an exception set. */
+static PyObject* timed_queue_schedule(timed_queue_t* queue, PyObject* seq,
+                                      PyObject* when,
+                                      int (*parse)(PyObject*, timed_event_t*),
+                                      const char* name)
+{
+    Byte* batch;
+    Float64 base = 0.0;
+    int relative = 0;
+    Py_ssize_t n, i;
+    unsigned int head;
+
+    // until the unit has rendered, the next cycle's sample time is unknown
+    if (when == Py_None) {
+        if (atomic_load_explicit(&queue->rendered, memory_order_acquire))
+            base = atomic_load_explicit(&queue->next_sample_time,
+                                        memory_order_relaxed);
+        else
+            relative = 1;
+    } else if ((base = PyFloat_AsDouble(when)) == -1.0 && PyErr_Occurred())
+        return NULL;
+
+    n = PySequence_Fast_GET_SIZE(seq);
+    head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    if (n > TIMED_QUEUE_SIZE
+                - (head
+                   - atomic_load_explicit(&queue->tail,
+                                          memory_order_acquire))) {
+        PyErr_Format(CoreAudioError, "the %s queue is full", name);
+        return NULL;
+    }
+
+    if (!(batch = PyMem_Malloc((n ? n : 1) * queue->size)))
+        return PyErr_NoMemory();
+
+    for (i = 0; i < n; ++i) {
+        timed_event_t* event = timed_queue_at(queue, batch, (UInt32)i);
+
+        if (parse(PySequence_Fast_GET_ITEM(seq, i), event) < 0) {
+            PyMem_Free(batch);
+            return NULL;
+        }
+
+        event->time += base;
+        event->seq = queue->seq++;
+        event->relative = relative;
+    }
+
+    qsort(batch, n, queue->size, queue->compare);
+
+    for (i = 0; i < n; ++i)
+        memcpy(timed_queue_at(queue, queue->events,
+                              (head + i) & (TIMED_QUEUE_SIZE - 1)),
+               timed_queue_at(queue, batch, (UInt32)i), queue->size);
+    atomic_store_explicit(&queue->head, head + (unsigned int)n,
+                          memory_order_release);
+    queue->queued += n;
+
+    PyMem_Free(batch);
+
+    if (relative) {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+
+    return PyFloat_FromDouble(base);
+}
+
+/* Discard all queued and pending events, from the next cycle on */
+static void timed_queue_clear(timed_queue_t* queue)
+{
+    atomic_store_explicit(&queue->flush_to,
+                          atomic_load_explicit(&queue->head,
+                                               memory_order_relaxed),
+                          memory_order_relaxed);
+    atomic_fetch_add_explicit(&queue->flushes, 1, memory_order_release);
+}
+
+/* Queued and pending events */
+static unsigned int timed_queue_length(timed_queue_t* queue)
+{
+    return atomic_load(&queue->head) - atomic_load(&queue->tail)
+        + atomic_load(&queue->npending);
+}
+
+/*
+ * MIDI event scheduling
+ *
+ * ScheduleMIDI() queues a batch of MIDI events for a MusicDevice, each
+ * with a sample time, in a timed event queue. Before each cycle is
+ * rendered, a render notification sends the events due in it with
+ * MusicDeviceMIDIEvent and the matching inOffsetSampleFrame. Events that
+ * are already late are sent at offset 0.
+ */
+
+typedef struct {
+    timed_event_t timed;
+    UInt8 status;
+    UInt8 data1;
+    UInt8 data2;
+} midi_event_t;
+
+typedef struct midi_queue {
+    timed_queue_t timed; /* of midi_event_t, stored after the queue */
+    AudioUnit instance;
+    atomic_int notes_off; /* ClearMIDI also stops sounding notes */
+} midi_queue_t;
+
+static OSStatus midi_notify(void* inRefCon,
+                            AudioUnitRenderActionFlags* ioActionFlags,
+                            const AudioTimeStamp* inTimeStamp,
+                            UInt32 inBusNumber, UInt32 inNumberFrames,
+                            AudioBufferList* ioData)
+{
+    midi_queue_t* queue = (midi_queue_t*)inRefCon;
+    Float64 start = inTimeStamp->mSampleTime;
+    Float64 end = start + inNumberFrames;
+    UInt32 n, i;
+    UInt8 channel;
+    OSStatus rc;
+
+    if (!(*ioActionFlags & kAudioUnitRenderAction_PreRender)
+        || inBusNumber != 0)
+        return noErr;
+
+    if (timed_queue_begin(&queue->timed, start)
+        && atomic_exchange(&queue->notes_off, 0))
+        for (channel = 0; channel < 16; ++channel)
+            MusicDeviceMIDIEvent(queue->instance, 0xb0 | channel, 123, 0, 0);
+
+    n = timed_queue_due(&queue->timed, start, end);
+    for (i = 0; i < n; ++i) {
+        midi_event_t* event = timed_queue_pending(&queue->timed, i);
+        UInt32 offset = 0;
+
+        if (event->timed.time >= start)
+            offset = (UInt32)(event->timed.time - start);
+
+        rc = MusicDeviceMIDIEvent(queue->instance, event->status,
+                                  event->data1, event->data2, offset);
+        if (rc != noErr)
+            atomic_fetch_add_explicit(&queue->timed.errors, 1,
+                                      memory_order_relaxed);
+    }
+
+    timed_queue_consume(&queue->timed, n);
+    timed_queue_end(&queue->timed, end);
+
+    return noErr;
+}
+
+/* Return the unit's MIDI queue, creating it on first use */
+static midi_queue_t* audio_unit_get_midi(audio_unit_t* self)
+{
+    midi_queue_t* queue;
+    OSStatus rc;
+
+    if (self->midi)
+        return self->midi;
+
+    if (!(queue = PyMem_Calloc(1, sizeof(midi_queue_t)
+                                      + TIMED_QUEUE_STORAGE(
+                                          sizeof(midi_event_t))))) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    memory_prefault_buffer(queue, sizeof(midi_queue_t)
+                                      + TIMED_QUEUE_STORAGE(
+                                          sizeof(midi_event_t)));
+    timed_queue_init(&queue->timed, queue + 1, sizeof(midi_event_t),
+                     timed_event_compare);
+    queue->instance = self->instance;
+
+    rc = AudioUnitAddRenderNotify(self->instance, midi_notify, queue);
+    if (rc != noErr) {
+        PyMem_Free(queue);
+        PyErr_Format(CoreAudioError, "AudioUnitAddRenderNotify failed: %4.4s",
+                     (char*)&rc);
+        return NULL;
+    }
+
+    self->midi = queue;
+
+    return queue;
+}
+
+static int midi_event_parse(PyObject* item, timed_event_t* timed)
+{
+    midi_event_t* event = (midi_event_t*)timed;
+    unsigned int status, data1 = 0, data2 = 0;
+
+    if (!PyArg_ParseTuple(item,
+                          "dI|II;events must be (frame, status[, data1"
+                          "[, data2]])",
+                          &timed->time, &status, &data1, &data2))
+        return -1;
+
+    if (status < 0x80 || status > 0xff || data1 > 0x7f || data2 > 0x7f) {
+        PyErr_Format(PyExc_ValueError, "invalid MIDI event %u %u %u", status,
+                     data1, data2);
+        return -1;
+    }
+
+    event->status = (UInt8)status;
+    event->data1 = (UInt8)data1;
+    event->data2 = (UInt8)data2;
+
+    return 0;
+}
+
+static PyObject* audio_unit_schedulemidi(audio_unit_t* self, PyObject* args)
+{
+    PyObject* events;
+    PyObject* seq;
+    PyObject* when = Py_None;
+    PyObject* retval;
+    midi_queue_t* queue;
+
+    if (!PyArg_ParseTuple(args, "O|O:ScheduleMIDI", &events, &when))
+        return NULL;
+
+    if (!(queue = audio_unit_get_midi(self)))
+        return NULL;
+
+    if (!(seq = PySequence_Fast(events, "events must be a sequence")))
+        return NULL;
+
+    retval = timed_queue_schedule(&queue->timed, seq, when, midi_event_parse,
+                                  "MIDI");
+    Py_DECREF(seq);
+
+    return retval;
+}
+
+static PyObject* audio_unit_clearmidi(audio_unit_t* self, PyObject* args)
+{
+    midi_queue_t* queue;
+    int notes_off = 1;
+
+    if (!PyArg_ParseTuple(args, "|p:ClearMIDI", &notes_off))
+        return NULL;
+
+    if (!(queue = audio_unit_get_midi(self)))
+        return NULL;
+
+    // the render thread discards what it has drained and what is queued
+    if (notes_off)
+        atomic_store(&queue->notes_off, 1);
+    timed_queue_clear(&queue->timed);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject* audio_unit_midievent(audio_unit_t* self, PyObject* args)
+{
+    unsigned int status, data1 = 0, data2 = 0, offset = 0;
+    OSStatus rc;
+
+    if (!PyArg_ParseTuple(args, "I|III:MIDIEvent", &status, &data1, &data2,
+                          &offset))
+        return NULL;
+
+    rc = MusicDeviceMIDIEvent(self->instance, status, data1, data2, offset);
+    if (rc != noErr) {
+        PyErr_Format(CoreAudioError, "MusicDeviceMIDIEvent failed: %4.4s",
+                     (char*)&rc);
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject* audio_unit_getmidistats(audio_unit_t* self, PyObject* args)
+{
+    midi_queue_t* queue = self->midi;
+
+    if (!PyArg_ParseTuple(args, ":GetMIDIStats"))
+        return NULL;
+
+    if (!queue)
+        return Py_BuildValue("{sKsIsKsKsKsd}", "queued", 0ULL, "pending", 0U,
+                             "dispatched", 0ULL, "late", 0ULL, "errors", 0ULL,
+                             "sample_time", 0.0);
+
+    return Py_BuildValue(
+        "{sKsIsKsKsKsd}", "queued", (unsigned long long)queue->timed.queued,
+        "pending", timed_queue_length(&queue->timed), "dispatched",
+        atomic_load(&queue->timed.dispatched), "late",
+        atomic_load(&queue->timed.late), "errors",
+        atomic_load(&queue->timed.errors), "sample_time",
+        atomic_load(&queue->timed.next_sample_time));
+}
+
+/*
+ * Parameter automation
+ *
+ * ScheduleParameters() queues a batch of parameter changes, each either
+ * immediate or a linear ramp over a number of frames, from any Python
+ * thread. Like MIDI events, the changes are kept in a timed event queue.
+ * A render notification passes the changes due in each cycle to
+ * AudioUnitScheduleParameters in one call: immediate
+ * changes at their buffer offset, ramps as the slice of the ramp that
+ * falls into the cycle. A new change to a parameter replaces its ramp; a
+ * new ramp starts from where the previous one was.
+ */
+
+/* The number of parameters that can ramp at the same time */
+#define PARAM_MAX_RAMPS 256
+
+/* Events passed to AudioUnitScheduleParameters at a time */
+#define PARAM_BATCH 64
+
+typedef struct {
+    timed_event_t timed;
+    AudioUnitParameterID id;
+    AudioUnitScope scope;
+    AudioUnitElement element;
+    AudioUnitParameterValue value;
+    UInt32 ramp; /* in frames, 0 for an immediate change */
+} param_change_t;
+
+typedef struct {
+    AudioUnitParameterID id;
+    AudioUnitScope scope;
+    AudioUnitElement element;
+    Float64 start;
+    UInt32 duration;
+    AudioUnitParameterValue from;
+    AudioUnitParameterValue to;
+} param_ramp_t;
+
+typedef struct param_queue {
+    timed_queue_t timed; /* of param_change_t, stored after the queue */
+    AudioUnit instance;
+    atomic_uint nramps;
+
+    /* render thread only */
+    param_ramp_t ramps[PARAM_MAX_RAMPS];
+    AudioUnitParameterEvent batch[PARAM_BATCH];
+    UInt32 nbatch;
+} param_queue_t;
+
+static void param_queue_flush_batch(param_queue_t* queue)
+{
+    OSStatus rc;
+
+    if (!queue->nbatch)
+        return;
+
+    rc = AudioUnitScheduleParameters(queue->instance, queue->batch,
+                                     queue->nbatch);
+    if (rc != noErr)
+        atomic_fetch_add_explicit(&queue->timed.errors, queue->nbatch,
+                                  memory_order_relaxed);
+
+    queue->nbatch = 0;
+}
+
+static AudioUnitParameterEvent* param_queue_event(param_queue_t* queue,
+                                                  AudioUnitParameterID id,
+                                                  AudioUnitScope scope,
+                                                  AudioUnitElement element)
+{
+    AudioUnitParameterEvent* event;
+
+    if (queue->nbatch == PARAM_BATCH)
+        param_queue_flush_batch(queue);
+
+    event = &queue->batch[queue->nbatch++];
+    memset(event, 0, sizeof(*event));
+    event->parameter = id;
+    event->scope = scope;
+    event->element = element;
+
+    return event;
+}
+
+static void param_queue_immediate(param_queue_t* queue,
+                                  AudioUnitParameterID id,
+                                  AudioUnitScope scope,
+                                  AudioUnitElement element,
+                                  AudioUnitParameterValue value,
+                                  UInt32 offset)
+{
+    AudioUnitParameterEvent* event = param_queue_event(queue, id, scope,
+                                                       element);
+
+    event->eventType = kParameterEvent_Immediate;
+    event->eventValues.immediate.bufferOffset = offset;
+    event->eventValues.immediate.value = value;
+}
+
+static AudioUnitParameterValue param_ramp_value(const param_ramp_t* ramp,
+                                                Float64 time)
+{
+    Float64 t = (time - ramp->start) / ramp->duration;
+
+    if (t <= 0.0)
+        return ramp->from;
+    if (t >= 1.0)
+        return ramp->to;
+
+    return ramp->from + (AudioUnitParameterValue)(t * (ramp->to - ramp->from));
+}
+
+/* The value of the last immediate change to a parameter that is still in
+   the batch, which AudioUnitGetParameter does not see yet */
+static int param_queue_batched(param_queue_t* queue,
+                               const param_change_t* change,
+                               AudioUnitParameterValue* value)
+{
+    UInt32 i = queue->nbatch;
+
+    while (i-- > 0) {
+        const AudioUnitParameterEvent* event = &queue->batch[i];
+
+        if (event->parameter == change->id && event->scope == change->scope
+            && event->element == change->element
+            && event->eventType == kParameterEvent_Immediate) {
+            *value = event->eventValues.immediate.value;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Start a change; it replaces a ramp of the same parameter */
+static void param_queue_apply(param_queue_t* queue,
+                              const param_change_t* change, Float64 start)
+{
+    UInt32 nramps = atomic_load_explicit(&queue->nramps, memory_order_relaxed);
+    param_ramp_t* ramp = NULL;
+    AudioUnitParameterValue from;
+    UInt32 i;
+
+    for (i = 0; i < nramps; ++i) {
+        param_ramp_t* r = &queue->ramps[i];
+
+        if (r->id == change->id && r->scope == change->scope
+            && r->element == change->element) {
+            ramp = r;
+            break;
+        }
+    }
+
+    if (!change->ramp) {
+        if (ramp) {
+            *ramp = queue->ramps[--nramps];
+            atomic_store_explicit(&queue->nramps, nramps,
+                                  memory_order_relaxed);
+        }
+        param_queue_immediate(queue, change->id, change->scope,
+                              change->element, change->value,
+                              change->timed.time > start
+                                  ? (UInt32)(change->timed.time - start)
+                                  : 0);
+        return;
+    }
+
+    if (ramp)
+        from = param_ramp_value(ramp, change->timed.time);
+    else if (nramps == PARAM_MAX_RAMPS
+             || (!param_queue_batched(queue, change, &from)
+                 && AudioUnitGetParameter(queue->instance, change->id,
+                                          change->scope, change->element,
+                                          &from)
+                     != noErr)) {
+        atomic_fetch_add_explicit(&queue->timed.errors, 1,
+                                  memory_order_relaxed);
+        return;
+    } else {
+        ramp = &queue->ramps[nramps++];
+        atomic_store_explicit(&queue->nramps, nramps, memory_order_relaxed);
+    }
+
+    ramp->id = change->id;
+    ramp->scope = change->scope;
+    ramp->element = change->element;
+    ramp->start = change->timed.time;
+    ramp->duration = change->ramp;
+    ramp->from = from;
+    ramp->to = change->value;
+}
+
+static OSStatus param_notify(void* inRefCon,
+                             AudioUnitRenderActionFlags* ioActionFlags,
+                             const AudioTimeStamp* inTimeStamp,
+                             UInt32 inBusNumber, UInt32 inNumberFrames,
+                             AudioBufferList* ioData)
+{
+    param_queue_t* queue = (param_queue_t*)inRefCon;
+    Float64 start = inTimeStamp->mSampleTime;
+    Float64 end = start + inNumberFrames;
+    UInt32 nramps, n, i;
+
+    if (!(*ioActionFlags & kAudioUnitRenderAction_PreRender)
+        || inBusNumber != 0)
+        return noErr;
+
+    if (timed_queue_begin(&queue->timed, start))
+        atomic_store_explicit(&queue->nramps, 0, memory_order_relaxed);
+
+    n = timed_queue_due(&queue->timed, start, end);
+    for (i = 0; i < n; ++i)
+        param_queue_apply(queue, timed_queue_pending(&queue->timed, i), start);
+    timed_queue_consume(&queue->timed, n);
+
+    // the slice of each ramp in this cycle; a ramp that ends in it is
+    // finished with its final value
+    nramps = atomic_load_explicit(&queue->nramps, memory_order_relaxed);
+    for (i = 0; i < nramps;) {
+        param_ramp_t* ramp = &queue->ramps[i];
+        Float64 from = ramp->start > start ? ramp->start : start;
+        Float64 to = ramp->start + ramp->duration;
+
+        if (to > end)
+            to = end;
+
+        if (from < to) {
+            AudioUnitParameterEvent* event = param_queue_event(
+                queue, ramp->id, ramp->scope, ramp->element);
+
+            event->eventType = kParameterEvent_Ramped;
+            event->eventValues.ramp.startBufferOffset = (SInt32)(from - start);
+            event->eventValues.ramp.durationInFrames = (UInt32)(to - from);
+            event->eventValues.ramp.startValue = param_ramp_value(ramp, from);
+            event->eventValues.ramp.endValue = param_ramp_value(ramp, to);
+        }
+
+        if (ramp->start + ramp->duration < end) {
+            param_queue_immediate(queue, ramp->id, ramp->scope, ramp->element,
+                                  ramp->to,
+                                  (UInt32)(ramp->start + ramp->duration
+                                           - start));
+            *ramp = queue->ramps[--nramps];
+        } else
+            ++i;
+    }
+    atomic_store_explicit(&queue->nramps, nramps, memory_order_relaxed);
+
+    param_queue_flush_batch(queue);
+
+    timed_queue_end(&queue->timed, end);
+
+    return noErr;
+}
+
+/* Return the unit's parameter queue, creating it on first use */
+static param_queue_t* audio_unit_get_params(audio_unit_t* self)
+{
+    param_queue_t* queue;
+    OSStatus rc;
+
+    if (self->params)
+        return self->params;
+
+    if (!(queue = PyMem_Calloc(1, sizeof(param_queue_t)
+                                      + TIMED_QUEUE_STORAGE(
+                                          sizeof(param_change_t))))) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    memory_prefault_buffer(queue, sizeof(param_queue_t)
+                                      + TIMED_QUEUE_STORAGE(
+                                          sizeof(param_change_t)));
+    timed_queue_init(&queue->timed, queue + 1, sizeof(param_change_t),
+                     timed_event_compare);
+    queue->instance = self->instance;
+
+    rc = AudioUnitAddRenderNotify(self->instance, param_notify, queue);
+    if (rc != noErr) {
+        PyMem_Free(queue);
+        PyErr_Format(CoreAudioError, "AudioUnitAddRenderNotify failed: %4.4s",
+                     (char*)&rc);
+        return NULL;
+    }
+
+    self->params = queue;
+
+    return queue;
+}
+
+static int param_change_parse(PyObject* item, timed_event_t* timed)
+{
+    param_change_t* change = (param_change_t*)timed;
+    unsigned int id, scope, element, ramp = 0;
+    float value;
+
+    if (!PyArg_ParseTuple(item,
+                          "dIIIf|I;changes must be (frame, id, scope, "
+                          "element, value[, ramp_frames])",
+                          &timed->time, &id, &scope, &element, &value, &ramp))
+        return -1;
+
+    change->id = id;
+    change->scope = scope;
+    change->element = element;
+    change->value = value;
+    change->ramp = ramp;
+
+    return 0;
+}
+
+static PyObject* audio_unit_scheduleparameters(audio_unit_t* self,
+                                               PyObject* args)
+{
+    PyObject* changes;
+    PyObject* seq;
+    PyObject* when = Py_None;
+    PyObject* retval;
+    param_queue_t* queue;
+
+    if (!PyArg_ParseTuple(args, "O|O:ScheduleParameters", &changes, &when))
+        return NULL;
+
+    if (!(queue = audio_unit_get_params(self)))
+        return NULL;
+
+    if (!(seq = PySequence_Fast(changes, "changes must be a sequence")))
+        return NULL;
+
+    retval = timed_queue_schedule(&queue->timed, seq, when,
+                                  param_change_parse, "parameter");
+    Py_DECREF(seq);
+
+    return retval;
+}
+
+static void param_queue_clear(param_queue_t* queue)
+{
+    timed_queue_clear(&queue->timed);
+}
+
+static PyObject* audio_unit_clearparameters(audio_unit_t* self,
+                                            PyObject* args)
+{
+    if (!PyArg_ParseTuple(args, ":ClearParameters"))
+        return NULL;
+
+    // parameters keep the values they have reached
+    if (self->params)
+        param_queue_clear(self->params);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject* audio_unit_setparameter(audio_unit_t* self, PyObject* args)
+{
+    unsigned int id, scope, element, offset = 0;
+    float value;
+    OSStatus rc;
+
+    if (!PyArg_ParseTuple(args, "IIIf|I:SetParameter", &id, &scope, &element,
+                          &value, &offset))
+        return NULL;
+
+    rc = AudioUnitSetParameter(self->instance, id, scope, element, value,
+                               offset);
+    if (rc != noErr) {
+        PyErr_Format(CoreAudioError, "AudioUnitSetParameter failed: %4.4s",
+                     (char*)&rc);
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject* audio_unit_getparameter(audio_unit_t* self, PyObject* args)
+{
+    unsigned int id, scope, element;
+    AudioUnitParameterValue value;
+    OSStatus rc;
+
+    if (!PyArg_ParseTuple(args, "III:GetParameter", &id, &scope, &element))
+        return NULL;
+
+    rc = AudioUnitGetParameter(self->instance, id, scope, element, &value);
+    if (rc != noErr) {
+        PyErr_Format(CoreAudioError, "AudioUnitGetParameter failed: %4.4s",
+                     (char*)&rc);
+        return NULL;
+    }
+
+    return PyFloat_FromDouble(value);
+}
+
+static PyObject* audio_unit_getparameterstats(audio_unit_t* self,
+                                              PyObject* args)
+{
+    param_queue_t* queue = self->params;
+
+    if (!PyArg_ParseTuple(args, ":GetParameterStats"))
+        return NULL;
+
+    if (!queue)
+        return Py_BuildValue("{sKsIsIsKsKsKsd}", "queued", 0ULL, "pending",
+                             0U, "ramps", 0U, "applied", 0ULL, "late", 0ULL,
+                             "errors", 0ULL, "sample_time", 0.0);
+
+    return Py_BuildValue(
+        "{sKsIsIsKsKsKsd}", "queued", (unsigned long long)queue->timed.queued,
+        "pending", timed_queue_length(&queue->timed), "ramps",
+        (unsigned int)atomic_load(&queue->nramps), "applied",
+        atomic_load(&queue->timed.dispatched), "late",
+        atomic_load(&queue->timed.late), "errors",
+        atomic_load(&queue->timed.errors), "sample_time",
+        atomic_load(&queue->timed.next_sample_time));
+}
+
+static PyObject* audio_unit_setstreamformat(audio_unit_t* self, PyObject* args)
+{
+    OSErr rc;
+    audio_stream_basic_desc_t* bdesc;
+    UInt32 bus = 0;
+    UInt32 scope = kAudioUnitScope_Input;
+    audio_unit_bus_t* b = NULL;
+
+    if (!PyArg_ParseTuple(args, "O!|II:SetStreamFormat",
+                          &AudioStreamBasicDescType, &bdesc, &bus, &scope))
+        return NULL;
+
+    if (scope == kAudioUnitScope_Input && !(b = audio_unit_get_bus(self, bus)))
+        return NULL;
+
+    Py_BEGIN_ALLOW_THREADS;
+    rc = AudioUnitSetProperty(self->instance, kAudioUnitProperty_StreamFormat,
+                              scope, bus, &bdesc->bdesc,
+                              sizeof(AudioStreamBasicDescription));
+    Py_END_ALLOW_THREADS;
+
+    if (rc != noErr) {
+        PyErr_Format(CoreAudioError,
+                     "AudioUnitSetProperty(StreamFormat) failed: %4.4s",
+                     (char*)&rc);
+        return NULL;
+    }
+
+    if (b) {
+        b->format = bdesc->bdesc;
+        b->has_format = 1;
+
+    }
+
+    if (audio_unit_resize_buffers(self) < 0)
+        return NULL;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject* audio_unit_getstreamformat(audio_unit_t* self, PyObject* args)
+{
+    OSErr rc;
+    UInt32 bus = 0;
+    UInt32 scope = kAudioUnitScope_Input;
+    UInt32 size = sizeof(AudioStreamBasicDescription);
+    audio_stream_basic_desc_t* retval;
+    AudioStreamBasicDescription desc;
+
+    if (!PyArg_ParseTuple(args, "|II:GetStreamFormat", &bus, &scope))
+        return NULL;
+
+    rc = AudioUnitGetProperty(self->instance, kAudioUnitProperty_StreamFormat,
+                              scope, bus, &desc, &size);
+    if (rc != noErr) {
+        PyErr_Format(CoreAudioError,
+                     "AudioUnitGetProperty(StreamFormat) failed: %4.4s",
+                     (char*)&rc);
+        return NULL;
+    }
+
+    if (!(retval = (audio_stream_basic_desc_t*)PyObject_New(
+              audio_stream_basic_desc_t, &AudioStreamBasicDescType)))
+        return NULL;
+
+    retval->bdesc = desc;
+
+    return (PyObject*)retval;
+}
+
+static PyObject* audio_unit_setbuscount(audio_unit_t* self, PyObject* args)
+{
+    OSErr rc;
+    UInt32 count;
+    UInt32 scope = kAudioUnitScope_Input;
+
+    if (!PyArg_ParseTuple(args, "I|I:SetBusCount", &count, &scope))
+        return NULL;
+
+    if (count > MAX_BUSES) {
+        PyErr_Format(PyExc_ValueError, "count must be at most %d", MAX_BUSES);
+        return NULL;
+    }
+
+    rc = AudioUnitSetProperty(self->instance, kAudioUnitProperty_ElementCount,
+                              scope, 0, &count, sizeof(count));
+    if (rc != noErr) {
+        PyErr_Format(CoreAudioError,
+                     "AudioUnitSetProperty(ElementCount) failed: %4.4s",
+                     (char*)&rc);
+        return NULL;
+    }
+
+    // Build the dispatch table now rather than while rendering
+    if (scope == kAudioUnitScope_Input && count
+        && !audio_unit_get_bus(self, count - 1))
+        return NULL;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject* audio_unit_getbuscount(audio_unit_t* self, PyObject* args)
+{
+    OSErr rc;
+    UInt32 count;
+    UInt32 scope = kAudioUnitScope_Input;
+    UInt32 size = sizeof(count);
+
+    if (!PyArg_ParseTuple(args, "|I:GetBusCount", &scope))
+        return NULL;
+
+    rc = AudioUnitGetProperty(self->instance, kAudioUnitProperty_ElementCount,
+                              scope, 0, &count, &size);
+    if (rc != noErr) {
+        PyErr_Format(CoreAudioError,
+                     "AudioUnitGetProperty(ElementCount) failed: %4.4s",
+                     (char*)&rc);
+        return NULL;
+    }
+
+    return PyLong_FromUnsignedLong(count);
+}
+
+static OSStatus audio_unit_render_callback(
+    void* inRefCon, AudioUnitRenderActionFlags* ioActionFlags,
+    const AudioTimeStamp* inTimeStamp, UInt32 inBusNumber,
+    UInt32 inNumberFrames, AudioBufferList* ioData)
+{
+    int rc;
+    audio_unit_t* self = (audio_unit_t*)inRefCon;
+    audio_unit_bus_t* bus = audio_unit_lookup_bus(self, inBusNumber);
+    deadline_t* deadline = atomic_load_explicit(&self->deadline,
+                                                memory_order_acquire);
+    trace_ring_t* trace = atomic_load_explicit(&self->trace,
+                                               memory_order_acquire);
+    UInt64 serial = trace ? trace_begin(trace) : 0;
+    PyGILState_STATE gil;
+
+    trace_event(trace, serial, TRACE_ENTER, inBusNumber, inNumberFrames);
+
+    if (deadline
+        && deadline_render(self, deadline, bus, trace, serial, ioActionFlags,
+                           inTimeStamp, inBusNumber, inNumberFrames, ioData)
+            == 0) {
+        trace_event(trace, serial, TRACE_EXIT, inBusNumber, inNumberFrames);
+        return 0;
+    }
+
+    gil = PyGILState_Ensure();
+
+    trace_event(trace, serial, TRACE_GIL_ACQUIRED, inBusNumber,
+                inNumberFrames);
+
+    rc = audio_unit_call_python(bus, trace, serial, ioActionFlags, inTimeStamp,
+                                inBusNumber, inNumberFrames, ioData);
+
+    PyGILState_Release(gil);
+
+    // On end of stream or errors, stop output - nothing good could come out
+    // of continued operation
+    if (rc != 0)
+        AudioOutputUnitStop(self->instance);
+
+    trace_event(trace, serial, TRACE_EXIT, inBusNumber, inNumberFrames);
+
+    return rc < 0 ? -1 : 0;
+}
+
+/* This is installed instead of audio_unit_render_callback when the render
+   callback is a native source. It never takes the GIL. */
+static OSStatus audio_unit_native_render_callback(
+    void* inRefCon, AudioUnitRenderActionFlags* ioActionFlags,
+    const AudioTimeStamp* inTimeStamp, UInt32 inBusNumber,
+    UInt32 inNumberFrames, AudioBufferList* ioData)
+{
+    audio_unit_t* self = (audio_unit_t*)inRefCon;
+    audio_unit_bus_t* bus = audio_unit_lookup_bus(self, inBusNumber);
+    native_source_t* source;
+    trace_ring_t* trace = atomic_load_explicit(&self->trace,
+                                               memory_order_acquire);
+    UInt64 serial = trace ? trace_begin(trace) : 0;
+    OSStatus rc = noErr;
+    UInt32 i;
+
+    // counted before the source is loaded, so that a source replaced after
+    // this is kept until we return
+    atomic_fetch_add(&self->native_calls, 1);
+    source = bus ? atomic_load(&bus->source) : NULL;
+
+    trace_event(trace, serial, TRACE_ENTER, inBusNumber, inNumberFrames);
+
+    if (source) {
+        rc = source->render((PyObject*)source, ioActionFlags, inTimeStamp,
+                            inBusNumber, inNumberFrames, ioData);
+    } else {
+        for (i = 0; i < ioData->mNumberBuffers; ++i)
+            memset(ioData->mBuffers[i].mData, 0,
+                   ioData->mBuffers[i].mDataByteSize);
+        *ioActionFlags |= kAudioUnitRenderAction_OutputIsSilence;
+    }
+
+    trace_event(trace, serial, TRACE_EXIT, inBusNumber, inNumberFrames);
+
+    atomic_fetch_add_explicit(&self->native_returns, 1, memory_order_release);
+
+    return rc;
+}
+
+/* Install 'callback' (a Python callable, a native source or None) on an
+   input bus. Returns 0 on success, -1 with an exception set. */
+static int audio_unit_set_bus_callback(audio_unit_t* self, UInt32 bus,
+                                       PyObject* callback, PyObject* user_data)
+{
+    OSErr rc;
+    audio_unit_bus_t* b = audio_unit_get_bus(self, bus);
+    PyObject* old_callback;
+    PyObject* old_user_data;
+    retired_source_t* retired = NULL;
+    AURenderCallbackStruct input;
+
+    if (!b)
+        return -1;
+
+    if (native_source_check(callback)
+        && ((native_source_t*)callback)->check) {
+        AudioStreamBasicDescription format;
+        UInt32 size = sizeof(format);
+
+        rc = AudioUnitGetProperty(self->instance,
+                                  kAudioUnitProperty_StreamFormat,
+                                  kAudioUnitScope_Input, bus, &format, &size);
+        if (rc != noErr) {
+            PyErr_Format(CoreAudioError,
+                         "AudioUnitGetProperty(StreamFormat) failed: %4.4s",
+                         (char*)&rc);
+            return -1;
+        }
+
+        if (((native_source_t*)callback)->check(callback, &format) < 0)
+            return -1;
+    }
+
+    if (atomic_load(&self->deadline) && callback != Py_None
+        && !native_source_check(callback)
+        && deadline_prepare_bus(self, bus, b) < 0)
+        return -1;
+
+    old_callback = b->callback;
+    old_user_data = b->user_data;
+
+    // Either the previous or the new native source is retired
+    if ((native_source_check(callback)
+         || (old_callback && native_source_check(old_callback)))
+        && !(retired = PyMem_Malloc(sizeof(retired_source_t)))) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    // Keep a reference
+    Py_INCREF(callback);
+    Py_INCREF(user_data);
+
+    b->callback = callback;
+    b->user_data = user_data;
+
+    // A native callback that is still installed may render from either
+    // source until the property is set and a while after: a source that is
+    // replaced is retired, not released
+    if (native_source_check(callback)) {
+        atomic_store(&b->source, (native_source_t*)callback);
+        input.inputProc = audio_unit_native_render_callback;
+        input.inputProcRefCon = self;
+    } else if (callback != Py_None) {
+        input.inputProc = audio_unit_render_callback;
+        input.inputProcRefCon = self;
+    } else {
+        input.inputProc = NULL;
+        input.inputProcRefCon = NULL;
+    }
+
+    // The render thread may be waiting for the GIL in the old callback
+    Py_BEGIN_ALLOW_THREADS;
+    rc = AudioUnitSetProperty(self->instance,
+                              kAudioUnitProperty_SetRenderCallback,
+                              kAudioUnitScope_Input, bus, &input,
+                              sizeof(input));
+    Py_END_ALLOW_THREADS;
+
+    if (rc != noErr) {
+        b->callback = old_callback;
+        b->user_data = old_user_data;
+        atomic_store(&b->source,
+                     old_callback && native_source_check(old_callback)
+                         ? (native_source_t*)old_callback
+                         : NULL);
+
+        if (native_source_check(callback))
+            audio_unit_retire_source(self, retired, callback);
+        else {
+            PyMem_Free(retired);
+            Py_DECREF(callback);
+        }
+        Py_DECREF(user_data);
+
+        PyErr_Format(CoreAudioError,
+                     "AudioUnitSetProperty(RenderCallback) failed: "
+                     "%c%c%c%c",
+                     FOURCC_ARGS(rc));
+        return -1;
+    }
+
+    if (!native_source_check(callback))
+        atomic_store(&b->source, NULL);
+
+    connection_uninstall(old_callback);
+
+    // The previous callback is no longer installed, release it only now
+    if (old_callback && native_source_check(old_callback))
+        audio_unit_retire_source(self, retired, old_callback);
+    else {
+        PyMem_Free(retired);
+        Py_XDECREF(old_callback);
+    }
+    Py_XDECREF(old_user_data);
+
+    audio_unit_reclaim_sources(self, 0);
+
+    return 0;
+}
+
+static PyObject* audio_unit_setrendercallback(audio_unit_t* self,
+                                              PyObject* args)
+{
+    PyObject* callback;
+    PyObject* user_data = Py_None;
+    UInt32 bus = 0;
+
+    if (!PyArg_ParseTuple(args, "O|OI:SetRenderCallback", &callback,
+                          &user_data, &bus)) {
+        return NULL;
+    }
+
+    if (audio_unit_set_bus_callback(self, bus, callback, user_data) < 0)
+        return NULL;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject* audio_unit_setdeadline(audio_unit_t* self, PyObject* args)
+{
+    double fraction;
+    const char* concealment = NULL;
+    deadline_t* deadline = atomic_load(&self->deadline);
+    bus_table_t* table;
+    int mode = CONCEAL_CROSSFADE;
+    UInt32 i;
+
+    if (!PyArg_ParseTuple(args, "d|s:SetDeadline", &fraction, &concealment))
+        return NULL;
+
+    if (fraction < 0.0 || fraction > 1.0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "fraction must be between 0 and 1");
+        return NULL;
+    }
+
+    if (concealment) {
+        for (mode = 0; mode < (int)(sizeof(conceal_names) / sizeof(char*));
+             ++mode)
+            if (!strcmp(concealment, conceal_names[mode]))
+                break;
+        if (mode == sizeof(conceal_names) / sizeof(char*)) {
+            PyErr_Format(PyExc_ValueError, "unknown concealment '%s'",
+                         concealment);
+            return NULL;
+        }
+    }
+
+    if (!deadline && fraction > 0.0) {
+        if (!(deadline = deadline_new(self)))
+            return NULL;
+
+        // buffers for the Python callbacks that are already installed
+        if ((table = atomic_load(&self->buses))) {
+            for (i = 0; i < table->count; ++i) {
+                audio_unit_bus_t* b = atomic_load(&table->bus[i]);
+
+                if (b && b->callback && b->callback != Py_None
+                    && !native_source_check(b->callback)
+                    && deadline_prepare_bus(self, i, b) < 0) {
+                    deadline_free(deadline);
+                    return NULL;
+                }
+            }
+        }
+
+        pthread_mutex_lock(&deadline->lock);
+        deadline->fraction = fraction;
+        deadline->mode = mode;
+        pthread_mutex_unlock(&deadline->lock);
+
+        atomic_store_explicit(&self->deadline, deadline, memory_order_release);
+    } else if (deadline) {
+        // with a fraction of 0, the worker stays around, but is not used
+        pthread_mutex_lock(&deadline->lock);
+        deadline->fraction = fraction;
+        deadline->mode = mode;
+        pthread_mutex_unlock(&deadline->lock);
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject* audio_unit_getdeadlinestats(audio_unit_t* self,
+                                             PyObject* args)
+{
+    deadline_t* deadline = atomic_load(&self->deadline);
+    deadline_t stats;
+
+    if (!PyArg_ParseTuple(args, ":GetDeadlineStats"))
+        return NULL;
+
+    if (!deadline) {
+        memset(&stats, 0, sizeof(stats));
+        stats.mode = CONCEAL_CROSSFADE;
+    } else {
+        pthread_mutex_lock(&deadline->lock);
+        stats = *deadline;
+        pthread_mutex_unlock(&deadline->lock);
+    }
+
+    return Py_BuildValue(
+        "{sdsssKsKsKsKsKsKsdsdsdsK}", "fraction", stats.fraction,
+        "concealment", conceal_names[stats.mode], "periods", stats.periods,
+        "misses", stats.misses, "late", stats.late, "skipped", stats.skipped,
+        "errors", stats.errors, "contended", stats.contended, "mean_wait_us",
+        stats.periods ? stats.wait_ns / 1e3 / stats.periods : 0.0,
+        "max_wait_us", stats.max_wait_ns / 1e3, "last_miss_sample_time",
+        stats.last_miss_sample_time, "last_miss_host_time",
+        stats.last_miss_host_time);
+}
+
+static PyObject* audio_unit_enabletracing(audio_unit_t* self, PyObject* args)
+{
+    UInt32 capacity = 65536;
+    trace_ring_t* ring;
+
+    if (!PyArg_ParseTuple(args, "|I:EnableTracing", &capacity))
+        return NULL;
+
+    if (capacity < 16 || capacity & (capacity - 1)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "capacity must be a power of two and at least 16");
+        return NULL;
+    }
+
+    // The render thread may still be writing to the ring. If it is large
+    // enough, it is cleared in place: events from before are skipped and a
+    // late one is at worst reported as lost. Otherwise it is retired; rings
+    // only grow, so the retired ones take less memory than the current one.
+    if (self->trace_ring && capacity <= self->trace_ring->size) {
+        ring = self->trace_ring;
+        atomic_store_explicit(&ring->capacity, capacity,
+                              memory_order_relaxed);
+        atomic_store_explicit(&ring->base, atomic_load(&ring->head),
+                              memory_order_relaxed);
+    } else {
+        if (!(ring = trace_ring_new(capacity)))
+            return PyErr_NoMemory();
+
+        ring->retired = self->trace_ring;
+        self->trace_ring = ring;
+    }
+
+    atomic_store_explicit(&self->trace, self->trace_ring,
+                          memory_order_release);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject* audio_unit_disabletracing(audio_unit_t* self, PyObject* args)
+{
+    if (!PyArg_ParseTuple(args, ":DisableTracing"))
+        return NULL;
+
+    atomic_store_explicit(&self->trace, NULL, memory_order_release);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject* audio_unit_gettrace(audio_unit_t* self, PyObject* args)
+{
+    const char* format = "chrome";
+
+    if (!PyArg_ParseTuple(args, "|s:GetTrace", &format))
+        return NULL;
+
+    if (!self->trace_ring) {
+        PyErr_SetString(CoreAudioError, "tracing was never enabled");
+        return NULL;
+    }
+
+    return trace_format(self->trace_ring, format);
+}
+
+static PyObject* audio_unit_initialize(audio_unit_t* self, PyObject* args)
+{
+    OSErr rc;
+
+    if (!PyArg_ParseTuple(args, ":Initialize"))
+        return NULL;
+
+    rc = AudioUnitInitialize(self->instance);
+    if (rc != noErr) {
+        PyErr_Format(CoreAudioError, "Initialize failed: %4.4s", (char*)&rc);
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject* audio_unit_start(audio_unit_t* self, PyObject* args)
+{
+    OSErr rc;
+
+    if (!PyArg_ParseTuple(args, ":Start"))
+        return NULL;
+
+    rc = AudioOutputUnitStart(self->instance);
+    if (rc != noErr) {
+        PyErr_Format(CoreAudioError, "Start failed: %4.4s", (char*)&rc);
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject* audio_unit_stop(audio_unit_t* self, PyObject* args)
+{
+    OSErr rc;
+
+    if (!PyArg_ParseTuple(args, ":Stop"))
+        return NULL;
+
+    // Stop waits for the render callback, which may wait for the GIL
+    Py_BEGIN_ALLOW_THREADS;
+    rc = AudioOutputUnitStop(self->instance);
+    Py_END_ALLOW_THREADS;
+    if (rc != noErr) {
+        PyErr_Format(CoreAudioError, "Stop failed: %4.4s", (char*)&rc);
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject* audio_unit_render(audio_unit_t* self, PyObject* args)
+{
+    OSErr rc = noErr;
+    AudioUnitRenderActionFlags flags = 0;
+    AudioStreamBasicDescription format;
+    AudioTimeStamp ts;
+    AudioBufferList* abl;
+    UInt32 frames;
+    UInt32 bus = 0;
+    UInt32 size = sizeof(format);
+    Float64 sample_time = 0.0;
+    PyObject* result;
+    UInt32 i;
+
+    if (!PyArg_ParseTuple(args, "I|dI:Render", &frames, &sample_time, &bus)) {
+        return NULL;
+    }
+
+    rc = AudioUnitGetProperty(self->instance, kAudioUnitProperty_StreamFormat,
+                              kAudioUnitScope_Output, bus, &format, &size);
+    if (rc != noErr) {
+        PyErr_Format(CoreAudioError,
+                     "AudioUnitGetProperty(StreamFormat) failed: %4.4s",
+                     (char*)&rc);
+        return NULL;
+    }
+
+    if (!(abl = alloc_buffer_list(&format, frames)))
+        return PyErr_NoMemory();
+
+    memset(&ts, 0, sizeof(ts));
+    ts.mSampleTime = sample_time;
+    ts.mHostTime = AudioGetCurrentHostTime();
+    ts.mRateScalar = 1.0;
+    ts.mFlags = kAudioTimeStampSampleTimeValid | kAudioTimeStampHostTimeValid
+        | kAudioTimeStampRateScalarValid;
+
+    Py_BEGIN_ALLOW_THREADS;
+    rc = AudioUnitRender(self->instance, &flags, &ts, bus, frames, abl);
+    Py_END_ALLOW_THREADS;
+
+    if (rc != noErr) {
+        PyMem_Free(abl);
+        PyErr_Format(CoreAudioError, "Render failed: %4.4s", (char*)&rc);
+        return NULL;
+    }
+
+    // (flags, buffer, ...) like the render callbacks return
+    if ((result = PyTuple_New(abl->mNumberBuffers + 1))) {
+        PyTuple_SET_ITEM(result, 0, PyLong_FromUnsignedLong(flags));
+        for (i = 0; i < abl->mNumberBuffers; ++i)
+            PyTuple_SET_ITEM(result, i + 1,
+                             PyBytes_FromStringAndSize(
+                                 abl->mBuffers[i].mData,
+                                 abl->mBuffers[i].mDataByteSize));
+        for (i = 0; i <= abl->mNumberBuffers; ++i)
+            if (!PyTuple_GET_ITEM(result, i)) {
+                Py_CLEAR(result);
+                break;
+            }
+    }
+
+    PyMem_Free(abl);
+
+    return result;
+}
+
+/* AudioUnit Object Bureaucracy */
+
+static PyMethodDef audio_unit_methods[] = {
+    { "Initialize", (PyCFunction)audio_unit_initialize, METH_VARARGS },
+    { "Start", (PyCFunction)audio_unit_start, METH_VARARGS },
+    { "Stop", (PyCFunction)audio_unit_stop, METH_VARARGS },
+    { "SetStreamFormat", (PyCFunction)audio_unit_setstreamformat,
+      METH_VARARGS,
+      "SetStreamFormat(desc[, bus[, scope]]) -- set the stream format of a "
+      "bus, in the input scope by default." },
+    { "GetStreamFormat", (PyCFunction)audio_unit_getstreamformat,
+      METH_VARARGS,
+      "GetStreamFormat([bus[, scope]]) -- return the stream format of a bus "
+      "as an AudioStreamBasicDescription." },
+    { "SetBusCount", (PyCFunction)audio_unit_setbuscount, METH_VARARGS,
+      "SetBusCount(count[, scope]) -- set the number of buses (elements), "
+      "e.g. the inputs of a mixer. The unit must not be initialized." },
+    { "GetBusCount", (PyCFunction)audio_unit_getbuscount, METH_VARARGS,
+      "GetBusCount([scope]) -- return the number of buses in a scope." },
+    { "GetProperty", (PyCFunction)audio_unit_getproperty, METH_VARARGS,
+      "GetProperty(property[, scope[, element[, type]]]) -- return a "
+      "property, converted by type: 'I', 'i', 'Q', 'd', 'f', 'asbd' or 'b' "
+      "(bytes). Well known properties need no type." },
+    { "SetProperty", (PyCFunction)audio_unit_setproperty, METH_VARARGS,
+      "SetProperty(property, value[, scope[, element[, type]]]) -- set a "
+      "property; see GetProperty for the types." },
+    { "SetBufferFrames", (PyCFunction)audio_unit_setbufferframes,
+      METH_VARARGS,
+      "SetBufferFrames(frames) -- set the device buffer size of an output "
+      "unit, or MaximumFramesPerSlice of other units. Raising "
+      "MaximumFramesPerSlice requires an uninitialized unit." },
+    { "GetBufferFrames", (PyCFunction)audio_unit_getbufferframes,
+      METH_VARARGS,
+      "GetBufferFrames() -- return the device buffer size, or "
+      "MaximumFramesPerSlice for units without a device." },
+    { "GetLatency", (PyCFunction)audio_unit_getlatency, METH_VARARGS,
+      "GetLatency() -- return a dict with the total output latency in "
+      "'frames' and 'seconds', and its parts." },
+    { "SetRenderCallback", (PyCFunction)audio_unit_setrendercallback,
+      METH_VARARGS,
+      "SetRenderCallback(callback[, user_data[, bus]]) -- install a Python "
+      "callable, a native source or None on an input bus." },
+    { "SetDeadline", (PyCFunction)audio_unit_setdeadline, METH_VARARGS,
+      "SetDeadline(fraction[, concealment]) -- wait for Python render "
+      "callbacks only up to 'fraction' of the period, then conceal the miss "
+      "with 'fade', 'repeat' or 'crossfade' (the default). 0 turns the "
+      "deadline off." },
+    { "GetDeadlineStats", (PyCFunction)audio_unit_getdeadlinestats,
+      METH_VARARGS,
+      "GetDeadlineStats() -- return a dict with the number of periods, "
+      "misses, late blocks, errors, contended periods and the time spent "
+      "waiting." },
+    { "ScheduleMIDI", (PyCFunction)audio_unit_schedulemidi, METH_VARARGS,
+      "ScheduleMIDI(events[, sample_time]) -- queue a batch of "
+      "(frame, status[, data1[, data2]]) MIDI events for a MusicDevice. "
+      "Frames are relative to sample_time, or to the next render cycle. "
+      "Returns the sample time the batch is relative to, or None if the "
+      "unit has not rendered yet." },
+    { "ClearMIDI", (PyCFunction)audio_unit_clearmidi, METH_VARARGS,
+      "ClearMIDI([notes_off]) -- discard all scheduled MIDI events and, "
+      "unless notes_off is false, send all notes off." },
+    { "MIDIEvent", (PyCFunction)audio_unit_midievent, METH_VARARGS,
+      "MIDIEvent(status[, data1[, data2[, offset]]]) -- send a MIDI event "
+      "to a MusicDevice now." },
+    { "GetMIDIStats", (PyCFunction)audio_unit_getmidistats, METH_VARARGS,
+      "GetMIDIStats() -- return a dict of MIDI scheduling statistics." },
+    { "SetParameter", (PyCFunction)audio_unit_setparameter, METH_VARARGS,
+      "SetParameter(id, scope, element, value[, offset]) -- set a parameter "
+      "now." },
+    { "GetParameter", (PyCFunction)audio_unit_getparameter, METH_VARARGS,
+      "GetParameter(id, scope, element) -- return a parameter's value." },
+    { "ScheduleParameters", (PyCFunction)audio_unit_scheduleparameters,
+      METH_VARARGS,
+      "ScheduleParameters(changes[, sample_time]) -- queue a batch of "
+      "(frame, id, scope, element, value[, ramp_frames]) parameter changes. "
+      "A change with ramp_frames ramps linearly to value. Frames are "
+      "relative to sample_time, or to the next render cycle. Returns the "
+      "sample time the batch is relative to, or None if the unit has not "
+      "rendered yet." },
+    { "ClearParameters", (PyCFunction)audio_unit_clearparameters,
+      METH_VARARGS,
+      "ClearParameters() -- discard scheduled parameter changes and stop "
+      "all ramps." },
+    { "GetParameterStats", (PyCFunction)audio_unit_getparameterstats,
+      METH_VARARGS,
+      "GetParameterStats() -- return a dict of parameter scheduling "
+      "statistics." },
+    { "Render", (PyCFunction)audio_unit_render, METH_VARARGS,
+      "Render(frames[, sample_time[, bus]]) -- pull one buffer from an "
+      "output bus and return (flags, buffer, ...)." },
+    { "EnableTracing", (PyCFunction)audio_unit_enabletracing, METH_VARARGS,
+      "EnableTracing([capacity]) -- record render callback events into a "
+      "ring of 'capacity' events, discarding those recorded before." },
+    { "DisableTracing", (PyCFunction)audio_unit_disabletracing, METH_VARARGS,
+      "DisableTracing() -- stop recording; the ring is kept for GetTrace." },
+    { "GetTrace", (PyCFunction)audio_unit_gettrace, METH_VARARGS,
+      "GetTrace([format]) -- return the recorded events as Chrome trace JSON "
+      "(format='chrome', a str) or Perfetto protobuf (format='perfetto', "
+      "bytes)." },
+    { NULL, NULL }
+};
+
+#if PY_VERSION_HEX < 0x02020000
+static PyObject* audio_unit_getattr(audio_unit_t* self, char* name)
+{
+    return Py_FindMethod(audio_unit_methods, (PyObject*)self, name);
+}
+#endif
+
+static PyTypeObject AudioUnitType = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    .tp_name = "coreaudio.AudioUnit",
+    .tp_basicsize = sizeof(audio_unit_t),
+    .tp_doc = PyDoc_STR("CoreFoundation AudioUnit"),
+    .tp_new = audio_unit_new,
+    .tp_dealloc = (destructor)audio_unit_dealloc,
+    .tp_getattro = PyObject_GenericGetAttr,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_methods = audio_unit_methods,
+};
+
+/*
+ * VirtualDriver
+ *
+ * Renders one or many AudioUnits back to back on a virtual clock, without a
+ * device and as fast as the render path allows. Each unit gets its own
+ * monotonically advancing AudioTimeStamp; timing jitter and clock drift can
+ * be injected into the host times. The PRNG is seeded, so runs are
+ * reproducible.
+ */
+
+typedef struct {
+    AudioUnit instance;
+    AudioStreamBasicDescription format;
+    AudioBufferList* buffers;
+    UInt32 buffer_frames;
+    Float64 sample_time;
+    UInt64 host_time;
+} virtual_unit_t;
+
+typedef struct {
+    PyObject_HEAD;
+    PyObject* units; /* a tuple of AudioUnit */
+    virtual_unit_t* state;
+    Py_ssize_t nunits;
+    UInt32* frames; /* buffer sizes, used in turn */
+    Py_ssize_t nframes;
+    Py_ssize_t frames_index;
+    double jitter; /* in seconds */
+    double drift_ppm;
+    UInt64 rng;
+    UInt64 start_ns;
+} virtual_driver_t;
+
+static PyTypeObject VirtualDriverType;
+
+/* xorshift64*, uniform in [-1, 1) */
+static double virtual_driver_random(virtual_driver_t* self)
+{
+    self->rng ^= self->rng >> 12;
+    self->rng ^= self->rng << 25;
+    self->rng ^= self->rng >> 27;
+
+    return (double)((self->rng * 0x2545F4914F6CDD1DULL) >> 11)
+        / (double)(1ULL << 52)
+        - 1.0;
+}
+
+static void virtual_driver_dealloc(virtual_driver_t* obj)
+{
+    Py_ssize_t i;
+
+    if (obj->state) {
+        for (i = 0; i < obj->nunits; ++i)
+            PyMem_Free(obj->state[i].buffers);
+        PyMem_Free(obj->state);
+    }
+    PyMem_Free(obj->frames);
+    Py_XDECREF(obj->units);
+
+    PyObject_Free(obj);
+}
+
+static PyObject* virtual_driver_new(PyTypeObject* type, PyObject* args,
+                                    PyObject* kwds)
+{
+    static char* kwlist[] = { "units", "frames", "jitter", "drift_ppm",
+                              "seed", NULL };
+    virtual_driver_t* self;
+    PyObject* units;
+    PyObject* frames = NULL;
+    double jitter = 0.0;
+    double drift_ppm = 0.0;
+    unsigned long long seed = 1;
+    UInt32 max_frames = 0;
+    Py_ssize_t i;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|OddK:VirtualDriver",
+                                     kwlist, &units, &frames, &jitter,
+                                     &drift_ppm, &seed))
+        return NULL;
+
+    if (jitter < 0.0) {
+        PyErr_SetString(PyExc_ValueError, "jitter must not be negative");
+        return NULL;
+    }
+
+    if (!(self = (virtual_driver_t*)PyObject_New(virtual_driver_t,
+                                                 &VirtualDriverType)))
+        return NULL;
+
+    self->state = NULL;
+    self->frames = NULL;
+    self->nframes = 0;
+    self->frames_index = 0;
+    self->jitter = jitter;
+    self->drift_ppm = drift_ppm;
+    self->rng = seed ? seed : 1;
+    self->start_ns = AudioConvertHostTimeToNanos(AudioGetCurrentHostTime());
+
+    if (PyObject_TypeCheck(units, &AudioUnitType))
+        self->units = PyTuple_Pack(1, units);
+    else
+        self->units = PySequence_Tuple(units);
+    if (!self->units)
+        goto error;
+
+    self->nunits = PyTuple_GET_SIZE(self->units);
+    if (!self->nunits) {
+        PyErr_SetString(PyExc_ValueError, "need at least one AudioUnit");
+        goto error;
+    }
+
+    // the buffer sizes: an int or a sequence of ints, used in turn
+    if (!frames || PyLong_Check(frames)) {
+        self->nframes = 1;
+        if (!(self->frames = PyMem_Malloc(sizeof(UInt32))))
+            goto nomem;
+        self->frames[0] = frames ? (UInt32)PyLong_AsUnsignedLong(frames) : 512;
+    } else {
+        PyObject* seq = PySequence_Fast(frames, "frames must be an int or a "
+                                                "sequence of ints");
+        if (!seq)
+            goto error;
+        self->nframes = PySequence_Fast_GET_SIZE(seq);
+        if (!(self->frames = PyMem_Malloc(
+                  (self->nframes ? self->nframes : 1) * sizeof(UInt32)))) {
+            Py_DECREF(seq);
+            goto nomem;
+        }
+        for (i = 0; i < self->nframes; ++i)
+            self->frames[i] = (UInt32)PyLong_AsUnsignedLong(
+                PySequence_Fast_GET_ITEM(seq, i));
+        Py_DECREF(seq);
+    }
+    if (PyErr_Occurred())
+        goto error;
+
+    for (i = 0; i < self->nframes; ++i) {
+        if (!self->frames[i]) {
+            PyErr_SetString(PyExc_ValueError, "buffer sizes must be positive");
+            goto error;
+        }
+        if (self->frames[i] > max_frames)
+            max_frames = self->frames[i];
+    }
+    if (!self->nframes) {
+        PyErr_SetString(PyExc_ValueError, "need at least one buffer size");
+        goto error;
+    }
+
+    if (!(self->state = PyMem_Calloc(self->nunits, sizeof(virtual_unit_t))))
+        goto nomem;
+
+    for (i = 0; i < self->nunits; ++i) {
+        PyObject* o = PyTuple_GET_ITEM(self->units, i);
+        virtual_unit_t* vu = &self->state[i];
+        UInt32 size = sizeof(AudioStreamBasicDescription);
+        OSStatus rc;
+
+        if (!PyObject_TypeCheck(o, &AudioUnitType)) {
+            PyErr_SetString(PyExc_TypeError, "units must be AudioUnits");
+            goto error;
+        }
+
+        vu->instance = ((audio_unit_t*)o)->instance;
+
+        // AudioUnitRender renders in the output scope format
+        rc = AudioUnitGetProperty(vu->instance, kAudioUnitProperty_StreamFormat,
+                                  kAudioUnitScope_Output, 0, &vu->format,
+                                  &size);
+        if (rc != noErr) {
+            PyErr_Format(CoreAudioError,
+                         "AudioUnitGetProperty(StreamFormat) failed: %4.4s",
+                         (char*)&rc);
+            goto error;
+        }
+        if (vu->format.mSampleRate <= 0.0) {
+            PyErr_SetString(CoreAudioError, "unit has no sample rate");
+            goto error;
+        }
+
+        vu->buffer_frames = max_frames;
+        if (!(vu->buffers = alloc_buffer_list(&vu->format, max_frames)))
+            goto nomem;
+    }
+
+    return (PyObject*)self;
+
+nomem:
+    PyErr_NoMemory();
+error:
+    virtual_driver_dealloc(self);
+    return NULL;
+}
+
+static PyObject* virtual_driver_run(virtual_driver_t* self, PyObject* args)
+{
+    Py_ssize_t periods, p, i;
+    UInt64 callbacks = 0, errors = 0;
+    UInt64 rendered_frames = 0;
+    double audio_seconds = 0.0;
+    double max_render = 0.0;
+    struct timespec wall0, wall1, cpu0, cpu1;
+    double wall, cpu;
+    UInt32 j;
+
+    if (!PyArg_ParseTuple(args, "n:Run", &periods))
+        return NULL;
+
+    clock_gettime(CLOCK_MONOTONIC, &wall0);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu0);
+
+    // The render callbacks take the GIL themselves
+    Py_BEGIN_ALLOW_THREADS;
+    for (p = 0; p < periods; ++p) {
+        UInt32 frames = self->frames[self->frames_index];
+
+        self->frames_index = (self->frames_index + 1) % self->nframes;
+
+        for (i = 0; i < self->nunits; ++i) {
+            virtual_unit_t* vu = &self->state[i];
+            AudioUnitRenderActionFlags flags = 0;
+            AudioTimeStamp ts;
+            double rate = vu->format.mSampleRate;
+            double ns;
+            struct timespec t0, t1;
+            double elapsed;
+            OSStatus rc;
+
+            for (j = 0; j < vu->buffers->mNumberBuffers; ++j)
+                vu->buffers->mBuffers[j].mDataByteSize
+                    = frames * vu->format.mBytesPerFrame;
+
+            // nominal host time of this period, skewed by the drift and
+            // perturbed by the jitter, but never going backwards
+            ns = vu->sample_time / rate * 1e9 / (1.0 + self->drift_ppm * 1e-6);
+            ns += self->jitter * 1e9 * virtual_driver_random(self);
+            if (ns < 0.0)
+                ns = 0.0;
+
+            memset(&ts, 0, sizeof(ts));
+            ts.mSampleTime = vu->sample_time;
+            ts.mHostTime
+                = AudioConvertNanosToHostTime(self->start_ns + (UInt64)ns);
+            if (ts.mHostTime <= vu->host_time)
+                ts.mHostTime = vu->host_time + 1;
+            ts.mRateScalar = 1.0 / (1.0 + self->drift_ppm * 1e-6);
+            ts.mFlags = kAudioTimeStampSampleTimeValid
+                | kAudioTimeStampHostTimeValid
+                | kAudioTimeStampRateScalarValid;
+
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            rc = AudioUnitRender(vu->instance, &flags, &ts, 0, frames,
+                                 vu->buffers);
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+
+            elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+            if (elapsed > max_render)
+                max_render = elapsed;
+
+            callbacks++;
+            if (rc != noErr)
+                errors++;
+
+            vu->host_time = ts.mHostTime;
+            vu->sample_time += frames;
+            rendered_frames += frames;
+            audio_seconds += frames / rate;
+        }
+    }
+    Py_END_ALLOW_THREADS;
+
+    clock_gettime(CLOCK_MONOTONIC, &wall1);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu1);
+
+    wall = (wall1.tv_sec - wall0.tv_sec) + (wall1.tv_nsec - wall0.tv_nsec) / 1e9;
+    cpu = (cpu1.tv_sec - cpu0.tv_sec) + (cpu1.tv_nsec - cpu0.tv_nsec) / 1e9;
+
+    return Py_BuildValue(
+        "{snsKsKsKsdsdsdsdsdsdsd}", "periods", periods, "callbacks", callbacks,
+        "errors", errors, "frames", rendered_frames, "audio_seconds",
+        audio_seconds, "wall_seconds", wall, "cpu_seconds", cpu,
+        "callbacks_per_second", wall > 0.0 ? callbacks / wall : 0.0,
+        "realtime_factor", wall > 0.0 ? audio_seconds / wall : 0.0,
+        // how many units like these one core could keep up with
+        "units_per_core",
+        cpu > 0.0 ? audio_seconds / cpu : 0.0, "max_render_us",
+        max_render * 1e6);
+}
+
+static PyObject* virtual_driver_getsampletime(virtual_driver_t* self,
+                                              PyObject* args)
+{
+    Py_ssize_t index = 0;
+
+    if (!PyArg_ParseTuple(args, "|n:GetSampleTime", &index))
+        return NULL;
+
+    if (index < 0 || index >= self->nunits) {
+        PyErr_SetString(PyExc_IndexError, "unit index out of range");
+        return NULL;
+    }
+
+    return PyFloat_FromDouble(self->state[index].sample_time);
+}
+
+static PyMethodDef virtual_driver_methods[] = {
+    { "Run", (PyCFunction)virtual_driver_run, METH_VARARGS,
+      "Run(periods) -- render 'periods' buffers on every unit and return a "
+      "dict of throughput statistics." },
+    { "GetSampleTime", (PyCFunction)virtual_driver_getsampletime,
+      METH_VARARGS,
+      "GetSampleTime([index]) -- the virtual sample time of a unit." },
+    { NULL, NULL }
+};
+
+static PyTypeObject VirtualDriverType = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    .tp_name = "coreaudio.VirtualDriver",
+    .tp_basicsize = sizeof(virtual_driver_t),
+    .tp_doc = PyDoc_STR(
+        "VirtualDriver(units, frames=512, jitter=0.0, drift_ppm=0.0, seed=1)"
+        "\n\n"
+        "Render AudioUnits faster than real time on a virtual clock. 'frames' "
+        "is a buffer size or a sequence of buffer sizes used in turn, "
+        "'jitter' the maximum host time deviation in seconds. On macOS, use "
+        "kAudioUnitSubType_GenericOutput units."),
+    .tp_new = virtual_driver_new,
+    .tp_dealloc = (destructor)virtual_driver_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_methods = virtual_driver_methods,
+};
+
+/*
+ * Connections
+ *
+ * Connect(src, src_bus, dst, dst_bus) installs a Connection as the render
+ * callback of an input bus of dst. When dst pulls the bus, the Connection
+ * renders src natively, on the render thread and without the GIL, so that
+ * a graph of AudioUnits is scheduled by pulling from its output unit.
+ *
+ * The output of a source bus is rendered into a buffer preallocated at the
+ * source's MaximumFramesPerSlice. It is shared by all Connections from that
+ * bus, so a unit that feeds several others renders only once per cycle (as
+ * long as the cycle has a valid sample time). All units of a graph are
+ * expected to render on one thread, like in an AUGraph.
+ *
+ * A Connection that is replaced or disconnected is retired like any other
+ * native source: it keeps its slot and its source unit until the render
+ * thread can no longer be inside it, or until the destination is disposed
+ * of.
+ */
+
+static OSStatus connection_render(PyObject* source,
+                                  AudioUnitRenderActionFlags* ioActionFlags,
+                                  const AudioTimeStamp* inTimeStamp,
+                                  UInt32 inBusNumber, UInt32 inNumberFrames,
+                                  AudioBufferList* ioData)
+{
+    connection_t* self = (connection_t*)source;
+    unit_output_t* output = unit_output_current(self->output);
+    AudioBufferList* abl = output->buffers;
+    UInt32 i;
+    int cached = (inTimeStamp->mFlags & kAudioTimeStampSampleTimeValid)
+        && output->valid && output->frames == inNumberFrames
+        && output->sample_time == inTimeStamp->mSampleTime;
+
+    if (inNumberFrames > output->max_frames)
+        return kAudioUnitErr_TooManyFramesToProcess;
+
+    if (!cached) {
+        for (i = 0; i < abl->mNumberBuffers; ++i)
+            abl->mBuffers[i].mDataByteSize
+                = inNumberFrames * output->format.mBytesPerFrame;
+
+        output->flags = 0;
+        output->status
+            = AudioUnitRender(self->src->instance, &output->flags, inTimeStamp,
+                              self->src_bus, inNumberFrames, abl);
+        output->sample_time = inTimeStamp->mSampleTime;
+        output->frames = inNumberFrames;
+        output->valid = (inTimeStamp->mFlags & kAudioTimeStampSampleTimeValid)
+            && output->status == noErr;
+    }
+
+    if (output->status != noErr)
+        return output->status;
+
+    for (i = 0; i < ioData->mNumberBuffers && i < abl->mNumberBuffers; ++i) {
+        if (!ioData->mBuffers[i].mData && !output->ncopies) {
+            ioData->mBuffers[i].mData = abl->mBuffers[i].mData;
+            ioData->mBuffers[i].mDataByteSize = abl->mBuffers[i].mDataByteSize;
+        } else if (!ioData->mBuffers[i].mData) {
+            // a copy, which the destination may overwrite
+            AudioBuffer* copy = &output->copies[self->slot]->mBuffers[i];
+
+            memcpy(copy->mData, abl->mBuffers[i].mData,
+                   abl->mBuffers[i].mDataByteSize);
+            ioData->mBuffers[i].mData = copy->mData;
+            ioData->mBuffers[i].mDataByteSize = abl->mBuffers[i].mDataByteSize;
+        } else {
+            memcpy(ioData->mBuffers[i].mData, abl->mBuffers[i].mData,
+                   ioData->mBuffers[i].mDataByteSize
+                           < abl->mBuffers[i].mDataByteSize
+                       ? ioData->mBuffers[i].mDataByteSize
+                       : abl->mBuffers[i].mDataByteSize);
+        }
+    }
+
+    *ioActionFlags |= output->flags & kAudioUnitRenderAction_OutputIsSilence;
+
+    return noErr;
+}
+
+/* Does 'unit' (transitively) pull from 'target'? */
+static int connection_reaches(audio_unit_t* unit, audio_unit_t* target)
+{
+    bus_table_t* table;
+    UInt32 i;
+
+    if (unit == target)
+        return 1;
+
+    if (!(table = atomic_load(&unit->buses)))
+        return 0;
+
+    for (i = 0; i < table->count; ++i) {
+        audio_unit_bus_t* b = atomic_load(&table->bus[i]);
+
+        if (b && b->callback
+            && PyObject_TypeCheck(b->callback, &ConnectionType)
+            && connection_reaches(((connection_t*)b->callback)->src, target))
+            return 1;
+    }
+
+    return 0;
+}
+
+static void connection_dealloc(connection_t* obj)
+{
+    obj->output->slots &= ~(1ULL << obj->slot);
+    Py_XDECREF(obj->src);
+
+    PyObject_Free(obj);
+}
+
+static PyObject* coreaudio_connect(PyObject* self, PyObject* args)
+{
+    OSErr rc;
+    audio_unit_t* src;
+    audio_unit_t* dst;
+    UInt32 src_bus, dst_bus;
+    unit_output_t* output;
+    unit_output_t* current;
+    audio_unit_bus_t* b;
+    connection_t* connection;
+    UInt32 slot = 0, last = 0;
+    UInt64 slots = 0;
+
+    if (!PyArg_ParseTuple(args, "O!IO!I:Connect", &AudioUnitType, &src,
+                          &src_bus, &AudioUnitType, &dst, &dst_bus))
+        return NULL;
+
+    if (connection_reaches(src, dst)) {
+        PyErr_SetString(CoreAudioError, "Connect would create a cycle");
+        return NULL;
+    }
+
+    // the first free slot; with more than one connection, each needs a
+    // copy up to the last slot taken
+    for (slot = 0; slot < src->noutputs; ++slot)
+        if (src->outputs[slot]->bus == src_bus) {
+            slots = src->outputs[slot]->slots;
+            break;
+        }
+    for (slot = 0; slot < MAX_OUTPUT_CONNECTIONS && (slots & (1ULL << slot));
+         ++slot)
+        ;
+    if (slot == MAX_OUTPUT_CONNECTIONS) {
+        PyErr_SetString(CoreAudioError, "too many connections from the bus");
+        return NULL;
+    }
+    slots |= 1ULL << slot;
+    while (last < MAX_OUTPUT_CONNECTIONS - 1 && slots >> (last + 1))
+        ++last;
+
+    if (!(output = audio_unit_get_output(
+              src, src_bus, slots & (slots - 1) ? last + 1 : 0)))
+        return NULL;
+    current = unit_output_current(output);
+
+    if (!(b = audio_unit_get_bus(dst, dst_bus)))
+        return NULL;
+
+    Py_BEGIN_ALLOW_THREADS;
+    rc = AudioUnitSetProperty(dst->instance, kAudioUnitProperty_StreamFormat,
+                              kAudioUnitScope_Input, dst_bus, &current->format,
+                              sizeof(AudioStreamBasicDescription));
+    Py_END_ALLOW_THREADS;
+
+    if (rc != noErr) {
+        PyErr_Format(CoreAudioError,
+                     "AudioUnitSetProperty(StreamFormat) failed: %4.4s",
+                     (char*)&rc);
+        return NULL;
+    }
+
+    b->format = current->format;
+    b->has_format = 1;
+
+    if (!(connection
+          = (connection_t*)PyObject_New(connection_t, &ConnectionType)))
+        return NULL;
+
+    connection->source.render = connection_render;
+    connection->source.check = NULL;
+    Py_INCREF(src);
+    connection->src = src;
+    connection->src_bus = src_bus;
+    connection->dst_bus = dst_bus;
+    connection->output = output;
+    connection->slot = slot;
+    connection->installed = 0;
+    output->slots |= 1ULL << slot;
+
+    if (audio_unit_set_bus_callback(dst, dst_bus, (PyObject*)connection,
+                                    Py_None)
+        < 0) {
+        Py_DECREF(connection);
+        return NULL;
+    }
+
+    connection->installed = 1;
+    src->connections++;
+
+    return (PyObject*)connection;
+}
+
+static PyObject* coreaudio_disconnect(PyObject* self, PyObject* args)
+{
+    audio_unit_t* dst;
+    UInt32 dst_bus;
+    audio_unit_bus_t* b;
+
+    if (!PyArg_ParseTuple(args, "O!I:Disconnect", &AudioUnitType, &dst,
+                          &dst_bus))
+        return NULL;
+
+    // leave render callbacks and other native sources alone
+    b = audio_unit_lookup_bus(dst, dst_bus);
+    if (!b || !b->callback
+        || !PyObject_TypeCheck(b->callback, &ConnectionType)) {
+        PyErr_SetString(CoreAudioError, "the bus is not connected");
+        return NULL;
+    }
+
+    if (audio_unit_set_bus_callback(dst, dst_bus, Py_None, Py_None) < 0)
+        return NULL;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyMemberDef connection_members[] = {
+    { "src", T_OBJECT, offsetof(connection_t, src), READONLY },
+    { "src_bus", T_UINT, offsetof(connection_t, src_bus), READONLY },
+    { "dst_bus", T_UINT, offsetof(connection_t, dst_bus), READONLY },
+    { NULL }
+};
+
+static PyTypeObject ConnectionType = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    .tp_name = "coreaudio.Connection",
+    .tp_basicsize = sizeof(connection_t),
+    .tp_doc = PyDoc_STR(
+        "A connection from an output bus of one AudioUnit to an input bus of "
+        "another, as returned by Connect()."),
+    .tp_dealloc = (destructor)connection_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_members = connection_members,
+};
+
+/* Create an AudioUnit object for a new instance of 'component' */
+static audio_unit_t* audio_unit_instantiate(AudioComponent component)
+{
+    AudioUnit au;
+    audio_unit_t* retval;
     OSErr rc;
 
-    if (!PyArg_ParseTuple(args, ":Stop"))
+    rc = AudioComponentInstanceNew(component, &au);
+    if (rc != noErr) {
+        PyErr_Format(CoreAudioError, "AudioComponentInstanceNew failed: %4.4s",
+                     (char*)&rc);
+        return NULL;
+    }
+
+    if (!(retval = (audio_unit_t*)PyObject_New(audio_unit_t, &AudioUnitType))) {
+        AudioComponentInstanceDispose(au);
+        return NULL;
+    }
+
+    audio_unit_init(retval, au);
+
+    return retval;
+}
+
+/*
+ * Recorder
+ *
+ * A Recorder taps the output of one bus of an AudioUnit with a render
+ * notification and writes it to a WAV file. The render thread only copies
+ * each cycle into a lock-free ring; a single writer thread, shared by all
+ * recorders, drains the rings in chunks of RECORDER_CHUNK bytes at page
+ * aligned file offsets. The lengths in the header are patched when the
+ * recording is closed (and with every fsync), and recordings that grow
+ * beyond 4 GB are turned into RF64 (EBU Tech 3306).
+ *
+ * If the ring is full, the cycle is dropped and counted.
+ */
+
+#define RECORDER_CHUNK 65536
+#define RECORDER_PERIOD_NS 20000000ULL
+
+/* The header: RIFF, a JUNK chunk that becomes ds64 for RF64, fmt, a JUNK
+   chunk that pads the data to the first page and the data chunk header */
+#define WAV_DS64_OFFSET 12
+#define WAV_FMT_OFFSET 48
+#define WAV_DATA_OFFSET 4096
+
+#define WAVE_FORMAT_PCM 1
+#define WAVE_FORMAT_IEEE_FLOAT 3
+#define WAVE_FORMAT_EXTENSIBLE 0xfffe
+
+typedef struct recording {
+    unit_tap_t tap;
+    struct recording* next; /* in the writer's lists */
+    int fd;
+    AudioStreamBasicDescription format;
+    UInt32 bus;
+    UInt32 bytes_per_frame;
+
+    /* the ring: size is a power of two and a multiple of RECORDER_CHUNK */
+    Byte* ring;
+    UInt32 size;
+    atomic_uint head; /* written by the render thread */
+    atomic_uint tail; /* written by the writer thread */
+
+    /* configuration */
+    UInt64 fsync_ns; /* 0: never */
+    UInt64 preallocate; /* in bytes, 0: never */
+
+    /* writer thread state */
+    UInt64 allocated;
+    UInt64 last_sync;
+    int closing; /* protected by writer_lock */
+    int closed; /* protected by writer_lock */
+    int error; /* an errno value */
+
+    /* statistics */
+    atomic_ullong frames;
+    atomic_ullong dropped;
+    atomic_ullong data_bytes;
+    atomic_ullong writes;
+    atomic_ullong syncs;
+} recording_t;
+
+typedef struct {
+    PyObject_HEAD;
+    audio_unit_t* unit;
+    PyObject* path;
+    recording_t* recording;
+} recorder_t;
+
+static PyTypeObject RecorderType;
+
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_wake;
+static pthread_cond_t writer_done;
+static recording_t* writer_incoming;
+static unsigned int writer_requests;
+static int writer_started;
+
+static void wav_put16(Byte* p, UInt16 v)
+{
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+}
+
+static void wav_put32(Byte* p, UInt32 v)
+{
+    wav_put16(p, v & 0xffff);
+    wav_put16(p + 2, v >> 16);
+}
+
+static void wav_put64(Byte* p, UInt64 v)
+{
+    wav_put32(p, (UInt32)v);
+    wav_put32(p + 4, (UInt32)(v >> 32));
+}
+
+static void wav_header(const recording_t* r, UInt64 data_bytes,
+                       Byte header[WAV_DATA_OFFSET])
+{
+    const AudioStreamBasicDescription* fmt = &r->format;
+    UInt64 riff_size = WAV_DATA_OFFSET - 8 + data_bytes;
+    int rf64 = riff_size > 0xffffffffULL;
+    UInt16 tag = fmt->mFormatFlags & kAudioFormatFlagIsFloat
+        ? WAVE_FORMAT_IEEE_FLOAT
+        : WAVE_FORMAT_PCM;
+    // readers expect WAVE_FORMAT_EXTENSIBLE for more than two channels or
+    // more than 16 bits per sample
+    int extensible = fmt->mChannelsPerFrame > 2 || fmt->mBitsPerChannel > 16;
+    UInt32 fmt_size = extensible ? 40 : 16;
+    UInt32 pad = WAV_FMT_OFFSET + 8 + fmt_size;
+
+    memset(header, 0, WAV_DATA_OFFSET);
+
+    memcpy(header, rf64 ? "RF64" : "RIFF", 4);
+    wav_put32(header + 4, rf64 ? 0xffffffff : (UInt32)riff_size);
+    memcpy(header + 8, "WAVE", 4);
+
+    memcpy(header + WAV_DS64_OFFSET, rf64 ? "ds64" : "JUNK", 4);
+    wav_put32(header + WAV_DS64_OFFSET + 4, 28);
+    if (rf64) {
+        wav_put64(header + WAV_DS64_OFFSET + 8, riff_size);
+        wav_put64(header + WAV_DS64_OFFSET + 16, data_bytes);
+        wav_put64(header + WAV_DS64_OFFSET + 24,
+                  data_bytes / r->bytes_per_frame);
+    }
+
+    memcpy(header + WAV_FMT_OFFSET, "fmt ", 4);
+    wav_put32(header + WAV_FMT_OFFSET + 4, fmt_size);
+    wav_put16(header + WAV_FMT_OFFSET + 8,
+              extensible ? WAVE_FORMAT_EXTENSIBLE : tag);
+    wav_put16(header + WAV_FMT_OFFSET + 10, (UInt16)fmt->mChannelsPerFrame);
+    wav_put32(header + WAV_FMT_OFFSET + 12, (UInt32)fmt->mSampleRate);
+    wav_put32(header + WAV_FMT_OFFSET + 16,
+              (UInt32)fmt->mSampleRate * r->bytes_per_frame);
+    wav_put16(header + WAV_FMT_OFFSET + 20, (UInt16)r->bytes_per_frame);
+    wav_put16(header + WAV_FMT_OFFSET + 22, (UInt16)fmt->mBitsPerChannel);
+
+    if (extensible) {
+        // cbSize, wValidBitsPerSample, no speaker positions and the
+        // SubFormat GUID of the format tag
+        static const Byte guid_tail[14] = { 0x00, 0x00, 0x00, 0x00, 0x10,
+                                            0x00, 0x80, 0x00, 0x00, 0xaa,
+                                            0x00, 0x38, 0x9b, 0x71 };
+
+        wav_put16(header + WAV_FMT_OFFSET + 24, 22);
+        wav_put16(header + WAV_FMT_OFFSET + 26, (UInt16)fmt->mBitsPerChannel);
+        wav_put32(header + WAV_FMT_OFFSET + 28, 0);
+        wav_put16(header + WAV_FMT_OFFSET + 32, tag);
+        memcpy(header + WAV_FMT_OFFSET + 34, guid_tail, sizeof(guid_tail));
+    }
+
+    memcpy(header + pad, "JUNK", 4);
+    wav_put32(header + pad + 4, WAV_DATA_OFFSET - 8 - pad - 8);
+
+    memcpy(header + WAV_DATA_OFFSET - 8, "data", 4);
+    wav_put32(header + WAV_DATA_OFFSET - 4,
+              rf64 ? 0xffffffff : (UInt32)data_bytes);
+}
+
+static int recording_write_header(recording_t* r)
+{
+    Byte header[WAV_DATA_OFFSET];
+
+    wav_header(r, atomic_load(&r->data_bytes), header);
+
+    return pwrite(r->fd, header, WAV_DATA_OFFSET, 0) == WAV_DATA_OFFSET ? 0
+                                                                        : -1;
+}
+
+static void recording_preallocate(recording_t* r, UInt64 end)
+{
+    UInt64 length;
+
+    if (!r->preallocate || end <= r->allocated)
+        return;
+
+    length = end - r->allocated;
+    length += r->preallocate - length % r->preallocate;
+
+    // keep the file size, so that readers never see unwritten data; if
+    // the file system cannot preallocate, we stop trying
+#if defined(__APPLE__)
+    {
+        fstore_t store = { F_ALLOCATEALL, F_PEOFPOSMODE, 0, (off_t)length, 0 };
+
+        if (fcntl(r->fd, F_PREALLOCATE, &store) < 0) {
+            r->preallocate = 0;
+            return;
+        }
+    }
+#elif defined(__linux__)
+    if (fallocate(r->fd, FALLOC_FL_KEEP_SIZE, (off_t)r->allocated,
+                  (off_t)length)
+        < 0) {
+        r->preallocate = 0;
+        return;
+    }
+#else
+    r->preallocate = 0;
+    return;
+#endif
+
+    r->allocated += length;
+}
+
+static int recording_sync(recording_t* r)
+{
+#ifdef __APPLE__
+    return fsync(r->fd);
+#else
+    return fdatasync(r->fd);
+#endif
+}
+
+/* Write what is in the ring: whole chunks, or everything if 'all' */
+static void recording_drain(recording_t* r, int all)
+{
+    unsigned int head = atomic_load_explicit(&r->head, memory_order_acquire);
+    unsigned int tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    UInt32 n = head - tail;
+    UInt64 offset = WAV_DATA_OFFSET + atomic_load(&r->data_bytes);
+
+    if (!all)
+        n &= ~(UInt32)(RECORDER_CHUNK - 1);
+
+    while (n && !r->error) {
+        UInt32 start = tail & (r->size - 1);
+        UInt32 length = n < r->size - start ? n : r->size - start;
+        ssize_t written;
+
+        recording_preallocate(r, offset + length);
+
+        written = pwrite(r->fd, r->ring + start, length, (off_t)offset);
+        if (written < 0) {
+            if (errno != EINTR)
+                r->error = errno;
+            continue;
+        }
+
+        tail += (UInt32)written;
+        n -= (UInt32)written;
+        offset += (UInt64)written;
+        atomic_fetch_add(&r->data_bytes, (UInt64)written);
+        atomic_fetch_add_explicit(&r->writes, 1, memory_order_relaxed);
+        atomic_store_explicit(&r->tail, tail, memory_order_release);
+    }
+
+    // after an error, the ring is discarded
+    if (r->error)
+        atomic_store_explicit(&r->tail, head, memory_order_release);
+
+    if (r->fsync_ns && !r->error && monotonic_ns() - r->last_sync >= r->fsync_ns) {
+        // patch the header, so that the file is readable after a crash
+        if (recording_write_header(r) < 0 || recording_sync(r) < 0)
+            r->error = errno;
+        r->last_sync = monotonic_ns();
+        atomic_fetch_add_explicit(&r->syncs, 1, memory_order_relaxed);
+    }
+}
+
+static void recording_finish(recording_t* r)
+{
+    recording_drain(r, 1);
+
+    if (!r->error && recording_write_header(r) < 0)
+        r->error = errno;
+
+    // release what was preallocated beyond the end
+    if (r->allocated > WAV_DATA_OFFSET
+        && ftruncate(r->fd, WAV_DATA_OFFSET + atomic_load(&r->data_bytes)) < 0
+        && !r->error)
+        r->error = errno;
+
+    if (r->fsync_ns && !r->error && recording_sync(r) < 0)
+        r->error = errno;
+
+    if (close(r->fd) < 0 && !r->error)
+        r->error = errno;
+    r->fd = -1;
+}
+
+static void* recorder_writer(void* arg)
+{
+    recording_t* active = NULL;
+    recording_t** link;
+    recording_t* r;
+    unsigned int seen = 0;
+
+    thread_register("recorder", 1);
+
+    pthread_mutex_lock(&writer_lock);
+
+    for (;;) {
+        while ((r = writer_incoming)) {
+            writer_incoming = r->next;
+            r->next = active;
+            active = r;
+        }
+        seen = writer_requests;
+
+        for (link = &active; (r = *link);) {
+            int closing = r->closing;
+
+            pthread_mutex_unlock(&writer_lock);
+
+            if (closing)
+                recording_finish(r);
+            else
+                recording_drain(r, 0);
+
+            pthread_mutex_lock(&writer_lock);
+
+            if (closing) {
+                *link = r->next;
+                r->closed = 1;
+                pthread_cond_broadcast(&writer_done);
+            } else
+                link = &r->next;
+        }
+
+        if (seen != writer_requests)
+            continue;
+
+        if (active)
+            deadline_timedwait(&writer_wake, &writer_lock,
+                               monotonic_ns() + RECORDER_PERIOD_NS);
+        else
+            pthread_cond_wait(&writer_wake, &writer_lock);
+    }
+
+    return NULL;
+}
+
+/* Hand a recording to the writer thread, starting it if necessary */
+static int recorder_writer_add(recording_t* r)
+{
+    pthread_condattr_t attr;
+    pthread_t thread;
+    int rc = 0;
+
+    pthread_mutex_lock(&writer_lock);
+
+    if (!writer_started) {
+        pthread_condattr_init(&attr);
+#ifndef __APPLE__
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+        pthread_cond_init(&writer_wake, &attr);
+        pthread_cond_init(&writer_done, NULL);
+        pthread_condattr_destroy(&attr);
+
+        if (!(rc = pthread_create(&thread, NULL, recorder_writer, NULL))) {
+            pthread_detach(thread);
+            writer_started = 1;
+        } else {
+            pthread_cond_destroy(&writer_wake);
+            pthread_cond_destroy(&writer_done);
+        }
+    }
+
+    if (writer_started) {
+        r->next = writer_incoming;
+        writer_incoming = r;
+        writer_requests++;
+        pthread_cond_signal(&writer_wake);
+    }
+
+    pthread_mutex_unlock(&writer_lock);
+
+    return rc;
+}
+
+static OSStatus recorder_notify(void* inRefCon,
+                                AudioUnitRenderActionFlags* ioActionFlags,
+                                const AudioTimeStamp* inTimeStamp,
+                                UInt32 inBusNumber, UInt32 inNumberFrames,
+                                AudioBufferList* ioData)
+{
+    recording_t* r = (recording_t*)inRefCon;
+    const AudioStreamBasicDescription* fmt = &r->format;
+    UInt32 bytes = inNumberFrames * r->bytes_per_frame;
+    unsigned int head, tail;
+    UInt32 mask = r->size - 1;
+    UInt32 i, c;
+
+    if (!(*ioActionFlags & kAudioUnitRenderAction_PostRender)
+        || (*ioActionFlags & kAudioUnitRenderAction_PostRenderError)
+        || inBusNumber != r->bus)
+        return noErr;
+
+    head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+    if (r->size - (head - tail) < bytes) {
+        atomic_fetch_add_explicit(&r->dropped, inNumberFrames,
+                                  memory_order_relaxed);
+        return noErr;
+    }
+
+    if (!(fmt->mFormatFlags & kAudioFormatFlagIsNonInterleaved)) {
+        UInt32 start = head & mask;
+        UInt32 first = bytes < r->size - start ? bytes : r->size - start;
+        const Byte* data = ioData->mBuffers[0].mData;
+
+        if (ioData->mBuffers[0].mDataByteSize < bytes) {
+            atomic_fetch_add_explicit(&r->dropped, inNumberFrames,
+                                      memory_order_relaxed);
+            return noErr;
+        }
+
+        memcpy(r->ring + start, data, first);
+        memcpy(r->ring, data + first, bytes - first);
+    } else {
+        // interleave; samples are 2 or 4 bytes and never wrap
+        UInt32 sample = fmt->mBitsPerChannel / 8;
+        UInt32 channels = fmt->mChannelsPerFrame;
+
+        if (ioData->mNumberBuffers < channels) {
+            atomic_fetch_add_explicit(&r->dropped, inNumberFrames,
+                                      memory_order_relaxed);
+            return noErr;
+        }
+
+        for (c = 0; c < channels; ++c) {
+            const Byte* data = ioData->mBuffers[c].mData;
+            UInt32 pos = head + c * sample;
+
+            if (ioData->mBuffers[c].mDataByteSize < inNumberFrames * sample)
+                continue;
+
+            for (i = 0; i < inNumberFrames; ++i) {
+                Byte* dst = r->ring + (pos & mask);
+
+                if (sample == 2)
+                    memcpy(dst, data + i * 2, 2);
+                else
+                    memcpy(dst, data + i * 4, 4);
+                pos += r->bytes_per_frame;
+            }
+        }
+    }
+
+    atomic_fetch_add_explicit(&r->frames, inNumberFrames, memory_order_relaxed);
+    atomic_store_explicit(&r->head, head + bytes, memory_order_release);
+
+    return noErr;
+}
+
+static void recording_free(recording_t* r)
+{
+    free(r->ring);
+    PyMem_Free(r);
+}
+
+static void recording_tap_free(unit_tap_t* tap)
+{
+    recording_free((recording_t*)tap);
+}
+
+static int recorder_format_supported(const AudioStreamBasicDescription* fmt)
+{
+    if (fmt->mFormatID != kAudioFormatLinearPCM || !fmt->mChannelsPerFrame
+        || fmt->mSampleRate <= 0.0
+        || (fmt->mFormatFlags & kAudioFormatFlagIsBigEndian))
+        return 0;
+
+    if (fmt->mFormatFlags & kAudioFormatFlagIsFloat)
+        return fmt->mBitsPerChannel == 32;
+
+    return (fmt->mFormatFlags & kAudioFormatFlagIsSignedInteger)
+        && (fmt->mBitsPerChannel == 16 || fmt->mBitsPerChannel == 32);
+}
+
+/* Stop the tap and wait until the writer has closed the file. Returns the
+   writer's errno value, or 0. */
+static int recorder_close(recorder_t* self)
+{
+    recording_t* r = self->recording;
+    int error;
+
+    if (!r)
+        return 0;
+
+    Py_BEGIN_ALLOW_THREADS;
+    AudioUnitRemoveRenderNotify(self->unit->instance, recorder_notify, r);
+
+    pthread_mutex_lock(&writer_lock);
+    r->closing = 1;
+    writer_requests++;
+    pthread_cond_signal(&writer_wake);
+    while (!r->closed)
+        pthread_cond_wait(&writer_done, &writer_lock);
+    pthread_mutex_unlock(&writer_lock);
+    Py_END_ALLOW_THREADS;
+
+    error = r->error;
+    self->recording = NULL;
+    audio_unit_retire_tap(self->unit, &r->tap);
+
+    return error;
+}
+
+static void recorder_dealloc(recorder_t* obj)
+{
+    recorder_close(obj);
+
+    Py_XDECREF(obj->unit);
+    Py_XDECREF(obj->path);
+
+    PyObject_Free(obj);
+}
+
+static PyObject* recorder_new(PyTypeObject* type, PyObject* args,
+                              PyObject* kwds)
+{
+    static char* kwlist[] = { "unit",   "path",           "bus",
+                              "ring_seconds", "fsync_interval",
+                              "preallocate",  NULL };
+    audio_unit_t* unit;
+    PyObject* path;
+    recorder_t* self;
+    recording_t* r;
+    AudioStreamBasicDescription format;
+    UInt32 size = sizeof(format);
+    unsigned int bus = 0;
+    double ring_seconds = 2.0;
+    double fsync_interval = 0.0;
+    double preallocate = 0.0;
+    double ring_bytes;
+    Byte header[WAV_DATA_OFFSET];
+    OSStatus rc;
+    int fd, err;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!O&|Iddd:Recorder", kwlist,
+                                     &AudioUnitType, &unit,
+                                     PyUnicode_FSConverter, &path, &bus,
+                                     &ring_seconds, &fsync_interval,
+                                     &preallocate))
+        return NULL;
+
+    if (ring_seconds <= 0.0 || fsync_interval < 0.0 || preallocate < 0.0) {
+        Py_DECREF(path);
+        PyErr_SetString(PyExc_ValueError,
+                        "ring_seconds must be positive, fsync_interval and "
+                        "preallocate must not be negative");
+        return NULL;
+    }
+
+    rc = AudioUnitGetProperty(unit->instance, kAudioUnitProperty_StreamFormat,
+                              kAudioUnitScope_Output, bus, &format, &size);
+    if (rc != noErr) {
+        Py_DECREF(path);
+        PyErr_Format(CoreAudioError,
+                     "AudioUnitGetProperty(StreamFormat) failed: %4.4s",
+                     (char*)&rc);
+        return NULL;
+    }
+
+    if (!recorder_format_supported(&format)) {
+        Py_DECREF(path);
+        PyErr_SetString(CoreAudioError,
+                        "can only record 16 or 32 bit integer or 32 bit float "
+                        "linear PCM");
+        return NULL;
+    }
+
+    if (!(r = PyMem_Calloc(1, sizeof(recording_t)))) {
+        Py_DECREF(path);
+        return PyErr_NoMemory();
+    }
+
+    r->tap.free = recording_tap_free;
+    r->fd = -1;
+    r->format = format;
+    r->bus = bus;
+    r->bytes_per_frame = format.mChannelsPerFrame * format.mBitsPerChannel / 8;
+    r->fsync_ns = (UInt64)(fsync_interval * 1e9);
+    r->preallocate = (UInt64)(preallocate * format.mSampleRate)
+        * r->bytes_per_frame;
+    r->preallocate += RECORDER_CHUNK - r->preallocate % RECORDER_CHUNK;
+    if (preallocate == 0.0)
+        r->preallocate = 0;
+    r->last_sync = monotonic_ns();
+
+    ring_bytes = ring_seconds * format.mSampleRate * r->bytes_per_frame;
+    for (r->size = 4 * RECORDER_CHUNK; r->size < ring_bytes
+         && r->size < 0x80000000u;
+         r->size <<= 1)
+        ;
+
+    if (posix_memalign((void**)&r->ring, 4096, r->size)) {
+        PyMem_Free(r);
+        Py_DECREF(path);
+        return PyErr_NoMemory();
+    }
+    memory_prefault_buffer(r->ring, r->size);
+
+    Py_BEGIN_ALLOW_THREADS;
+    fd = open(PyBytes_AS_STRING(path), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+              0644);
+    err = errno;
+    if (fd >= 0) {
+        r->fd = fd;
+        wav_header(r, 0, header);
+        if (pwrite(fd, header, WAV_DATA_OFFSET, 0) != WAV_DATA_OFFSET) {
+            err = errno;
+            close(fd);
+            fd = -1;
+        } else {
+            r->allocated = WAV_DATA_OFFSET;
+            recording_preallocate(r, WAV_DATA_OFFSET + 1);
+        }
+    }
+    Py_END_ALLOW_THREADS;
+
+    if (fd < 0) {
+        recording_free(r);
+        errno = err;
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path);
+        Py_DECREF(path);
+        return NULL;
+    }
+
+    if (!(self = (recorder_t*)PyObject_New(recorder_t, &RecorderType))) {
+        close(fd);
+        recording_free(r);
+        Py_DECREF(path);
+        return NULL;
+    }
+
+    Py_INCREF(unit);
+    self->unit = unit;
+    self->path = path;
+    self->recording = NULL;
+
+    if ((err = recorder_writer_add(r))) {
+        close(fd);
+        recording_free(r);
+        Py_DECREF(self);
+        errno = err;
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+
+    // the writer owns the recording from here; closing returns it
+    self->recording = r;
+    unit->taps++;
+
+    rc = AudioUnitAddRenderNotify(unit->instance, recorder_notify, r);
+    if (rc != noErr) {
+        recorder_close(self);
+        Py_DECREF(self);
+        PyErr_Format(CoreAudioError, "AudioUnitAddRenderNotify failed: %4.4s",
+                     (char*)&rc);
+        return NULL;
+    }
+
+    return (PyObject*)self;
+}
+
+static PyObject* recorder_closemethod(recorder_t* self, PyObject* args)
+{
+    int error;
+
+    if (!PyArg_ParseTuple(args, ":Close"))
+        return NULL;
+
+    if ((error = recorder_close(self))) {
+        errno = error;
+        return PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError,
+                                                    self->path);
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject* recorder_getstats(recorder_t* self, PyObject* args)
+{
+    recording_t* r = self->recording;
+
+    if (!PyArg_ParseTuple(args, ":GetStats"))
+        return NULL;
+
+    if (!r)
+        return Py_BuildValue("{sO}", "closed", Py_True);
+
+    return Py_BuildValue(
+        "{sOsKsKsKsIsKsKsi}", "closed", Py_False, "frames",
+        atomic_load(&r->frames), "dropped_frames", atomic_load(&r->dropped),
+        "bytes_written", atomic_load(&r->data_bytes), "pending_bytes",
+        (unsigned int)(atomic_load(&r->head) - atomic_load(&r->tail)),
+        "writes", atomic_load(&r->writes), "syncs", atomic_load(&r->syncs),
+        "error", r->error);
+}
+
+static PyMethodDef recorder_methods[] = {
+    { "Close", (PyCFunction)recorder_closemethod, METH_VARARGS,
+      "Close() -- stop recording, write what is buffered and the final "
+      "header and close the file." },
+    { "GetStats", (PyCFunction)recorder_getstats, METH_VARARGS,
+      "GetStats() -- return a dict of recording statistics." },
+    { NULL, NULL }
+};
+
+static PyTypeObject RecorderType = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    .tp_name = "coreaudio.Recorder",
+    .tp_basicsize = sizeof(recorder_t),
+    .tp_doc = PyDoc_STR(
+        "Recorder(unit, path, bus=0, ring_seconds=2.0, fsync_interval=0.0, "
+        "preallocate=0.0)\n\n"
+        "Records the output of 'bus' of 'unit' to a WAV (or RF64) file. "
+        "'ring_seconds' sizes the buffer between the render thread and the "
+        "disk writer; the file is synced every 'fsync_interval' seconds and "
+        "disk space is preallocated 'preallocate' seconds at a time (0 "
+        "disables both)."),
+    .tp_new = recorder_new,
+    .tp_dealloc = (destructor)recorder_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_methods = recorder_methods,
+};
+
+/*
+ * Clock correlation
+ *
+ * A Clock follows the timestamps of a unit's render cycles and fits its
+ * sample time against the host time, with the fit weighted exponentially
+ * over a window of a few seconds. The slope of the fit is the actual
+ * sample rate as seen by the host clock; until enough cycles have been
+ * seen, the rate scalar of the timestamps (or the nominal rate) stands in
+ * for it. The render thread publishes each estimate behind a sequence
+ * counter, so conversions never wait for it.
+ */
+
+/* A timestamp this far off the fit (in ns) restarts it */
+#define CLOCK_MAX_ERROR 5000000.0
+
+enum { CLOCK_NOMINAL, CLOCK_RATE_SCALAR, CLOCK_FIT };
+
+typedef struct {
+    Float64 sample_time; /* the reference point */
+    UInt64 host_ns;
+    Float64 offset; /* host ns at sample_time, relative to host_ns */
+    Float64 ns_per_sample;
+    Float64 rate_scalar;
+    Float64 jitter; /* RMS deviation from the fit, in ns */
+    UInt64 observations;
+    UInt64 resets;
+    int source;
+} clock_estimate_t;
+
+typedef struct {
+    unit_tap_t tap;
+    Float64 nominal_rate;
+    Float64 window; /* in samples */
+
+    /* render thread only: weighted sums relative to the last timestamp */
+    Float64 last_sample_time;
+    UInt64 last_host_ns;
+    Float64 sw, sx, sy, sxx, sxy, se2;
+    clock_estimate_t current;
+
+    atomic_uint seq; /* odd while the snapshot is written */
+    clock_estimate_t snapshot;
+} clock_model_t;
+
+typedef struct {
+    PyObject_HEAD;
+    audio_unit_t* unit;
+    clock_model_t* model;
+} audio_clock_t;
+
+static PyTypeObject ClockType;
+
+static void clock_model_reset(clock_model_t* c)
+{
+    c->sw = c->sx = c->sy = c->sxx = c->sxy = c->se2 = 0.0;
+    c->current.observations = 0;
+    c->current.offset = 0.0;
+    c->current.jitter = 0.0;
+}
+
+static void clock_model_publish(clock_model_t* c)
+{
+    unsigned int seq = atomic_load_explicit(&c->seq, memory_order_relaxed);
+
+    atomic_store_explicit(&c->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    c->snapshot = c->current;
+    atomic_store_explicit(&c->seq, seq + 2, memory_order_release);
+}
+
+static void clock_model_read(clock_model_t* c, clock_estimate_t* e)
+{
+    unsigned int seq;
+
+    do {
+        while ((seq = atomic_load_explicit(&c->seq, memory_order_acquire))
+               & 1)
+            ;
+        *e = c->snapshot;
+        atomic_thread_fence(memory_order_acquire);
+    } while (atomic_load_explicit(&c->seq, memory_order_relaxed) != seq);
+}
+
+static void clock_model_update(clock_model_t* c, const AudioTimeStamp* ts)
+{
+    clock_estimate_t* e = &c->current;
+    UInt64 host_ns = AudioConvertHostTimeToNanos(ts->mHostTime);
+    Float64 a, b, decay, var, predicted, err;
+
+    if ((ts->mFlags & kAudioTimeStampRateScalarValid)
+        && ts->mRateScalar > 0.0)
+        e->rate_scalar = ts->mRateScalar;
+
+    if (e->observations) {
+        // move the sums to the new timestamp and forget old ones
+        a = ts->mSampleTime - c->last_sample_time;
+        b = (Float64)(SInt64)(host_ns - c->last_host_ns);
+        predicted = e->offset + e->ns_per_sample * a;
+        err = b - predicted;
+
+        if (a <= 0.0 || b <= 0.0
+            || (e->observations > 1 && fabs(err) > CLOCK_MAX_ERROR)) {
+            e->resets++;
+            clock_model_reset(c);
+        } else {
+            c->sxx += -2.0 * a * c->sx + a * a * c->sw;
+            c->sxy += -a * c->sy - b * c->sx + a * b * c->sw;
+            c->sx -= a * c->sw;
+            c->sy -= b * c->sw;
+
+            decay = exp(-a / c->window);
+            c->sw *= decay;
+            c->sx *= decay;
+            c->sy *= decay;
+            c->sxx *= decay;
+            c->sxy *= decay;
+            if (e->observations > 1)
+                c->se2 = c->se2 * decay + (1.0 - decay) * err * err;
+        }
+    }
+
+    c->sw += 1.0;
+    c->last_sample_time = ts->mSampleTime;
+    c->last_host_ns = host_ns;
+    e->observations++;
+
+    e->sample_time = ts->mSampleTime;
+    e->host_ns = host_ns;
+    e->jitter = sqrt(c->se2);
+
+    var = c->sxx * c->sw - c->sx * c->sx;
+    if (e->observations >= 4 && var > 0.0) {
+        e->ns_per_sample = (c->sxy * c->sw - c->sx * c->sy) / var;
+        e->offset = (c->sy - e->ns_per_sample * c->sx) / c->sw;
+        e->source = CLOCK_FIT;
+    } else {
+        // the rate scalar is the ratio of actual to nominal host ticks per
+        // sample
+        e->ns_per_sample = 1e9 * e->rate_scalar / c->nominal_rate;
+        e->offset = 0.0;
+        e->source = e->rate_scalar != 1.0 ? CLOCK_RATE_SCALAR : CLOCK_NOMINAL;
+    }
+
+    clock_model_publish(c);
+}
+
+static OSStatus clock_notify(void* inRefCon,
+                             AudioUnitRenderActionFlags* ioActionFlags,
+                             const AudioTimeStamp* inTimeStamp,
+                             UInt32 inBusNumber, UInt32 inNumberFrames,
+                             AudioBufferList* ioData)
+{
+    const UInt32 valid = kAudioTimeStampSampleTimeValid
+        | kAudioTimeStampHostTimeValid;
+
+    if ((*ioActionFlags & kAudioUnitRenderAction_PreRender)
+        && inBusNumber == 0 && (inTimeStamp->mFlags & valid) == valid)
+        clock_model_update((clock_model_t*)inRefCon, inTimeStamp);
+
+    return noErr;
+}
+
+static Float64 clock_estimate_host_ns(const clock_estimate_t* e,
+                                      Float64 sample_time)
+{
+    return (Float64)e->host_ns + e->offset
+        + e->ns_per_sample * (sample_time - e->sample_time);
+}
+
+static Float64 clock_estimate_sample_time(const clock_estimate_t* e,
+                                          UInt64 host_ns)
+{
+    return e->sample_time
+        + ((Float64)(SInt64)(host_ns - e->host_ns) - e->offset)
+        / e->ns_per_sample;
+}
+
+static void clock_model_free(unit_tap_t* tap)
+{
+    PyMem_Free(tap);
+}
+
+static void clock_close(audio_clock_t* self)
+{
+    if (!self->model)
+        return;
+
+    Py_BEGIN_ALLOW_THREADS;
+    AudioUnitRemoveRenderNotify(self->unit->instance, clock_notify,
+                                self->model);
+    Py_END_ALLOW_THREADS;
+
+    audio_unit_retire_tap(self->unit, &self->model->tap);
+    self->model = NULL;
+}
+
+static void clock_dealloc(audio_clock_t* obj)
+{
+    clock_close(obj);
+    Py_XDECREF(obj->unit);
+
+    PyObject_Free(obj);
+}
+
+static PyObject* clock_new(PyTypeObject* type, PyObject* args, PyObject* kwds)
+{
+    static char* kwlist[] = { "unit", "window", "sample_rate", NULL };
+    audio_unit_t* unit;
+    audio_clock_t* self;
+    clock_model_t* c;
+    double window = 2.0;
+    double sample_rate = 0.0;
+    OSStatus rc;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!|dd:Clock", kwlist,
+                                     &AudioUnitType, &unit, &window,
+                                     &sample_rate))
+        return NULL;
+
+    if (window <= 0.0 || sample_rate < 0.0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "window must be positive and sample_rate must not "
+                        "be negative");
+        return NULL;
+    }
+
+    if (sample_rate == 0.0) {
+        AudioStreamBasicDescription format;
+        UInt32 size = sizeof(format);
+
+        rc = AudioUnitGetProperty(unit->instance,
+                                  kAudioUnitProperty_StreamFormat,
+                                  kAudioUnitScope_Output, 0, &format, &size);
+        if (rc != noErr) {
+            PyErr_Format(CoreAudioError,
+                         "AudioUnitGetProperty(StreamFormat) failed: %4.4s",
+                         (char*)&rc);
+            return NULL;
+        }
+        sample_rate = format.mSampleRate;
+    }
+
+    // also catches a NaN rate
+    if (!(sample_rate > 0.0)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "the unit has no sample rate; pass sample_rate");
+        return NULL;
+    }
+
+    if (!(c = PyMem_Calloc(1, sizeof(clock_model_t))))
+        return PyErr_NoMemory();
+
+    c->tap.free = clock_model_free;
+    c->nominal_rate = sample_rate;
+    c->window = window * sample_rate;
+    c->current.rate_scalar = 1.0;
+    c->current.ns_per_sample = 1e9 / sample_rate;
+    c->snapshot = c->current;
+
+    if (!(self = (audio_clock_t*)PyObject_New(audio_clock_t, &ClockType))) {
+        PyMem_Free(c);
+        return NULL;
+    }
+
+    Py_INCREF(unit);
+    self->unit = unit;
+    self->model = NULL;
+
+    rc = AudioUnitAddRenderNotify(unit->instance, clock_notify, c);
+    if (rc != noErr) {
+        PyMem_Free(c);
+        Py_DECREF(self);
+        PyErr_Format(CoreAudioError, "AudioUnitAddRenderNotify failed: %4.4s",
+                     (char*)&rc);
+        return NULL;
+    }
+    self->model = c;
+    unit->taps++;
+
+    return (PyObject*)self;
+}
+
+/* Read the current estimate; fails if the clock is closed or has not seen
+   a render cycle yet */
+static int clock_get_estimate(audio_clock_t* self, clock_estimate_t* e)
+{
+    if (!self->model) {
+        PyErr_SetString(CoreAudioError, "the clock is closed");
+        return -1;
+    }
+
+    clock_model_read(self->model, e);
+    if (!e->observations) {
+        PyErr_SetString(CoreAudioError, "the unit has not rendered yet");
+        return -1;
+    }
+
+    return 0;
+}
+
+static PyObject* clock_getestimate(audio_clock_t* self, PyObject* args)
+{
+    static const char* sources[] = { "nominal", "rate_scalar", "fit" };
+    clock_estimate_t e;
+    Float64 nominal, rate;
+
+    if (!PyArg_ParseTuple(args, ":GetEstimate"))
+        return NULL;
+
+    if (!self->model) {
+        PyErr_SetString(CoreAudioError, "the clock is closed");
+        return NULL;
+    }
+
+    clock_model_read(self->model, &e);
+    nominal = self->model->nominal_rate;
+    rate = 1e9 / e.ns_per_sample;
+
+    return Py_BuildValue(
+        "{sdsdsdsdsdsdsKsKsdsKss}", "rate", rate, "nominal_rate", nominal,
+        "drift_ppm", (rate / nominal - 1.0) * 1e6, "rate_scalar",
+        e.rate_scalar, "ns_per_sample", e.ns_per_sample, "jitter_ns",
+        e.jitter, "observations", (unsigned long long)e.observations,
+        "resets", (unsigned long long)e.resets, "sample_time", e.sample_time,
+        "host_time",
+        (unsigned long long)AudioConvertNanosToHostTime(
+            (UInt64)clock_estimate_host_ns(&e, e.sample_time)),
+        "source", sources[e.source]);
+}
+
+static PyObject* clock_sampletimetohosttime(audio_clock_t* self, PyObject* args)
+{
+    clock_estimate_t e;
+    double sample_time;
+    Float64 ns;
+
+    if (!PyArg_ParseTuple(args, "d:SampleTimeToHostTime", &sample_time))
+        return NULL;
+
+    if (clock_get_estimate(self, &e) < 0)
+        return NULL;
+
+    ns = clock_estimate_host_ns(&e, sample_time);
+
+    return PyLong_FromUnsignedLongLong(
+        AudioConvertNanosToHostTime(ns > 0.0 ? (UInt64)ns : 0));
+}
+
+static PyObject* clock_hosttimetosampletime(audio_clock_t* self, PyObject* args)
+{
+    clock_estimate_t e;
+    unsigned long long host_time;
+
+    if (!PyArg_ParseTuple(args, "K:HostTimeToSampleTime", &host_time))
+        return NULL;
+
+    if (clock_get_estimate(self, &e) < 0)
+        return NULL;
+
+    return PyFloat_FromDouble(clock_estimate_sample_time(
+        &e, AudioConvertHostTimeToNanos(host_time)));
+}
+
+static PyObject* clock_sampletimetonanos(audio_clock_t* self, PyObject* args)
+{
+    clock_estimate_t e;
+    double sample_time;
+    Float64 ns;
+
+    if (!PyArg_ParseTuple(args, "d:SampleTimeToNanos", &sample_time))
+        return NULL;
+
+    if (clock_get_estimate(self, &e) < 0)
+        return NULL;
+
+    ns = clock_estimate_host_ns(&e, sample_time);
+
+    return PyLong_FromUnsignedLongLong(ns > 0.0 ? (UInt64)ns : 0);
+}
+
+static PyObject* clock_nanostosampletime(audio_clock_t* self, PyObject* args)
+{
+    clock_estimate_t e;
+    unsigned long long ns;
+
+    if (!PyArg_ParseTuple(args, "K:NanosToSampleTime", &ns))
+        return NULL;
+
+    if (clock_get_estimate(self, &e) < 0)
+        return NULL;
+
+    return PyFloat_FromDouble(clock_estimate_sample_time(&e, ns));
+}
+
+static PyObject* clock_closemethod(audio_clock_t* self, PyObject* args)
+{
+    if (!PyArg_ParseTuple(args, ":Close"))
+        return NULL;
+
+    clock_close(self);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyMethodDef clock_methods[] = {
+    { "GetEstimate", (PyCFunction)clock_getestimate, METH_VARARGS,
+      "GetEstimate() -- return a dict with the estimated sample rate, the "
+      "drift from the nominal rate in ppm and the state of the fit." },
+    { "SampleTimeToHostTime", (PyCFunction)clock_sampletimetohosttime,
+      METH_VARARGS,
+      "SampleTimeToHostTime(sample_time) -- return the host time at which "
+      "sample_time is rendered." },
+    { "HostTimeToSampleTime", (PyCFunction)clock_hosttimetosampletime,
+      METH_VARARGS,
+      "HostTimeToSampleTime(host_time) -- return the sample time at "
+      "host_time." },
+    { "SampleTimeToNanos", (PyCFunction)clock_sampletimetonanos,
+      METH_VARARGS,
+      "SampleTimeToNanos(sample_time) -- like SampleTimeToHostTime, in "
+      "nanoseconds." },
+    { "NanosToSampleTime", (PyCFunction)clock_nanostosampletime,
+      METH_VARARGS,
+      "NanosToSampleTime(ns) -- like HostTimeToSampleTime, in "
+      "nanoseconds." },
+    { "Close", (PyCFunction)clock_closemethod, METH_VARARGS,
+      "Close() -- stop following the unit." },
+    { NULL, NULL }
+};
+
+static PyMemberDef clock_members[] = {
+    { "unit", T_OBJECT, offsetof(audio_clock_t, unit), READONLY },
+    { NULL }
+};
+
+static PyTypeObject ClockType = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    .tp_name = "coreaudio.Clock",
+    .tp_basicsize = sizeof(audio_clock_t),
+    .tp_doc = PyDoc_STR(
+        "Clock(unit, window=2.0, sample_rate=0.0)\n\n"
+        "Estimates the actual sample rate of 'unit' against the host clock "
+        "from the timestamps of its render cycles, averaged over about "
+        "'window' seconds, and converts between sample time and host time. "
+        "'sample_rate' is the nominal rate; by default that of the unit's "
+        "output."),
+    .tp_new = clock_new,
+    .tp_dealloc = (destructor)clock_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_members = clock_members,
+    .tp_methods = clock_methods,
+};
+
+/*
+ * Spectral analysis
+ *
+ * An Analyzer taps the output of one bus of an AudioUnit like a Recorder,
+ * but the render thread only mixes each cycle down to mono into a float
+ * ring. A single analysis thread, shared by all analyzers, takes a Hann
+ * windowed frame from every ring each 'hop' frames, runs a real FFT on it
+ * and computes the magnitude of each bin and the energy of each band. The
+ * results are published through a triple buffer, so neither the analysis
+ * thread nor a reader ever waits for the other.
+ *
+ * If the analysis thread falls behind by more than the ring, it skips to
+ * the latest frame and counts an overrun.
+ */
+
+#define ANALYZER_PERIOD_NS 10000000ULL
+#define ANALYZER_MIN_SIZE 64
+#define ANALYZER_MAX_SIZE 65536
+#define ANALYZER_MAX_BANDS 64
+
+/* Set in 'middle' when the analysis thread has published a spectrum the
+   reader has not taken yet */
+#define SPECTRUM_NEW 4
+
+/* A real FFT of n points, computed as a complex FFT of n / 2 points */
+typedef struct {
+    UInt32 n;
+    UInt32 m;
+    UInt32* bitrev;
+    Float32* tw_re; /* twiddles of the radix-2 stages, one after another */
+    Float32* tw_im;
+    Float32* post_re; /* e^(-2 pi i k / n), k <= m */
+    Float32* post_im;
+    Float32* window;
+    Float32* re;
+    Float32* im;
+} fft_t;
+
+static void fft_free(fft_t* f)
+{
+    free(f->bitrev);
+    free(f->tw_re);
+    free(f->tw_im);
+    free(f->post_re);
+    free(f->post_im);
+    free(f->window);
+    free(f->re);
+    free(f->im);
+}
+
+static Float32* fft_alloc(UInt32 n)
+{
+    void* p;
+
+    return posix_memalign(&p, 16, n * sizeof(Float32)) ? NULL : p;
+}
+
+/* Set up an FFT of n points; n is a power of two of at least 16 */
+static int fft_init(fft_t* f, UInt32 n)
+{
+    UInt32 m = n / 2, bits = 0, len, k, i;
+    Float32* twr;
+    Float32* twi;
+
+    memset(f, 0, sizeof(*f));
+    f->n = n;
+    f->m = m;
+
+    while ((1u << bits) < m)
+        ++bits;
+
+    if (!(f->bitrev = malloc(m * sizeof(UInt32)))
+        || !(f->tw_re = fft_alloc(m)) || !(f->tw_im = fft_alloc(m))
+        || !(f->post_re = fft_alloc(m + 1))
+        || !(f->post_im = fft_alloc(m + 1)) || !(f->window = fft_alloc(n))
+        || !(f->re = fft_alloc(m)) || !(f->im = fft_alloc(m))) {
+        fft_free(f);
+        memset(f, 0, sizeof(*f));
+        return -1;
+    }
+
+    for (i = 0; i < m; ++i) {
+        UInt32 r = 0, j;
+
+        for (j = 0; j < bits; ++j)
+            r |= ((i >> j) & 1) << (bits - 1 - j);
+        f->bitrev[i] = r;
+    }
+
+    // the first two stages need no twiddles and are done as one radix-4
+    // pass
+    twr = f->tw_re;
+    twi = f->tw_im;
+    for (len = 8; len <= m; len <<= 1)
+        for (k = 0; k < len / 2; ++k) {
+            *twr++ = (Float32)cos(2.0 * M_PI * k / len);
+            *twi++ = (Float32)-sin(2.0 * M_PI * k / len);
+        }
+
+    for (k = 0; k <= m; ++k) {
+        f->post_re[k] = (Float32)cos(2.0 * M_PI * k / n);
+        f->post_im[k] = (Float32)-sin(2.0 * M_PI * k / n);
+    }
+
+    // periodic Hann
+    for (i = 0; i < n; ++i)
+        f->window[i] = (Float32)(0.5 - 0.5 * cos(2.0 * M_PI * i / n));
+
+    return 0;
+}
+
+/* half radix-2 butterflies: a += w b, b = a - w b */
+static void fft_butterflies(Float32* ar, Float32* ai, Float32* br,
+                            Float32* bi, const Float32* wr, const Float32* wi,
+                            UInt32 half)
+{
+    UInt32 k = 0;
+
+#if defined(__SSE__)
+    for (; k + 4 <= half; k += 4) {
+        __m128 vwr = _mm_loadu_ps(wr + k), vwi = _mm_loadu_ps(wi + k);
+        __m128 vbr = _mm_loadu_ps(br + k), vbi = _mm_loadu_ps(bi + k);
+        __m128 var = _mm_loadu_ps(ar + k), vai = _mm_loadu_ps(ai + k);
+        __m128 tr = _mm_sub_ps(_mm_mul_ps(vwr, vbr), _mm_mul_ps(vwi, vbi));
+        __m128 ti = _mm_add_ps(_mm_mul_ps(vwr, vbi), _mm_mul_ps(vwi, vbr));
+
+        _mm_storeu_ps(br + k, _mm_sub_ps(var, tr));
+        _mm_storeu_ps(bi + k, _mm_sub_ps(vai, ti));
+        _mm_storeu_ps(ar + k, _mm_add_ps(var, tr));
+        _mm_storeu_ps(ai + k, _mm_add_ps(vai, ti));
+    }
+#elif defined(__ARM_NEON)
+    for (; k + 4 <= half; k += 4) {
+        float32x4_t vwr = vld1q_f32(wr + k), vwi = vld1q_f32(wi + k);
+        float32x4_t vbr = vld1q_f32(br + k), vbi = vld1q_f32(bi + k);
+        float32x4_t var = vld1q_f32(ar + k), vai = vld1q_f32(ai + k);
+        float32x4_t tr = vmlsq_f32(vmulq_f32(vwr, vbr), vwi, vbi);
+        float32x4_t ti = vmlaq_f32(vmulq_f32(vwr, vbi), vwi, vbr);
+
+        vst1q_f32(br + k, vsubq_f32(var, tr));
+        vst1q_f32(bi + k, vsubq_f32(vai, ti));
+        vst1q_f32(ar + k, vaddq_f32(var, tr));
+        vst1q_f32(ai + k, vaddq_f32(vai, ti));
+    }
+#endif
+
+    for (; k < half; ++k) {
+        Float32 tr = wr[k] * br[k] - wi[k] * bi[k];
+        Float32 ti = wr[k] * bi[k] + wi[k] * br[k];
+
+        br[k] = ar[k] - tr;
+        bi[k] = ai[k] - ti;
+        ar[k] += tr;
+        ai[k] += ti;
+    }
+}
+
+/* Window the n samples of 'frame' and store |X[k]|^2 for k <= n / 2 in
+   'power' */
+static void fft_power(fft_t* f, const Float32* frame, Float32* power)
+{
+    Float32* re = f->re;
+    Float32* im = f->im;
+    const Float32* twr = f->tw_re;
+    const Float32* twi = f->tw_im;
+    UInt32 m = f->m, len, i, k;
+
+    // even samples are the real, odd ones the imaginary parts
+    for (i = 0; i < m; ++i) {
+        re[f->bitrev[i]] = frame[2 * i] * f->window[2 * i];
+        im[f->bitrev[i]] = frame[2 * i + 1] * f->window[2 * i + 1];
+    }
+
+    for (i = 0; i < m; i += 4) {
+        Float32 y0r = re[i] + re[i + 1], y0i = im[i] + im[i + 1];
+        Float32 y1r = re[i] - re[i + 1], y1i = im[i] - im[i + 1];
+        Float32 y2r = re[i + 2] + re[i + 3], y2i = im[i + 2] + im[i + 3];
+        Float32 y3r = re[i + 2] - re[i + 3], y3i = im[i + 2] - im[i + 3];
+
+        re[i] = y0r + y2r;
+        im[i] = y0i + y2i;
+        re[i + 2] = y0r - y2r;
+        im[i + 2] = y0i - y2i;
+        // -i y3
+        re[i + 1] = y1r + y3i;
+        im[i + 1] = y1i - y3r;
+        re[i + 3] = y1r - y3i;
+        im[i + 3] = y1i + y3r;
+    }
+
+    for (len = 8; len <= m; len <<= 1) {
+        UInt32 half = len / 2;
+
+        for (i = 0; i < m; i += len)
+            fft_butterflies(re + i, im + i, re + i + half, im + i + half, twr,
+                            twi, half);
+        twr += half;
+        twi += half;
+    }
+
+    // untangle the spectra of the even and odd samples
+    for (k = 0; k <= m; ++k) {
+        UInt32 a = k == m ? 0 : k, b = k == 0 ? 0 : m - k;
+        Float32 evr = 0.5f * (re[a] + re[b]), evi = 0.5f * (im[a] - im[b]);
+        Float32 odr = 0.5f * (im[a] + im[b]), odi = -0.5f * (re[a] - re[b]);
+        Float32 xr = evr + f->post_re[k] * odr - f->post_im[k] * odi;
+        Float32 xi = evi + f->post_re[k] * odi + f->post_im[k] * odr;
+
+        power[k] = xr * xr + xi * xi;
+    }
+}
+
+typedef struct {
+    int written; /* holds a spectrum */
+    UInt64 count; /* spectra computed before this one */
+    Float64 sample_time; /* of the first frame */
+    Float32 rms;
+    Float32* bins;
+    Float32* bands;
+} spectrum_t;
+
+typedef struct analysis {
+    unit_tap_t tap;
+    struct analysis* next; /* in the analysis thread's lists */
+    AudioStreamBasicDescription format;
+    UInt32 bus;
+
+    /* the ring of mono frames; size is a power of two */
+    Float32* ring;
+    UInt32 size;
+    UInt32 max_frames; /* the most the render thread writes past head */
+    atomic_ullong head; /* written by the render thread */
+    Float64 start_time; /* the sample time of frame 0 */
+
+    /* configuration */
+    UInt32 hop;
+    UInt32 nbands;
+    UInt32* band_bins; /* nbands + 1 bin indices */
+
+    /* analysis thread state */
+    fft_t fft;
+    UInt64 position; /* of the next frame to analyze */
+    Float32* frame;
+    Float32* power;
+    Float32 scale; /* from |X[k]| to the amplitude of a sine */
+    Float32 power_scale; /* from |X[k]|^2 to the mean square */
+    UInt32 back;
+    int closing; /* protected by analysis_lock */
+    int closed; /* protected by analysis_lock */
+
+    /* the triple buffer */
+    spectrum_t spectra[3];
+    atomic_uint middle;
+    UInt32 front; /* the reader's, with the GIL held */
+
+    /* statistics */
+    atomic_ullong analyses;
+    atomic_ullong overruns;
+} analysis_t;
+
+typedef struct {
+    PyObject_HEAD;
+    audio_unit_t* unit;
+    analysis_t* analysis;
+} analyzer_t;
+
+static PyTypeObject AnalyzerType;
+
+static pthread_mutex_t analysis_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t analysis_wake;
+static pthread_cond_t analysis_done;
+static analysis_t* analysis_incoming;
+static unsigned int analysis_requests;
+static int analysis_started;
+
+static void analysis_spectrum(analysis_t* a, UInt64 position)
+{
+    spectrum_t* s = &a->spectra[a->back];
+    fft_t* f = &a->fft;
+    UInt32 mask = a->size - 1, i, b;
+    UInt64 head;
+    Float32 sum = 0.0f;
+
+    for (i = 0; i < f->n; ++i) {
+        Float32 x = a->ring[(position + i) & mask];
+
+        a->frame[i] = x;
+        sum += x * x;
+    }
+
+    // the render thread may have overwritten the frame while it was read,
+    // and may be writing up to max_frames past head
+    head = atomic_load_explicit(&a->head, memory_order_acquire);
+    if (head - position > a->size - a->max_frames) {
+        atomic_fetch_add_explicit(&a->overruns, 1, memory_order_relaxed);
+        return;
+    }
+
+    fft_power(f, a->frame, a->power);
+
+    for (i = 0; i <= f->m; ++i)
+        s->bins[i] = sqrtf(a->power[i]) * a->scale;
+    s->bins[0] *= 0.5f;
+    s->bins[f->m] *= 0.5f;
+
+    // the mean square in each band; by Parseval's theorem, the bands
+    // covering all bins add up to that of the windowed frame
+    a->power[0] *= 0.5f;
+    a->power[f->m] *= 0.5f;
+    for (b = 0; b < a->nbands; ++b) {
+        Float32 energy = 0.0f;
+
+        for (i = a->band_bins[b]; i < a->band_bins[b + 1]; ++i)
+            energy += a->power[i];
+        s->bands[b] = energy * a->power_scale;
+    }
+
+    s->written = 1;
+    s->count = atomic_load_explicit(&a->analyses, memory_order_relaxed);
+    s->sample_time = a->start_time + position;
+    s->rms = sqrtf(sum / f->n);
+
+    a->back = atomic_exchange_explicit(&a->middle, a->back | SPECTRUM_NEW,
+                                       memory_order_acq_rel)
+        & 3;
+    atomic_fetch_add_explicit(&a->analyses, 1, memory_order_relaxed);
+}
+
+static void analysis_run(analysis_t* a)
+{
+    UInt64 head = atomic_load_explicit(&a->head, memory_order_acquire);
+    UInt32 n = a->fft.n;
+
+    if (head < a->position + n)
+        return;
+
+    // skip what has been overwritten, keeping to the hop
+    if (head - a->position > a->size - a->max_frames) {
+        UInt64 skip = (head - n - a->position) / a->hop * a->hop;
+
+        a->position += skip;
+        atomic_fetch_add_explicit(&a->overruns, skip / a->hop,
+                                  memory_order_relaxed);
+    }
+
+    for (; a->position + n <= head; a->position += a->hop)
+        analysis_spectrum(a, a->position);
+}
+
+static void* analyzer_thread(void* arg)
+{
+    analysis_t* active = NULL;
+    analysis_t** link;
+    analysis_t* a;
+    unsigned int seen = 0;
+
+    thread_register("analyzer", 1);
+
+    pthread_mutex_lock(&analysis_lock);
+
+    for (;;) {
+        while ((a = analysis_incoming)) {
+            analysis_incoming = a->next;
+            a->next = active;
+            active = a;
+        }
+        seen = analysis_requests;
+
+        for (link = &active; (a = *link);) {
+            int closing = a->closing;
+
+            if (!closing) {
+                pthread_mutex_unlock(&analysis_lock);
+                analysis_run(a);
+                pthread_mutex_lock(&analysis_lock);
+                link = &a->next;
+            } else {
+                *link = a->next;
+                a->closed = 1;
+                pthread_cond_broadcast(&analysis_done);
+            }
+        }
+
+        if (seen != analysis_requests)
+            continue;
+
+        if (active)
+            deadline_timedwait(&analysis_wake, &analysis_lock,
+                               monotonic_ns() + ANALYZER_PERIOD_NS);
+        else
+            pthread_cond_wait(&analysis_wake, &analysis_lock);
+    }
+
+    return NULL;
+}
+
+/* Hand an analysis to the analysis thread, starting it if necessary */
+static int analyzer_thread_add(analysis_t* a)
+{
+    pthread_condattr_t attr;
+    pthread_t thread;
+    int rc = 0;
+
+    pthread_mutex_lock(&analysis_lock);
+
+    if (!analysis_started) {
+        pthread_condattr_init(&attr);
+#ifndef __APPLE__
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+        pthread_cond_init(&analysis_wake, &attr);
+        pthread_cond_init(&analysis_done, NULL);
+        pthread_condattr_destroy(&attr);
+
+        if (!(rc = pthread_create(&thread, NULL, analyzer_thread, NULL))) {
+            pthread_detach(thread);
+            analysis_started = 1;
+        } else {
+            pthread_cond_destroy(&analysis_wake);
+            pthread_cond_destroy(&analysis_done);
+        }
+    }
+
+    if (analysis_started) {
+        a->next = analysis_incoming;
+        analysis_incoming = a;
+        analysis_requests++;
+        pthread_cond_signal(&analysis_wake);
+    }
+
+    pthread_mutex_unlock(&analysis_lock);
+
+    return rc;
+}
+
+static Float32 analyzer_sample(const AudioStreamBasicDescription* fmt,
+                               const void* data, UInt32 index)
+{
+    if (fmt->mFormatFlags & kAudioFormatFlagIsFloat)
+        return ((const Float32*)data)[index];
+    if (fmt->mBitsPerChannel == 16)
+        return ((const SInt16*)data)[index] / 32768.0f;
+
+    return ((const SInt32*)data)[index] / 2147483648.0f;
+}
+
+static OSStatus analyzer_notify(void* inRefCon,
+                                AudioUnitRenderActionFlags* ioActionFlags,
+                                const AudioTimeStamp* inTimeStamp,
+                                UInt32 inBusNumber, UInt32 inNumberFrames,
+                                AudioBufferList* ioData)
+{
+    analysis_t* a = (analysis_t*)inRefCon;
+    const AudioStreamBasicDescription* fmt = &a->format;
+    UInt32 channels = fmt->mChannelsPerFrame;
+    UInt32 sample = fmt->mBitsPerChannel / 8;
+    Float32 scale = 1.0f / channels;
+    UInt32 mask = a->size - 1;
+    UInt64 head;
+    UInt32 i, c;
+
+    if (!(*ioActionFlags & kAudioUnitRenderAction_PostRender)
+        || (*ioActionFlags & kAudioUnitRenderAction_PostRenderError)
+        || inBusNumber != a->bus)
+        return noErr;
+
+    // MaximumFramesPerSlice was raised after the analyzer was created; the
+    // ring has no headroom for this
+    if (inNumberFrames > a->max_frames) {
+        atomic_fetch_add_explicit(&a->overruns, 1, memory_order_relaxed);
+        return noErr;
+    }
+
+    if (fmt->mFormatFlags & kAudioFormatFlagIsNonInterleaved) {
+        if (ioData->mNumberBuffers < channels)
+            return noErr;
+        for (c = 0; c < channels; ++c)
+            if (ioData->mBuffers[c].mDataByteSize < inNumberFrames * sample)
+                return noErr;
+    } else if (ioData->mBuffers[0].mDataByteSize
+               < inNumberFrames * channels * sample)
+        return noErr;
+
+    head = atomic_load_explicit(&a->head, memory_order_relaxed);
+    if (!head && (inTimeStamp->mFlags & kAudioTimeStampSampleTimeValid))
+        a->start_time = inTimeStamp->mSampleTime;
+
+    for (c = 0; c < channels; ++c) {
+        const void* data;
+        UInt32 stride;
+
+        if (fmt->mFormatFlags & kAudioFormatFlagIsNonInterleaved) {
+            data = ioData->mBuffers[c].mData;
+            stride = 1;
+        } else {
+            data = (const Byte*)ioData->mBuffers[0].mData + c * sample;
+            stride = channels;
+        }
+
+        if (c == 0)
+            for (i = 0; i < inNumberFrames; ++i)
+                a->ring[(head + i) & mask]
+                    = analyzer_sample(fmt, data, i * stride) * scale;
+        else
+            for (i = 0; i < inNumberFrames; ++i)
+                a->ring[(head + i) & mask]
+                    += analyzer_sample(fmt, data, i * stride) * scale;
+    }
+
+    atomic_store_explicit(&a->head, head + inNumberFrames,
+                          memory_order_release);
+
+    return noErr;
+}
+
+static void analysis_free(analysis_t* a)
+{
+    int i;
+
+    fft_free(&a->fft);
+    for (i = 0; i < 3; ++i)
+        PyMem_Free(a->spectra[i].bins);
+    PyMem_Free(a->band_bins);
+    free(a->ring);
+    free(a->frame);
+    free(a->power);
+    PyMem_Free(a);
+}
+
+static void analysis_tap_free(unit_tap_t* tap)
+{
+    analysis_free((analysis_t*)tap);
+}
+
+/* Stop the tap and wait until the analysis thread has let go */
+static void analyzer_close(analyzer_t* self)
+{
+    analysis_t* a = self->analysis;
+
+    if (!a)
+        return;
+
+    Py_BEGIN_ALLOW_THREADS;
+    AudioUnitRemoveRenderNotify(self->unit->instance, analyzer_notify, a);
+
+    pthread_mutex_lock(&analysis_lock);
+    a->closing = 1;
+    analysis_requests++;
+    pthread_cond_signal(&analysis_wake);
+    while (!a->closed)
+        pthread_cond_wait(&analysis_done, &analysis_lock);
+    pthread_mutex_unlock(&analysis_lock);
+    Py_END_ALLOW_THREADS;
+
+    self->analysis = NULL;
+    audio_unit_retire_tap(self->unit, &a->tap);
+}
+
+static void analyzer_dealloc(analyzer_t* obj)
+{
+    analyzer_close(obj);
+    Py_XDECREF(obj->unit);
+
+    PyObject_Free(obj);
+}
+
+/* Octave bands from 44 Hz, the last one up to the Nyquist frequency */
+static UInt32 analyzer_default_bands(Float64 rate, Float64* edges)
+{
+    UInt32 n = 0;
+    Float64 f;
+
+    for (f = 1000.0 / 16 / M_SQRT2; f < rate / 2 && n < ANALYZER_MAX_BANDS;
+         f *= 2.0)
+        edges[n++] = f;
+    edges[n] = rate / 2;
+
+    return n;
+}
+
+static PyObject* analyzer_new(PyTypeObject* type, PyObject* args,
+                              PyObject* kwds)
+{
+    static char* kwlist[] = { "unit", "bus", "size", "hop", "bands", NULL };
+    audio_unit_t* unit;
+    PyObject* bands = Py_None;
+    analyzer_t* self;
+    analysis_t* a;
+    AudioStreamBasicDescription format;
+    UInt32 size_bytes = sizeof(format);
+    unsigned int bus = 0, size = 1024, hop = 0;
+    UInt32 max_frames;
+    Float64 edges[ANALYZER_MAX_BANDS + 1];
+    UInt32 nbands, ring, i;
+    Float32 window_sum = 0.0f, window_power = 0.0f;
+    OSStatus rc;
+    int err;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!|IIIO:Analyzer", kwlist,
+                                     &AudioUnitType, &unit, &bus, &size, &hop,
+                                     &bands))
+        return NULL;
+
+    if (size < ANALYZER_MIN_SIZE || size > ANALYZER_MAX_SIZE
+        || (size & (size - 1))) {
+        PyErr_SetString(PyExc_ValueError,
+                        "size must be a power of two between 64 and 65536");
+        return NULL;
+    }
+
+    if (!hop)
+        hop = size / 2;
+    if (hop > size) {
+        PyErr_SetString(PyExc_ValueError, "hop must not exceed size");
+        return NULL;
+    }
+
+    rc = AudioUnitGetProperty(unit->instance, kAudioUnitProperty_StreamFormat,
+                              kAudioUnitScope_Output, bus, &format,
+                              &size_bytes);
+    if (rc != noErr) {
+        PyErr_Format(CoreAudioError,
+                     "AudioUnitGetProperty(StreamFormat) failed: %4.4s",
+                     (char*)&rc);
+        return NULL;
+    }
+
+    if (!recorder_format_supported(&format)) {
+        PyErr_SetString(CoreAudioError,
+                        "can only analyze 16 or 32 bit integer or 32 bit "
+                        "float linear PCM");
+        return NULL;
+    }
+
+    size_bytes = sizeof(max_frames);
+    rc = AudioUnitGetProperty(unit->instance,
+                              kAudioUnitProperty_MaximumFramesPerSlice,
+                              kAudioUnitScope_Global, 0, &max_frames,
+                              &size_bytes);
+    if (rc != noErr) {
+        PyErr_Format(CoreAudioError,
+                     "AudioUnitGetProperty(MaximumFramesPerSlice) failed: "
+                     "%4.4s",
+                     (char*)&rc);
+        return NULL;
+    }
+
+    if (bands == Py_None)
+        nbands = analyzer_default_bands(format.mSampleRate, edges);
+    else {
+        PyObject* seq = PySequence_Fast(bands, "bands must be a sequence");
+        Py_ssize_t n;
+
+        if (!seq)
+            return NULL;
+
+        n = PySequence_Fast_GET_SIZE(seq);
+        if (n < 2 || n > ANALYZER_MAX_BANDS + 1) {
+            Py_DECREF(seq);
+            PyErr_SetString(PyExc_ValueError,
+                            "bands must have between 2 and 65 edges");
+            return NULL;
+        }
+
+        for (i = 0; i < n; ++i) {
+            edges[i] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(seq, i));
+            if (edges[i] == -1.0 && PyErr_Occurred()) {
+                Py_DECREF(seq);
+                return NULL;
+            }
+            if (edges[i] < 0.0 || (i && edges[i] <= edges[i - 1])) {
+                Py_DECREF(seq);
+                PyErr_SetString(PyExc_ValueError,
+                                "band edges must be ascending frequencies");
+                return NULL;
+            }
+        }
+        Py_DECREF(seq);
+        nbands = (UInt32)n - 1;
+    }
+
+    if (!(a = PyMem_Calloc(1, sizeof(analysis_t))))
+        return PyErr_NoMemory();
+
+    a->tap.free = analysis_tap_free;
+    a->format = format;
+    a->bus = bus;
+    a->hop = hop;
+    a->max_frames = max_frames;
+    a->nbands = nbands;
+    a->start_time = 0.0;
+    a->front = 0;
+    a->back = 2;
+    atomic_init(&a->middle, 1);
+
+    // room for the frame being analyzed, a cycle being written and 100 ms
+    // more
+    ring = 2 * size + max_frames + (UInt32)(format.mSampleRate / 10);
+    for (a->size = size; a->size < ring; a->size <<= 1)
+        ;
+
+    if (fft_init(&a->fft, size) < 0 || !(a->ring = fft_alloc(a->size))
+        || !(a->frame = fft_alloc(size)) || !(a->power = fft_alloc(size / 2 + 1))
+        || !(a->band_bins = PyMem_Malloc((nbands + 1) * sizeof(UInt32)))) {
+        analysis_free(a);
+        return PyErr_NoMemory();
+    }
+    memory_prefault_buffer(a->ring, a->size * sizeof(Float32));
+
+    for (i = 0; i < 3; ++i) {
+        spectrum_t* s = &a->spectra[i];
+
+        if (!(s->bins = PyMem_Calloc(size / 2 + 1 + nbands, sizeof(Float32)))) {
+            analysis_free(a);
+            return PyErr_NoMemory();
+        }
+        s->bands = s->bins + size / 2 + 1;
+    }
+
+    // a band holds the bins from its lower edge up to its upper edge; the
+    // last one includes the Nyquist bin if it reaches it
+    for (i = 0; i <= nbands; ++i) {
+        Float64 bin = ceil(edges[i] * size / format.mSampleRate);
+
+        a->band_bins[i] = bin > size / 2 ? size / 2 + 1 : (UInt32)bin;
+    }
+    if (edges[nbands] * 2 >= format.mSampleRate)
+        a->band_bins[nbands] = size / 2 + 1;
+
+    for (i = 0; i < size; ++i) {
+        window_sum += a->fft.window[i];
+        window_power += a->fft.window[i] * a->fft.window[i];
+    }
+    a->scale = 2.0f / window_sum;
+    a->power_scale = 2.0f / (size * window_power);
+
+    if (!(self = (analyzer_t*)PyObject_New(analyzer_t, &AnalyzerType))) {
+        analysis_free(a);
+        return NULL;
+    }
+
+    Py_INCREF(unit);
+    self->unit = unit;
+    self->analysis = NULL;
+
+    if ((err = analyzer_thread_add(a))) {
+        analysis_free(a);
+        Py_DECREF(self);
+        errno = err;
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+
+    // the analysis thread shares it from here; closing returns it
+    self->analysis = a;
+    unit->taps++;
+
+    rc = AudioUnitAddRenderNotify(unit->instance, analyzer_notify, a);
+    if (rc != noErr) {
+        analyzer_close(self);
+        Py_DECREF(self);
+        PyErr_Format(CoreAudioError, "AudioUnitAddRenderNotify failed: %4.4s",
+                     (char*)&rc);
+        return NULL;
+    }
+
+    return (PyObject*)self;
+}
+
+static PyObject* analyzer_getspectrum(analyzer_t* self, PyObject* args)
+{
+    analysis_t* a = self->analysis;
+    spectrum_t* s;
+    PyObject* bands;
+    UInt32 i;
+
+    if (!PyArg_ParseTuple(args, ":GetSpectrum"))
+        return NULL;
+
+    if (!a) {
+        PyErr_SetString(CoreAudioError, "the analyzer is closed");
+        return NULL;
+    }
+
+    if (atomic_load_explicit(&a->middle, memory_order_relaxed)
+        & SPECTRUM_NEW)
+        a->front = atomic_exchange_explicit(&a->middle, a->front,
+                                            memory_order_acq_rel)
+            & 3;
+    s = &a->spectra[a->front];
+
+    // until the first spectrum is swapped in, the front buffer is empty
+    if (!s->written) {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+
+    if (!(bands = PyTuple_New(a->nbands)))
+        return NULL;
+    for (i = 0; i < a->nbands; ++i) {
+        PyObject* energy = PyFloat_FromDouble(s->bands[i]);
+
+        if (!energy) {
+            Py_DECREF(bands);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(bands, i, energy);
+    }
+
+    return Py_BuildValue("{sKsdsdsdsy#sN}", "count",
+                         (unsigned long long)s->count, "sample_time",
+                         s->sample_time, "rms", (double)s->rms, "bin_width",
+                         a->format.mSampleRate / a->fft.n, "bins",
+                         (const char*)s->bins,
+                         (Py_ssize_t)((a->fft.m + 1) * sizeof(Float32)),
+                         "bands", bands);
+}
+
+static PyObject* analyzer_getstats(analyzer_t* self, PyObject* args)
+{
+    analysis_t* a = self->analysis;
+
+    if (!PyArg_ParseTuple(args, ":GetStats"))
         return NULL;
 
-    rc = AudioOutputUnitStop(self->instance);
-    if (rc != noErr) {
-        PyErr_Format(CoreAudioError, "Stop failed: %4.4s", (char*)&rc);
+    if (!a)
+        return Py_BuildValue("{sO}", "closed", Py_True);
+
+    return Py_BuildValue("{sOsKsKsK}", "closed", Py_False, "frames",
+                         atomic_load(&a->head), "analyses",
+                         atomic_load(&a->analyses), "overruns",
+                         atomic_load(&a->overruns));
+}
+
+static PyObject* analyzer_closemethod(analyzer_t* self, PyObject* args)
+{
+    if (!PyArg_ParseTuple(args, ":Close"))
         return NULL;
-    }
+
+    analyzer_close(self);
 
     Py_INCREF(Py_None);
     return Py_None;
 }
 
-static PyObject* audio_unit_render(audio_unit_t* self, PyObject* args)
+static PyMethodDef analyzer_methods[] = {
+    { "GetSpectrum", (PyCFunction)analyzer_getspectrum, METH_VARARGS,
+      "GetSpectrum() -- return a dict with the latest spectrum, or None. "
+      "'bins' holds the amplitude of each bin as 32 bit floats, 'bands' the "
+      "mean square in each band." },
+    { "GetStats", (PyCFunction)analyzer_getstats, METH_VARARGS,
+      "GetStats() -- return a dict of analysis statistics." },
+    { "Close", (PyCFunction)analyzer_closemethod, METH_VARARGS,
+      "Close() -- stop the analysis." },
+    { NULL, NULL }
+};
+
+static PyMemberDef analyzer_members[] = {
+    { "unit", T_OBJECT, offsetof(analyzer_t, unit), READONLY },
+    { NULL }
+};
+
+static PyTypeObject AnalyzerType = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    .tp_name = "coreaudio.Analyzer",
+    .tp_basicsize = sizeof(analyzer_t),
+    .tp_doc = PyDoc_STR(
+        "Analyzer(unit, bus=0, size=1024, hop=size/2, bands=None)\n\n"
+        "Computes the spectrum of the output of 'bus' of 'unit' over 'size' "
+        "frames every 'hop' frames, off the render thread. 'bands' is a "
+        "sequence of ascending band edges in Hz; by default octave bands."),
+    .tp_new = analyzer_new,
+    .tp_dealloc = (destructor)analyzer_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_members = analyzer_members,
+    .tp_methods = analyzer_methods,
+};
+
+/*
+ * Component registry
+ *
+ * AudioComponents(desc) enumerates the matching components once and
+ * caches the result per description.
+ */
+
+static PyObject* component_cache; /* (type, subtype, ...) -> tuple */
+
+static PyObject* coreaudio_components(PyObject* self, PyObject* args)
 {
-    OSErr rc = noErr;
-    // AudioUnitRenderActionFlags flags = 0;
+    component_desc_t* description = NULL;
+    AudioComponentDescription desc;
+    int refresh = 0;
+    AudioComponent c = NULL;
+    PyObject* key;
+    PyObject* list;
+    PyObject* retval;
+
+    if (!PyArg_ParseTuple(args, "|O!p:AudioComponents",
+                          &AudioComponentDescriptionType, &description,
+                          &refresh))
+        return NULL;
+
+    if (description)
+        desc = description->desc;
+    else
+        memset(&desc, 0, sizeof(desc));
+
+    if (!component_cache && !(component_cache = PyDict_New()))
+        return NULL;
+
+    if (!(key = Py_BuildValue("(IIIII)", desc.componentType,
+                              desc.componentSubType,
+                              desc.componentManufacturer, desc.componentFlags,
+                              desc.componentFlagsMask)))
+        return NULL;
+
+    if (!refresh && (retval = PyDict_GetItemWithError(component_cache, key))) {
+        Py_DECREF(key);
+        Py_INCREF(retval);
+        return retval;
+    }
+
+    if (PyErr_Occurred() || !(list = PyList_New(0))) {
+        Py_DECREF(key);
+        return NULL;
+    }
+
+    while ((c = AudioComponentFindNext(c, &desc))) {
+        component_t* component;
+        int rc;
+
+        if (!(component = (component_t*)PyObject_New(component_t,
+                                                      &AudioComponentType)))
+            goto error;
+        component->component = c;
+
+        rc = PyList_Append(list, (PyObject*)component);
+        Py_DECREF(component);
+        if (rc < 0)
+            goto error;
+    }
+
+    if (!(retval = PyList_AsTuple(list))
+        || PyDict_SetItem(component_cache, key, retval) < 0) {
+        Py_XDECREF(retval);
+        goto error;
+    }
+
+    Py_DECREF(list);
+    Py_DECREF(key);
+
+    return retval;
+
+error:
+    Py_DECREF(list);
+    Py_DECREF(key);
+    return NULL;
+}
+
+/*
+ * AudioUnit pools
+ *
+ * An AudioUnitPool keeps initialized AudioUnits of one description ready,
+ * so a session can check one out without paying for instantiation and
+ * initialization. Released units are reset before they are reused: they
+ * are stopped, their render callbacks, the Connections that feed them,
+ * scheduled MIDI events and parameter changes are removed, tracing and the
+ * deadline are turned off and AudioUnitReset clears their state. Stream
+ * formats and other properties are kept.
+ *
+ * A unit with a Recorder, Clock or Analyzer attached can't be released:
+ * it would keep tapping the next session's audio for the previous owner.
+ * Nor can a unit that a Connection still pulls from: the next session
+ * would render it while the previous one does.
+ */
 
-    if (!PyArg_ParseTuple(args, ":Render")) {
+typedef struct {
+    PyObject_HEAD;
+    AudioComponent component;
+    audio_stream_basic_desc_t* format; /* or NULL */
+    PyObject* units; /* a list of ready units */
+    PyObject* checked_out; /* the set of units handed out */
+    Py_ssize_t size;
+    UInt64 created;
+    UInt64 reused;
+    UInt64 discarded;
+} audio_unit_pool_t;
+
+static PyTypeObject AudioUnitPoolType;
+
+/* Return a unit to its freshly initialized state, or -1 */
+static int audio_unit_reset(audio_unit_t* self)
+{
+    bus_table_t* table = atomic_load(&self->buses);
+    deadline_t* deadline = atomic_load(&self->deadline);
+    OSStatus rc;
+    UInt32 i;
+
+    // not all units can be stopped
+    Py_BEGIN_ALLOW_THREADS;
+    AudioOutputUnitStop(self->instance);
+    Py_END_ALLOW_THREADS;
+
+    for (i = 0; table && i < table->count; ++i) {
+        audio_unit_bus_t* b = atomic_load(&table->bus[i]);
+
+        if (b && b->callback && b->callback != Py_None
+            && audio_unit_set_bus_callback(self, i, Py_None, Py_None) < 0)
+            return -1;
+    }
+
+    atomic_store_explicit(&self->trace, NULL, memory_order_release);
+
+    if (self->midi)
+        timed_queue_clear(&self->midi->timed);
+
+    if (self->params)
+        param_queue_clear(self->params);
+
+    if (deadline) {
+        pthread_mutex_lock(&deadline->lock);
+        deadline->fraction = 0.0;
+        pthread_mutex_unlock(&deadline->lock);
+    }
+
+    rc = AudioUnitReset(self->instance, kAudioUnitScope_Global, 0);
+    if (rc != noErr) {
+        PyErr_Format(CoreAudioError, "AudioUnitReset failed: %4.4s",
+                     (char*)&rc);
+        return -1;
+    }
+
+    return 0;
+}
+
+static audio_unit_t* audio_unit_pool_create(audio_unit_pool_t* self)
+{
+    OSStatus rc;
+    audio_unit_t* unit;
+
+    if (!(unit = audio_unit_instantiate(self->component)))
         return NULL;
+
+    if (self->format) {
+        rc = AudioUnitSetProperty(unit->instance,
+                                  kAudioUnitProperty_StreamFormat,
+                                  kAudioUnitScope_Input, 0,
+                                  &self->format->bdesc,
+                                  sizeof(AudioStreamBasicDescription));
+        if (rc != noErr) {
+            Py_DECREF(unit);
+            PyErr_Format(CoreAudioError,
+                         "AudioUnitSetProperty(StreamFormat) failed: %4.4s",
+                         (char*)&rc);
+            return NULL;
+        }
     }
 
-    // rc = AudioUnitRender(self->instance);
+    rc = AudioUnitInitialize(unit->instance);
     if (rc != noErr) {
-        PyErr_Format(CoreAudioError, "Render failed: %4.4s", (char*)&rc);
+        Py_DECREF(unit);
+        PyErr_Format(CoreAudioError, "AudioUnitInitialize failed: %4.4s",
+                     (char*)&rc);
+        return NULL;
+    }
+
+    self->created++;
+
+    return unit;
+}
+
+static int audio_unit_pool_fill(audio_unit_pool_t* self)
+{
+    audio_unit_t* unit;
+    int rc;
+
+    while (PyList_GET_SIZE(self->units) < self->size) {
+        if (!(unit = audio_unit_pool_create(self)))
+            return -1;
+        rc = PyList_Append(self->units, (PyObject*)unit);
+        Py_DECREF(unit);
+        if (rc < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static void audio_unit_pool_dealloc(audio_unit_pool_t* obj)
+{
+    Py_XDECREF(obj->units);
+    Py_XDECREF(obj->checked_out);
+    Py_XDECREF(obj->format);
+
+    PyObject_Free(obj);
+}
+
+static PyObject* audio_unit_pool_new(PyTypeObject* type, PyObject* args,
+                                     PyObject* kwds)
+{
+    static char* kwlist[] = { "description", "size", "format", NULL };
+    audio_unit_pool_t* self;
+    component_desc_t* description;
+    audio_stream_basic_desc_t* format = NULL;
+    Py_ssize_t size = 4;
+    AudioComponent component;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!|nO!:AudioUnitPool",
+                                     kwlist, &AudioComponentDescriptionType,
+                                     &description, &size,
+                                     &AudioStreamBasicDescType, &format))
+        return NULL;
+
+    if (size < 0) {
+        PyErr_SetString(PyExc_ValueError, "size must not be negative");
+        return NULL;
+    }
+
+    if (!(component = AudioComponentFindNext(NULL, &description->desc))) {
+        PyErr_SetString(CoreAudioError, "no matching AudioComponent");
+        return NULL;
+    }
+
+    if (!(self = (audio_unit_pool_t*)PyObject_New(audio_unit_pool_t,
+                                                  &AudioUnitPoolType)))
+        return NULL;
+
+    self->component = component;
+    Py_XINCREF(format);
+    self->format = format;
+    self->size = size;
+    self->created = 0;
+    self->reused = 0;
+    self->discarded = 0;
+    self->checked_out = NULL;
+
+    if (!(self->units = PyList_New(0)) || !(self->checked_out = PySet_New(NULL))
+        || audio_unit_pool_fill(self) < 0) {
+        Py_DECREF(self);
+        return NULL;
+    }
+
+    return (PyObject*)self;
+}
+
+static PyObject* audio_unit_pool_checkout(audio_unit_pool_t* self,
+                                          PyObject* args)
+{
+    Py_ssize_t n = PyList_GET_SIZE(self->units);
+    PyObject* unit;
+
+    if (!PyArg_ParseTuple(args, ":Checkout"))
+        return NULL;
+
+    if (n) {
+        unit = PyList_GET_ITEM(self->units, n - 1);
+        Py_INCREF(unit);
+        if (PyList_SetSlice(self->units, n - 1, n, NULL) < 0) {
+            Py_DECREF(unit);
+            return NULL;
+        }
+        self->reused++;
+    } else if (!(unit = (PyObject*)audio_unit_pool_create(self))) {
+        return NULL;
+    }
+
+    if (PySet_Add(self->checked_out, unit) < 0) {
+        Py_DECREF(unit);
+        return NULL;
+    }
+
+    return unit;
+}
+
+static PyObject* audio_unit_pool_release(audio_unit_pool_t* self,
+                                         PyObject* args)
+{
+    audio_unit_t* unit;
+    int found;
+
+    if (!PyArg_ParseTuple(args, "O!:Release", &AudioUnitType, &unit))
+        return NULL;
+
+    if (unit->taps) {
+        PyErr_SetString(CoreAudioError,
+                        "close the unit's Recorders, Clocks and Analyzers "
+                        "before releasing it");
+        return NULL;
+    }
+
+    if (unit->connections) {
+        PyErr_SetString(CoreAudioError,
+                        "disconnect the Connections that pull from the unit "
+                        "before releasing it");
+        return NULL;
+    }
+
+    // only units of this pool, and each only once
+    if ((found = PySet_Discard(self->checked_out, (PyObject*)unit)) < 0)
+        return NULL;
+    if (!found) {
+        PyErr_SetString(CoreAudioError,
+                        "the unit is not checked out from this pool");
+        return NULL;
+    }
+
+    // A unit that cannot be reset or is not needed is disposed of
+    if (PyList_GET_SIZE(self->units) >= self->size
+        || audio_unit_reset(unit) < 0) {
+        PyErr_Clear();
+        self->discarded++;
+    } else if (PyList_Append(self->units, (PyObject*)unit) < 0) {
         return NULL;
     }
 
@@ -584,37 +9773,70 @@ static PyObject* audio_unit_render(audio_unit_t* self, PyObject* args)
     return Py_None;
 }
 
-/* AudioUnit Object Bureaucracy */
+static PyObject* audio_unit_pool_fillmethod(audio_unit_pool_t* self,
+                                            PyObject* args)
+{
+    if (!PyArg_ParseTuple(args, ":Fill"))
+        return NULL;
 
-static PyMethodDef audio_unit_methods[] = {
-    { "Initialize", (PyCFunction)audio_unit_initialize, METH_VARARGS },
-    { "Start", (PyCFunction)audio_unit_start, METH_VARARGS },
-    { "Stop", (PyCFunction)audio_unit_stop, METH_VARARGS },
-    { "SetStreamFormat", (PyCFunction)audio_unit_setstreamformat,
-      METH_VARARGS },
-    { "SetRenderCallback", (PyCFunction)audio_unit_setrendercallback,
-      METH_VARARGS },
-    { "Render", (PyCFunction)audio_unit_render, METH_VARARGS },
-    { NULL, NULL }
-};
+    if (audio_unit_pool_fill(self) < 0)
+        return NULL;
 
-#if PY_VERSION_HEX < 0x02020000
-static PyObject* audio_unit_getattr(audio_unit_t* self, char* name)
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject* audio_unit_pool_getstats(audio_unit_pool_t* self,
+                                          PyObject* args)
 {
-    return Py_FindMethod(audio_unit_methods, (PyObject*)self, name);
+    if (!PyArg_ParseTuple(args, ":GetStats"))
+        return NULL;
+
+    return Py_BuildValue("{snsnsnsKsKsK}", "size", self->size, "available",
+                         PyList_GET_SIZE(self->units), "checked_out",
+                         PySet_GET_SIZE(self->checked_out), "created", self->created,
+                         "reused", self->reused, "discarded",
+                         self->discarded);
 }
-#endif
 
-static PyTypeObject AudioUnitType = {
+static Py_ssize_t audio_unit_pool_length(audio_unit_pool_t* self)
+{
+    return PyList_GET_SIZE(self->units);
+}
+
+static PyMethodDef audio_unit_pool_methods[] = {
+    { "Checkout", (PyCFunction)audio_unit_pool_checkout, METH_VARARGS,
+      "Checkout() -- return an initialized AudioUnit; a new one is created "
+      "if none is ready." },
+    { "Release", (PyCFunction)audio_unit_pool_release, METH_VARARGS,
+      "Release(unit) -- reset a unit checked out from this pool and keep it "
+      "for the next Checkout, or dispose of it if the pool is full." },
+    { "Fill", (PyCFunction)audio_unit_pool_fillmethod, METH_VARARGS,
+      "Fill() -- create units until 'size' are ready." },
+    { "GetStats", (PyCFunction)audio_unit_pool_getstats, METH_VARARGS,
+      "GetStats() -- return a dict of pool statistics." },
+    { NULL, NULL }
+};
+
+static PySequenceMethods audio_unit_pool_as_sequence = {
+    .sq_length = (lenfunc)audio_unit_pool_length,
+};
+
+static PyTypeObject AudioUnitPoolType = {
     PyVarObject_HEAD_INIT(&PyType_Type, 0)
-    .tp_name = "coreaudio.AudioUnit",
-    .tp_basicsize = sizeof(audio_unit_t),
-    .tp_doc = PyDoc_STR("CoreFoundation AudioUnit"),
-    .tp_new = audio_unit_new,
-    .tp_dealloc = (destructor)audio_unit_dealloc,
-    .tp_getattro = PyObject_GenericGetAttr,
+    .tp_name = "coreaudio.AudioUnitPool",
+    .tp_basicsize = sizeof(audio_unit_pool_t),
+    .tp_doc = PyDoc_STR(
+        "AudioUnitPool(description, size=4, format=None)\n\n"
+        "Keeps 'size' initialized AudioUnits of the first component that "
+        "matches 'description' ready for Checkout. 'format' is set on input "
+        "bus 0 before a unit is initialized. len() is the number of units "
+        "ready."),
+    .tp_new = audio_unit_pool_new,
+    .tp_dealloc = (destructor)audio_unit_pool_dealloc,
     .tp_flags = Py_TPFLAGS_DEFAULT,
-    .tp_methods = audio_unit_methods,
+    .tp_methods = audio_unit_pool_methods,
+    .tp_as_sequence = &audio_unit_pool_as_sequence,
 };
 
 static PyObject* coreaudio_findnextcomponent(PyObject* self, PyObject* args)
@@ -628,10 +9850,6 @@ static PyObject* coreaudio_findnextcomponent(PyObject* self, PyObject* args)
                           &AudioComponentDescriptionType, &componentDescription))
         return NULL;
 
-    if (!PyArg_ParseTuple(args, "OO:AudioComponentFindNext", &component,
-                          &componentDescription))
-        return NULL;
-
     if ((PyObject*)component == Py_None)
         c = AudioComponentFindNext(NULL, &componentDescription->desc);
     else
@@ -654,35 +9872,110 @@ static PyObject* coreaudio_findnextcomponent(PyObject* self, PyObject* args)
 static PyObject* coreaudio_instancenew(PyObject* self, PyObject* args)
 {
     component_t* component;
-    AudioUnit au;
-    audio_unit_t* retval;
-    OSErr rc;
 
     if (!PyArg_ParseTuple(args, "O!:AudioComponentInstanceNew", &AudioComponentType,
                           &component))
         return NULL;
 
-    rc = AudioComponentInstanceNew(component->component, &au);
-    if (rc != noErr) {
-        PyErr_Format(CoreAudioError, "AudioComponentInstanceNew failed: %4.4s",
-                     (char*)&rc);
+    return (PyObject*)audio_unit_instantiate(component->component);
+}
+
+static PyObject* coreaudio_converthosttimetonanos(PyObject* self,
+                                                  PyObject* args)
+{
+    unsigned long long host_time;
+
+    if (!PyArg_ParseTuple(args, "K:AudioConvertHostTimeToNanos", &host_time))
         return NULL;
-    }
 
-    if (!(retval = (audio_unit_t*)PyObject_New(audio_unit_t, &AudioUnitType)))
+    return PyLong_FromUnsignedLongLong(AudioConvertHostTimeToNanos(host_time));
+}
+
+static PyObject* coreaudio_convertnanostohosttime(PyObject* self,
+                                                  PyObject* args)
+{
+    unsigned long long ns;
+
+    if (!PyArg_ParseTuple(args, "K:AudioConvertNanosToHostTime", &ns))
         return NULL;
 
-    retval->instance = au;
-    retval->render_callback = NULL;
-    retval->user_data = NULL;
+    return PyLong_FromUnsignedLongLong(AudioConvertNanosToHostTime(ns));
+}
 
-    return (PyObject*)retval;
+static PyObject* coreaudio_getcurrenthosttime(PyObject* self, PyObject* args)
+{
+    if (!PyArg_ParseTuple(args, ":AudioGetCurrentHostTime"))
+        return NULL;
+
+    return PyLong_FromUnsignedLongLong(AudioGetCurrentHostTime());
+}
+
+static PyObject* coreaudio_gethostclockfrequency(PyObject* self,
+                                                 PyObject* args)
+{
+    if (!PyArg_ParseTuple(args, ":AudioGetHostClockFrequency"))
+        return NULL;
+
+    return PyFloat_FromDouble(AudioGetHostClockFrequency());
 }
 
 static PyMethodDef coreaudio_methods[] = {
     { "AudioComponentFindNext", (PyCFunction)coreaudio_findnextcomponent,
       METH_VARARGS },
     { "AudioComponentInstanceNew", (PyCFunction)coreaudio_instancenew, METH_VARARGS },
+    { "AudioComponents", (PyCFunction)coreaudio_components, METH_VARARGS,
+      "AudioComponents([desc[, refresh]]) -- return a tuple of all "
+      "components matching desc (all components by default). The result is "
+      "cached unless refresh is true." },
+    { "AudioConvertHostTimeToNanos",
+      (PyCFunction)coreaudio_converthosttimetonanos, METH_VARARGS,
+      "AudioConvertHostTimeToNanos(host_time) -- convert host ticks to "
+      "nanoseconds." },
+    { "AudioConvertNanosToHostTime",
+      (PyCFunction)coreaudio_convertnanostohosttime, METH_VARARGS,
+      "AudioConvertNanosToHostTime(ns) -- convert nanoseconds to host "
+      "ticks." },
+    { "AudioGetCurrentHostTime", (PyCFunction)coreaudio_getcurrenthosttime,
+      METH_VARARGS,
+      "AudioGetCurrentHostTime() -- return the current host time." },
+    { "AudioGetHostClockFrequency",
+      (PyCFunction)coreaudio_gethostclockfrequency, METH_VARARGS,
+      "AudioGetHostClockFrequency() -- return the host clock's ticks per "
+      "second." },
+    { "Connect", (PyCFunction)coreaudio_connect, METH_VARARGS,
+      "Connect(src, src_bus, dst, dst_bus) -- render an output bus of src "
+      "into an input bus of dst and return the Connection." },
+    { "Disconnect", (PyCFunction)coreaudio_disconnect, METH_VARARGS,
+      "Disconnect(dst, dst_bus) -- remove the Connection that feeds an input "
+      "bus." },
+    { "GetThreadStats", (PyCFunction)coreaudio_getthreadstats, METH_VARARGS,
+      "GetThreadStats() -- return a list of dicts with the page faults, "
+      "context switches, CPU time and scheduling of each registered "
+      "thread." },
+    { "RegisterThread", (PyCFunction)coreaudio_registerthread, METH_VARARGS,
+      "RegisterThread(name) -- register the calling thread under name and "
+      "apply the policy for name. Returns the thread's id." },
+    { "SetMemoryPolicy", (PyCFunction)coreaudio_setmemorypolicy,
+      METH_VARARGS | METH_KEYWORDS,
+      "SetMemoryPolicy(lock=False, prefault=False) -- lock all current and "
+      "future memory of the process, and prefault buffers the render thread "
+      "writes to when they are allocated." },
+    { "SetThreadPolicy", (PyCFunction)coreaudio_setthreadpolicy,
+      METH_VARARGS | METH_KEYWORDS,
+      "SetThreadPolicy(name, realtime=False, priority=0, cpus=None, "
+      "period=0.0, computation=0.0, constraint=0.0) -- set the scheduling of "
+      "the threads named name, now and when they register. priority is the "
+      "realtime priority or else the nice value (the precedence on macOS); "
+      "period, computation and constraint are the time constraints of "
+      "realtime threads on macOS, in seconds. Returns the number of threads "
+      "changed." },
+    { "TimeStretchBuffer", (PyCFunction)coreaudio_timestretchbuffer,
+      METH_VARARGS,
+      "TimeStretchBuffer(data, format, rate[, quality]) -- return data "
+      "played 'rate' times as fast, without changing its pitch." },
+    { "UnregisterThread", (PyCFunction)coreaudio_unregisterthread,
+      METH_VARARGS,
+      "UnregisterThread() -- remove the calling thread from the registry." },
     { NULL, NULL }
 };
 
@@ -724,6 +10017,36 @@ PyInit_coreaudio(void)
     if (PyType_Ready(&AudioUnitType) < 0)
         return NULL;
 
+    if (PyType_Ready(&JitterBufferType) < 0)
+        return NULL;
+
+    if (PyType_Ready(&VirtualDriverType) < 0)
+        return NULL;
+
+    if (PyType_Ready(&ConnectionType) < 0)
+        return NULL;
+
+    if (PyType_Ready(&SampleBankType) < 0)
+        return NULL;
+
+    if (PyType_Ready(&AudioUnitPoolType) < 0)
+        return NULL;
+
+    if (PyType_Ready(&RecorderType) < 0)
+        return NULL;
+
+    if (PyType_Ready(&ClockType) < 0)
+        return NULL;
+
+    if (PyType_Ready(&AnalyzerType) < 0)
+        return NULL;
+
+    if (PyType_Ready(&TimeStretchType) < 0)
+        return NULL;
+
+    if (PyType_Ready(&ClipPlayerType) < 0)
+        return NULL;
+
     PyObject* m = PyModule_Create(&coreaudiomodule);
     if (m == NULL)
         return NULL;
@@ -751,6 +10074,36 @@ PyInit_coreaudio(void)
         Py_INCREF(&AudioTimeStampType);
         PyModule_AddObject(m, "AudioTimeStamp",
                            (PyObject*)&AudioTimeStampType);
+
+        Py_INCREF(&JitterBufferType);
+        PyModule_AddObject(m, "JitterBuffer", (PyObject*)&JitterBufferType);
+
+        Py_INCREF(&VirtualDriverType);
+        PyModule_AddObject(m, "VirtualDriver", (PyObject*)&VirtualDriverType);
+
+        Py_INCREF(&ConnectionType);
+        PyModule_AddObject(m, "Connection", (PyObject*)&ConnectionType);
+
+        Py_INCREF(&AudioUnitPoolType);
+        PyModule_AddObject(m, "AudioUnitPool", (PyObject*)&AudioUnitPoolType);
+
+        Py_INCREF(&RecorderType);
+        PyModule_AddObject(m, "Recorder", (PyObject*)&RecorderType);
+
+        Py_INCREF(&ClockType);
+        PyModule_AddObject(m, "Clock", (PyObject*)&ClockType);
+
+        Py_INCREF(&AnalyzerType);
+        PyModule_AddObject(m, "Analyzer", (PyObject*)&AnalyzerType);
+
+        Py_INCREF(&TimeStretchType);
+        PyModule_AddObject(m, "TimeStretch", (PyObject*)&TimeStretchType);
+
+        Py_INCREF(&SampleBankType);
+        PyModule_AddObject(m, "SampleBank", (PyObject*)&SampleBankType);
+
+        Py_INCREF(&ClipPlayerType);
+        PyModule_AddObject(m, "ClipPlayer", (PyObject*)&ClipPlayerType);
     }
 
     _EXPORT_INT(m, kAudioUnitType_Output);
@@ -849,5 +10202,20 @@ PyInit_coreaudio(void)
     _EXPORT_INT(m, kAudioTimeStampWordClockTimeValid);
     _EXPORT_INT(m, kAudioTimeStampSMPTETimeValid);
 
+    _EXPORT_INT(m, kAudioUnitScope_Global);
+    _EXPORT_INT(m, kAudioUnitScope_Input);
+    _EXPORT_INT(m, kAudioUnitScope_Output);
+
+    _EXPORT_INT(m, kMultiChannelMixerParam_Volume);
+
+    _EXPORT_INT(m, kAudioUnitProperty_SampleRate);
+    _EXPORT_INT(m, kAudioUnitProperty_StreamFormat);
+    _EXPORT_INT(m, kAudioUnitProperty_ElementCount);
+    _EXPORT_INT(m, kAudioUnitProperty_Latency);
+    _EXPORT_INT(m, kAudioUnitProperty_MaximumFramesPerSlice);
+    _EXPORT_INT(m, kAudioUnitProperty_TailTime);
+    _EXPORT_INT(m, kAudioUnitProperty_SetRenderCallback);
+    _EXPORT_INT(m, kAudioOutputUnitProperty_CurrentDevice);
+
     return m;
 }
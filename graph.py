@@ -0,0 +1,229 @@
+#!/usr/bin/env python3
+
+r"""Render a graph of Connections with fan-out on the VirtualDriver.
+
+A mixer with two Python sources feeds two effects and, directly, one bus
+of a second mixer that sums the effects; a generic output unit pulls the
+second mixer:
+
+    source 0 --\                 /-- effect 0 --\
+                +-- mixer 0 ----+--- effect 1 ---+-- mixer 1 -- output
+    source 1 --/                 \---------------/
+
+Every unit is recorded. Each one must render exactly once per cycle, the
+output must be three times the sum of the sources, and Connections that
+would close a cycle must be rejected. Disconnected Connections must give
+their slot back once the graph has rendered past them, and a pooled unit
+that a Connection still pulls from must not be released."""
+
+import coreaudio
+from optparse import OptionParser
+import os
+import struct
+import sys
+import tempfile
+
+def open_unit(type, subtype):
+    desc = coreaudio.AudioComponentDescription(
+        type, subtype, coreaudio.kAudioUnitManufacturer_Apple)
+
+    c = coreaudio.AudioComponentFindNext(None, desc)
+
+    return coreaudio.AudioComponentInstanceNew(c)
+
+def source_value(bus, sample_time):
+    """Multiples of 1/64, so that sums are exact in 32 bit floats."""
+
+    return ((sample_time * (bus + 1)) % 97 - 48) / 64.0
+
+def source_callback(calls):
+    """Return a render callback that counts its calls per bus and cycle."""
+
+    def render_callback(flags, time, bus, frames, *buffers):
+        t = int(time['mSampleTime'])
+        calls[(bus, t)] = calls.get((bus, t), 0) + 1
+        data = struct.pack('=%df' % frames,
+                           *[source_value(bus, t + i) for i in range(frames)])
+
+        return (flags,) + tuple(data for b in buffers)
+
+    return render_callback
+
+def read_wav(path):
+    """Return the samples of a WAV file of 32 bit floats."""
+
+    with open(path, 'rb') as f:
+        data = f.read()
+
+    pos = 12
+    while pos + 8 <= len(data):
+        chunk, size = struct.unpack('<4sI', data[pos:pos + 8])
+        if chunk == b'data':
+            return struct.unpack('<%df' % (size // 4),
+                                 data[pos + 8:pos + 8 + size])
+        pos += 8 + size + (size & 1)
+
+    raise ValueError('%s has no data chunk' % path)
+
+def check_cycles(units):
+    """Return a list of Connections that were wrongly accepted."""
+
+    mixer0, effect0, effect1, mixer1, output = units
+    errors = []
+
+    for src, dst in ((output, mixer0), (mixer1, mixer0), (effect0, effect0),
+                     (mixer1, effect1)):
+        try:
+            coreaudio.Connect(src, 0, dst, 1)
+        except Exception as e:
+            if 'cycle' not in str(e):
+                errors.append('Connect raised %r' % e)
+            continue
+        errors.append('a cycle through Connect was accepted')
+
+    return errors
+
+def check_reconnect(mixer0, mixer1, driver):
+    """Reconnect a bus more often than a source bus has slots; return a
+    list of problems."""
+
+    try:
+        for i in range(200):
+            coreaudio.Disconnect(mixer1, 2)
+            driver.Run(1)
+            coreaudio.Connect(mixer0, 0, mixer1, 2)
+            driver.Run(1)
+    except Exception as e:
+        return ['reconnecting failed after %d times: %s' % (i, e)]
+
+    return []
+
+def check_pool():
+    """Return a list of problems with releasing connected pooled units."""
+
+    desc = coreaudio.AudioComponentDescription(
+        coreaudio.kAudioUnitType_Mixer, coreaudio.kAudioUnitSubType_StereoMixer,
+        coreaudio.kAudioUnitManufacturer_Apple)
+    pool = coreaudio.AudioUnitPool(desc, 2)
+    src, dst = pool.Checkout(), pool.Checkout()
+    errors = []
+
+    coreaudio.Connect(src, 0, dst, 0)
+    try:
+        pool.Release(src)
+        errors.append('a unit that feeds a Connection was released')
+    except Exception as e:
+        if 'Connection' not in str(e):
+            errors.append('Release raised %r' % e)
+
+    # releasing the destination removes the Connection
+    pool.Release(dst)
+    pool.Release(src)
+    if pool.GetStats()['available'] != 2:
+        errors.append('the pool has %d units, expected 2'
+                      % pool.GetStats()['available'])
+
+    return errors
+
+if __name__ == '__main__':
+    parser = OptionParser(usage='usage: %prog [options]')
+    parser.add_option("-p", "--periods", dest="periods", type="int",
+                      help="Number of periods to render. ", default=200)
+    parser.add_option("-f", "--frames", dest="frames", type="string",
+                      help="Comma separated frames per period, used in "
+                      "turn. ", default="512,64,1024,333")
+
+    options, args = parser.parse_args()
+    frames = [int(f) for f in options.frames.split(',')]
+
+    mixer0 = open_unit(coreaudio.kAudioUnitType_Mixer,
+                       coreaudio.kAudioUnitSubType_StereoMixer)
+    effect0 = open_unit(coreaudio.kAudioUnitType_Effect,
+                        coreaudio.kAudioUnitSubType_LowPassFilter)
+    effect1 = open_unit(coreaudio.kAudioUnitType_Effect,
+                        coreaudio.kAudioUnitSubType_Delay)
+    mixer1 = open_unit(coreaudio.kAudioUnitType_Mixer,
+                       coreaudio.kAudioUnitSubType_StereoMixer)
+    output = open_unit(coreaudio.kAudioUnitType_Output,
+                       coreaudio.kAudioUnitSubType_GenericOutput)
+    units = (mixer0, effect0, effect1, mixer1, output)
+
+    fmt = mixer0.GetStreamFormat(0, coreaudio.kAudioUnitScope_Output)
+
+    calls = {}
+    mixer0.SetBusCount(2)
+    mixer1.SetBusCount(3)
+    for bus in range(2):
+        mixer0.SetStreamFormat(fmt, bus)
+        mixer0.SetRenderCallback(source_callback(calls), None, bus)
+
+    connections = [coreaudio.Connect(mixer0, 0, effect0, 0),
+                   coreaudio.Connect(mixer0, 0, effect1, 0),
+                   coreaudio.Connect(mixer0, 0, mixer1, 2),
+                   coreaudio.Connect(effect0, 0, mixer1, 0),
+                   coreaudio.Connect(effect1, 0, mixer1, 1),
+                   coreaudio.Connect(mixer1, 0, output, 0)]
+
+    errors = check_cycles(units)
+
+    for u in units:
+        u.Initialize()
+
+    paths = []
+    recorders = []
+    for u in units:
+        fd, path = tempfile.mkstemp(suffix='.wav')
+        os.close(fd)
+        paths.append(path)
+        recorders.append(coreaudio.Recorder(u, path, ring_seconds=60.0))
+
+    driver = coreaudio.VirtualDriver(output, frames)
+    stats = driver.Run(options.periods)
+    total = int(driver.GetSampleTime())
+
+    names = ('mixer 0', 'effect 0', 'effect 1', 'mixer 1', 'output')
+    samples = []
+    for name, r, path in zip(names, recorders, paths):
+        recorded = r.GetStats()
+        r.Close()
+        # a unit that renders twice in a cycle is recorded twice
+        if recorded['frames'] != total:
+            errors.append('%s rendered %d frames in %d'
+                          % (name, recorded['frames'], total))
+        if recorded['dropped_frames']:
+            errors.append('the recorder of %s dropped %d frames'
+                          % (name, recorded['dropped_frames']))
+        samples.append(read_wav(path))
+        os.unlink(path)
+
+    repeated = [k for k, n in calls.items() if n != 1]
+    if repeated:
+        errors.append('%d sources were pulled more than once in a cycle'
+                      % len(repeated))
+    if len(calls) != 2 * options.periods:
+        errors.append('the sources were pulled %d times in %d periods'
+                      % (len(calls), options.periods))
+
+    # the recordings are interleaved stereo
+    channels = fmt.mChannelsPerFrame
+    for name, s, gain in zip(names, samples, (1, 1, 1, 3, 3)):
+        for t in range(total):
+            expected = gain * (source_value(0, t) + source_value(1, t))
+            if any(s[t * channels + c] != expected for c in range(channels)):
+                errors.append('%s is %r at %d, expected %r'
+                              % (name, s[t * channels], t, expected))
+                break
+
+    if stats['errors']:
+        errors.append('%d render errors' % stats['errors'])
+
+    errors += check_reconnect(mixer0, mixer1, driver)
+    errors += check_pool()
+
+    print('periods: %d' % options.periods)
+    print('frames: %d' % total)
+    for e in errors:
+        print(e)
+    print('errors: %d' % len(errors))
+
+    sys.exit(1 if errors else 0)
@@ -0,0 +1,246 @@
+#!/usr/bin/env python3
+
+"""Feed a JitterBuffer with generated packets on the VirtualDriver.
+
+Packets are sequenced (with a 16 bit wrap), jittered, and therefore
+reordered, duplicated and dropped. The output is recorded and checked: every
+packet that is played must come out whole and in order, the gaps must be
+concealed or accounted for as dropped, and the statistics must add up.
+
+The first packets are held up and arrive in one burst, so that playout
+starts with too much delay and the buffer has to shrink it: the packet
+after each one it skips must be crossfaded in from the skipped one."""
+
+import coreaudio
+from optparse import OptionParser
+import os
+import random
+import struct
+import sys
+import tempfile
+import wave
+
+from stress import open_generic_au
+
+# Payload samples encode the packet index; concealed packets are attenuated
+# copies of the last one, so they always fall below PAYLOAD_BASE
+PAYLOAD_BASE = 0x4000
+MAX_CONCEAL = 5
+
+def payload_value(index):
+    return PAYLOAD_BASE | (index & (PAYLOAD_BASE - 1))
+
+def generate(options):
+    """Return the packets as (arrival, index, seq, timestamp) tuples in
+    arrival order, and the set of dropped indices."""
+
+    rnd = random.Random(options.seed)
+    jitter = int(options.jitter * options.rate / 1000.0)
+    first_seq = 0x10000 - options.packets // 2
+    timestamp = rnd.randrange(1 << 32)
+    packets = []
+    dropped = set()
+    burst = 0
+
+    for i in range(options.packets):
+        # never drop the first and the last packet, and keep bursts short
+        # enough to stay clear of a rebuffer
+        if 0 < i < options.packets - 1 and burst < 2 \
+           and rnd.random() < options.loss:
+            dropped.add(i)
+            burst += 1
+            continue
+        burst = 0
+
+        seq = (first_seq + i) & 0xffff
+        ts = (timestamp + i * options.frames) & 0xffffffff
+        sent = i * options.frames
+        if i < options.burst:
+            packets.append((options.burst * options.frames, i, seq, ts))
+            continue
+        packets.append((sent + rnd.randint(0, jitter), i, seq, ts))
+
+        if rnd.random() < options.duplicates:
+            packets.append((sent + rnd.randint(0, jitter), i, seq, ts))
+
+    packets.sort()
+
+    return packets, dropped
+
+def check(blocks, packets, dropped, stats, options):
+    """Return a list of problems with the rendered 'blocks'."""
+
+    errors = []
+    played = []
+    gaps = 0
+    pending = 0
+    last = None
+    run = 0
+    fades = 0
+
+    for n, block in enumerate(blocks):
+        value = block[-1]
+        if any(v != value for v in block):
+            # a crossfade from a skipped packet ends on the one played
+            if not (all(a <= b for a, b in zip(block, block[1:]))
+                    or all(a >= b for a, b in zip(block, block[1:]))):
+                errors.append('block %d is not a whole packet' % n)
+                continue
+            fades += 1
+
+        if value >= PAYLOAD_BASE and value != last:
+            index = played[-1] + 1 if played else 0
+            while payload_value(index) != value:
+                index += 1
+            if index >= options.packets:
+                errors.append('block %d plays a packet out of order' % n)
+                continue
+            if index in dropped:
+                errors.append('block %d plays dropped packet %d' % (n, index))
+            played.append(index)
+            last = value
+            gaps += pending
+            pending = 0
+            run = 0
+        elif last is not None:
+            expected = last >> run if run < MAX_CONCEAL else 0
+            if value != expected:
+                errors.append('block %d: concealed %d, expected %d'
+                              % (n, value, expected))
+            pending += 1
+            run += 1
+        elif value:
+            errors.append('block %d is not silent before playout' % n)
+
+    if not played:
+        return errors + ['nothing was played']
+
+    # between the first and the last packet played, every sequence number
+    # was either played, concealed or skipped to shrink the delay
+    span = played[-1] - played[0] + 1
+    if span != len(played) + gaps + stats['dropped']:
+        errors.append('%d packets spanned, but %d played, %d concealed and '
+                      '%d dropped' % (span, len(played), gaps,
+                                      stats['dropped']))
+
+    # a crossfade between equal values, from a concealed packet, is whole
+    if fades > stats['dropped'] or (stats['dropped'] and not fades):
+        errors.append('%d packets skipped, but %d crossfades'
+                      % (stats['dropped'], fades))
+
+    if stats['lost'] + stats['underruns'] < gaps:
+        errors.append('%d gaps, but only %d lost and %d underruns'
+                      % (gaps, stats['lost'], stats['underruns']))
+
+    # the playout delay covers the network delay: nothing is late, and
+    # every missing packet was either concealed or skipped
+    sent = set(p[1] for p in packets)
+    for k, expected in (('received', len(packets)), ('late', 0),
+                        ('overflow', 0),
+                        ('duplicate', len(packets) - len(sent))):
+        if stats[k] != expected:
+            errors.append('%s is %d, expected %d' % (k, stats[k], expected))
+
+    if not stats['lost'] <= len(dropped) \
+       <= stats['lost'] + stats['underruns'] + stats['dropped']:
+        errors.append('%d packets dropped, but %d lost, %d underruns and %d '
+                      'skipped' % (len(dropped), stats['lost'],
+                                   stats['underruns'], stats['dropped']))
+
+    if not len(played) <= len(sent) <= len(played) + stats['dropped']:
+        errors.append('%d packets sent, but %d played and %d skipped'
+                      % (len(sent), len(played), stats['dropped']))
+
+    return errors
+
+if __name__ == '__main__':
+    parser = OptionParser(usage='usage: %prog [options]')
+    parser.add_option("-n", "--packets", dest="packets", type="int",
+                      help="Number of packets to send. ", default=2000)
+    parser.add_option("-f", "--frames", dest="frames", type="int",
+                      help="Frames per packet. ", default=160)
+    parser.add_option("-r", "--rate", dest="rate", type="float",
+                      help="Sample rate. ", default=8000.0)
+    parser.add_option("-j", "--jitter", dest="jitter", type="float",
+                      help="Maximum network delay in ms. ", default=40.0)
+    parser.add_option("-l", "--loss", dest="loss", type="float",
+                      help="Packet loss probability. ", default=0.05)
+    parser.add_option("-d", "--duplicates", dest="duplicates", type="float",
+                      help="Packet duplication probability. ", default=0.02)
+    parser.add_option("-b", "--burst", dest="burst", type="int",
+                      help="Number of packets held up at the start, "
+                      "which arrive at once. ", default=20)
+    parser.add_option("-s", "--seed", dest="seed", type="int",
+                      help="Random seed. ", default=1)
+
+    options, args = parser.parse_args()
+    if not 0 < options.packets < PAYLOAD_BASE:
+        parser.error('packets must be between 1 and %d' % (PAYLOAD_BASE - 1))
+
+    au = open_generic_au()
+    au.SetStreamFormat(coreaudio.AudioStreamBasicDescription(
+        options.rate,
+        coreaudio.kAudioFormatLinearPCM,
+        coreaudio.kAudioFormatFlagIsSignedInteger | \
+        coreaudio.kAudioFormatFlagsNativeEndian | \
+        coreaudio.kAudioFormatFlagIsNonInterleaved,
+        2, 1, 2, 1, 16))
+
+    # start playing only once the network delay is covered
+    packet_ms = options.frames * 1000.0 / options.rate
+    jb = coreaudio.JitterBuffer(options.frames, options.rate,
+                                coreaudio.kAudioFormatLinearPCM,
+                                min_delay=options.jitter + 2 * packet_ms,
+                                max_delay=4 * options.jitter + 100.0,
+                                capacity=256)
+    au.SetRenderCallback(jb)
+
+    packets, dropped = generate(options)
+    # render until the last packet is well past the playout delay
+    periods = packets[-1][0] // options.frames + 64
+
+    fd, path = tempfile.mkstemp(suffix='.wav')
+    os.close(fd)
+    recorder = coreaudio.Recorder(
+        au, path, ring_seconds=periods * options.frames / options.rate + 1.0)
+
+    driver = coreaudio.VirtualDriver(au, options.frames)
+    sent = 0
+    for p in range(periods):
+        now = p * options.frames
+        while sent < len(packets) and packets[sent][0] <= now:
+            arrival, index, seq, ts = packets[sent]
+            jb.Put(seq, ts, struct.pack('=%dh' % options.frames,
+                                        *[payload_value(index)]
+                                        * options.frames))
+            sent += 1
+        driver.Run(1)
+
+    stats = jb.GetStats()
+    recorded = recorder.GetStats()
+    recorder.Close()
+
+    f = wave.open(path, 'r')
+    data = f.readframes(f.getnframes())
+    f.close()
+    os.unlink(path)
+
+    samples = struct.unpack('<%dh' % (len(data) // 2), data)
+    blocks = [samples[i:i + options.frames]
+              for i in range(0, len(samples), options.frames)]
+
+    errors = check(blocks, packets, dropped, stats, options)
+    if recorded['dropped_frames']:
+        errors.append('the recorder dropped %d frames'
+                      % recorded['dropped_frames'])
+    if len(samples) != periods * options.frames:
+        errors.append('recorded %d frames, rendered %d'
+                      % (len(samples), periods * options.frames))
+
+    for k in sorted(stats):
+        print('%s: %s' % (k, stats[k]))
+    for e in errors:
+        print(e)
+    print('errors: %d' % len(errors))
+
+    sys.exit(1 if errors else 0)
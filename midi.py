@@ -0,0 +1,210 @@
+#!/usr/bin/env python3
+
+"""Check MIDI scheduling on a MusicDevice rendered by the VirtualDriver.
+
+Notes are scheduled in shuffled batches, out of time order, and each one is
+stopped with all sound off, so it is audible for exactly the frames between
+its two events. The recorded output shows when the events reached
+MusicDeviceMIDIEvent and at which offset: every note must start and stop on
+its frame, simultaneous events must keep their order, late events must go
+out at the start of the next cycle and ClearMIDI must discard what is
+queued."""
+
+import coreaudio
+from optparse import OptionParser
+import os
+import random
+import struct
+import sys
+import tempfile
+
+NOTE_ON = 0x90
+CONTROL = 0xb0
+ALL_SOUND_OFF = 120
+
+# the synth's attack and release times, in seconds
+ATTACK = 0.005
+RELEASE = 0.05
+
+def open_synth():
+    desc = coreaudio.AudioComponentDescription(
+        coreaudio.kAudioUnitType_MusicDevice,
+        coreaudio.kAudioUnitSubType_DLSSynth,
+        coreaudio.kAudioUnitManufacturer_Apple)
+
+    c = coreaudio.AudioComponentFindNext(None, desc)
+    au = coreaudio.AudioComponentInstanceNew(c)
+
+    au.Initialize()
+
+    return au
+
+def note(rnd, start, frames):
+    """Return the events of a note that sounds for 'frames' from 'start',
+    each in a list of its own."""
+
+    channel = rnd.randrange(16)
+    key = rnd.randrange(40, 90)
+
+    return [[(start, NOTE_ON | channel, key, 100)],
+            [(start + frames, CONTROL | channel, ALL_SOUND_OFF, 0)]]
+
+def read_wav(path, channels):
+    """Return the first channel of a WAV file of 32 bit floats."""
+
+    with open(path, 'rb') as f:
+        data = f.read()
+
+    pos = 12
+    while pos + 8 <= len(data):
+        chunk, size = struct.unpack('<4sI', data[pos:pos + 8])
+        if chunk == b'data':
+            samples = struct.unpack('<%df' % (size // 4),
+                                    data[pos + 8:pos + 8 + size])
+            return samples[::channels]
+        pos += 8 + size + (size & 1)
+
+    raise ValueError('%s has no data chunk' % path)
+
+def sounding(samples):
+    """Return the [start, end) ranges of nonzero samples."""
+
+    ranges = []
+    start = None
+
+    for i, s in enumerate(samples):
+        if s and start is None:
+            start = i
+        elif not s and start is not None:
+            ranges.append((start, i))
+            start = None
+    if start is not None:
+        ranges.append((start, len(samples)))
+
+    return ranges
+
+def render_until(driver, sample_time):
+    while driver.GetSampleTime() < sample_time:
+        driver.Run(1)
+
+if __name__ == '__main__':
+    parser = OptionParser(usage='usage: %prog [options]')
+    parser.add_option("-n", "--notes", dest="notes", type="int",
+                      help="Number of notes to schedule. ", default=100)
+    parser.add_option("-f", "--frames", dest="frames", type="string",
+                      help="Comma separated frames per period, used in "
+                      "turn. ", default="512,100,999,256")
+    parser.add_option("-s", "--seed", dest="seed", type="int",
+                      help="Random seed. ", default=1)
+
+    options, args = parser.parse_args()
+    frames = [int(f) for f in options.frames.split(',')]
+    rnd = random.Random(options.seed)
+
+    synth = open_synth()
+    fmt = synth.GetStreamFormat(0, coreaudio.kAudioUnitScope_Output)
+    attack = int(ATTACK * fmt.mSampleRate)
+    release = int(RELEASE * fmt.mSampleRate)
+
+    fd, path = tempfile.mkstemp(suffix='.wav')
+    os.close(fd)
+    recorder = coreaudio.Recorder(synth, path, ring_seconds=60.0)
+    driver = coreaudio.VirtualDriver(synth, frames)
+
+    # A note sounds from the frame after its note on (the first sample of a
+    # sine is 0) up to its all sound off. The end of a release is only known
+    # to a few frames.
+    expected = []
+    events = []
+    t = 300
+    for i in range(options.notes):
+        length = rnd.randint(2, 400)
+        events += note(rnd, t, length)
+        expected.append((t + 1, t + length, 0))
+        t += length + rnd.randint(1, 1500)
+
+    # simultaneous events keep their order: this note is stopped as soon as
+    # it starts, the next one is stopped before it starts
+    events.append([(t, NOTE_ON, 60, 100), (t, CONTROL, ALL_SOUND_OFF, 0)])
+    t += 1000
+    events.append([(t, CONTROL, ALL_SOUND_OFF, 0), (t, NOTE_ON, 60, 100)])
+    events.append([(t + 200, CONTROL, ALL_SOUND_OFF, 0)])
+    expected.append((t + 1, t + 200, 0))
+    t += 1000
+
+    # shuffled batches, the latest first
+    rnd.shuffle(events)
+    batches = [[], [], []]
+    for e in events:
+        batches[e[0][0] * len(batches) // t] += e
+    for b in reversed(batches):
+        synth.ScheduleMIDI(b, 0.0)
+    dispatched = sum(len(e) for e in events)
+
+    render_until(driver, t)
+
+    # a late note on goes out at the start of the next cycle
+    now = driver.GetSampleTime()
+    synth.ScheduleMIDI([(0, NOTE_ON, 60, 100)], now - 1000)
+    synth.ScheduleMIDI([(500, CONTROL, ALL_SOUND_OFF, 0)])
+    expected.append((int(now) + 1, int(now) + 500, 0))
+    dispatched += 2
+    render_until(driver, now + 1000)
+
+    # ClearMIDI discards what is queued and releases what sounds; the
+    # queued events are due well after the cycle that clears them
+    later = 101 + attack + max(frames) + 1000
+    now = driver.GetSampleTime()
+    synth.ScheduleMIDI([(100, NOTE_ON, 60, 100), (later, NOTE_ON, 64, 100),
+                        (later + 1000, CONTROL, ALL_SOUND_OFF, 0)])
+    dispatched += 1
+    render_until(driver, now + 101 + attack)
+    cleared = driver.GetSampleTime()
+    synth.ClearMIDI()
+    render_until(driver, now + later + 2000)
+    expected.append((int(now) + 101, int(cleared) + release + 1, 4))
+
+    # without notes off, what sounds keeps sounding
+    now = driver.GetSampleTime()
+    synth.ScheduleMIDI([(100, NOTE_ON, 60, 100), (later, CONTROL,
+                                                  ALL_SOUND_OFF, 0)])
+    dispatched += 1
+    render_until(driver, now + 101)
+    synth.ClearMIDI(False)
+    render_until(driver, now + later + 1000)
+    synth.MIDIEvent(CONTROL, ALL_SOUND_OFF, 0)
+    stopped = driver.GetSampleTime()
+    render_until(driver, stopped + 1000)
+    expected.append((int(now) + 101, int(stopped), 0))
+
+    stats = synth.GetMIDIStats()
+    recorded = recorder.GetStats()
+    recorder.Close()
+    samples = read_wav(path, fmt.mChannelsPerFrame)
+    os.unlink(path)
+
+    errors = []
+    for (start, end, slack), s in zip(expected, sounding(samples)):
+        if s[0] != start or not end - slack <= s[1] <= end:
+            errors.append('sounding from %d to %d, expected %d to %d'
+                          % (s + (start, end)))
+    if len(sounding(samples)) != len(expected):
+        errors.append('%d notes sounded, expected %d'
+                      % (len(sounding(samples)), len(expected)))
+
+    for k, v in (('dispatched', dispatched), ('late', 1), ('errors', 0),
+                 ('pending', 0)):
+        if stats[k] != v:
+            errors.append('%s is %d, expected %d' % (k, stats[k], v))
+
+    if recorded['dropped_frames']:
+        errors.append('the recorder dropped %d frames'
+                      % recorded['dropped_frames'])
+
+    for k in sorted(stats):
+        print('%s: %s' % (k, stats[k]))
+    for e in errors:
+        print(e)
+    print('errors: %d' % len(errors))
+
+    sys.exit(1 if errors else 0)
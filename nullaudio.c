@@ -0,0 +1,1587 @@
+/*
+ * nullaudio -- a device-less stand-in for the CoreAudio/AudioUnit API
+ *
+ * Author: Lars Immisch (lars@ibp.de)
+ *
+ * License: Python Software Foundation License
+ *
+ */
+
+#include "nullaudio.h"
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* The simulated device: its id, the default and smallest number of frames
+   per period, and its latency (in frames) */
+#define NULL_DEVICE_ID 2
+#define NULL_DEVICE_FRAMES 512
+#define NULL_DEVICE_MIN_FRAMES 15
+#define NULL_DEVICE_LATENCY 32
+#define NULL_DEVICE_SAFETY_OFFSET 16
+
+/* The default MaximumFramesPerSlice */
+#define NULL_MAX_FRAMES 4096
+
+/* The default number of mixer input buses, and the maximum */
+#define NULL_MIXER_INPUTS 8
+#define NULL_MAX_ELEMENTS 1024
+
+/* Render notifications per unit */
+#define NULL_MAX_NOTIFY 8
+
+/* The synth's voices, and the MIDI events it queues per render cycle */
+#define NULL_SYNTH_VOICES 32
+#define NULL_SYNTH_EVENTS 1024
+
+/* Scheduled parameter events per render cycle */
+#define NULL_PARAM_EVENTS 256
+
+enum {
+    NULL_DEVICE_OUTPUT, /* paced by a thread once started */
+    NULL_GENERIC_OUTPUT, /* rendered by AudioUnitRender only */
+    NULL_MIXER, /* sums its input buses */
+    NULL_EFFECT, /* passes its input through unchanged */
+    NULL_SYNTH, /* plays MIDI notes as sine tones */
+};
+
+struct OpaqueAudioComponent {
+    AudioComponentDescription desc;
+    const char* name;
+    UInt32 version;
+    int kind;
+};
+
+#define NULL_COMPONENT(type, subtype, name, kind)                             \
+    {                                                                         \
+        { type, subtype, kAudioUnitManufacturer_Apple, 0, 0 }, name,          \
+            0x10000, kind                                                     \
+    }
+
+static struct OpaqueAudioComponent null_components[] = {
+    NULL_COMPONENT(kAudioUnitType_Output, kAudioUnitSubType_DefaultOutput,
+                   "Apple: AUDefaultOutput", NULL_DEVICE_OUTPUT),
+    NULL_COMPONENT(kAudioUnitType_Output, kAudioUnitSubType_SystemOutput,
+                   "Apple: AUSystemOutput", NULL_DEVICE_OUTPUT),
+    NULL_COMPONENT(kAudioUnitType_Output, kAudioUnitSubType_HALOutput,
+                   "Apple: AUHAL", NULL_DEVICE_OUTPUT),
+    NULL_COMPONENT(kAudioUnitType_Output, kAudioUnitSubType_GenericOutput,
+                   "Apple: AUGenericOutput", NULL_GENERIC_OUTPUT),
+    NULL_COMPONENT(kAudioUnitType_Mixer, kAudioUnitSubType_StereoMixer,
+                   "Apple: AUMixer", NULL_MIXER),
+    NULL_COMPONENT(kAudioUnitType_Mixer, kAudioUnitSubType_MatrixMixer,
+                   "Apple: AUMatrixMixer", NULL_MIXER),
+    NULL_COMPONENT(kAudioUnitType_FormatConverter,
+                   kAudioUnitSubType_AUConverter, "Apple: AUConverter",
+                   NULL_EFFECT),
+    NULL_COMPONENT(kAudioUnitType_Effect, kAudioUnitSubType_Delay,
+                   "Apple: AUDelay", NULL_EFFECT),
+    NULL_COMPONENT(kAudioUnitType_Effect, kAudioUnitSubType_LowPassFilter,
+                   "Apple: AULowpass", NULL_EFFECT),
+    NULL_COMPONENT(kAudioUnitType_Effect, kAudioUnitSubType_HighPassFilter,
+                   "Apple: AUHipass", NULL_EFFECT),
+    NULL_COMPONENT(kAudioUnitType_Effect, kAudioUnitSubType_PeakLimiter,
+                   "Apple: AUPeakLimiter", NULL_EFFECT),
+    NULL_COMPONENT(kAudioUnitType_MusicDevice, kAudioUnitSubType_DLSSynth,
+                   "Apple: DLSMusicDevice", NULL_SYNTH),
+};
+
+#define NULL_NCOMPONENTS                                                      \
+    (sizeof(null_components) / sizeof(null_components[0]))
+
+/* An input element (bus) */
+typedef struct {
+    AURenderCallbackStruct input;
+    AudioStreamBasicDescription format;
+    AudioBufferList* scratch; /* mixer only, allocated on Initialize */
+    AudioUnitParameterValue volume; /* mixer only */
+} null_element_t;
+
+/* A MIDI event, due at 'offset' frames into the next render cycle */
+typedef struct {
+    UInt32 offset;
+    UInt8 status;
+    UInt8 data1;
+    UInt8 data2;
+} null_midi_t;
+
+enum { VOICE_OFF, VOICE_ATTACK, VOICE_SUSTAIN, VOICE_RELEASE };
+
+typedef struct {
+    int state;
+    UInt8 channel;
+    UInt8 note;
+    Float32 gain;
+    Float32 level; /* the envelope */
+    Float64 phase;
+    Float64 increment;
+} null_voice_t;
+
+struct ComponentInstanceRecord {
+    AudioComponent component;
+
+    /* lock protects the properties below; it is never held while calling
+       out to a render callback */
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+    int rendering;
+
+    null_element_t* inputs;
+    UInt32 ninputs;
+    AudioStreamBasicDescription output_format;
+    UInt32 max_frames;
+    int initialized;
+
+    AURenderCallbackStruct notify[NULL_MAX_NOTIFY];
+    UInt32 nnotify;
+
+    /* the mixer's output volume, the parameter events for the next render
+       cycle and the per-frame gains, allocated on Initialize */
+    AudioUnitParameterValue volume;
+    AudioUnitParameterEvent params[NULL_PARAM_EVENTS];
+    UInt32 nparams;
+    Float32* gain;
+
+    /* the synth: events are queued under the lock, voices belong to the
+       render thread */
+    null_midi_t events[NULL_SYNTH_EVENTS];
+    UInt32 nevents;
+    null_voice_t voices[NULL_SYNTH_VOICES];
+
+    /* the device thread; a thread stopped from within its own render
+       callback is detached and only signals when it has exited */
+    atomic_int running;
+    atomic_uint generation;
+    int has_thread;
+    int detached;
+    pthread_t thread;
+};
+
+/* The unit whose render callback the current thread is in, if any */
+static __thread AudioUnit null_rendering;
+
+/* The device buffer size; device threads pick it up with the next period */
+static atomic_uint null_device_frames = NULL_DEVICE_FRAMES;
+
+/*
+ * Host time: nanoseconds on the monotonic clock
+ */
+
+UInt64 AudioGetCurrentHostTime(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (UInt64)ts.tv_sec * 1000000000ULL + (UInt64)ts.tv_nsec;
+}
+
+UInt64 AudioConvertHostTimeToNanos(UInt64 inHostTime) { return inHostTime; }
+
+UInt64 AudioConvertNanosToHostTime(UInt64 inNanos) { return inNanos; }
+
+Float64 AudioGetHostClockFrequency(void) { return 1e9; }
+
+/*
+ * AudioComponent
+ */
+
+static int null_desc_matches(const AudioComponentDescription* desc,
+                             const AudioComponentDescription* pattern)
+{
+    // zero fields in the pattern are wildcards
+    return (!pattern->componentType
+            || pattern->componentType == desc->componentType)
+        && (!pattern->componentSubType
+            || pattern->componentSubType == desc->componentSubType)
+        && (!pattern->componentManufacturer
+            || pattern->componentManufacturer == desc->componentManufacturer);
+}
+
+AudioComponent AudioComponentFindNext(AudioComponent inComponent,
+                                      const AudioComponentDescription* inDesc)
+{
+    size_t i = inComponent ? (size_t)(inComponent - null_components) + 1 : 0;
+
+    for (; i < NULL_NCOMPONENTS; ++i)
+        if (null_desc_matches(&null_components[i].desc, inDesc))
+            return &null_components[i];
+
+    return NULL;
+}
+
+struct __CFString {
+    char* cstr;
+};
+
+OSStatus AudioComponentCopyName(AudioComponent inComponent,
+                                CFStringRef* outName)
+{
+    struct __CFString* name;
+
+    if (!inComponent)
+        return kAudioUnitErr_InvalidParameter;
+
+    if (!(name = malloc(sizeof(*name))))
+        return kAudioUnitErr_FailedInitialization;
+    if (!(name->cstr = strdup(inComponent->name))) {
+        free(name);
+        return kAudioUnitErr_FailedInitialization;
+    }
+
+    *outName = name;
+
+    return noErr;
+}
+
+OSStatus AudioComponentGetDescription(AudioComponent inComponent,
+                                      AudioComponentDescription* outDesc)
+{
+    if (!inComponent)
+        return kAudioUnitErr_InvalidParameter;
+
+    *outDesc = inComponent->desc;
+
+    return noErr;
+}
+
+OSStatus AudioComponentGetVersion(AudioComponent inComponent,
+                                  UInt32* outVersion)
+{
+    if (!inComponent)
+        return kAudioUnitErr_InvalidParameter;
+
+    *outVersion = inComponent->version;
+
+    return noErr;
+}
+
+Boolean CFStringGetCString(CFStringRef theString, char* buffer,
+                           CFIndex bufferSize, CFStringEncoding encoding)
+{
+    size_t len = strlen(theString->cstr);
+
+    if (encoding != kCFStringEncodingUTF8 || bufferSize <= 0
+        || len >= (size_t)bufferSize)
+        return 0;
+
+    memcpy(buffer, theString->cstr, len + 1);
+
+    return 1;
+}
+
+void CFRelease(CFTypeRef cf)
+{
+    struct __CFString* name = (struct __CFString*)cf;
+
+    // the only CoreFoundation objects we hand out are names
+    free(name->cstr);
+    free(name);
+}
+
+static void null_default_format(AudioStreamBasicDescription* fmt)
+{
+    // the canonical AudioUnit format: non-interleaved float32 stereo
+    memset(fmt, 0, sizeof(*fmt));
+    fmt->mSampleRate = 44100.0;
+    fmt->mFormatID = kAudioFormatLinearPCM;
+    fmt->mFormatFlags = kAudioFormatFlagIsFloat | kAudioFormatFlagIsPacked
+        | kAudioFormatFlagIsNonInterleaved | kAudioFormatFlagsNativeEndian;
+    fmt->mBytesPerPacket = 4;
+    fmt->mFramesPerPacket = 1;
+    fmt->mBytesPerFrame = 4;
+    fmt->mChannelsPerFrame = 2;
+    fmt->mBitsPerChannel = 32;
+}
+
+static AudioBufferList* null_alloc_buffers(const AudioStreamBasicDescription* fmt,
+                                           UInt32 frames)
+{
+    UInt32 nbuffers = fmt->mFormatFlags & kAudioFormatFlagIsNonInterleaved
+        ? fmt->mChannelsPerFrame
+        : 1;
+    UInt32 size = frames * (fmt->mBytesPerFrame ? fmt->mBytesPerFrame : 1);
+    AudioBufferList* abl;
+    Byte* data;
+    UInt32 i;
+
+    if (!nbuffers)
+        nbuffers = 1;
+
+    abl = calloc(1, sizeof(AudioBufferList)
+                     + (nbuffers - 1) * sizeof(AudioBuffer)
+                     + (size_t)nbuffers * size);
+    if (!abl)
+        return NULL;
+
+    data = (Byte*)&abl->mBuffers[nbuffers];
+    abl->mNumberBuffers = nbuffers;
+    for (i = 0; i < nbuffers; ++i) {
+        abl->mBuffers[i].mNumberChannels
+            = nbuffers == 1 ? fmt->mChannelsPerFrame : 1;
+        abl->mBuffers[i].mDataByteSize = size;
+        abl->mBuffers[i].mData = data + (size_t)i * size;
+    }
+
+    return abl;
+}
+
+/* Allocate the mixer's per-input scratch buffers. Caller holds the lock and
+   no render is in progress. */
+static OSStatus null_alloc_scratch(AudioUnit unit)
+{
+    UInt32 i;
+
+    if (unit->component->kind != NULL_MIXER)
+        return noErr;
+
+    for (i = 0; i < unit->ninputs; ++i) {
+        free(unit->inputs[i].scratch);
+        unit->inputs[i].scratch
+            = null_alloc_buffers(&unit->inputs[i].format, unit->max_frames);
+        if (!unit->inputs[i].scratch)
+            return kAudioUnitErr_FailedInitialization;
+    }
+
+    // a gain per frame for the input and for the output
+    free(unit->gain);
+    if (!(unit->gain = malloc(2 * unit->max_frames * sizeof(Float32))))
+        return kAudioUnitErr_FailedInitialization;
+
+    return noErr;
+}
+
+static void null_free_scratch(AudioUnit unit)
+{
+    UInt32 i;
+
+    for (i = 0; i < unit->ninputs; ++i) {
+        free(unit->inputs[i].scratch);
+        unit->inputs[i].scratch = NULL;
+    }
+
+    free(unit->gain);
+    unit->gain = NULL;
+}
+
+OSStatus AudioComponentInstanceNew(AudioComponent inComponent,
+                                   AudioComponentInstance* outInstance)
+{
+    AudioUnit unit;
+
+    if (!inComponent)
+        return kAudioUnitErr_InvalidParameter;
+
+    if (!(unit = calloc(1, sizeof(*unit))))
+        return kAudioUnitErr_FailedInitialization;
+
+    unit->component = inComponent;
+    // like the DLSSynth, the synth has no inputs
+    unit->ninputs = inComponent->kind == NULL_MIXER ? NULL_MIXER_INPUTS
+        : inComponent->kind == NULL_SYNTH        ? 0
+                                                 : 1;
+    unit->inputs = calloc(unit->ninputs ? unit->ninputs : 1,
+                          sizeof(null_element_t));
+    if (!unit->inputs) {
+        free(unit);
+        return kAudioUnitErr_FailedInitialization;
+    }
+    for (UInt32 i = 0; i < unit->ninputs; ++i) {
+        null_default_format(&unit->inputs[i].format);
+        unit->inputs[i].volume = 1.0f;
+    }
+    unit->volume = 1.0f;
+
+    pthread_mutex_init(&unit->lock, NULL);
+    pthread_cond_init(&unit->idle, NULL);
+    null_default_format(&unit->output_format);
+    unit->max_frames = NULL_MAX_FRAMES;
+
+    *outInstance = unit;
+
+    return noErr;
+}
+
+OSStatus AudioComponentInstanceDispose(AudioComponentInstance inInstance)
+{
+    if (!inInstance)
+        return kAudioUnitErr_InvalidParameter;
+
+    AudioOutputUnitStop(inInstance);
+
+    pthread_mutex_lock(&inInstance->lock);
+    while ((inInstance->rendering && null_rendering != inInstance)
+           || inInstance->detached)
+        pthread_cond_wait(&inInstance->idle, &inInstance->lock);
+    pthread_mutex_unlock(&inInstance->lock);
+
+    null_free_scratch(inInstance);
+    free(inInstance->inputs);
+    pthread_cond_destroy(&inInstance->idle);
+    pthread_mutex_destroy(&inInstance->lock);
+    free(inInstance);
+
+    return noErr;
+}
+
+/*
+ * AudioUnit
+ */
+
+OSStatus AudioUnitInitialize(AudioUnit inUnit)
+{
+    OSStatus rc;
+
+    pthread_mutex_lock(&inUnit->lock);
+    if ((rc = null_alloc_scratch(inUnit)) == noErr)
+        inUnit->initialized = 1;
+    pthread_mutex_unlock(&inUnit->lock);
+
+    return rc;
+}
+
+OSStatus AudioUnitUninitialize(AudioUnit inUnit)
+{
+    pthread_mutex_lock(&inUnit->lock);
+    inUnit->initialized = 0;
+    pthread_mutex_unlock(&inUnit->lock);
+
+    return noErr;
+}
+
+static OSStatus null_check_size(UInt32 size, size_t expected)
+{
+    return size < expected ? kAudioUnitErr_InvalidPropertyValue : noErr;
+}
+
+/* Wait until no render is in progress. Caller holds the lock. */
+static void null_wait_idle(AudioUnit unit)
+{
+    while (unit->rendering && null_rendering != unit)
+        pthread_cond_wait(&unit->idle, &unit->lock);
+}
+
+OSStatus AudioUnitReset(AudioUnit inUnit, AudioUnitScope inScope,
+                        AudioUnitElement inElement)
+{
+    if (inScope != kAudioUnitScope_Global)
+        return kAudioUnitErr_InvalidScope;
+
+    // only the synth and scheduled parameters outlive a render cycle
+    pthread_mutex_lock(&inUnit->lock);
+    null_wait_idle(inUnit);
+    inUnit->nparams = 0;
+    inUnit->nevents = 0;
+    memset(inUnit->voices, 0, sizeof(inUnit->voices));
+    pthread_mutex_unlock(&inUnit->lock);
+
+    return noErr;
+}
+
+static int null_is_output(AudioUnit unit)
+{
+    return unit->component->kind == NULL_DEVICE_OUTPUT
+        || unit->component->kind == NULL_GENERIC_OUTPUT;
+}
+
+/* Units whose input and output formats are always the same */
+static int null_is_passthrough(AudioUnit unit)
+{
+    return null_is_output(unit) || unit->component->kind == NULL_EFFECT;
+}
+
+static OSStatus null_set_stream_format(AudioUnit unit, AudioUnitScope scope,
+                                       AudioUnitElement element,
+                                       const AudioStreamBasicDescription* fmt)
+{
+    switch (scope) {
+    case kAudioUnitScope_Input:
+        if (element >= unit->ninputs)
+            return kAudioUnitErr_InvalidElement;
+        unit->inputs[element].format = *fmt;
+        break;
+    case kAudioUnitScope_Output:
+        if (element != 0)
+            return kAudioUnitErr_InvalidElement;
+        unit->output_format = *fmt;
+        break;
+    default:
+        return kAudioUnitErr_InvalidScope;
+    }
+
+    // Output units and effects do no format conversion
+    if (null_is_passthrough(unit)) {
+        unit->inputs[0].format = *fmt;
+        unit->output_format = *fmt;
+    }
+
+    if (unit->initialized && unit->component->kind == NULL_MIXER) {
+        null_wait_idle(unit);
+        return null_alloc_scratch(unit);
+    }
+
+    return noErr;
+}
+
+static OSStatus null_set_element_count(AudioUnit unit, AudioUnitScope scope,
+                                       UInt32 count)
+{
+    null_element_t* inputs;
+    UInt32 i;
+
+    if (scope != kAudioUnitScope_Input)
+        return kAudioUnitErr_InvalidScope;
+
+    if (unit->component->kind != NULL_MIXER)
+        return kAudioUnitErr_InvalidPropertyValue;
+
+    if (unit->initialized)
+        return kAudioUnitErr_Initialized;
+
+    if (!count || count > NULL_MAX_ELEMENTS)
+        return kAudioUnitErr_InvalidPropertyValue;
+
+    if (!(inputs = realloc(unit->inputs, count * sizeof(null_element_t))))
+        return kAudioUnitErr_FailedInitialization;
+
+    for (i = unit->ninputs; i < count; ++i) {
+        memset(&inputs[i], 0, sizeof(null_element_t));
+        null_default_format(&inputs[i].format);
+        inputs[i].volume = 1.0f;
+    }
+
+    unit->inputs = inputs;
+    unit->ninputs = count;
+
+    return noErr;
+}
+
+OSStatus AudioUnitSetProperty(AudioUnit inUnit, AudioUnitPropertyID inID,
+                              AudioUnitScope inScope,
+                              AudioUnitElement inElement, const void* inData,
+                              UInt32 inDataSize)
+{
+    OSStatus rc = noErr;
+
+    pthread_mutex_lock(&inUnit->lock);
+
+    switch (inID) {
+    case kAudioUnitProperty_StreamFormat:
+        if ((rc = null_check_size(inDataSize,
+                                  sizeof(AudioStreamBasicDescription))))
+            break;
+        rc = null_set_stream_format(
+            inUnit, inScope, inElement,
+            (const AudioStreamBasicDescription*)inData);
+        break;
+    case kAudioUnitProperty_ElementCount:
+        if ((rc = null_check_size(inDataSize, sizeof(UInt32))))
+            break;
+        rc = null_set_element_count(inUnit, inScope, *(const UInt32*)inData);
+        break;
+    case kAudioUnitProperty_SampleRate: {
+        AudioStreamBasicDescription fmt;
+
+        if ((rc = null_check_size(inDataSize, sizeof(Float64))))
+            break;
+        if (inScope == kAudioUnitScope_Input && inElement < inUnit->ninputs)
+            fmt = inUnit->inputs[inElement].format;
+        else if (inScope == kAudioUnitScope_Output && inElement == 0)
+            fmt = inUnit->output_format;
+        else {
+            rc = inScope == kAudioUnitScope_Input
+                    || inScope == kAudioUnitScope_Output
+                ? kAudioUnitErr_InvalidElement
+                : kAudioUnitErr_InvalidScope;
+            break;
+        }
+        fmt.mSampleRate = *(const Float64*)inData;
+        rc = null_set_stream_format(inUnit, inScope, inElement, &fmt);
+        break;
+    }
+    case kAudioUnitProperty_MaximumFramesPerSlice:
+        if ((rc = null_check_size(inDataSize, sizeof(UInt32))))
+            break;
+        if (inUnit->initialized)
+            rc = kAudioUnitErr_Initialized;
+        else if (!*(const UInt32*)inData)
+            rc = kAudioUnitErr_InvalidPropertyValue;
+        else
+            inUnit->max_frames = *(const UInt32*)inData;
+        break;
+    case kAudioOutputUnitProperty_CurrentDevice:
+        if ((rc = null_check_size(inDataSize, sizeof(AudioDeviceID))))
+            break;
+        if (inUnit->component->kind != NULL_DEVICE_OUTPUT)
+            rc = kAudioUnitErr_InvalidProperty;
+        else if (*(const AudioDeviceID*)inData != NULL_DEVICE_ID)
+            rc = kAudioUnitErr_InvalidPropertyValue;
+        break;
+    case kAudioUnitProperty_Latency:
+    case kAudioUnitProperty_TailTime:
+        rc = kAudioUnitErr_PropertyNotWritable;
+        break;
+    case kAudioUnitProperty_SetRenderCallback:
+        if ((rc = null_check_size(inDataSize, sizeof(AURenderCallbackStruct))))
+            break;
+        if (inScope != kAudioUnitScope_Input) {
+            rc = kAudioUnitErr_InvalidScope;
+            break;
+        }
+        if (inElement >= inUnit->ninputs) {
+            rc = kAudioUnitErr_InvalidElement;
+            break;
+        }
+        inUnit->inputs[inElement].input
+            = *(const AURenderCallbackStruct*)inData;
+        // Like CoreAudio, the previous callback is not called once we
+        // return, unless we are being called from within it
+        null_wait_idle(inUnit);
+        break;
+    default:
+        rc = kAudioUnitErr_InvalidProperty;
+    }
+
+    pthread_mutex_unlock(&inUnit->lock);
+
+    return rc;
+}
+
+OSStatus AudioUnitGetProperty(AudioUnit inUnit, AudioUnitPropertyID inID,
+                              AudioUnitScope inScope,
+                              AudioUnitElement inElement, void* outData,
+                              UInt32* ioDataSize)
+{
+    OSStatus rc = noErr;
+
+    pthread_mutex_lock(&inUnit->lock);
+
+    switch (inID) {
+    case kAudioUnitProperty_StreamFormat:
+        if ((rc = null_check_size(*ioDataSize,
+                                  sizeof(AudioStreamBasicDescription))))
+            break;
+        if (inScope == kAudioUnitScope_Input && inElement < inUnit->ninputs)
+            *(AudioStreamBasicDescription*)outData
+                = inUnit->inputs[inElement].format;
+        else if (inScope == kAudioUnitScope_Output && inElement == 0)
+            *(AudioStreamBasicDescription*)outData = inUnit->output_format;
+        else if (inScope == kAudioUnitScope_Input
+                 || inScope == kAudioUnitScope_Output)
+            rc = kAudioUnitErr_InvalidElement;
+        else
+            rc = kAudioUnitErr_InvalidScope;
+        *ioDataSize = sizeof(AudioStreamBasicDescription);
+        break;
+    case kAudioUnitProperty_ElementCount:
+        if ((rc = null_check_size(*ioDataSize, sizeof(UInt32))))
+            break;
+        if (inScope == kAudioUnitScope_Input)
+            *(UInt32*)outData = inUnit->ninputs;
+        else if (inScope == kAudioUnitScope_Output)
+            *(UInt32*)outData = 1;
+        else
+            *(UInt32*)outData = 1;
+        *ioDataSize = sizeof(UInt32);
+        break;
+    case kAudioUnitProperty_SampleRate:
+        if ((rc = null_check_size(*ioDataSize, sizeof(Float64))))
+            break;
+        if (inScope == kAudioUnitScope_Input && inElement < inUnit->ninputs)
+            *(Float64*)outData = inUnit->inputs[inElement].format.mSampleRate;
+        else if (inScope == kAudioUnitScope_Output && inElement == 0)
+            *(Float64*)outData = inUnit->output_format.mSampleRate;
+        else
+            rc = inScope == kAudioUnitScope_Input
+                    || inScope == kAudioUnitScope_Output
+                ? kAudioUnitErr_InvalidElement
+                : kAudioUnitErr_InvalidScope;
+        *ioDataSize = sizeof(Float64);
+        break;
+    case kAudioUnitProperty_MaximumFramesPerSlice:
+        if ((rc = null_check_size(*ioDataSize, sizeof(UInt32))))
+            break;
+        *(UInt32*)outData = inUnit->max_frames;
+        *ioDataSize = sizeof(UInt32);
+        break;
+    case kAudioUnitProperty_Latency:
+    case kAudioUnitProperty_TailTime:
+        // the stand-ins process without delay
+        if ((rc = null_check_size(*ioDataSize, sizeof(Float64))))
+            break;
+        *(Float64*)outData = 0.0;
+        *ioDataSize = sizeof(Float64);
+        break;
+    case kAudioOutputUnitProperty_CurrentDevice:
+        if ((rc = null_check_size(*ioDataSize, sizeof(AudioDeviceID))))
+            break;
+        if (inUnit->component->kind != NULL_DEVICE_OUTPUT) {
+            rc = kAudioUnitErr_InvalidProperty;
+            break;
+        }
+        *(AudioDeviceID*)outData = NULL_DEVICE_ID;
+        *ioDataSize = sizeof(AudioDeviceID);
+        break;
+    default:
+        rc = kAudioUnitErr_InvalidProperty;
+    }
+
+    pthread_mutex_unlock(&inUnit->lock);
+
+    return rc;
+}
+
+OSStatus AudioUnitGetPropertyInfo(AudioUnit inUnit, AudioUnitPropertyID inID,
+                                  AudioUnitScope inScope,
+                                  AudioUnitElement inElement,
+                                  UInt32* outDataSize, Boolean* outWritable)
+{
+    UInt32 size;
+    Boolean writable = 1;
+
+    switch (inID) {
+    case kAudioUnitProperty_StreamFormat:
+        size = sizeof(AudioStreamBasicDescription);
+        break;
+    case kAudioUnitProperty_SampleRate:
+        size = sizeof(Float64);
+        break;
+    case kAudioUnitProperty_ElementCount:
+    case kAudioUnitProperty_MaximumFramesPerSlice:
+        size = sizeof(UInt32);
+        break;
+    case kAudioUnitProperty_Latency:
+    case kAudioUnitProperty_TailTime:
+        size = sizeof(Float64);
+        writable = 0;
+        break;
+    case kAudioUnitProperty_SetRenderCallback:
+        size = sizeof(AURenderCallbackStruct);
+        break;
+    case kAudioOutputUnitProperty_CurrentDevice:
+        if (inUnit->component->kind != NULL_DEVICE_OUTPUT)
+            return kAudioUnitErr_InvalidProperty;
+        size = sizeof(AudioDeviceID);
+        break;
+    default:
+        return kAudioUnitErr_InvalidProperty;
+    }
+
+    if (outDataSize)
+        *outDataSize = size;
+    if (outWritable)
+        *outWritable = writable;
+
+    return noErr;
+}
+
+/*
+ * The device: a few read-only properties and the buffer size
+ */
+
+OSStatus AudioObjectGetPropertyData(AudioObjectID inObjectID,
+                                    const AudioObjectPropertyAddress* inAddress,
+                                    UInt32 inQualifierDataSize,
+                                    const void* inQualifierData,
+                                    UInt32* ioDataSize, void* outData)
+{
+    if (inObjectID != NULL_DEVICE_ID)
+        return kAudioHardwareBadObjectError;
+
+    switch (inAddress->mSelector) {
+    case kAudioDevicePropertyBufferFrameSize:
+    case kAudioDevicePropertyLatency:
+    case kAudioDevicePropertySafetyOffset:
+        if (*ioDataSize < sizeof(UInt32))
+            return kAudioHardwareBadPropertySizeError;
+        *(UInt32*)outData = inAddress->mSelector
+                == kAudioDevicePropertyBufferFrameSize
+            ? atomic_load(&null_device_frames)
+            : inAddress->mSelector == kAudioDevicePropertyLatency
+            ? NULL_DEVICE_LATENCY
+            : NULL_DEVICE_SAFETY_OFFSET;
+        *ioDataSize = sizeof(UInt32);
+        return noErr;
+    case kAudioDevicePropertyBufferFrameSizeRange:
+        if (*ioDataSize < sizeof(AudioValueRange))
+            return kAudioHardwareBadPropertySizeError;
+        ((AudioValueRange*)outData)->mMinimum = NULL_DEVICE_MIN_FRAMES;
+        ((AudioValueRange*)outData)->mMaximum = NULL_MAX_FRAMES;
+        *ioDataSize = sizeof(AudioValueRange);
+        return noErr;
+    case kAudioDevicePropertyNominalSampleRate:
+        if (*ioDataSize < sizeof(Float64))
+            return kAudioHardwareBadPropertySizeError;
+        *(Float64*)outData = 44100.0;
+        *ioDataSize = sizeof(Float64);
+        return noErr;
+    default:
+        return kAudioHardwareUnknownPropertyError;
+    }
+}
+
+OSStatus AudioObjectSetPropertyData(AudioObjectID inObjectID,
+                                    const AudioObjectPropertyAddress* inAddress,
+                                    UInt32 inQualifierDataSize,
+                                    const void* inQualifierData,
+                                    UInt32 inDataSize, const void* inData)
+{
+    UInt32 frames;
+
+    if (inObjectID != NULL_DEVICE_ID)
+        return kAudioHardwareBadObjectError;
+
+    switch (inAddress->mSelector) {
+    case kAudioDevicePropertyBufferFrameSize:
+        if (inDataSize < sizeof(UInt32))
+            return kAudioHardwareBadPropertySizeError;
+        frames = *(const UInt32*)inData;
+        if (frames < NULL_DEVICE_MIN_FRAMES || frames > NULL_MAX_FRAMES)
+            return kAudioHardwareIllegalOperationError;
+        atomic_store(&null_device_frames, frames);
+        return noErr;
+    case kAudioDevicePropertyBufferFrameSizeRange:
+    case kAudioDevicePropertyLatency:
+    case kAudioDevicePropertySafetyOffset:
+    case kAudioDevicePropertyNominalSampleRate:
+        return kAudioHardwareIllegalOperationError;
+    default:
+        return kAudioHardwareUnknownPropertyError;
+    }
+}
+
+static void null_silence(AudioBufferList* ioData)
+{
+    UInt32 i;
+
+    for (i = 0; i < ioData->mNumberBuffers; ++i)
+        memset(ioData->mBuffers[i].mData, 0, ioData->mBuffers[i].mDataByteSize);
+}
+
+/* Pull input element 'bus' through its render callback */
+static OSStatus null_pull_input(AudioUnit unit,
+                                AudioUnitRenderActionFlags* ioActionFlags,
+                                const AudioTimeStamp* inTimeStamp, UInt32 bus,
+                                UInt32 inNumberFrames, AudioBufferList* ioData)
+{
+    AURenderCallbackStruct input;
+    AudioUnit outer = null_rendering;
+    OSStatus rc;
+
+    pthread_mutex_lock(&unit->lock);
+    input = unit->inputs[bus].input;
+    pthread_mutex_unlock(&unit->lock);
+
+    if (input.inputProc) {
+        null_rendering = unit;
+        rc = input.inputProc(input.inputProcRefCon, ioActionFlags,
+                             inTimeStamp, bus, inNumberFrames, ioData);
+        null_rendering = outer;
+    } else {
+        null_silence(ioData);
+        *ioActionFlags |= kAudioUnitRenderAction_OutputIsSilence;
+        rc = noErr;
+    }
+
+    return rc;
+}
+
+/*
+ * Parameters: the mixer has a volume for each input and for its output
+ */
+
+/* The volume 'inScope'/'inElement' refers to, or NULL */
+static AudioUnitParameterValue* null_volume(AudioUnit unit,
+                                            AudioUnitParameterID inID,
+                                            AudioUnitScope inScope,
+                                            AudioUnitElement inElement,
+                                            OSStatus* rc)
+{
+    *rc = kAudioUnitErr_InvalidParameter;
+
+    if (unit->component->kind != NULL_MIXER
+        || inID != kMultiChannelMixerParam_Volume)
+        return NULL;
+
+    *rc = kAudioUnitErr_InvalidElement;
+
+    if (inScope == kAudioUnitScope_Input) {
+        if (inElement < unit->ninputs)
+            return &unit->inputs[inElement].volume;
+    } else if (inScope == kAudioUnitScope_Output) {
+        if (inElement == 0)
+            return &unit->volume;
+    } else
+        *rc = kAudioUnitErr_InvalidScope;
+
+    return NULL;
+}
+
+OSStatus AudioUnitGetParameter(AudioUnit inUnit, AudioUnitParameterID inID,
+                               AudioUnitScope inScope,
+                               AudioUnitElement inElement,
+                               AudioUnitParameterValue* outValue)
+{
+    AudioUnitParameterValue* volume;
+    OSStatus rc = noErr;
+
+    pthread_mutex_lock(&inUnit->lock);
+    if ((volume = null_volume(inUnit, inID, inScope, inElement, &rc))) {
+        *outValue = *volume;
+        rc = noErr;
+    }
+    pthread_mutex_unlock(&inUnit->lock);
+
+    return rc;
+}
+
+OSStatus AudioUnitSetParameter(AudioUnit inUnit, AudioUnitParameterID inID,
+                               AudioUnitScope inScope,
+                               AudioUnitElement inElement,
+                               AudioUnitParameterValue inValue,
+                               UInt32 inBufferOffsetInFrames)
+{
+    AudioUnitParameterValue* volume;
+    OSStatus rc = noErr;
+
+    // the offset is ignored, like it is outside of a render cycle
+    pthread_mutex_lock(&inUnit->lock);
+    if ((volume = null_volume(inUnit, inID, inScope, inElement, &rc))) {
+        *volume = inValue;
+        rc = noErr;
+    }
+    pthread_mutex_unlock(&inUnit->lock);
+
+    return rc;
+}
+
+/* Events apply to the next render cycle, or to the current one when sent
+   from a render notification */
+OSStatus AudioUnitScheduleParameters(
+    AudioUnit inUnit, const AudioUnitParameterEvent* inParameterEvent,
+    UInt32 inNumParamEvents)
+{
+    OSStatus rc = noErr;
+    UInt32 i;
+
+    pthread_mutex_lock(&inUnit->lock);
+    for (i = 0; i < inNumParamEvents && rc == noErr; ++i) {
+        const AudioUnitParameterEvent* event = &inParameterEvent[i];
+
+        if (!null_volume(inUnit, event->parameter, event->scope,
+                         event->element, &rc))
+            break;
+        rc = noErr;
+
+        if (event->eventType != kParameterEvent_Immediate
+            && event->eventType != kParameterEvent_Ramped)
+            rc = kAudioUnitErr_InvalidParameter;
+        else if (inUnit->nparams == NULL_PARAM_EVENTS)
+            rc = kAudioUnitErr_CannotDoInCurrentContext;
+        else
+            inUnit->params[inUnit->nparams++] = *event;
+    }
+    pthread_mutex_unlock(&inUnit->lock);
+
+    return rc;
+}
+
+/* Fill 'gain' with the volume of 'scope'/'element' for each frame, applying
+   the events in order, and keep the value at the end */
+static void null_gain(const AudioUnitParameterEvent* events, UInt32 nevents,
+                      AudioUnitScope scope, AudioUnitElement element,
+                      AudioUnitParameterValue* volume, Float32* gain,
+                      UInt32 frames)
+{
+    UInt32 e, i;
+
+    for (i = 0; i < frames; ++i)
+        gain[i] = *volume;
+
+    for (e = 0; e < nevents; ++e) {
+        const AudioUnitParameterEvent* event = &events[e];
+
+        if (event->scope != scope || event->element != element)
+            continue;
+
+        if (event->eventType == kParameterEvent_Immediate) {
+            *volume = event->eventValues.immediate.value;
+            for (i = event->eventValues.immediate.bufferOffset; i < frames;
+                 ++i)
+                gain[i] = *volume;
+        } else {
+            SInt64 start = event->eventValues.ramp.startBufferOffset;
+            UInt32 duration = event->eventValues.ramp.durationInFrames;
+            Float32 from = event->eventValues.ramp.startValue;
+            Float32 to = event->eventValues.ramp.endValue;
+
+            for (i = start > 0 ? (UInt32)start : 0; i < frames; ++i)
+                gain[i] = (SInt64)i < start + duration
+                    ? from + (to - from) * (Float32)((SInt64)i - start)
+                        / duration
+                    : to;
+            *volume = start + duration <= frames
+                ? to
+                : from + (to - from) * (Float32)(frames - start) / duration;
+        }
+    }
+}
+
+/*
+ * The mixer: pulls every input bus that has a render callback and sums it
+ * into a float32 non-interleaved output, scaled by the input and output
+ * volumes. Inputs may be float32 or 16 bit signed integer, interleaved or
+ * not; mono inputs go to all channels.
+ */
+
+static Float32 null_sample(const AudioBufferList* abl,
+                           const AudioStreamBasicDescription* fmt,
+                           UInt32 channel, UInt32 frame)
+{
+    UInt32 buffer = 0, index = frame;
+
+    if (fmt->mFormatFlags & kAudioFormatFlagIsNonInterleaved)
+        buffer = channel;
+    else
+        index = frame * fmt->mChannelsPerFrame + channel;
+
+    if (fmt->mFormatFlags & kAudioFormatFlagIsFloat)
+        return ((const Float32*)abl->mBuffers[buffer].mData)[index];
+
+    return ((const SInt16*)abl->mBuffers[buffer].mData)[index] / 32768.0f;
+}
+
+static int null_mixable(const AudioStreamBasicDescription* fmt)
+{
+    if (fmt->mFormatID != kAudioFormatLinearPCM || !fmt->mChannelsPerFrame)
+        return 0;
+
+    if (fmt->mFormatFlags & kAudioFormatFlagIsFloat)
+        return fmt->mBitsPerChannel == 32;
+
+    return (fmt->mFormatFlags & kAudioFormatFlagIsSignedInteger)
+        && fmt->mBitsPerChannel == 16;
+}
+
+static OSStatus null_mixer_render(AudioUnit unit,
+                                  AudioUnitRenderActionFlags* ioActionFlags,
+                                  const AudioTimeStamp* inTimeStamp,
+                                  UInt32 inNumberFrames,
+                                  AudioBufferList* ioData)
+{
+    AudioUnitParameterEvent params[NULL_PARAM_EVENTS];
+    Float32* gain = unit->gain;
+    Float32* volume = unit->gain + unit->max_frames;
+    UInt32 nparams, bus, c, i, j;
+    int silent = 1;
+
+    if (!(unit->output_format.mFormatFlags & kAudioFormatFlagIsFloat)
+        || !(unit->output_format.mFormatFlags
+             & kAudioFormatFlagIsNonInterleaved))
+        return kAudioUnitErr_FormatNotSupported;
+
+    pthread_mutex_lock(&unit->lock);
+    nparams = unit->nparams;
+    memcpy(params, unit->params, nparams * sizeof(AudioUnitParameterEvent));
+    unit->nparams = 0;
+    null_gain(params, nparams, kAudioUnitScope_Output, 0, &unit->volume,
+              volume, inNumberFrames);
+    pthread_mutex_unlock(&unit->lock);
+
+    null_silence(ioData);
+
+    for (bus = 0; bus < unit->ninputs; ++bus) {
+        null_element_t* in = &unit->inputs[bus];
+        AudioUnitRenderActionFlags flags = 0;
+        OSStatus rc;
+
+        if (!in->input.inputProc || !in->scratch)
+            continue;
+
+        if (!null_mixable(&in->format))
+            return kAudioUnitErr_FormatNotSupported;
+
+        for (j = 0; j < in->scratch->mNumberBuffers; ++j)
+            in->scratch->mBuffers[j].mDataByteSize
+                = inNumberFrames * in->format.mBytesPerFrame;
+
+        rc = null_pull_input(unit, &flags, inTimeStamp, bus, inNumberFrames,
+                             in->scratch);
+        if (rc != noErr)
+            return rc;
+
+        pthread_mutex_lock(&unit->lock);
+        null_gain(params, nparams, kAudioUnitScope_Input, bus, &in->volume,
+                  gain, inNumberFrames);
+        pthread_mutex_unlock(&unit->lock);
+
+        if (flags & kAudioUnitRenderAction_OutputIsSilence)
+            continue;
+        silent = 0;
+
+        for (c = 0; c < ioData->mNumberBuffers; ++c) {
+            Float32* out = ioData->mBuffers[c].mData;
+            UInt32 channel = c < in->format.mChannelsPerFrame
+                ? c
+                : in->format.mChannelsPerFrame - 1;
+
+            for (i = 0; i < inNumberFrames; ++i)
+                out[i] += gain[i]
+                    * null_sample(in->scratch, &in->format, channel, i);
+        }
+    }
+
+    for (c = 0; c < ioData->mNumberBuffers; ++c) {
+        Float32* out = ioData->mBuffers[c].mData;
+
+        for (i = 0; i < inNumberFrames; ++i)
+            out[i] *= volume[i];
+    }
+
+    if (silent)
+        *ioActionFlags |= kAudioUnitRenderAction_OutputIsSilence;
+
+    return noErr;
+}
+
+/*
+ * The synth: a stand-in for the DLSSynth that plays every note as a sine
+ * tone with a short attack and release. It understands note on, note off
+ * and the all notes/sound off controllers; other events are ignored.
+ * Events sent from within a render notification apply to the cycle being
+ * rendered, events sent at other times to the next one.
+ */
+
+OSStatus MusicDeviceMIDIEvent(MusicDeviceComponent inUnit, UInt32 inStatus,
+                              UInt32 inData1, UInt32 inData2,
+                              UInt32 inOffsetSampleFrame)
+{
+    OSStatus rc = noErr;
+    null_midi_t* event;
+
+    if (inUnit->component->kind != NULL_SYNTH)
+        return kAudioUnitErr_InvalidProperty;
+
+    pthread_mutex_lock(&inUnit->lock);
+    if (inUnit->nevents == NULL_SYNTH_EVENTS)
+        rc = kAudioUnitErr_CannotDoInCurrentContext;
+    else {
+        event = &inUnit->events[inUnit->nevents++];
+        event->offset = inOffsetSampleFrame;
+        event->status = (UInt8)inStatus;
+        event->data1 = (UInt8)inData1;
+        event->data2 = (UInt8)inData2;
+    }
+    pthread_mutex_unlock(&inUnit->lock);
+
+    return rc;
+}
+
+static void null_synth_event(AudioUnit unit, const null_midi_t* event,
+                             Float64 sample_rate)
+{
+    UInt8 channel = event->status & 0x0f;
+    null_voice_t* voice = NULL;
+    UInt32 i;
+
+    switch (event->status & 0xf0) {
+    case 0x90:
+        if (event->data2) {
+            // a free voice, or the quietest one
+            for (i = 0; i < NULL_SYNTH_VOICES; ++i) {
+                null_voice_t* v = &unit->voices[i];
+
+                if (v->state == VOICE_OFF) {
+                    voice = v;
+                    break;
+                }
+                if (!voice || v->level < voice->level)
+                    voice = v;
+            }
+            voice->state = VOICE_ATTACK;
+            voice->channel = channel;
+            voice->note = event->data1;
+            voice->gain = event->data2 / 127.0f * 0.25f;
+            voice->level = 0.0f;
+            voice->phase = 0.0;
+            voice->increment = 2.0 * M_PI * 440.0
+                * pow(2.0, (event->data1 - 69) / 12.0) / sample_rate;
+            break;
+        }
+        // note on with velocity 0 is note off
+        /* fall through */
+    case 0x80:
+        for (i = 0; i < NULL_SYNTH_VOICES; ++i) {
+            null_voice_t* v = &unit->voices[i];
+
+            if (v->state != VOICE_OFF && v->state != VOICE_RELEASE
+                && v->channel == channel && v->note == event->data1)
+                v->state = VOICE_RELEASE;
+        }
+        break;
+    case 0xb0:
+        // all sound off stops at once, all notes off releases
+        if (event->data1 != 120 && event->data1 != 123)
+            break;
+        for (i = 0; i < NULL_SYNTH_VOICES; ++i) {
+            null_voice_t* v = &unit->voices[i];
+
+            if (v->channel != channel || v->state == VOICE_OFF)
+                continue;
+            v->state = event->data1 == 120 ? VOICE_OFF : VOICE_RELEASE;
+        }
+        break;
+    }
+}
+
+/* Add frames [start, end) of all voices to the output */
+static void null_synth_voices(AudioUnit unit, AudioBufferList* ioData,
+                              UInt32 start, UInt32 end, Float32 attack,
+                              Float32 release)
+{
+    const AudioStreamBasicDescription* fmt = &unit->output_format;
+    int interleaved = !(fmt->mFormatFlags & kAudioFormatFlagIsNonInterleaved);
+    UInt32 channels = fmt->mChannelsPerFrame;
+    UInt32 v, i, c;
+
+    for (v = 0; v < NULL_SYNTH_VOICES; ++v) {
+        null_voice_t* voice = &unit->voices[v];
+
+        for (i = start; i < end && voice->state != VOICE_OFF; ++i) {
+            Float32 sample;
+
+            if (voice->state == VOICE_ATTACK
+                && (voice->level += attack) >= 1.0f) {
+                voice->level = 1.0f;
+                voice->state = VOICE_SUSTAIN;
+            } else if (voice->state == VOICE_RELEASE
+                       && (voice->level -= release) <= 0.0f) {
+                voice->level = 0.0f;
+                voice->state = VOICE_OFF;
+            }
+
+            sample = (Float32)sin(voice->phase) * voice->gain * voice->level;
+            voice->phase += voice->increment;
+            if (voice->phase >= 2.0 * M_PI)
+                voice->phase -= 2.0 * M_PI;
+
+            for (c = 0; c < channels; ++c) {
+                if (interleaved)
+                    ((Float32*)ioData->mBuffers[0].mData)[i * channels + c]
+                        += sample;
+                else
+                    ((Float32*)ioData->mBuffers[c].mData)[i] += sample;
+            }
+        }
+    }
+}
+
+static OSStatus null_synth_render(AudioUnit unit,
+                                  AudioUnitRenderActionFlags* ioActionFlags,
+                                  UInt32 inNumberFrames,
+                                  AudioBufferList* ioData)
+{
+    const AudioStreamBasicDescription* fmt = &unit->output_format;
+    Float64 sample_rate = fmt->mSampleRate > 0.0 ? fmt->mSampleRate : 44100.0;
+    null_midi_t events[NULL_SYNTH_EVENTS];
+    UInt32 nevents, i, j, pos = 0;
+    int silent = 1;
+
+    if (!(fmt->mFormatFlags & kAudioFormatFlagIsFloat)
+        || fmt->mBitsPerChannel != 32)
+        return kAudioUnitErr_FormatNotSupported;
+
+    pthread_mutex_lock(&unit->lock);
+    nevents = unit->nevents;
+    memcpy(events, unit->events, nevents * sizeof(null_midi_t));
+    unit->nevents = 0;
+    pthread_mutex_unlock(&unit->lock);
+
+    // order by offset, keeping the order of simultaneous events
+    for (i = 1; i < nevents; ++i) {
+        null_midi_t event = events[i];
+
+        for (j = i; j > 0 && events[j - 1].offset > event.offset; --j)
+            events[j] = events[j - 1];
+        events[j] = event;
+    }
+
+    null_silence(ioData);
+
+    for (i = 0; i <= nevents; ++i) {
+        UInt32 end = i < nevents ? events[i].offset : inNumberFrames;
+
+        if (end > inNumberFrames)
+            end = inNumberFrames;
+        if (end > pos) {
+            null_synth_voices(unit, ioData, pos, end,
+                              (Float32)(1.0 / (0.005 * sample_rate)),
+                              (Float32)(1.0 / (0.05 * sample_rate)));
+            pos = end;
+        }
+        if (i < nevents)
+            null_synth_event(unit, &events[i], sample_rate);
+    }
+
+    for (i = 0; i < NULL_SYNTH_VOICES; ++i)
+        if (unit->voices[i].state != VOICE_OFF)
+            silent = 0;
+
+    if (silent && !nevents)
+        *ioActionFlags |= kAudioUnitRenderAction_OutputIsSilence;
+
+    return noErr;
+}
+
+/*
+ * Render notifications
+ */
+
+OSStatus AudioUnitAddRenderNotify(AudioUnit inUnit, AURenderCallback inProc,
+                                  void* inProcUserData)
+{
+    OSStatus rc = noErr;
+
+    pthread_mutex_lock(&inUnit->lock);
+    if (inUnit->nnotify == NULL_MAX_NOTIFY)
+        rc = kAudioUnitErr_FailedInitialization;
+    else {
+        inUnit->notify[inUnit->nnotify].inputProc = inProc;
+        inUnit->notify[inUnit->nnotify].inputProcRefCon = inProcUserData;
+        inUnit->nnotify++;
+    }
+    pthread_mutex_unlock(&inUnit->lock);
+
+    return rc;
+}
+
+OSStatus AudioUnitRemoveRenderNotify(AudioUnit inUnit, AURenderCallback inProc,
+                                     void* inProcUserData)
+{
+    UInt32 i;
+
+    pthread_mutex_lock(&inUnit->lock);
+    for (i = 0; i < inUnit->nnotify; ++i) {
+        if (inUnit->notify[i].inputProc == inProc
+            && inUnit->notify[i].inputProcRefCon == inProcUserData) {
+            memmove(&inUnit->notify[i], &inUnit->notify[i + 1],
+                    (inUnit->nnotify - i - 1) * sizeof(AURenderCallbackStruct));
+            inUnit->nnotify--;
+            break;
+        }
+    }
+    // as with render callbacks, a removed notification is not called again
+    null_wait_idle(inUnit);
+    pthread_mutex_unlock(&inUnit->lock);
+
+    return noErr;
+}
+
+static OSStatus null_notify(AudioUnit unit, AudioUnitRenderActionFlags phase,
+                            AudioUnitRenderActionFlags* ioActionFlags,
+                            const AudioTimeStamp* inTimeStamp, UInt32 bus,
+                            UInt32 inNumberFrames, AudioBufferList* ioData)
+{
+    AURenderCallbackStruct notify[NULL_MAX_NOTIFY];
+    UInt32 nnotify, i;
+    OSStatus rc = noErr;
+
+    pthread_mutex_lock(&unit->lock);
+    nnotify = unit->nnotify;
+    memcpy(notify, unit->notify, nnotify * sizeof(AURenderCallbackStruct));
+    pthread_mutex_unlock(&unit->lock);
+
+    for (i = 0; i < nnotify && rc == noErr; ++i) {
+        AudioUnitRenderActionFlags flags = *ioActionFlags | phase;
+
+        rc = notify[i].inputProc(notify[i].inputProcRefCon, &flags,
+                                 inTimeStamp, bus, inNumberFrames, ioData);
+    }
+
+    return rc;
+}
+
+OSStatus AudioUnitRender(AudioUnit inUnit,
+                         AudioUnitRenderActionFlags* ioActionFlags,
+                         const AudioTimeStamp* inTimeStamp,
+                         UInt32 inOutputBusNumber, UInt32 inNumberFrames,
+                         AudioBufferList* ioData)
+{
+    OSStatus rc;
+
+    if (!inUnit->initialized)
+        return kAudioUnitErr_Uninitialized;
+
+    if (inOutputBusNumber != 0)
+        return kAudioUnitErr_InvalidElement;
+
+    if (inNumberFrames > inUnit->max_frames)
+        return kAudioUnitErr_TooManyFramesToProcess;
+
+    // Property changes that affect rendering wait for this to drop to zero
+    pthread_mutex_lock(&inUnit->lock);
+    inUnit->rendering++;
+    pthread_mutex_unlock(&inUnit->lock);
+
+    rc = null_notify(inUnit, kAudioUnitRenderAction_PreRender, ioActionFlags,
+                     inTimeStamp, inOutputBusNumber, inNumberFrames, ioData);
+
+    if (rc == noErr) {
+        if (inUnit->component->kind == NULL_MIXER)
+            rc = null_mixer_render(inUnit, ioActionFlags, inTimeStamp,
+                                   inNumberFrames, ioData);
+        else if (inUnit->component->kind == NULL_SYNTH)
+            rc = null_synth_render(inUnit, ioActionFlags, inNumberFrames,
+                                   ioData);
+        else
+            rc = null_pull_input(inUnit, ioActionFlags, inTimeStamp, 0,
+                                 inNumberFrames, ioData);
+    }
+
+    if (rc == noErr)
+        rc = null_notify(inUnit, kAudioUnitRenderAction_PostRender,
+                         ioActionFlags, inTimeStamp, inOutputBusNumber,
+                         inNumberFrames, ioData);
+
+    pthread_mutex_lock(&inUnit->lock);
+    if (--inUnit->rendering == 0)
+        pthread_cond_broadcast(&inUnit->idle);
+    pthread_mutex_unlock(&inUnit->lock);
+
+    return rc;
+}
+
+/*
+ * The simulated device: renders a period, then sleeps until it is due
+ */
+
+static void* null_device_thread(void* arg)
+{
+    AudioUnit unit = (AudioUnit)arg;
+    AudioStreamBasicDescription fmt;
+    AudioBufferList* abl;
+    AudioTimeStamp ts;
+    struct timespec next;
+    UInt32 frames;
+    UInt32 max_frames;
+    UInt64 period_ns;
+    unsigned int generation = atomic_load(&unit->generation);
+    UInt32 i;
+
+    // MaximumFramesPerSlice cannot change while we are initialized
+    pthread_mutex_lock(&unit->lock);
+    fmt = unit->output_format;
+    max_frames = unit->max_frames;
+    pthread_mutex_unlock(&unit->lock);
+
+    if (fmt.mSampleRate <= 0.0)
+        fmt.mSampleRate = 44100.0;
+
+    if (!(abl = null_alloc_buffers(&fmt, max_frames)))
+        goto done;
+
+    memset(&ts, 0, sizeof(ts));
+    ts.mRateScalar = 1.0;
+    ts.mFlags = kAudioTimeStampSampleTimeValid | kAudioTimeStampHostTimeValid
+        | kAudioTimeStampRateScalarValid;
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    for (;;) {
+        AudioUnitRenderActionFlags flags = 0;
+
+        frames = atomic_load(&null_device_frames);
+        if (frames > max_frames)
+            frames = max_frames;
+        period_ns = (UInt64)(frames * 1e9 / fmt.mSampleRate);
+
+        for (i = 0; i < abl->mNumberBuffers; ++i)
+            abl->mBuffers[i].mDataByteSize = frames * fmt.mBytesPerFrame;
+
+        ts.mHostTime = AudioGetCurrentHostTime();
+        AudioUnitRender(unit, &flags, &ts, 0, frames, abl);
+        ts.mSampleTime += frames;
+
+        if (!atomic_load(&unit->running)
+            || atomic_load(&unit->generation) != generation)
+            break;
+
+        next.tv_nsec += period_ns;
+        while (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL)
+               == EINTR)
+            ;
+    }
+
+    free(abl);
+
+done:
+    pthread_mutex_lock(&unit->lock);
+    if (unit->detached && atomic_load(&unit->generation) == generation) {
+        unit->detached = 0;
+        pthread_cond_broadcast(&unit->idle);
+    }
+    pthread_mutex_unlock(&unit->lock);
+
+    return NULL;
+}
+
+OSStatus AudioOutputUnitStart(AudioUnit ci)
+{
+    OSStatus rc = noErr;
+
+    if (!ci->initialized)
+        return kAudioUnitErr_Uninitialized;
+
+    if (ci->component->kind != NULL_DEVICE_OUTPUT)
+        return null_is_output(ci) ? noErr : kAudioUnitErr_InvalidProperty;
+
+    pthread_mutex_lock(&ci->lock);
+    while (ci->detached)
+        pthread_cond_wait(&ci->idle, &ci->lock);
+    if (!ci->has_thread) {
+        atomic_fetch_add(&ci->generation, 1);
+        atomic_store(&ci->running, 1);
+        if (pthread_create(&ci->thread, NULL, null_device_thread, ci) == 0)
+            ci->has_thread = 1;
+        else {
+            atomic_store(&ci->running, 0);
+            rc = kAudioUnitErr_FailedInitialization;
+        }
+    }
+    pthread_mutex_unlock(&ci->lock);
+
+    return rc;
+}
+
+OSStatus AudioOutputUnitStop(AudioUnit ci)
+{
+    pthread_t thread;
+    int has_thread;
+
+    pthread_mutex_lock(&ci->lock);
+    atomic_store(&ci->running, 0);
+    thread = ci->thread;
+    has_thread = ci->has_thread;
+    ci->has_thread = 0;
+    // Stopping from within the render callback is allowed
+    if (has_thread && pthread_equal(thread, pthread_self())) {
+        ci->detached = 1;
+        pthread_detach(thread);
+        has_thread = 0;
+    }
+    pthread_mutex_unlock(&ci->lock);
+
+    if (has_thread)
+        pthread_join(thread, NULL);
+
+    return noErr;
+}
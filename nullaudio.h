@@ -0,0 +1,449 @@
+/*
+ * nullaudio -- a device-less stand-in for the CoreAudio/AudioUnit API
+ *
+ * This implements the subset of the AudioUnit API that coreaudio.c uses,
+ * so the module can be built and its render path exercised on platforms
+ * without CoreAudio. Output units render into the void, paced in real
+ * time by a thread once started; GenericOutput units are only rendered
+ * by calling AudioUnitRender.
+ *
+ * Author: Lars Immisch (lars@ibp.de)
+ *
+ * License: Python Software Foundation License
+ *
+ */
+
+#ifndef NULLAUDIO_H
+#define NULLAUDIO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint8_t Byte;
+typedef uint8_t UInt8;
+typedef int8_t SInt8;
+typedef uint16_t UInt16;
+typedef int16_t SInt16;
+typedef uint32_t UInt32;
+typedef int32_t SInt32;
+typedef uint64_t UInt64;
+typedef int64_t SInt64;
+typedef float Float32;
+typedef double Float64;
+typedef unsigned char Boolean;
+
+typedef long CFIndex;
+typedef UInt32 CFStringEncoding;
+typedef const void* CFTypeRef;
+typedef const struct __CFString* CFStringRef;
+
+enum {
+    kCFStringEncodingUTF8 = 0x08000100,
+};
+
+typedef SInt16 OSErr;
+typedef SInt32 OSStatus;
+typedef UInt32 OSType;
+
+#define noErr 0
+
+#define FOURCC(a, b, c, d)                                                    \
+    (((UInt32)(a) << 24) | ((UInt32)(b) << 16) | ((UInt32)(c) << 8)          \
+     | (UInt32)(d))
+
+typedef struct {
+    OSType componentType;
+    OSType componentSubType;
+    OSType componentManufacturer;
+    UInt32 componentFlags;
+    UInt32 componentFlagsMask;
+} AudioComponentDescription;
+
+typedef struct OpaqueAudioComponent* AudioComponent;
+typedef struct ComponentInstanceRecord* AudioComponentInstance;
+typedef AudioComponentInstance AudioUnit;
+
+typedef struct {
+    Float64 mSampleRate;
+    UInt32 mFormatID;
+    UInt32 mFormatFlags;
+    UInt32 mBytesPerPacket;
+    UInt32 mFramesPerPacket;
+    UInt32 mBytesPerFrame;
+    UInt32 mChannelsPerFrame;
+    UInt32 mBitsPerChannel;
+    UInt32 mReserved;
+} AudioStreamBasicDescription;
+
+typedef struct {
+    SInt16 mSubframes;
+    SInt16 mSubframeDivisor;
+    UInt32 mCounter;
+    UInt32 mType;
+    UInt32 mFlags;
+    SInt16 mHours;
+    SInt16 mMinutes;
+    SInt16 mSeconds;
+    SInt16 mFrames;
+} SMPTETime;
+
+typedef struct {
+    Float64 mSampleTime;
+    UInt64 mHostTime;
+    Float64 mRateScalar;
+    UInt64 mWordClockTime;
+    SMPTETime mSMPTETime;
+    UInt32 mFlags;
+    UInt32 mReserved;
+} AudioTimeStamp;
+
+typedef struct {
+    UInt32 mNumberChannels;
+    UInt32 mDataByteSize;
+    void* mData;
+} AudioBuffer;
+
+typedef struct {
+    UInt32 mNumberBuffers;
+    AudioBuffer mBuffers[1];
+} AudioBufferList;
+
+typedef UInt32 AudioUnitRenderActionFlags;
+typedef UInt32 AudioUnitPropertyID;
+typedef UInt32 AudioUnitScope;
+typedef UInt32 AudioUnitElement;
+typedef UInt32 AudioUnitParameterID;
+typedef Float32 AudioUnitParameterValue;
+
+typedef OSStatus (*AURenderCallback)(void* inRefCon,
+                                     AudioUnitRenderActionFlags* ioActionFlags,
+                                     const AudioTimeStamp* inTimeStamp,
+                                     UInt32 inBusNumber, UInt32 inNumberFrames,
+                                     AudioBufferList* ioData);
+
+typedef struct {
+    AURenderCallback inputProc;
+    void* inputProcRefCon;
+} AURenderCallbackStruct;
+
+typedef UInt32 AUParameterEventType;
+
+typedef struct {
+    AudioUnitScope scope;
+    AudioUnitElement element;
+    AudioUnitParameterID parameter;
+    AUParameterEventType eventType;
+    union {
+        struct {
+            SInt32 startBufferOffset;
+            UInt32 durationInFrames;
+            AudioUnitParameterValue startValue;
+            AudioUnitParameterValue endValue;
+        } ramp;
+        struct {
+            UInt32 bufferOffset;
+            AudioUnitParameterValue value;
+        } immediate;
+    } eventValues;
+} AudioUnitParameterEvent;
+
+typedef UInt32 AudioObjectID;
+typedef AudioObjectID AudioDeviceID;
+typedef UInt32 AudioObjectPropertySelector;
+typedef UInt32 AudioObjectPropertyScope;
+typedef UInt32 AudioObjectPropertyElement;
+
+typedef struct {
+    AudioObjectPropertySelector mSelector;
+    AudioObjectPropertyScope mScope;
+    AudioObjectPropertyElement mElement;
+} AudioObjectPropertyAddress;
+
+typedef struct {
+    Float64 mMinimum;
+    Float64 mMaximum;
+} AudioValueRange;
+
+/* Component types, subtypes and manufacturers */
+
+enum {
+    kAudioUnitType_Output = FOURCC('a', 'u', 'o', 'u'),
+    kAudioUnitSubType_HALOutput = FOURCC('a', 'h', 'a', 'l'),
+    kAudioUnitSubType_DefaultOutput = FOURCC('d', 'e', 'f', ' '),
+    kAudioUnitSubType_SystemOutput = FOURCC('s', 'y', 's', ' '),
+    kAudioUnitSubType_GenericOutput = FOURCC('g', 'e', 'n', 'r'),
+
+    kAudioUnitType_MusicDevice = FOURCC('a', 'u', 'm', 'u'),
+    kAudioUnitSubType_DLSSynth = FOURCC('d', 'l', 's', ' '),
+
+    kAudioUnitType_MusicEffect = FOURCC('a', 'u', 'm', 'f'),
+
+    kAudioUnitType_FormatConverter = FOURCC('a', 'u', 'f', 'c'),
+    kAudioUnitSubType_AUConverter = FOURCC('c', 'o', 'n', 'v'),
+    kAudioUnitSubType_Varispeed = FOURCC('v', 'a', 'r', 'i'),
+    kAudioUnitSubType_DeferredRenderer = FOURCC('d', 'e', 'f', 'r'),
+    kAudioUnitSubType_TimePitch = FOURCC('t', 'm', 'p', 't'),
+    kAudioUnitSubType_Splitter = FOURCC('s', 'p', 'l', 't'),
+    kAudioUnitSubType_Merger = FOURCC('m', 'e', 'r', 'g'),
+
+    kAudioUnitType_Effect = FOURCC('a', 'u', 'f', 'x'),
+    kAudioUnitSubType_Delay = FOURCC('d', 'e', 'l', 'y'),
+    kAudioUnitSubType_LowPassFilter = FOURCC('l', 'p', 'a', 's'),
+    kAudioUnitSubType_HighPassFilter = FOURCC('h', 'p', 'a', 's'),
+    kAudioUnitSubType_BandPassFilter = FOURCC('b', 'p', 'a', 's'),
+    kAudioUnitSubType_HighShelfFilter = FOURCC('h', 's', 'h', 'f'),
+    kAudioUnitSubType_LowShelfFilter = FOURCC('l', 's', 'h', 'f'),
+    kAudioUnitSubType_ParametricEQ = FOURCC('p', 'm', 'e', 'q'),
+    kAudioUnitSubType_GraphicEQ = FOURCC('g', 'r', 'e', 'q'),
+    kAudioUnitSubType_PeakLimiter = FOURCC('l', 'm', 't', 'r'),
+    kAudioUnitSubType_DynamicsProcessor = FOURCC('d', 'c', 'm', 'p'),
+    kAudioUnitSubType_MultiBandCompressor = FOURCC('m', 'c', 'm', 'p'),
+    kAudioUnitSubType_MatrixReverb = FOURCC('m', 'r', 'e', 'v'),
+    kAudioUnitSubType_SampleDelay = FOURCC('s', 'd', 'l', 'y'),
+    kAudioUnitSubType_Pitch = FOURCC('t', 'm', 'p', 'i'),
+    kAudioUnitSubType_AUFilter = FOURCC('f', 'i', 'l', 't'),
+    kAudioUnitSubType_NetSend = FOURCC('n', 's', 'n', 'd'),
+
+    kAudioUnitType_Mixer = FOURCC('a', 'u', 'm', 'x'),
+    kAudioUnitSubType_StereoMixer = FOURCC('s', 'm', 'x', 'r'),
+    kAudioUnitSubType_MatrixMixer = FOURCC('m', 'x', 'm', 'x'),
+
+    kAudioUnitType_Panner = FOURCC('a', 'u', 'p', 'n'),
+
+    kAudioUnitType_OfflineEffect = FOURCC('a', 'u', 'o', 'l'),
+
+    kAudioUnitType_Generator = FOURCC('a', 'u', 'g', 'n'),
+    kAudioUnitSubType_ScheduledSoundPlayer = FOURCC('s', 's', 'p', 'l'),
+    kAudioUnitSubType_AudioFilePlayer = FOURCC('a', 'f', 'p', 'l'),
+    kAudioUnitSubType_NetReceive = FOURCC('n', 'r', 'c', 'v'),
+
+    kAudioUnitManufacturer_Apple = FOURCC('a', 'p', 'p', 'l'),
+};
+
+/* Formats */
+
+enum {
+    kAudioFormatLinearPCM = FOURCC('l', 'p', 'c', 'm'),
+    kAudioFormatAC3 = FOURCC('a', 'c', '-', '3'),
+    kAudioFormat60958AC3 = FOURCC('c', 'a', 'c', '3'),
+    kAudioFormatAppleIMA4 = FOURCC('i', 'm', 'a', '4'),
+    kAudioFormatMPEG4AAC = FOURCC('a', 'a', 'c', ' '),
+    kAudioFormatMPEG4CELP = FOURCC('c', 'e', 'l', 'p'),
+    kAudioFormatMPEG4HVXC = FOURCC('h', 'v', 'x', 'c'),
+    kAudioFormatMPEG4TwinVQ = FOURCC('t', 'w', 'v', 'q'),
+    kAudioFormatMACE3 = FOURCC('M', 'A', 'C', '3'),
+    kAudioFormatMACE6 = FOURCC('M', 'A', 'C', '6'),
+    kAudioFormatULaw = FOURCC('u', 'l', 'a', 'w'),
+    kAudioFormatALaw = FOURCC('a', 'l', 'a', 'w'),
+    kAudioFormatQDesign = FOURCC('Q', 'D', 'M', 'C'),
+    kAudioFormatQDesign2 = FOURCC('Q', 'D', 'M', '2'),
+    kAudioFormatQUALCOMM = FOURCC('Q', 'c', 'l', 'p'),
+    kAudioFormatMPEGLayer1 = FOURCC('.', 'm', 'p', '1'),
+    kAudioFormatMPEGLayer2 = FOURCC('.', 'm', 'p', '2'),
+    kAudioFormatMPEGLayer3 = FOURCC('.', 'm', 'p', '3'),
+    kAudioFormatDVAudio = FOURCC('d', 'v', 'c', 'a'),
+    kAudioFormatVariableDurationDVAudio = FOURCC('v', 'd', 'v', 'a'),
+    kAudioFormatTimeCode = FOURCC('t', 'i', 'm', 'e'),
+    kAudioFormatMIDIStream = FOURCC('m', 'i', 'd', 'i'),
+    kAudioFormatParameterValueStream = FOURCC('a', 'p', 'v', 's'),
+    kAudioFormatAppleLossless = FOURCC('a', 'l', 'a', 'c'),
+};
+
+enum {
+    kAudioFormatFlagIsFloat = (1U << 0),
+    kAudioFormatFlagIsBigEndian = (1U << 1),
+    kAudioFormatFlagIsSignedInteger = (1U << 2),
+    kAudioFormatFlagIsPacked = (1U << 3),
+    kAudioFormatFlagIsAlignedHigh = (1U << 4),
+    kAudioFormatFlagIsNonInterleaved = (1U << 5),
+    kAudioFormatFlagIsNonMixable = (1U << 6),
+    kAudioFormatFlagsAreAllClear = 0x80000000,
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    kAudioFormatFlagsNativeEndian = kAudioFormatFlagIsBigEndian,
+#else
+    kAudioFormatFlagsNativeEndian = 0,
+#endif
+};
+
+enum {
+    kAudioTimeStampSampleTimeValid = (1U << 0),
+    kAudioTimeStampHostTimeValid = (1U << 1),
+    kAudioTimeStampRateScalarValid = (1U << 2),
+    kAudioTimeStampWordClockTimeValid = (1U << 3),
+    kAudioTimeStampSMPTETimeValid = (1U << 4),
+};
+
+enum {
+    kAudioUnitRenderAction_PreRender = (1U << 2),
+    kAudioUnitRenderAction_PostRender = (1U << 3),
+    kAudioUnitRenderAction_OutputIsSilence = (1U << 4),
+    kAudioUnitRenderAction_PostRenderError = (1U << 8),
+};
+
+/* Scopes and properties */
+
+enum {
+    kAudioUnitScope_Global = 0,
+    kAudioUnitScope_Input = 1,
+    kAudioUnitScope_Output = 2,
+};
+
+/* Parameters */
+
+enum {
+    kParameterEvent_Immediate = 1,
+    kParameterEvent_Ramped = 2,
+};
+
+enum {
+    kMultiChannelMixerParam_Volume = 0,
+};
+
+enum {
+    kAudioUnitProperty_SampleRate = 2,
+    kAudioUnitProperty_StreamFormat = 8,
+    kAudioUnitProperty_ElementCount = 11,
+    kAudioUnitProperty_Latency = 12,
+    kAudioUnitProperty_MaximumFramesPerSlice = 14,
+    kAudioUnitProperty_TailTime = 20,
+    kAudioUnitProperty_SetRenderCallback = 23,
+    kAudioOutputUnitProperty_CurrentDevice = 2000,
+};
+
+/* Audio objects (devices) */
+
+enum {
+    kAudioObjectUnknown = 0,
+    kAudioObjectSystemObject = 1,
+};
+
+enum {
+    kAudioObjectPropertyScopeGlobal = FOURCC('g', 'l', 'o', 'b'),
+    kAudioObjectPropertyScopeInput = FOURCC('i', 'n', 'p', 't'),
+    kAudioObjectPropertyScopeOutput = FOURCC('o', 'u', 't', 'p'),
+    kAudioObjectPropertyElementMain = 0,
+};
+
+enum {
+    kAudioDevicePropertyNominalSampleRate = FOURCC('n', 's', 'r', 't'),
+    kAudioDevicePropertyLatency = FOURCC('l', 't', 'n', 'c'),
+    kAudioDevicePropertySafetyOffset = FOURCC('s', 'a', 'f', 't'),
+    kAudioDevicePropertyBufferFrameSize = FOURCC('f', 's', 'i', 'z'),
+    kAudioDevicePropertyBufferFrameSizeRange = FOURCC('f', 's', 'z', '#'),
+};
+
+/* Errors */
+
+enum {
+    kAudioUnitErr_InvalidProperty = -10879,
+    kAudioUnitErr_InvalidParameter = -10878,
+    kAudioUnitErr_InvalidElement = -10877,
+    kAudioUnitErr_NoConnection = -10876,
+    kAudioUnitErr_FailedInitialization = -10875,
+    kAudioUnitErr_TooManyFramesToProcess = -10874,
+    kAudioUnitErr_FormatNotSupported = -10868,
+    kAudioUnitErr_Uninitialized = -10867,
+    kAudioUnitErr_InvalidScope = -10866,
+    kAudioUnitErr_PropertyNotWritable = -10865,
+    kAudioUnitErr_CannotDoInCurrentContext = -10863,
+    kAudioUnitErr_Initialized = -10849,
+    kAudioUnitErr_InvalidPropertyValue = -10851,
+    kAudioComponentErr_InstanceInvalidated = -66749,
+
+    kAudioHardwareUnknownPropertyError = FOURCC('w', 'h', 'o', '?'),
+    kAudioHardwareBadPropertySizeError = FOURCC('!', 's', 'i', 'z'),
+    kAudioHardwareIllegalOperationError = FOURCC('n', 'o', 'p', 'e'),
+    kAudioHardwareBadObjectError = FOURCC('!', 'o', 'b', 'j'),
+};
+
+/* AudioComponent */
+
+AudioComponent AudioComponentFindNext(AudioComponent inComponent,
+                                      const AudioComponentDescription* inDesc);
+OSStatus AudioComponentInstanceNew(AudioComponent inComponent,
+                                   AudioComponentInstance* outInstance);
+OSStatus AudioComponentInstanceDispose(AudioComponentInstance inInstance);
+OSStatus AudioComponentCopyName(AudioComponent inComponent,
+                                CFStringRef* outName);
+OSStatus AudioComponentGetDescription(AudioComponent inComponent,
+                                      AudioComponentDescription* outDesc);
+OSStatus AudioComponentGetVersion(AudioComponent inComponent,
+                                  UInt32* outVersion);
+
+/* Just enough CoreFoundation for component names */
+
+Boolean CFStringGetCString(CFStringRef theString, char* buffer,
+                           CFIndex bufferSize, CFStringEncoding encoding);
+void CFRelease(CFTypeRef cf);
+
+/* AudioUnit */
+
+OSStatus AudioUnitInitialize(AudioUnit inUnit);
+OSStatus AudioUnitUninitialize(AudioUnit inUnit);
+OSStatus AudioUnitReset(AudioUnit inUnit, AudioUnitScope inScope,
+                        AudioUnitElement inElement);
+OSStatus AudioUnitSetProperty(AudioUnit inUnit, AudioUnitPropertyID inID,
+                              AudioUnitScope inScope,
+                              AudioUnitElement inElement, const void* inData,
+                              UInt32 inDataSize);
+OSStatus AudioUnitGetProperty(AudioUnit inUnit, AudioUnitPropertyID inID,
+                              AudioUnitScope inScope,
+                              AudioUnitElement inElement, void* outData,
+                              UInt32* ioDataSize);
+OSStatus AudioUnitGetPropertyInfo(AudioUnit inUnit, AudioUnitPropertyID inID,
+                                  AudioUnitScope inScope,
+                                  AudioUnitElement inElement,
+                                  UInt32* outDataSize, Boolean* outWritable);
+OSStatus AudioUnitGetParameter(AudioUnit inUnit, AudioUnitParameterID inID,
+                               AudioUnitScope inScope,
+                               AudioUnitElement inElement,
+                               AudioUnitParameterValue* outValue);
+OSStatus AudioUnitSetParameter(AudioUnit inUnit, AudioUnitParameterID inID,
+                               AudioUnitScope inScope,
+                               AudioUnitElement inElement,
+                               AudioUnitParameterValue inValue,
+                               UInt32 inBufferOffsetInFrames);
+OSStatus AudioUnitScheduleParameters(
+    AudioUnit inUnit, const AudioUnitParameterEvent* inParameterEvent,
+    UInt32 inNumParamEvents);
+OSStatus AudioUnitRender(AudioUnit inUnit,
+                         AudioUnitRenderActionFlags* ioActionFlags,
+                         const AudioTimeStamp* inTimeStamp,
+                         UInt32 inOutputBusNumber, UInt32 inNumberFrames,
+                         AudioBufferList* ioData);
+OSStatus AudioOutputUnitStart(AudioUnit ci);
+OSStatus AudioOutputUnitStop(AudioUnit ci);
+OSStatus AudioUnitAddRenderNotify(AudioUnit inUnit, AURenderCallback inProc,
+                                  void* inProcUserData);
+OSStatus AudioUnitRemoveRenderNotify(AudioUnit inUnit, AURenderCallback inProc,
+                                     void* inProcUserData);
+
+/* MusicDevice */
+
+typedef AudioComponentInstance MusicDeviceComponent;
+
+OSStatus MusicDeviceMIDIEvent(MusicDeviceComponent inUnit, UInt32 inStatus,
+                              UInt32 inData1, UInt32 inData2,
+                              UInt32 inOffsetSampleFrame);
+
+/* Audio objects: there is one device, shared by all output units */
+
+OSStatus AudioObjectGetPropertyData(AudioObjectID inObjectID,
+                                    const AudioObjectPropertyAddress* inAddress,
+                                    UInt32 inQualifierDataSize,
+                                    const void* inQualifierData,
+                                    UInt32* ioDataSize, void* outData);
+OSStatus AudioObjectSetPropertyData(AudioObjectID inObjectID,
+                                    const AudioObjectPropertyAddress* inAddress,
+                                    UInt32 inQualifierDataSize,
+                                    const void* inQualifierData,
+                                    UInt32 inDataSize, const void* inData);
+
+/* Host time */
+
+UInt64 AudioGetCurrentHostTime(void);
+UInt64 AudioConvertHostTimeToNanos(UInt64 inHostTime);
+UInt64 AudioConvertNanosToHostTime(UInt64 inNanos);
+Float64 AudioGetHostClockFrequency(void);
+
+#endif /* NULLAUDIO_H */
@@ -1,14 +1,26 @@
 #!/usr/bin/env python3
 
+import sys
+
 from setuptools import Extension, setup
 
+if sys.platform == "darwin":
+    sources = ["coreaudio.c"]
+    extra_link_args = [
+        "-framework", "CoreAudio",
+        "-framework", "AudioUnit",
+        "-framework", "AudioToolbox"
+    ]
+else:
+    # no CoreAudio: build against the device-less null backend
+    sources = ["coreaudio.c", "nullaudio.c"]
+    extra_link_args = ["-lpthread", "-lm"]
+
 setup(name="coreaudio", version="0.1",
    ext_modules=[
-      Extension("coreaudio", ["coreaudio.c"],
-         extra_link_args=[
-            "-framework", "CoreAudio",
-            "-framework", "AudioUnit"
-         ]
+      Extension("coreaudio", sources,
+         depends=["nullaudio.h"],
+         extra_link_args=extra_link_args
       )
    ]
 )
@@ -0,0 +1,69 @@
+#!/usr/bin/env python3
+
+import coreaudio
+from optparse import OptionParser
+import wave
+
+from play import au_wav_prepare
+
+def open_generic_au():
+    """Open a GenericOutput unit; it is only rendered when pulled."""
+
+    desc = coreaudio.AudioComponentDescription(
+        coreaudio.kAudioUnitType_Output,
+        coreaudio.kAudioUnitSubType_GenericOutput,
+        coreaudio.kAudioUnitManufacturer_Apple)
+
+    c = coreaudio.AudioComponentFindNext(None, desc)
+    au = coreaudio.AudioComponentInstanceNew(c)
+
+    au.Initialize()
+
+    return au
+
+def loop_callback(f):
+    """Return a render callback that plays 'f' in a loop."""
+
+    width = f.getsampwidth() * f.getnchannels()
+
+    def render_callback(flags, time, bus, frames, nbuffers, user_data):
+        buf = f.readframes(frames)
+        if len(buf) < frames * width:
+            f.rewind()
+            buf = buf + f.readframes(frames - len(buf) // width)
+
+        return (None, buf)
+
+    return render_callback
+
+if __name__ == '__main__':
+    parser = OptionParser(usage='usage: %prog [options] <file>')
+    parser.add_option("-u", "--units", dest="units", type="int",
+                      help="Number of units to render. ", default=16)
+    parser.add_option("-f", "--frames", dest="frames", type="int",
+                      help="Frames per render call. ", default=512)
+    parser.add_option("-s", "--seconds", dest="seconds", type="float",
+                      help="Seconds of audio to render per unit. ",
+                      default=3600.0)
+    parser.add_option("-j", "--jitter", dest="jitter", type="float",
+                      help="Host time jitter in seconds. ", default=0.0)
+
+    options, args = parser.parse_args()
+    if len(args) < 1:
+        parser.error('need a file argument')
+
+    units = []
+    for i in range(options.units):
+        au = open_generic_au()
+        f = au_wav_prepare(au, args[0])
+        au.SetRenderCallback(loop_callback(f))
+        units.append(au)
+
+    rate = wave.open(args[0], 'r').getframerate()
+    periods = int(options.seconds * rate / options.frames)
+
+    driver = coreaudio.VirtualDriver(units, options.frames, options.jitter)
+    stats = driver.Run(periods)
+
+    for k in sorted(stats):
+        print('%s: %s' % (k, stats[k]))